@@ -0,0 +1,660 @@
+/*
+Arduino, WiFi and PubSubClient shims for the host-side simulator
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+Implements the API declared in sim/shim/ on top of the simulated world (sim_world.h).
+*/
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <PubSubClient.h>
+#include <Preferences.h>
+#include <esp_now.h>
+#include <esp_timer.h>
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <new>
+
+#include "sim_world.h"
+
+HardwareSerial Serial;
+EspClass ESP;
+WiFiClass WiFi;
+
+// RTC memory, start and end of the section with all RTC_DATA_ATTR variables
+extern "C" char __start_sim_rtc[];
+extern "C" char __stop_sim_rtc[];
+extern "C" char __start_sim_rtc_noinit[];
+extern "C" char __stop_sim_rtc_noinit[];
+
+// Pins used by water_thing, see hardware_functions.h
+static const int pinPressure = 33;
+static const int pinBattery = 35;
+static const int pinValveOpen = 25;
+static const int pinValveClose = 26;
+static const int pinLeds[3] = {18, 19, 17}; // red, orange, green
+
+// Same ADC correction as the firmware, the simulated ADC is its inverse
+static const double adcOffset = 0.175101646;
+static const double adcGain = 0.000725018385 + pow(0.0000000888075249, 2) + pow(0.0000000000220849715, 3);
+
+//***************************
+//***      Time/boot      ***
+//***************************
+
+extern "C" time_t time(time_t* t) noexcept {
+    // Unix time follows the simulated clock
+    time_t now = (time_t)(simGet()->nowUs / 1000000ULL);
+    if (t != nullptr) {
+        *t = now;
+    }
+    return now;
+}
+
+static void checkHung() {
+    // A wake that never goes to sleep would keep the simulation from ever finishing
+    simWorld* w = simGet();
+    if (w->inBoot && (w->nowUs - w->bootUs) / 1e6 > w->cfg.maxAwake) {
+        w->stats.hungWakes++;
+        memcpy(w->rtcNoinit, __start_sim_rtc_noinit, __stop_sim_rtc_noinit - __start_sim_rtc_noinit); // Kept through the reset
+        fflush(stdout);
+        _exit(3);
+    }
+}
+
+// One shot timers, the firmware uses one (wake budget)
+struct simEspTimer {
+    esp_timer_create_args_t args;
+    uint64_t dueUs;          // Simulated time, 0 if not started
+};
+
+static simEspTimer timers[2];
+static int timerCount = 0;
+
+static void runTimers() {
+    // Callbacks of the due timers, a callback may not return (deep sleep)
+    simWorld* w = simGet();
+    for (int i = 0; i < timerCount; i++) {
+        if (timers[i].dueUs != 0 && w->nowUs >= timers[i].dueUs) {
+            timers[i].dueUs = 0;
+            if (strcmp(timers[i].args.name, "wake_budget") == 0) {
+                w->stats.budgetCuts++;
+            }
+            timers[i].args.callback(timers[i].args.arg);
+        }
+    }
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* create_args, esp_timer_handle_t* out_handle) {
+    if (timerCount >= (int)(sizeof(timers) / sizeof(timers[0]))) {
+        return ESP_FAIL;
+    }
+    timers[timerCount].args = *create_args;
+    timers[timerCount].dueUs = 0;
+    *out_handle = &timers[timerCount++];
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+    timer->dueUs = simGet()->nowUs + (timeout_us > 0 ? timeout_us : 1);
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+    timer->dueUs = 0;
+    return ESP_OK;
+}
+
+unsigned long millis() {
+    return simAwakeMs();
+}
+
+unsigned long micros() {
+    simWorld* w = simGet();
+    return (unsigned long)(w->nowUs - w->bootUs);
+}
+
+void delay(uint32_t ms) {
+    simAdvance(ms * 1000ULL);
+    simEspNowPoll();
+    runTimers();
+    checkHung();
+}
+
+void delayMicroseconds(uint32_t us) {
+    simAdvance(us);
+}
+
+void yield() {
+    simAdvance(100);
+    runTimers();
+    checkHung();
+}
+
+uint32_t getCpuFrequencyMhz() {
+    return 240;
+}
+
+bool setCpuFrequencyMhz(uint32_t cpu_freq_mhz) {
+    (void)cpu_freq_mhz;
+    return true;
+}
+
+void configTime(long gmtOffset_sec, int daylightOffset_sec, const char* server1, const char* server2, const char* server3) {
+    // Simulated clock is always synchronised
+    (void)gmtOffset_sec; (void)daylightOffset_sec; (void)server1; (void)server2; (void)server3;
+}
+
+void EspClass::restart() {
+    fflush(stdout);
+    _exit(4);
+}
+
+//***************************
+//***        Heap         ***
+//***************************
+
+// Count allocations made while the firmware runs, a measure of heap traffic (and fragmentation risk) per wake.
+// Note that std::string keeps short strings inline, the real String allocates a little more often.
+// Bytes in use during a wake give ESP.getFreeHeap(), starting from the free heap of the real device after boot.
+#define SIM_HEAP_FREE 250000      // bytes, free heap after boot
+#define SIM_HEAP_WIFI 45000       // bytes, used by the WiFi and TCP/IP stacks while the radio is on
+#define SIM_HEAP_BLOCK 110000     // bytes, largest free block of the real device
+
+static long heapUsed = 0;         // bytes allocated this wake
+static long heapMinFree = SIM_HEAP_FREE;
+
+uint32_t EspClass::getFreeHeap() {
+    long free = SIM_HEAP_FREE - heapUsed - (simGet()->dev.radioOn ? SIM_HEAP_WIFI : 0);
+    if (free < heapMinFree) heapMinFree = free;
+    return free > 0 ? (uint32_t)free : 0;
+}
+
+uint32_t EspClass::getMinFreeHeap() {
+    getFreeHeap();
+    return heapMinFree > 0 ? (uint32_t)heapMinFree : 0;
+}
+
+uint32_t EspClass::getMaxAllocHeap() {
+    uint32_t free = getFreeHeap();
+    return free < SIM_HEAP_BLOCK ? free : SIM_HEAP_BLOCK;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {
+    // Stack use is not simulated, a typical value for loopTask (8 kB stack)
+    (void)task;
+    return 5000;
+}
+
+TaskHandle_t xTaskGetHandle(const char* name) {
+    (void)name;
+    return nullptr;
+}
+
+void* operator new(size_t size) {
+    simWorld* w = simGet();
+    if (w->inBoot) {
+        w->stats.heapAllocs++;
+    } else if (!w->started) {
+        w->stats.initAllocs++;
+    }
+    void* p = malloc(size ? size : 1);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    if (w->inBoot) {
+        heapUsed += malloc_usable_size(p);
+        ESP.getFreeHeap();
+    }
+    return p;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+    if (p != nullptr && simGet()->inBoot) {
+        heapUsed -= malloc_usable_size(p);
+    }
+    free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    operator delete(p);
+}
+
+void operator delete(void* p, size_t size) noexcept {
+    (void)size;
+    operator delete(p);
+}
+
+void operator delete[](void* p, size_t size) noexcept {
+    (void)size;
+    operator delete(p);
+}
+
+//***************************
+//***       Serial        ***
+//***************************
+
+size_t HardwareSerial::write(uint8_t c) {
+    if (simGet()->cfg.verbose) {
+        putchar(c);
+    }
+    return 1;
+}
+
+size_t Print::printf(const char* format, ...) {
+    char buffer[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    return print(buffer);
+}
+
+//***************************
+//***        Pins         ***
+//***************************
+
+void pinMode(uint8_t pin, uint8_t mode) {
+    (void)pin; (void)mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+    simWorld* w = simGet();
+    if (pin == pinValveOpen || pin == pinValveClose) {
+        int dir = pin == pinValveOpen ? 1 : -1;
+        if (val == HIGH) {
+            if (w->dev.motorDir == 0) w->stats.actuations++;
+            if (w->dev.pressedAt != 0) {
+                double latency = (w->nowUs - w->dev.pressedAt) / 1e6;
+                w->stats.buttonMoves++;
+                w->stats.buttonLatency += latency;
+                if (latency > w->stats.buttonLatencyMax) w->stats.buttonLatencyMax = latency;
+                w->dev.pressedAt = 0;
+            }
+            w->dev.motorDir = dir;
+        } else if (w->dev.motorDir == dir) {
+            w->dev.motorDir = 0;
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        if (pin == pinLeds[i]) w->dev.leds[i] = val == HIGH;
+    }
+}
+
+int digitalRead(uint8_t pin) {
+    simWorld* w = simGet();
+    return (pin == w->dev.buttonPin && w->nowUs < w->dev.buttonUntil) ? HIGH : LOW;
+}
+
+void attachInterrupt(uint8_t pin, void (*isr)(void), int mode) {
+    // Buttons are only pressed during deep sleep in the simulation, no edges while awake
+    (void)pin; (void)isr; (void)mode;
+}
+
+void detachInterrupt(uint8_t pin) {
+    (void)pin;
+}
+
+static uint16_t voltage2adc(double u) {
+    // Inverse of the ADC correction plus noise, 11 dB attenuation saturates at about 3.1 V
+    std::normal_distribution<double> noise(0.0, 4.0);
+    double code = (u - adcOffset) / adcGain + noise(simGet()->rng);
+    if (code < 0.0) code = 0.0;
+    if (code > 4095.0 || u > 3.1) code = 4095.0;
+    return (uint16_t)code;
+}
+
+uint16_t analogRead(uint8_t pin) {
+    simAdvance(10); // A conversion takes about 10 us
+    if (pin == pinBattery) {
+        // Voltage divider 100k/30k
+        return voltage2adc(simBatteryVoltage() * 30.0 / 130.0);
+    }
+    if (pin == pinPressure) {
+        // 0.5-4.5 V for 0-2.068 bar(e), voltage divider 67.3k/117.3k
+        double u = 0.5 + simPressure() / 2.068 * 4.0;
+        return voltage2adc(u * 117.3 / (67.3 + 117.3));
+    }
+    return 0;
+}
+
+//***************************
+//***     Deep sleep      ***
+//***************************
+
+esp_err_t esp_sleep_enable_timer_wakeup(uint64_t time_in_us) {
+    simGet()->dev.sleepUs = time_in_us;
+    return ESP_OK;
+}
+
+esp_err_t esp_sleep_enable_ext1_wakeup(uint64_t mask, esp_sleep_ext1_wakeup_mode_t mode) {
+    (void)mode;
+    simGet()->dev.ext1Mask = mask;
+    return ESP_OK;
+}
+
+esp_sleep_wakeup_cause_t esp_sleep_get_wakeup_cause() {
+    return (esp_sleep_wakeup_cause_t)simGet()->dev.wakeCause;
+}
+
+uint64_t esp_sleep_get_ext1_wakeup_status() {
+    return simGet()->dev.ext1Status;
+}
+
+esp_err_t esp_light_sleep_start() {
+    // The timer wakeup passes in light sleep, buttons are not enabled as light sleep wakeup
+    simWorld* w = simGet();
+    w->dev.lightSleep = true;
+    simAdvance(w->dev.sleepUs);
+    w->dev.lightSleep = false;
+    w->dev.sleepUs = 0;
+    runTimers();
+    checkHung();
+    return ESP_OK;
+}
+
+void esp_deep_sleep_start() {
+    // End of this wake, hand RTC memory over to the simulator and exit
+    simWorld* w = simGet();
+    w->dev.radioOn = false;
+    w->dev.motorDir = 0;
+    for (int i = 0; i < 3; i++) {
+        w->dev.leds[i] = false;
+    }
+    memcpy(w->rtc, __start_sim_rtc, __stop_sim_rtc - __start_sim_rtc);
+    memcpy(w->rtcNoinit, __start_sim_rtc_noinit, __stop_sim_rtc_noinit - __start_sim_rtc_noinit);
+    fflush(stdout);
+    _exit(0);
+}
+
+//***************************
+//***         NVS         ***
+//***************************
+
+static simNvs* nvsFind(const char* space, const char* key, bool create) {
+    simWorld* w = simGet();
+    char name[sizeof(w->nvs[0].key)];
+    snprintf(name, sizeof(name), "%s/%s", space, key);
+    for (int i = 0; i < w->nvsCount; i++) {
+        if (strcmp(w->nvs[i].key, name) == 0) {
+            return &w->nvs[i];
+        }
+    }
+    if (!create || w->nvsCount >= SIM_NVS_KEYS) {
+        return nullptr;
+    }
+    simNvs* entry = &w->nvs[w->nvsCount++];
+    snprintf(entry->key, sizeof(entry->key), "%s", name);
+    entry->value = 0;
+    return entry;
+}
+
+bool Preferences::begin(const char* name, bool readOnly) {
+    snprintf(space, sizeof(space), "%s", name);
+    this->readOnly = readOnly;
+    open = true;
+    return true;
+}
+
+uint32_t Preferences::getUInt(const char* key, uint32_t defaultValue) {
+    simNvs* entry = open ? nvsFind(space, key, false) : nullptr;
+    return entry != nullptr ? entry->value : defaultValue;
+}
+
+size_t Preferences::putUInt(const char* key, uint32_t value) {
+    simNvs* entry = open && !readOnly ? nvsFind(space, key, true) : nullptr;
+    if (entry == nullptr) {
+        return 0;
+    }
+    entry->value = value;
+    simGet()->stats.nvsWrites++;
+    return sizeof(value);
+}
+
+bool Preferences::isKey(const char* key) {
+    return open && nvsFind(space, key, false) != nullptr;
+}
+
+//***************************
+//***        WiFi         ***
+//***************************
+
+void WiFiClass::mode(wifi_mode_t mode) {
+    simGet()->dev.radioOn = mode != WIFI_OFF;
+}
+
+bool WiFiClass::setTxPower(wifi_power_t power) {
+    (void)power;
+    return true;
+}
+
+wl_status_t WiFiClass::begin(const char* ssid, const char* password) {
+    (void)ssid; (void)password;
+    simWorld* w = simGet();
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    w->dev.radioOn = true;
+    w->dev.wifiStarted = true;
+    w->dev.wifiFails = uniform(w->rng) < w->cfg.wifiFailProb;
+    w->dev.wifiConnectAt = w->nowUs + (uint64_t)(simLatency(w->cfg.wifiMedian, w->cfg.wifiSigma) * 1e6);
+    if (w->dev.wifiFails) {
+        w->stats.wifiFailures++;
+    }
+    return WL_DISCONNECTED;
+}
+
+wl_status_t WiFiClass::status() {
+    simWorld* w = simGet();
+    simAdvance(50);
+    if (w->dev.wifiStarted && !w->dev.wifiFails && w->nowUs >= w->dev.wifiConnectAt) {
+        return WL_CONNECTED;
+    }
+    return WL_DISCONNECTED;
+}
+
+bool WiFiClass::disconnect(bool wifioff) {
+    simWorld* w = simGet();
+    w->dev.wifiStarted = false;
+    if (wifioff) {
+        w->dev.radioOn = false;
+    }
+    return true;
+}
+
+void WiFiClass::onEvent(WiFiEventFuncCb callback, WiFiEvent_t event) {
+    // Events are not simulated
+    (void)callback; (void)event;
+}
+
+//***************************
+//***        MQTT         ***
+//***************************
+
+bool PubSubClient::connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos,
+                           bool willRetain, const char* willMessage, bool cleanSession) {
+    (void)id; (void)user; (void)pass; (void)willTopic; (void)willQos; (void)willRetain; (void)willMessage;
+    simWorld* w = simGet();
+    if (WiFi.status() != WL_CONNECTED) {
+        delay(100);
+        isConnected = false;
+        lastState = MQTT_CONNECT_FAILED;
+        return false;
+    }
+    simAdvance((uint64_t)(simLatency(w->cfg.mqttMedian, w->cfg.mqttSigma) * 1e6));
+    if (cleanSession) {
+        // The broker forgets the subscriptions and the queued reply
+        w->dev.subscribed[0] = '\0';
+        w->dev.pending = false;
+    }
+    isConnected = true;
+    lastState = MQTT_CONNECTED;
+    return true;
+}
+
+void PubSubClient::disconnect() {
+    isConnected = false;
+    lastState = MQTT_DISCONNECTED;
+}
+
+bool PubSubClient::connected() {
+    if (isConnected && WiFi.status() != WL_CONNECTED) {
+        isConnected = false;
+        lastState = MQTT_CONNECTION_LOST;
+    }
+    return isConnected;
+}
+
+bool PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int length, bool retained) {
+    (void)payload; (void)retained;
+    simWorld* w = simGet();
+    if (!connected()) {
+        return false;
+    }
+    simAdvance((uint64_t)(simLatency(w->cfg.publishMedian, w->cfg.publishSigma) * 1e6));
+    w->stats.publishes++;
+    w->stats.publishBytes += strlen(topic) + length;
+    simTransmit(strlen(topic) + length);
+
+    // Reply with settings to the ready message, like the node red flow
+    if (strstr(topic, "ready") != nullptr && w->cfg.settingsReply[0] != '\0' && w->dev.subscribed[0] != '\0') {
+        w->dev.pending = true;
+        w->dev.pendingAt = w->nowUs + (uint64_t)(simLatency(w->cfg.replyMedian, w->cfg.replySigma) * 1e6);
+        snprintf(w->pendingTopic, sizeof(w->pendingTopic), "%s", w->dev.subscribed);
+        snprintf(w->pendingPayload, sizeof(w->pendingPayload), "%s", w->cfg.settingsReply);
+    }
+    return true;
+}
+
+static unsigned int beginLength;
+
+bool PubSubClient::beginPublish(const char* topic, unsigned int length, bool retained) {
+    beginLength = length;
+    return publish(topic, (const uint8_t*)"", 0, retained);
+}
+
+int PubSubClient::endPublish() {
+    simGet()->stats.publishBytes += beginLength;
+    simTransmit(beginLength);
+    return 1;
+}
+
+bool PubSubClient::subscribe(const char* topic, uint8_t qos) {
+    (void)qos;
+    simWorld* w = simGet();
+    if (!connected()) {
+        return false;
+    }
+    if (strstr(topic, "settings") != nullptr) {
+        strncpy(w->dev.subscribed, topic, sizeof(w->dev.subscribed) - 1);
+    }
+    return true;
+}
+
+bool PubSubClient::loop() {
+    simWorld* w = simGet();
+    if (!connected()) {
+        return false;
+    }
+    if (w->dev.pending && w->nowUs >= w->dev.pendingAt && callback != nullptr) {
+        w->dev.pending = false;
+        char topic[sizeof(w->pendingTopic)];
+        strcpy(topic, w->pendingTopic);
+        callback(topic, (uint8_t*)w->pendingPayload, strlen(w->pendingPayload));
+    }
+    return true;
+}
+
+//***************************
+//***       ESP-NOW       ***
+//***************************
+
+static bool espNowStarted = false;
+static esp_now_send_cb_t espNowSent = nullptr;
+static esp_now_recv_cb_t espNowReceived = nullptr;
+static uint8_t espNowGateway[6]; // The peer, replies come from it
+
+esp_err_t esp_now_init() {
+    espNowStarted = simGet()->dev.radioOn;
+    return espNowStarted ? ESP_OK : ESP_ERR_ESPNOW_NOT_INIT;
+}
+
+esp_err_t esp_now_deinit() {
+    espNowStarted = false;
+    return ESP_OK;
+}
+
+esp_err_t esp_now_register_send_cb(esp_now_send_cb_t cb) {
+    espNowSent = cb;
+    return ESP_OK;
+}
+
+esp_err_t esp_now_register_recv_cb(esp_now_recv_cb_t cb) {
+    espNowReceived = cb;
+    return ESP_OK;
+}
+
+esp_err_t esp_now_add_peer(const esp_now_peer_info_t* peer) {
+    memcpy(espNowGateway, peer->peer_addr, sizeof(espNowGateway));
+    return espNowStarted ? ESP_OK : ESP_ERR_ESPNOW_NOT_INIT;
+}
+
+esp_err_t esp_now_send(const uint8_t* peer, const uint8_t* data, size_t length) {
+    simWorld* w = simGet();
+    if (!espNowStarted || !w->dev.radioOn || length > ESP_NOW_MAX_DATA_LEN) {
+        return ESP_ERR_ESPNOW_NOT_INIT;
+    }
+    simAdvance((uint64_t)(simLatency(w->cfg.espNowMedian, w->cfg.espNowSigma) * 1e6));
+    simTransmit(length);
+    w->stats.publishBytes += length;
+
+    // First fragment: flags, id, fragment, topic length, topic (see espnow_transport.h)
+    if (length >= 4 && (data[2] >> 4) == 0) {
+        w->stats.publishes++;
+        char topic[128];
+        size_t topicLength = data[3] < sizeof(topic) - 16 ? data[3] : sizeof(topic) - 16;
+        memcpy(topic, data + 4, topicLength);
+        topic[topicLength] = '\0';
+
+        // The gateway replies with settings to the ready message, like the node red flow
+        char* ready = strstr(topic, "ready");
+        if (ready != nullptr && w->cfg.settingsReply[0] != '\0') {
+            strcpy(ready, "settings");
+            w->dev.pending = true;
+            w->dev.pendingAt = w->nowUs + (uint64_t)(simLatency(w->cfg.replyMedian, w->cfg.replySigma) * 1e6);
+            snprintf(w->pendingTopic, sizeof(w->pendingTopic), "%s", topic);
+            snprintf(w->pendingPayload, sizeof(w->pendingPayload), "%s", w->cfg.settingsReply);
+        }
+    }
+    if (espNowSent != nullptr) {
+        espNowSent(peer, ESP_NOW_SEND_SUCCESS);
+    }
+    return ESP_OK;
+}
+
+void simEspNowPoll() {
+    // One frame, replies longer than a frame are not simulated
+    simWorld* w = simGet();
+    if (!espNowStarted || espNowReceived == nullptr || !w->dev.pending || w->nowUs < w->dev.pendingAt) {
+        return;
+    }
+    w->dev.pending = false;
+    uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+    size_t topicLength = strlen(w->pendingTopic);
+    size_t length = strlen(w->pendingPayload);
+    if (4 + topicLength + length > sizeof(frame)) {
+        return;
+    }
+    frame[0] = 0;
+    frame[1] = 0;
+    frame[2] = 0x01;
+    frame[3] = topicLength;
+    memcpy(frame + 4, w->pendingTopic, topicLength);
+    memcpy(frame + 4 + topicLength, w->pendingPayload, length);
+    espNowReceived(espNowGateway, frame, 4 + topicLength + length);
+}
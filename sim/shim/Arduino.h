@@ -0,0 +1,212 @@
+#ifndef SIM_ARDUINO_H
+#define SIM_ARDUINO_H
+
+/*
+Arduino shim for the host-side simulator
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+Provides the subset of the Arduino/ESP32 API used by water_thing on top of the simulated
+device in sim_world.h. Time is virtual, delay() advances the simulated clock and the hardware
+(valve, tank, battery, leds and buttons) is modelled by the simulator.
+
+Variables marked RTC_DATA_ATTR are placed in their own section (sim_rtc) that the simulator
+carries over between wakes, all other globals start from their initial values every boot, like on the device.
+RTC_NOINIT_ATTR variables (sim_rtc_noinit) are also kept through a watchdog reset, only power on clears them.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <string>
+
+// Memory placement
+#define RTC_DATA_ATTR __attribute__((section("sim_rtc")))
+#define RTC_NOINIT_ATTR __attribute__((section("sim_rtc_noinit")))
+#define RTC_RODATA_ATTR
+#define RTC_IRAM_ATTR
+#define IRAM_ATTR
+#define F(string_literal) (string_literal)
+
+// Pins
+#define HIGH 0x1
+#define LOW  0x0
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define INPUT_PULLUP 0x05
+#define INPUT_PULLDOWN 0x09
+#define RISING 0x01
+#define FALLING 0x02
+#define CHANGE 0x03
+
+typedef uint8_t byte;
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+
+//***************************
+//***       String        ***
+//***************************
+
+class String : public std::string {
+    // Arduino String on top of std::string, formats numbers like WString.h
+public:
+    String() {}
+    String(const char* str) : std::string(str ? str : "") {}
+    String(const std::string& str) : std::string(str) {}
+    String(char c) : std::string(1, c) {}
+    String(bool value) : std::string(value ? "1" : "0") {}
+    String(unsigned char value, unsigned char base = 10) { fromLong(value, base); }
+    String(int value, unsigned char base = 10) { fromLong(value, base); }
+    String(unsigned int value, unsigned char base = 10) { fromLong(value, base); }
+    String(long value, unsigned char base = 10) { fromLong(value, base); }
+    String(unsigned long value, unsigned char base = 10) { fromLong(value, base); }
+    String(long long value, unsigned char base = 10) { fromLong(value, base); }
+    String(unsigned long long value, unsigned char base = 10) { fromLong(value, base); }
+    String(float value, unsigned int decimalPlaces = 2) { fromDouble(value, decimalPlaces); }
+    String(double value, unsigned int decimalPlaces = 2) { fromDouble(value, decimalPlaces); }
+
+    long toInt() const { return atol(c_str()); }
+    float toFloat() const { return atof(c_str()); }
+    double toDouble() const { return atof(c_str()); }
+    String substring(unsigned int from) const { return from < size() ? String(substr(from)) : String(); }
+    String substring(unsigned int from, unsigned int to) const { return from < size() ? String(substr(from, to - from)) : String(); }
+    int indexOf(char c) const { size_t i = find(c); return i == npos ? -1 : (int)i; }
+    int indexOf(const char* str) const { size_t i = find(str); return i == npos ? -1 : (int)i; }
+    bool startsWith(const char* prefix) const { return rfind(prefix, 0) == 0; }
+    bool equals(const char* str) const { return compare(str) == 0; }
+
+private:
+    void fromLong(long long value, unsigned char base) {
+        char buffer[68];
+        if (base == 16) snprintf(buffer, sizeof(buffer), "%llx", value);
+        else snprintf(buffer, sizeof(buffer), "%lld", value);
+        assign(buffer);
+    }
+    void fromDouble(double value, unsigned int decimalPlaces) {
+        char buffer[64];
+        snprintf(buffer, sizeof(buffer), "%.*f", (int)decimalPlaces, value);
+        assign(buffer);
+    }
+};
+
+inline String operator+(const String& lhs, const String& rhs) { return String(static_cast<const std::string&>(lhs) + static_cast<const std::string&>(rhs)); }
+inline String operator+(const String& lhs, const char* rhs) { return String(static_cast<const std::string&>(lhs) + rhs); }
+inline String operator+(const char* lhs, const String& rhs) { return String(lhs + static_cast<const std::string&>(rhs)); }
+inline String operator+(const String& lhs, char rhs) { return String(static_cast<const std::string&>(lhs) + rhs); }
+
+//***************************
+//***       Serial        ***
+//***************************
+
+class Print {
+    // Output is only shown when the simulator runs with --verbose
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* buffer, size_t size) {
+        for (size_t i = 0; i < size; i++) write(buffer[i]);
+        return size;
+    }
+    size_t print(const char* str) { return write((const uint8_t*)str, strlen(str)); }
+    size_t print(const String& str) { return print(str.c_str()); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(int value, int base = 10) { return print(String(value, (unsigned char)base)); }
+    size_t print(unsigned int value, int base = 10) { return print(String(value, (unsigned char)base)); }
+    size_t print(long value, int base = 10) { return print(String(value, (unsigned char)base)); }
+    size_t print(unsigned long value, int base = 10) { return print(String(value, (unsigned char)base)); }
+    size_t print(double value, int digits = 2) { return print(String(value, (unsigned int)digits)); }
+    template <typename T> size_t println(const T& value) { size_t n = print(value); return n + print("\r\n"); }
+    template <typename T> size_t println(const T& value, int format) { size_t n = print(value, format); return n + print("\r\n"); }
+    size_t println() { return print("\r\n"); }
+    size_t printf(const char* format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+class HardwareSerial : public Print {
+public:
+    void begin(unsigned long baud) { (void)baud; }
+    void flush() {}
+    int available() { return 0; }
+    int read() { return -1; }
+    size_t write(uint8_t c) override;
+    using Print::write;
+};
+
+extern HardwareSerial Serial;
+
+//***************************
+//***   Time and pins     ***
+//***************************
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+void yield();
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+uint16_t analogRead(uint8_t pin);
+
+#define digitalPinToInterrupt(p) (p)
+void attachInterrupt(uint8_t pin, void (*isr)(void), int mode);
+void detachInterrupt(uint8_t pin);
+
+uint32_t getCpuFrequencyMhz();
+bool setCpuFrequencyMhz(uint32_t cpu_freq_mhz);
+
+void configTime(long gmtOffset_sec, int daylightOffset_sec, const char* server1, const char* server2 = nullptr, const char* server3 = nullptr);
+
+//***************************
+//***     ESP specific    ***
+//***************************
+
+class EspClass {
+public:
+    // Heap follows the allocations of the firmware, see arduino_shim.cpp
+    uint32_t getHeapSize() { return 320 * 1024; }
+    uint32_t getFreeHeap();
+    uint32_t getMinFreeHeap();
+    uint32_t getMaxAllocHeap();
+    void restart();
+};
+
+extern EspClass ESP;
+
+// FreeRTOS tasks are not simulated, only the running task exists
+typedef void* TaskHandle_t;
+typedef unsigned int UBaseType_t;
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
+TaskHandle_t xTaskGetHandle(const char* name);
+
+typedef enum {
+    ESP_SLEEP_WAKEUP_UNDEFINED,
+    ESP_SLEEP_WAKEUP_ALL,
+    ESP_SLEEP_WAKEUP_EXT0,
+    ESP_SLEEP_WAKEUP_EXT1,
+    ESP_SLEEP_WAKEUP_TIMER,
+    ESP_SLEEP_WAKEUP_TOUCHPAD,
+    ESP_SLEEP_WAKEUP_ULP,
+    ESP_SLEEP_WAKEUP_GPIO,
+} esp_sleep_wakeup_cause_t;
+
+typedef enum {
+    ESP_EXT1_WAKEUP_ALL_LOW = 0,
+    ESP_EXT1_WAKEUP_ANY_HIGH = 1
+} esp_sleep_ext1_wakeup_mode_t;
+
+esp_err_t esp_sleep_enable_timer_wakeup(uint64_t time_in_us);
+esp_err_t esp_sleep_enable_ext1_wakeup(uint64_t mask, esp_sleep_ext1_wakeup_mode_t mode);
+esp_sleep_wakeup_cause_t esp_sleep_get_wakeup_cause();
+uint64_t esp_sleep_get_ext1_wakeup_status();
+void esp_deep_sleep_start() __attribute__((noreturn));
+esp_err_t esp_light_sleep_start();
+
+void setup();
+void loop();
+
+#endif
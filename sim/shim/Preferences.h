@@ -0,0 +1,32 @@
+#ifndef SIM_PREFERENCES_H
+#define SIM_PREFERENCES_H
+
+/*
+Preferences (NVS) shim for the host-side simulator
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+Values are kept in the simulated world, like flash they survive deep sleep, resets and power loss.
+Only the unsigned integer type is implemented, writes are counted (flash wear).
+*/
+
+#include <Arduino.h>
+
+class Preferences {
+public:
+    Preferences() : open(false), readOnly(false) { space[0] = '\0'; }
+    ~Preferences() { end(); }
+
+    bool begin(const char* name, bool readOnly = false);
+    void end() { open = false; }
+
+    uint32_t getUInt(const char* key, uint32_t defaultValue = 0);
+    size_t putUInt(const char* key, uint32_t value);
+    bool isKey(const char* key);
+
+private:
+    bool open;
+    bool readOnly;
+    char space[16];
+};
+
+#endif
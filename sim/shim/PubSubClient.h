@@ -0,0 +1,70 @@
+#ifndef SIM_PUBSUBCLIENT_H
+#define SIM_PUBSUBCLIENT_H
+
+/*
+PubSubClient shim for the host-side simulator
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+Connecting and publishing take a random time drawn from the latency distributions in sim_world.h.
+Messages published by the device are counted, a reply to the "ready" message can be configured
+(--settings) and is delivered on the subscribed settings topic by loop().
+The broker keeps the subscription and a reply that has not been delivered between wakes (persistent session),
+a connect with clean session clears them.
+*/
+
+#include <Arduino.h>
+#include <WiFi.h>
+
+#define MQTT_CONNECTION_TIMEOUT     -4
+#define MQTT_CONNECTION_LOST        -3
+#define MQTT_CONNECT_FAILED         -2
+#define MQTT_DISCONNECTED           -1
+#define MQTT_CONNECTED               0
+
+#define MQTT_CALLBACK_SIGNATURE void (*callback)(char*, uint8_t*, unsigned int)
+
+class PubSubClient {
+public:
+    PubSubClient() : callback(nullptr), isConnected(false), lastState(MQTT_DISCONNECTED) {}
+    PubSubClient(Client& client) : PubSubClient() { (void)client; }
+
+    PubSubClient& setServer(IPAddress ip, uint16_t port) { (void)ip; (void)port; return *this; }
+    PubSubClient& setServer(const char* domain, uint16_t port) { (void)domain; (void)port; return *this; }
+    PubSubClient& setCallback(MQTT_CALLBACK_SIGNATURE) { this->callback = callback; return *this; }
+    PubSubClient& setClient(Client& client) { (void)client; return *this; }
+    PubSubClient& setKeepAlive(uint16_t keepAlive) { (void)keepAlive; return *this; }
+    PubSubClient& setSocketTimeout(uint16_t timeout) { (void)timeout; return *this; }
+    bool setBufferSize(uint16_t size) { (void)size; return true; }
+
+    bool connect(const char* id, const char* user, const char* pass) {
+        return connect(id, user, pass, nullptr, 0, false, nullptr, true);
+    }
+    bool connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos,
+                 bool willRetain, const char* willMessage, bool cleanSession);
+    void disconnect();
+    bool connected();
+    int state() { return lastState; }
+
+    bool publish(const char* topic, const char* payload) { return publish(topic, (const uint8_t*)payload, strlen(payload), false); }
+    bool publish(const char* topic, const char* payload, bool retained) { return publish(topic, (const uint8_t*)payload, strlen(payload), retained); }
+    bool publish(const char* topic, const uint8_t* payload, unsigned int length) { return publish(topic, payload, length, false); }
+    bool publish(const char* topic, const uint8_t* payload, unsigned int length, bool retained);
+
+    bool beginPublish(const char* topic, unsigned int length, bool retained);
+    size_t write(uint8_t c) { (void)c; return 1; }
+    size_t write(const uint8_t* buffer, size_t size) { (void)buffer; return size; }
+    int endPublish();
+
+    bool subscribe(const char* topic) { return subscribe(topic, 0); }
+    bool subscribe(const char* topic, uint8_t qos);
+    bool unsubscribe(const char* topic) { (void)topic; return connected(); }
+
+    bool loop();
+
+private:
+    MQTT_CALLBACK_SIGNATURE;
+    bool isConnected;
+    int lastState;
+};
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef SIM_WIFI_H
+#define SIM_WIFI_H
+
+/*
+WiFi shim for the host-side simulator
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+Association takes a random time drawn from the latency distribution in sim_world.h and fails
+with a configurable probability. The radio counts as on from WiFi.mode(WIFI_STA)/begin()
+until disconnect(true) or deep sleep.
+*/
+
+#include <Arduino.h>
+
+typedef enum {
+    WL_IDLE_STATUS = 0,
+    WL_NO_SSID_AVAIL = 1,
+    WL_CONNECTED = 3,
+    WL_CONNECT_FAILED = 4,
+    WL_DISCONNECTED = 6
+} wl_status_t;
+
+typedef enum {
+    WIFI_OFF = 0,
+    WIFI_STA = 1,
+    WIFI_AP = 2,
+    WIFI_AP_STA = 3
+} wifi_mode_t;
+
+typedef enum {
+    WIFI_POWER_19_5dBm = 78,
+    WIFI_POWER_19dBm = 76,
+    WIFI_POWER_18_5dBm = 74,
+    WIFI_POWER_17dBm = 68,
+    WIFI_POWER_15dBm = 60,
+    WIFI_POWER_13dBm = 52,
+    WIFI_POWER_11dBm = 44,
+    WIFI_POWER_8_5dBm = 34,
+    WIFI_POWER_7dBm = 28,
+    WIFI_POWER_5dBm = 20,
+    WIFI_POWER_2dBm = 8,
+    WIFI_POWER_MINUS_1dBm = -4
+} wifi_power_t;
+
+typedef enum {
+    ARDUINO_EVENT_WIFI_STA_START,
+    ARDUINO_EVENT_WIFI_STA_CONNECTED,
+    ARDUINO_EVENT_WIFI_STA_DISCONNECTED,
+    ARDUINO_EVENT_WIFI_STA_GOT_IP,
+    ARDUINO_EVENT_MAX
+} WiFiEvent_t;
+
+typedef union {
+    struct {
+        uint8_t reason;
+    } wifi_sta_disconnected;
+} WiFiEventInfo_t;
+
+typedef void (*WiFiEventFuncCb)(WiFiEvent_t event, WiFiEventInfo_t info);
+
+class IPAddress {
+public:
+    IPAddress() : address{0, 0, 0, 0} {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : address{a, b, c, d} {}
+    bool fromString(const char* str) {
+        unsigned int a, b, c, d;
+        if (sscanf(str, "%u.%u.%u.%u", &a, &b, &c, &d) != 4) return false;
+        address[0] = a; address[1] = b; address[2] = c; address[3] = d;
+        return true;
+    }
+    bool fromString(const String& str) { return fromString(str.c_str()); }
+    uint8_t operator[](int index) const { return address[index]; }
+    operator String() const {
+        char buffer[16];
+        snprintf(buffer, sizeof(buffer), "%u.%u.%u.%u", address[0], address[1], address[2], address[3]);
+        return String(buffer);
+    }
+private:
+    uint8_t address[4];
+};
+
+class WiFiClass {
+public:
+    void mode(wifi_mode_t mode);
+    bool setTxPower(wifi_power_t power);
+    bool hostname(const char* name) { (void)name; return true; }
+    bool setHostname(const char* name) { return hostname(name); }
+    bool hostname(const String& name) { return hostname(name.c_str()); }
+    wl_status_t begin(const char* ssid, const char* password);
+    wl_status_t begin(const String& ssid, const String& password) { return begin(ssid.c_str(), password.c_str()); }
+    wl_status_t status();
+    bool disconnect(bool wifioff = false);
+    void onEvent(WiFiEventFuncCb callback, WiFiEvent_t event);
+    String SSID() { return String("sim_ssid"); }
+    IPAddress localIP() { return IPAddress(192, 168, 1, 50); }
+};
+
+extern WiFiClass WiFi;
+
+class Client : public Print {
+public:
+    virtual int connect(IPAddress ip, uint16_t port) = 0;
+    virtual int connect(const char* host, uint16_t port) = 0;
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int read(uint8_t* buffer, size_t size) = 0;
+    virtual int peek() = 0;
+    virtual void flush() = 0;
+    virtual void stop() = 0;
+    virtual uint8_t connected() = 0;
+    virtual operator bool() = 0;
+};
+
+class WiFiClient : public Client {
+    // Data is exchanged directly by the PubSubClient shim, the client only tracks the connection
+public:
+    int connect(IPAddress ip, uint16_t port) override { (void)ip; (void)port; return WiFi.status() == WL_CONNECTED; }
+    int connect(const char* host, uint16_t port) override { (void)host; (void)port; return WiFi.status() == WL_CONNECTED; }
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int read(uint8_t* buffer, size_t size) override { (void)buffer; (void)size; return -1; }
+    int peek() override { return -1; }
+    void flush() override {}
+    void stop() override {}
+    uint8_t connected() override { return WiFi.status() == WL_CONNECTED; }
+    operator bool() override { return connected(); }
+    size_t write(uint8_t c) override { (void)c; return 1; }
+    using Print::write;
+};
+
+#endif
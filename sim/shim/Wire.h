@@ -0,0 +1,6 @@
+#ifndef SIM_WIRE_H
+#define SIM_WIRE_H
+
+// I2C is not used by water_thing, header only needed for the include in hardware_functions.h
+
+#endif
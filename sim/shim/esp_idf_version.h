@@ -0,0 +1,17 @@
+#ifndef SIM_ESP_IDF_VERSION_H
+#define SIM_ESP_IDF_VERSION_H
+
+/*
+ESP-IDF version shim for the host-side simulator
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+The simulator follows the API of ESP-IDF 4.4 (arduino-esp32 2.x).
+*/
+
+#define ESP_IDF_VERSION_VAL(major, minor, patch) ((major << 16) | (minor << 8) | (patch))
+#define ESP_IDF_VERSION_MAJOR 4
+#define ESP_IDF_VERSION_MINOR 4
+#define ESP_IDF_VERSION_PATCH 0
+#define ESP_IDF_VERSION ESP_IDF_VERSION_VAL(ESP_IDF_VERSION_MAJOR, ESP_IDF_VERSION_MINOR, ESP_IDF_VERSION_PATCH)
+
+#endif
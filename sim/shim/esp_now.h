@@ -0,0 +1,48 @@
+#ifndef SIM_ESP_NOW_H
+#define SIM_ESP_NOW_H
+
+/*
+ESP-NOW shim for the host-side simulator
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+The simulator plays the gateway. A frame takes a random time drawn from the ESP-NOW latency distribution in
+sim_world.h (airtime and the MAC acknowledgement) and is always acknowledged. A "ready" message is answered with
+the configured settings reply (--settings) on the settings topic, delivered to the receive callback by delay().
+Works with the radio on, WiFi.mode(WIFI_STA) without association.
+*/
+
+#include <Arduino.h>
+#include "esp_wifi.h"
+
+#define ESP_NOW_ETH_ALEN 6
+#define ESP_NOW_MAX_DATA_LEN 250
+#define ESP_ERR_ESPNOW_NOT_INIT 0x3065
+
+typedef enum {
+    ESP_NOW_SEND_SUCCESS = 0,
+    ESP_NOW_SEND_FAIL
+} esp_now_send_status_t;
+
+typedef struct {
+    uint8_t peer_addr[ESP_NOW_ETH_ALEN];
+    uint8_t lmk[16];
+    uint8_t channel;
+    wifi_interface_t ifidx;
+    bool encrypt;
+    void* priv;
+} esp_now_peer_info_t;
+
+typedef void (*esp_now_send_cb_t)(const uint8_t* mac, esp_now_send_status_t status);
+typedef void (*esp_now_recv_cb_t)(const uint8_t* mac, const uint8_t* data, int length);
+
+esp_err_t esp_now_init();
+esp_err_t esp_now_deinit();
+esp_err_t esp_now_register_send_cb(esp_now_send_cb_t cb);
+esp_err_t esp_now_register_recv_cb(esp_now_recv_cb_t cb);
+esp_err_t esp_now_add_peer(const esp_now_peer_info_t* peer);
+esp_err_t esp_now_send(const uint8_t* peer, const uint8_t* data, size_t length);
+
+// Delivers a due reply from the simulated gateway, called by delay()
+void simEspNowPoll();
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef SIM_ESP_TIMER_H
+#define SIM_ESP_TIMER_H
+
+/*
+esp_timer shim for the host-side simulator
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+One shot timers on the simulated clock. A timer that is due runs its callback the next time the firmware waits
+(delay(), yield(), light sleep), as the esp_timer task would preempt the setup() task there.
+*/
+
+#include <Arduino.h>
+
+typedef struct simEspTimer* esp_timer_handle_t;
+typedef void (*esp_timer_cb_t)(void* arg);
+
+typedef enum {
+    ESP_TIMER_TASK,
+} esp_timer_dispatch_t;
+
+typedef struct {
+    esp_timer_cb_t callback;
+    void* arg;
+    esp_timer_dispatch_t dispatch_method;
+    const char* name;
+    bool skip_unhandled_events;
+} esp_timer_create_args_t;
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* create_args, esp_timer_handle_t* out_handle);
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us);
+esp_err_t esp_timer_stop(esp_timer_handle_t timer);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef SIM_ESP_WIFI_H
+#define SIM_ESP_WIFI_H
+
+/*
+ESP WiFi driver shim for the host-side simulator
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+Only what the ESP-NOW transport needs, the channel is not simulated.
+*/
+
+#include <Arduino.h>
+
+typedef enum {
+    WIFI_IF_STA = 0,
+    WIFI_IF_AP
+} wifi_interface_t;
+
+typedef enum {
+    WIFI_SECOND_CHAN_NONE = 0,
+    WIFI_SECOND_CHAN_ABOVE,
+    WIFI_SECOND_CHAN_BELOW
+} wifi_second_chan_t;
+
+inline esp_err_t esp_wifi_set_channel(uint8_t primary, wifi_second_chan_t second) {
+    (void)primary; (void)second;
+    return ESP_OK;
+}
+
+#endif
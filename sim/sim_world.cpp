@@ -0,0 +1,269 @@
+/*
+Simulated world for the host-side simulator
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+*/
+
+#include "sim_world.h"
+
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <new>
+
+#define SIM_STEP_US 10000000ULL // Longest integration step, 10 s
+
+// Rest voltage of the simulated battery for SoC 0, 0.1 ... 1.0
+static const double restVoltage[] = {11.30, 11.51, 11.66, 11.81, 11.96, 12.10, 12.24, 12.37, 12.50, 12.62, 12.73};
+
+static void defaultConfig(simConfig& cfg) {
+    cfg.days = 30;
+    cfg.seed = 1;
+    cfg.verbose = false;
+    cfg.start = 0;
+    cfg.maxAwake = 600;
+
+    cfg.wifiMedian = 1.8;
+    cfg.wifiSigma = 0.5;
+    cfg.wifiFailProb = 0.02;
+    cfg.mqttMedian = 0.15;
+    cfg.mqttSigma = 0.6;
+    cfg.publishMedian = 0.005;
+    cfg.publishSigma = 0.5;
+    cfg.replyMedian = 0.08;
+    cfg.replySigma = 0.5;
+    cfg.espNowMedian = 0.002;
+    cfg.espNowSigma = 0.4;
+    cfg.settingsReply[0] = '\0';
+
+    cfg.tankArea = 1.0;
+    cfg.tankMax = 2.0;
+    cfg.tankStart = 1.5;
+    cfg.refillProb = 0.15;
+    cfg.refillLevel = 0.3;
+    cfg.flowCoefficient = 8.0;
+    cfg.pressureLoss = 0.3;
+
+    cfg.capacity = 7.2;
+    cfg.socStart = 0.9;
+    cfg.rInternal = 0.05;
+    cfg.solarPeak = 0.25;
+    cfg.cloudyProb = 0.3;
+    cfg.cloudyFactor = 0.15;
+    cfg.cloudySpellStart = -1;
+    cfg.cloudySpellDays = 0;
+
+    cfg.buttonPerDay = 0.0;
+}
+
+simWorld* simGet() {
+    // Shared between the simulator and the forked wakes, created on first use
+    // (may be called during static initialisation of the firmware globals)
+    static simWorld* world = nullptr;
+    if (world == nullptr) {
+        void* memory = mmap(nullptr, sizeof(simWorld), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        world = new (memory) simWorld();
+        defaultConfig(world->cfg);
+    }
+    return world;
+}
+
+double simLatency(double median, double sigma) {
+    std::lognormal_distribution<double> distribution(log(median), sigma);
+    return distribution(simGet()->rng);
+}
+
+unsigned long simAwakeMs() {
+    simWorld* w = simGet();
+    return (unsigned long)((w->nowUs - w->bootUs) / 1000ULL);
+}
+
+static long localDate(time_t t) {
+    // Days since 1970-01-01 of the local calendar date, days are 23 or 25 h long at DST changes
+    struct tm local;
+    localtime_r(&t, &local);
+    local.tm_hour = 12;
+    local.tm_min = 0;
+    local.tm_sec = 0;
+    return (long)(timegm(&local) / 86400);
+}
+
+int simLocalDay(uint64_t us) {
+    simWorld* w = simGet();
+    if (us < w->startUs) {
+        return 0;
+    }
+    return (int)(localDate((time_t)(us / 1000000ULL)) - localDate((time_t)(w->startUs / 1000000ULL)));
+}
+
+static double restVoltageAt(double soc) {
+    if (soc <= 0.0) return restVoltage[0];
+    if (soc >= 1.0) return restVoltage[10];
+    int i = (int)(soc * 10.0);
+    return restVoltage[i] + (soc * 10.0 - i) * (restVoltage[i + 1] - restVoltage[i]);
+}
+
+static bool stateActive(int state) {
+    // Is the device in a state of the energy model right now
+    simWorld* w = simGet();
+    if (w->dev.dead) {
+        return false;
+    }
+    switch (state) {
+        case ENERGY_SLEEP:      return !w->inBoot;
+        case ENERGY_LIGHT_SLEEP: return w->inBoot && w->dev.lightSleep;
+        case ENERGY_CPU:        return w->inBoot && !w->dev.lightSleep;
+        case ENERGY_WIFI_RX:    return w->inBoot && w->dev.radioOn;
+        case ENERGY_MOTOR:      return w->inBoot && w->dev.motorDir != 0;
+        case ENERGY_LED_RED:    return w->inBoot && w->dev.leds[0];
+        case ENERGY_LED_ORANGE: return w->inBoot && w->dev.leds[1];
+        case ENERGY_LED_GREEN:  return w->inBoot && w->dev.leds[2];
+        default:                return false; // Transmit is accounted per publish, see simTransmit()
+    }
+}
+
+static double loadCurrent() {
+    // Current drawn from the battery right now, A
+    double current = 0.0;
+    for (int i = 0; i < ENERGY_STATES; i++) {
+        if (stateActive(i)) current += energyMeter::current(i);
+    }
+    return current / 1000.0;
+}
+
+void simTransmit(size_t bytes) {
+    // Airtime estimate of the energy model, drawn directly from the battery
+    simWorld* w = simGet();
+    double seconds = ENERGY_TX_OVERHEAD + bytes * 8.0 / ENERGY_TX_RATE;
+    double charge = seconds * energyMeter::current(ENERGY_WIFI_TX) / 1000.0 / 3600.0;
+    w->stats.stateSeconds[ENERGY_WIFI_TX] += seconds;
+    w->stats.charge += charge;
+    w->dev.soc -= charge / w->cfg.capacity;
+}
+
+static double solarCurrent() {
+    // Charging current, sine over the day (06-18 local time) times today's cloudiness
+    simWorld* w = simGet();
+    time_t now = (time_t)(w->nowUs / 1000000ULL);
+    struct tm local;
+    localtime_r(&now, &local);
+    double hour = local.tm_hour + local.tm_min / 60.0;
+    if (hour < 6.0 || hour > 18.0) {
+        return 0.0;
+    }
+    return w->cfg.solarPeak * sin(M_PI * (hour - 6.0) / 12.0) * w->dev.cloudiness;
+}
+
+double simBatteryVoltage() {
+    simWorld* w = simGet();
+    double v = restVoltageAt(w->dev.soc) - (loadCurrent() - solarCurrent()) * w->cfg.rInternal;
+    return v > 0.0 ? v : 0.0;
+}
+
+double simPressure() {
+    // Pressure at the sensor, bar(e), static head lowered by the flow when the valve is open
+    simWorld* w = simGet();
+    double pStatic = 998.0 * 9.82 * w->dev.tankLevel / 1e5;
+    return pStatic * (1.0 - w->cfg.pressureLoss * w->dev.valvePos);
+}
+
+static void newDay(int day) {
+    // Weather and refill for a new day
+    simWorld* w = simGet();
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+    bool forcedCloudy = w->cfg.cloudySpellStart >= 0 && day >= w->cfg.cloudySpellStart &&
+                        day < w->cfg.cloudySpellStart + w->cfg.cloudySpellDays;
+    bool cloudy = forcedCloudy || uniform(w->rng) < w->cfg.cloudyProb;
+    w->dev.cloudiness = cloudy ? w->cfg.cloudyFactor : 1.0;
+    w->dev.weatherDay = day;
+
+    if (uniform(w->rng) < w->cfg.refillProb) {
+        w->dev.tankLevel += w->cfg.refillLevel;
+        if (w->dev.tankLevel > w->cfg.tankMax) {
+            w->dev.tankLevel = w->cfg.tankMax;
+        }
+    }
+}
+
+static void step(uint64_t us) {
+    // Integrate over a short interval
+    simWorld* w = simGet();
+    double dt = us / 1e6;
+
+    int day = simLocalDay(w->nowUs);
+    if (day != w->dev.weatherDay) {
+        newDay(day);
+    }
+
+    // Valve travel, takes 8 s end to end
+    if (w->dev.motorDir != 0) {
+        double before = w->dev.valvePos;
+        w->dev.valvePos += w->dev.motorDir * dt / 8.0;
+        w->dev.valvePos = w->dev.valvePos < 0.0 ? 0.0 : (w->dev.valvePos > 1.0 ? 1.0 : w->dev.valvePos);
+        w->stats.motor += dt;
+        if (before < 0.5 && w->dev.valvePos >= 0.5) {
+            w->stats.openings++;
+            if (day < SIM_MAX_DAYS && w->days[day].watered == 0 &&
+                (time_t)(w->nowUs / 1000000ULL) >= w->days[day].scheduled) {
+                w->days[day].watered = (time_t)(w->nowUs / 1000000ULL);
+            }
+        }
+    }
+
+    // Flow out of the tank
+    if (w->dev.valvePos > 0.0 && w->dev.tankLevel > 0.0) {
+        double litres = w->cfg.flowCoefficient * sqrt(simPressure()) * w->dev.valvePos * dt / 60.0;
+        w->dev.tankLevel -= litres / 1000.0 / w->cfg.tankArea;
+        if (w->dev.tankLevel < 0.0) w->dev.tankLevel = 0.0;
+        w->stats.water += litres;
+        if (day < SIM_MAX_DAYS) w->days[day].water += litres;
+    }
+
+    // Battery
+    double load = loadCurrent();
+    double solar = solarCurrent();
+    w->stats.charge += load * dt / 3600.0;
+    w->stats.solar += solar * dt / 3600.0;
+    w->dev.soc += (0.85 * solar - load) * dt / 3600.0 / w->cfg.capacity;
+    if (w->dev.soc > 1.0) w->dev.soc = 1.0;
+    if (w->dev.soc <= 0.0) {
+        w->dev.soc = 0.0;
+        w->dev.dead = true;
+    }
+
+    // Statistics
+    if (w->inBoot) {
+        w->stats.awake += dt;
+        if (w->dev.radioOn) w->stats.radio += dt;
+    }
+    for (int i = 0; i < ENERGY_STATES; i++) {
+        if (stateActive(i)) w->stats.stateSeconds[i] += dt;
+    }
+    if (w->dev.dead) {
+        w->stats.dead += dt;
+    }
+    if (day < SIM_MAX_DAYS) {
+        simDay& d = w->days[day];
+        if (w->inBoot) {
+            d.awake += dt;
+            if (w->dev.radioOn) d.radio += dt;
+        }
+        float soc = (float)w->dev.soc;
+        float v = (float)simBatteryVoltage();
+        if (d.minSoc < 0 || soc < d.minSoc) d.minSoc = soc;
+        if (soc > d.maxSoc) d.maxSoc = soc;
+        if (d.minVoltage <= 0 || v < d.minVoltage) d.minVoltage = v;
+    }
+
+    w->nowUs += us;
+}
+
+void simAdvance(uint64_t us) {
+    while (us > 0) {
+        uint64_t dt = us > SIM_STEP_US ? SIM_STEP_US : us;
+        step(dt);
+        us -= dt;
+    }
+}
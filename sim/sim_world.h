@@ -0,0 +1,182 @@
+#ifndef SIM_WORLD_H
+#define SIM_WORLD_H
+
+/*
+Simulated world for the host-side simulator
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+Everything the firmware cannot see directly: the virtual clock, the physical valve, the water tank,
+the battery with solar charging, the buttons, radio latencies and the statistics collected during a run.
+
+The world lives in shared memory so it is visible both to the simulator and to the forked process
+that runs one wake of the firmware (see simulator.cpp).
+
+simConfig:    Parameters of a run, set from the command line.
+simDevice:    Physical state of the device and the environment.
+simStats:     Totals collected over the run.
+simDay:       Per day statistics, battery trajectory and watering.
+simWorld:     All of the above plus clock and random generator.
+
+Functions:
+    simGet(): The shared world, created on first use.
+    simAdvance(uint64_t us): Advance the clock, integrating tank, battery and valve over the interval.
+    simAwakeMs(): Milliseconds since the current boot (millis()).
+    simLatency(double median, double sigma): Draw a latency in seconds from a log-normal distribution.
+    simTransmit(size_t bytes): Account for the charge of transmitting bytes.
+    simBatteryVoltage(), simPressure(): Terminal voltage and pressure at the sensor.
+    simLocalDay(uint64_t us): Index of the simulated day a point in time belongs to.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <random>
+
+#include "energy.h"
+
+#define SIM_MAX_DAYS 3660      // Longest run, days
+#define SIM_RTC_SIZE 8192      // RTC slow memory of the ESP32, bytes
+#define SIM_MAX_PAYLOAD 512    // Longest downlink payload
+
+struct simConfig {
+    double days;             // Length of run
+    uint32_t seed;           // Random seed
+    bool verbose;            // Show Serial output of the firmware
+    time_t start;            // Start of run, unix time
+    double maxAwake;         // s, a wake longer than this counts as hung and resets the device
+
+    // Radio latencies, log-normal with median and sigma (of the underlying normal distribution)
+    double wifiMedian, wifiSigma;   // s, association + DHCP
+    double wifiFailProb;            // Probability that association fails this wake
+    double mqttMedian, mqttSigma;   // s, TCP + MQTT connect
+    double publishMedian, publishSigma; // s, per publish
+    double replyMedian, replySigma; // s, until the settings reply arrives after "ready"
+    double espNowMedian, espNowSigma; // s, per ESP-NOW frame incl. acknowledgement
+    char settingsReply[SIM_MAX_PAYLOAD]; // Reply to "ready", empty for none
+
+    // Tank
+    double tankArea;         // m2
+    double tankMax;          // m, full tank
+    double tankStart;        // m
+    double refillProb;       // Probability of a refill (rain) each day
+    double refillLevel;      // m, added by a refill
+    double flowCoefficient;  // l/min per sqrt(bar), real flow coefficient of the installation
+    double pressureLoss;     // Share of static pressure lost at the sensor when the valve is fully open
+
+    // Battery and solar
+    double capacity;         // Ah
+    double socStart;         // 0-1
+    double rInternal;        // Ohm
+    double solarPeak;        // A, charging current at noon on a sunny day
+    double cloudyProb;       // Probability of a cloudy day
+    double cloudyFactor;     // Share of solar current on a cloudy day
+    int cloudySpellStart;    // Day of a forced cloudy spell, -1 for none
+    int cloudySpellDays;     // Length of the forced cloudy spell
+
+    double buttonPerDay;     // Average nr of button presses per day
+
+    // Current draw in each state is taken from the energy model of the firmware, see energy.h
+};
+
+struct simDevice {
+    double valvePos;         // 0 closed - 1 open
+    int motorDir;            // 1 opening, -1 closing, 0 off
+    bool leds[3];            // red, orange, green
+    double tankLevel;        // m
+    double soc;              // 0-1
+    bool dead;               // Battery empty, device is off
+    double cloudiness;       // Solar factor for today
+    int weatherDay;          // Day cloudiness was drawn for
+
+    bool radioOn;
+    bool wifiFails;          // Association will fail this wake
+    uint64_t wifiConnectAt;  // us, when association completes
+    bool wifiStarted;
+
+    uint64_t buttonUntil;    // us, button is held until
+    int buttonPin;
+    uint64_t pressedAt;      // us, press that has not started the motor yet, 0 if none
+
+    int wakeCause;           // esp_sleep_wakeup_cause_t of this boot
+    uint64_t ext1Status;     // Pins that caused an ext1 wake
+    uint64_t ext1Mask;       // Pins enabled for ext1 wake
+    uint64_t sleepUs;        // Requested sleep time, 0 if none
+    bool lightSleep;         // In light sleep during a wake
+
+    bool pending;            // Downlink message waiting
+    uint64_t pendingAt;      // us, arrives at
+    char subscribed[128];    // Settings topic the device subscribed to
+};
+
+#define SIM_NVS_KEYS 16          // Preferences entries, all namespaces
+
+struct simNvs {
+    char key[32];            // "namespace/key"
+    uint32_t value;
+};
+
+struct simStats {
+    uint64_t wakes, timerWakes, buttonWakes, resetWakes, hungWakes, deadWakes;
+    uint64_t budgetCuts;     // Wakes cut by the wake budget (wake_budget.h)
+    double awake;            // s
+    double radio;            // s
+    double motor;            // s
+    double dead;             // s, battery empty
+    double stateSeconds[ENERGY_STATES]; // s, time in each state of the energy model
+    uint64_t actuations;     // Motor runs
+    uint64_t openings;       // Valve opened
+    uint64_t publishes, publishBytes;
+    uint64_t heapAllocs;     // Heap allocations by the firmware during wakes (operator new)
+    uint64_t initAllocs;     // Heap allocations by constructors of globals, made on every boot of a real device
+    uint64_t wifiFailures;
+    uint64_t nvsWrites;      // Preferences values written to flash
+    uint64_t buttonMoves;    // Button wakes that started the motor
+    double buttonLatency;    // s, press to motor start, sum over buttonMoves
+    double buttonLatencyMax; // s
+    double water;            // l, delivered
+    double charge;           // Ah, drawn from battery
+    double solar;            // Ah, charged by solar
+};
+
+struct simDay {
+    double awake, radio;
+    uint32_t wakes;
+    float minSoc, maxSoc;
+    float minVoltage;
+    time_t scheduled;        // Watering target time this day
+    time_t watered;          // First valve opening after target, 0 if none
+    float water;             // l
+};
+
+struct simWorld {
+    simConfig cfg;
+    simDevice dev;
+    simStats stats;
+    simDay days[SIM_MAX_DAYS];
+
+    uint64_t startUs;        // us, unix time of start
+    uint64_t nowUs;          // us, unix time
+    uint64_t bootUs;         // us, start of current boot
+    bool inBoot;             // Running firmware (child process)
+    bool started;            // main() of the simulator has started, globals are constructed
+    uint64_t lastMotorStart; // For counting actuations
+
+    std::mt19937_64 rng;
+
+    uint8_t rtc[SIM_RTC_SIZE]; // RTC memory handed from the wake to the simulator
+    uint8_t rtcNoinit[SIM_RTC_SIZE]; // RTC_NOINIT_ATTR memory, also handed over when the wake hangs
+    simNvs nvs[SIM_NVS_KEYS];  // Flash, kept through resets and power loss
+    int nvsCount;
+    char pendingTopic[128];
+    char pendingPayload[SIM_MAX_PAYLOAD];
+};
+
+simWorld* simGet();
+void simAdvance(uint64_t us);
+unsigned long simAwakeMs();
+double simLatency(double median, double sigma);
+void simTransmit(size_t bytes);
+double simBatteryVoltage();
+double simPressure();
+int simLocalDay(uint64_t us);
+
+#endif
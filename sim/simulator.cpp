@@ -0,0 +1,343 @@
+/*
+Host-side simulator for water_thing
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+Runs the real firmware (main.cpp and all of src/) on a virtual clock to answer questions like
+"how many boots, radio seconds and actuations does a week cost with these settings?".
+
+Each wake runs setup() in a forked process. Deep sleep ends the process, RTC memory (all RTC_DATA_ATTR
+variables) is copied back to the simulator and carried into the next wake while all other globals start
+from their initial values, like after a real boot. A wake that hangs is reset, RTC_DATA_ATTR variables then
+start from their initial values while RTC_NOINIT_ATTR variables are kept. Between wakes the simulator integrates tank,
+battery and solar charging over the sleep time.
+
+Build and run with PlatformIO, see README.md in this folder:
+    pio run -e native_sim && .pio/build/native_sim/program --days 90
+
+Options:
+    --days N            Length of run in days (30)
+    --seed N            Random seed (1)
+    --start YYYY-MM-DD  First day of run (2026-05-01)
+    --verbose           Show Serial output of the firmware
+    --daily             Print a line per day
+    --csv FILE          Write per day statistics to FILE
+    --wifi-fail P       Probability that WiFi association fails (0.02)
+    --wifi-median S     Median WiFi association time, s (1.8)
+    --capacity AH       Battery capacity, Ah (7.2)
+    --soc X             Battery SoC at start, 0-1 (0.9)
+    --solar-peak A      Solar charging current at noon on a sunny day, A (0.25)
+    --cloudy P          Probability of a cloudy day (0.3)
+    --cloudy-spell D:N  Force N cloudy days starting at day D
+    --buttons N         Average button presses per day (0)
+    --settings JSON     Reply to the "ready" message with these settings
+*/
+
+#include <Arduino.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "sim_world.h"
+#include "config.h"
+#include "time_keeping.h"
+
+extern "C" char __start_sim_rtc[];
+extern "C" char __stop_sim_rtc[];
+extern "C" char __start_sim_rtc_noinit[];
+extern "C" char __stop_sim_rtc_noinit[];
+
+static const uint64_t buttonPins[] = {15, 2};
+
+static size_t rtcSize() {
+    return __stop_sim_rtc - __start_sim_rtc;
+}
+
+static size_t rtcNoinitSize() {
+    return __stop_sim_rtc_noinit - __start_sim_rtc_noinit;
+}
+
+static bool parseArgs(int argc, char** argv, simConfig& cfg, bool& daily, const char*& csv) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+        bool used = true;
+
+        if (strcmp(arg, "--verbose") == 0) { cfg.verbose = true; used = false; }
+        else if (strcmp(arg, "--daily") == 0) { daily = true; used = false; }
+        else if (value == nullptr) { fprintf(stderr, "Missing value for %s\n", arg); return false; }
+        else if (strcmp(arg, "--days") == 0) cfg.days = atof(value);
+        else if (strcmp(arg, "--seed") == 0) cfg.seed = atoi(value);
+        else if (strcmp(arg, "--csv") == 0) csv = value;
+        else if (strcmp(arg, "--wifi-fail") == 0) cfg.wifiFailProb = atof(value);
+        else if (strcmp(arg, "--wifi-median") == 0) cfg.wifiMedian = atof(value);
+        else if (strcmp(arg, "--capacity") == 0) cfg.capacity = atof(value);
+        else if (strcmp(arg, "--soc") == 0) cfg.socStart = atof(value);
+        else if (strcmp(arg, "--solar-peak") == 0) cfg.solarPeak = atof(value);
+        else if (strcmp(arg, "--cloudy") == 0) cfg.cloudyProb = atof(value);
+        else if (strcmp(arg, "--buttons") == 0) cfg.buttonPerDay = atof(value);
+        else if (strcmp(arg, "--settings") == 0) strncpy(cfg.settingsReply, value, sizeof(cfg.settingsReply) - 1);
+        else if (strcmp(arg, "--cloudy-spell") == 0) {
+            if (sscanf(value, "%d:%d", &cfg.cloudySpellStart, &cfg.cloudySpellDays) != 2) return false;
+        }
+        else if (strcmp(arg, "--start") == 0) {
+            struct tm start = {};
+            if (sscanf(value, "%d-%d-%d", &start.tm_year, &start.tm_mon, &start.tm_mday) != 3) return false;
+            start.tm_year -= 1900;
+            start.tm_mon -= 1;
+            start.tm_isdst = -1;
+            cfg.start = mktime(&start);
+        }
+        else { fprintf(stderr, "Unknown option %s\n", arg); return false; }
+
+        if (used) i++;
+    }
+    if (cfg.days < 1 || cfg.days > SIM_MAX_DAYS) {
+        fprintf(stderr, "--days must be 1-%d\n", SIM_MAX_DAYS);
+        return false;
+    }
+    return true;
+}
+
+static bool runWake() {
+    // Run setup() of the firmware in a child process until it enters deep sleep,
+    // returns false if the wake hung or crashed
+    simWorld* w = simGet();
+
+    w->bootUs = w->nowUs;
+    w->inBoot = true;
+    w->dev.sleepUs = 0;
+    w->dev.radioOn = false;
+    w->dev.wifiStarted = false;
+    w->stats.wakes++;
+    int day = simLocalDay(w->nowUs);
+    if (day < SIM_MAX_DAYS) w->days[day].wakes++;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        setup();
+        while (true) {
+            loop();
+            yield();
+        }
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+
+    w->inBoot = false;
+    w->dev.radioOn = false;
+    w->dev.lightSleep = false;
+    w->dev.motorDir = 0;
+    w->dev.pressedAt = 0;
+    for (int i = 0; i < 3; i++) w->dev.leds[i] = false;
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void sleepUntilNextWake(uint64_t endUs) {
+    // Sleep for the requested time, a button press may wake the device earlier
+    simWorld* w = simGet();
+    uint64_t sleepUs = w->dev.sleepUs;
+    if (sleepUs > endUs - w->nowUs) {
+        sleepUs = endUs - w->nowUs;
+    }
+    uint64_t pressUs = UINT64_MAX;
+
+    if (w->cfg.buttonPerDay > 0 && w->dev.ext1Mask != 0) {
+        std::exponential_distribution<double> nextPress(w->cfg.buttonPerDay / 86400.0);
+        pressUs = (uint64_t)(nextPress(w->rng) * 1e6);
+    }
+
+    if (pressUs < sleepUs) {
+        std::uniform_int_distribution<int> pin(0, 1);
+        uint64_t buttonPin = buttonPins[pin(w->rng)];
+        simAdvance(pressUs);
+        w->dev.wakeCause = ESP_SLEEP_WAKEUP_EXT1;
+        w->dev.ext1Status = 1ULL << buttonPin;
+        w->dev.buttonPin = (int)buttonPin;
+        w->dev.buttonUntil = w->nowUs + 300000ULL; // Held for 300 ms
+        w->dev.pressedAt = w->nowUs;
+        w->stats.buttonWakes++;
+    } else {
+        simAdvance(sleepUs);
+        w->dev.wakeCause = ESP_SLEEP_WAKEUP_TIMER;
+        w->dev.ext1Status = 0;
+        w->stats.timerWakes++;
+    }
+}
+
+static void powerOn(const uint8_t* initialRtc) {
+    // Power on reset, RTC memory starts from its initial values
+    simWorld* w = simGet();
+    memcpy(__start_sim_rtc, initialRtc, rtcSize());
+    w->dev.wakeCause = ESP_SLEEP_WAKEUP_UNDEFINED;
+    w->dev.ext1Status = 0;
+    w->dev.ext1Mask = 0;
+}
+
+static void printReport(const simWorld* w, double days, bool daily, const char* csv) {
+    const simStats& s = w->stats;
+    int nrDays = (int)days;
+    int scheduled = 0, watered = 0, late = 0, missed = 0;
+    float minSoc = 1.0;
+
+    FILE* csvFile = csv != nullptr ? fopen(csv, "w") : nullptr;
+    if (csvFile != nullptr) {
+        fprintf(csvFile, "day,date,wakes,awake_s,radio_s,min_soc,max_soc,min_voltage,watered,water_l\n");
+    }
+    if (daily) {
+        printf("\n day  date        wakes  awake s  radio s  SoC min-max  V min  watered  water l\n");
+    }
+
+    for (int d = 0; d < nrDays && d < SIM_MAX_DAYS; d++) {
+        const simDay& day = w->days[d];
+        char date[16], wateredAt[16];
+        time_t dayStart = (time_t)(w->startUs / 1000000ULL) + d * 86400;
+        struct tm local;
+        localtime_r(&dayStart, &local);
+        strftime(date, sizeof(date), "%Y-%m-%d", &local);
+
+        if (day.scheduled >= (time_t)(w->startUs / 1000000ULL) && day.scheduled < (time_t)(w->nowUs / 1000000ULL)) {
+            scheduled++;
+            if (day.watered != 0) {
+                watered++;
+                if (day.watered - day.scheduled > 300) late++;
+            } else {
+                missed++;
+            }
+        }
+        if (day.watered != 0) {
+            localtime_r(&day.watered, &local);
+            strftime(wateredAt, sizeof(wateredAt), "%H:%M", &local);
+        } else {
+            strcpy(wateredAt, "-");
+        }
+        if (day.minSoc >= 0 && day.minSoc < minSoc) minSoc = day.minSoc;
+
+        if (daily) {
+            printf("%4d  %s  %5u  %7.1f  %7.1f  %3.0f-%3.0f %%  %5.2f  %7s  %7.1f\n", d, date, day.wakes, day.awake, day.radio,
+                   day.minSoc * 100.0, day.maxSoc * 100.0, day.minVoltage, wateredAt, day.water);
+        }
+        if (csvFile != nullptr) {
+            fprintf(csvFile, "%d,%s,%u,%.2f,%.2f,%.4f,%.4f,%.3f,%s,%.2f\n", d, date, day.wakes, day.awake, day.radio,
+                    day.minSoc, day.maxSoc, day.minVoltage, wateredAt, day.water);
+        }
+    }
+    if (csvFile != nullptr) {
+        fclose(csvFile);
+    }
+
+    printf("\nwater_thing simulation, %.0f days, seed %u\n", days, w->cfg.seed);
+    printf("Wakes            %llu (timer %llu, button %llu, reset %llu, hung %llu), %.1f per day\n",
+           (unsigned long long)s.wakes, (unsigned long long)s.timerWakes, (unsigned long long)s.buttonWakes,
+           (unsigned long long)s.resetWakes, (unsigned long long)s.hungWakes, s.wakes / days);
+    printf("Budget cuts      %llu, wakes cut by the wake budget\n", (unsigned long long)s.budgetCuts);
+    printf("Awake time       %.0f s, %.1f s per day, %.2f s per wake\n", s.awake, s.awake / days, s.wakes ? s.awake / s.wakes : 0.0);
+    printf("Radio time       %.0f s, %.1f s per day (%llu WiFi failures)\n", s.radio, s.radio / days, (unsigned long long)s.wifiFailures);
+    printf("Publishes        %llu, %llu bytes\n", (unsigned long long)s.publishes, (unsigned long long)s.publishBytes);
+    printf("Heap             %.1f allocations per wake (%llu by constructors of globals)\n",
+           (s.wakes > 0 ? (double)s.heapAllocs / s.wakes : 0.0) + s.initAllocs, (unsigned long long)s.initAllocs);
+    printf("RTC memory       %zu of %d bytes used by retained variables\n", rtcSize() + rtcNoinitSize(), SIM_RTC_SIZE);
+    printf("Valve            %llu actuations, %.0f s motor time, %llu openings\n",
+           (unsigned long long)s.actuations, s.motor, (unsigned long long)s.openings);
+    printf("Buttons          %llu presses moved the valve, %.0f ms average, %.0f ms max from the press\n",
+           (unsigned long long)s.buttonMoves, s.buttonMoves ? s.buttonLatency * 1000.0 / s.buttonMoves : 0.0,
+           s.buttonLatencyMax * 1000.0);
+    printf("NVS              %d keys, %llu writes\n", w->nvsCount, (unsigned long long)s.nvsWrites);
+    printf("Waterings        %d scheduled, %d done, %d late (>5 min), %d missed, %.0f l delivered\n",
+           scheduled, watered, late, missed, s.water);
+    printf("Battery          SoC %.0f %% -> %.0f %% (min %.0f %%), %.3f Ah drawn, %.3f Ah solar, %.0f s dead\n",
+           w->cfg.socStart * 100.0, w->dev.soc * 100.0, minSoc * 100.0, s.charge, s.solar, s.dead);
+
+    // Energy budget per state, same model as the firmware (energy.h)
+    printf("Energy           %.2f mAh per day\n", s.charge * 1000.0 / days);
+    for (int i = 0; i < ENERGY_STATES; i++) {
+        double mAh = s.stateSeconds[i] * energyMeter::current(i) / 3600.0;
+        printf("  %-12s   %8.2f mAh/day  %5.1f %%  %10.0f s\n", energyMeter::stateName(i), mAh / days,
+               s.charge > 0 ? mAh / (s.charge * 10.0) : 0.0, s.stateSeconds[i]);
+    }
+}
+
+int main(int argc, char** argv) {
+    simWorld* w = simGet();
+    w->started = true;
+    bool daily = false;
+    const char* csv = nullptr;
+
+    // Time zone of the firmware, also used for the day boundaries of the simulation
+    timeSetup();
+    struct tm start = {};
+    start.tm_year = 2026 - 1900;
+    start.tm_mon = 4;
+    start.tm_mday = 1;
+    start.tm_isdst = -1;
+    w->cfg.start = mktime(&start);
+
+    if (!parseArgs(argc, argv, w->cfg, daily, csv)) {
+        return 1;
+    }
+
+    w->rng.seed(w->cfg.seed);
+    w->startUs = (uint64_t)w->cfg.start * 1000000ULL;
+    w->nowUs = w->startUs;
+    w->dev.tankLevel = w->cfg.tankStart;
+    w->dev.soc = w->cfg.socStart;
+    w->dev.weatherDay = -1;
+
+    // Watering target each day, from the default settings
+    for (int d = 0; d < SIM_MAX_DAYS; d++) {
+        struct tm target;
+        localtime_r(&w->cfg.start, &target);
+        target.tm_mday += d;
+        target.tm_hour = settings.getWaterTimeHour();
+        target.tm_min = settings.getWaterTimeMinute();
+        target.tm_sec = 0;
+        target.tm_isdst = -1;
+        w->days[d].scheduled = mktime(&target);
+        w->days[d].minSoc = -1;
+    }
+
+    if (rtcSize() + rtcNoinitSize() > SIM_RTC_SIZE) {
+        fprintf(stderr, "RTC memory overflow, %zu bytes used of %d\n", rtcSize() + rtcNoinitSize(), SIM_RTC_SIZE);
+        return 1;
+    }
+    static uint8_t initialRtc[SIM_RTC_SIZE];
+    memcpy(initialRtc, __start_sim_rtc, rtcSize());
+    powerOn(initialRtc);
+
+    uint64_t endUs = w->startUs + (uint64_t)(w->cfg.days * 86400e6);
+    while (w->nowUs < endUs) {
+        if (w->dev.dead) {
+            // Battery empty, wait for the sun to bring it back to 5 %
+            while (w->dev.soc < 0.05 && w->nowUs < endUs) {
+                simAdvance(600000000ULL);
+            }
+            w->dev.dead = false;
+            w->stats.deadWakes++;
+            memset(__start_sim_rtc_noinit, 0xA5, rtcNoinitSize()); // Lost with the power
+            powerOn(initialRtc);
+            continue;
+        }
+
+        memcpy(w->rtc, __start_sim_rtc, rtcSize());
+        memcpy(w->rtcNoinit, __start_sim_rtc_noinit, rtcNoinitSize());
+        bool slept = runWake();
+        memcpy(__start_sim_rtc_noinit, w->rtcNoinit, rtcNoinitSize());
+        if (!slept) {
+            // Hung or crashed, watchdog reset
+            w->stats.resetWakes++;
+            powerOn(initialRtc);
+            simAdvance(1000000ULL);
+            continue;
+        }
+
+        memcpy(__start_sim_rtc, w->rtc, rtcSize());
+        sleepUntilNextWake(endUs);
+    }
+
+    printReport(w, w->cfg.days, daily, csv);
+    return 0;
+}
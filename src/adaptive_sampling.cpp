@@ -0,0 +1,54 @@
+/*
+Adaptive sampling
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+*/
+
+#include "adaptive_sampling.h"
+#include "logger.h"
+
+// Retain sampling state after sleep
+RTC_DATA_ATTR samplingState samplingPolicyState = {0.0, 0.0, 0.0, 0.0, 0, 0};
+
+void samplingPolicy::update(time_t now, double level, double battery, int baseInterval) {
+    /*
+    Update with new readings.
+    Interval is doubled if the filtered readings are within the deadband and are not predicted to leave it
+    before the next sample, otherwise it is reset to baseInterval.
+    */
+    if (state.interval == 0) {
+        // First sample, starts the filter
+        state.interval = baseInterval;
+        state.level = level;
+        state.battery = battery;
+    } else {
+        double hours = difftime(now, state.lastSample) / 3600.0;
+        double dLevel = SAMPLING_EWMA_ALPHA * (level - state.level);
+        double dBattery = SAMPLING_EWMA_ALPHA * (battery - state.battery);
+
+        if (hours > 0) {
+            state.levelRate = dLevel / hours;
+            state.batteryRate = dBattery / hours;
+        }
+
+        // Predicted change until the sample after a doubled interval
+        double nextHours = 2.0 * state.interval / 3600.0;
+        bool stable = fabs(dLevel) < LEVEL_DEADBAND && fabs(dBattery) < BATTERY_DEADBAND &&
+                      fabs(state.levelRate * nextHours) < LEVEL_DEADBAND &&
+                      fabs(state.batteryRate * nextHours) < BATTERY_DEADBAND;
+
+        if (stable) {
+            state.interval *= 2;
+            if (state.interval > baseInterval * SAMPLING_MAX_FACTOR) {
+                state.interval = baseInterval * SAMPLING_MAX_FACTOR;
+            }
+        } else {
+            state.interval = baseInterval;
+        }
+        state.level += dLevel;
+        state.battery += dBattery;
+    }
+
+    state.lastSample = now;
+
+    LOG_DEBUG("Sampling interval: %ld s", (long)state.interval);
+}
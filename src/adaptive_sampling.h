@@ -0,0 +1,101 @@
+#ifndef ADAPTIVE_SAMPLING_H
+#define ADAPTIVE_SAMPLING_H
+
+/*
+Adaptive sampling
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+Decides when the sensors should be read. While tank level and battery voltage stay within a deadband
+the sampling interval is doubled for each sample (up to SAMPLING_MAX_FACTOR times the default sleep time),
+as soon as a reading moves outside the deadband, or is predicted to from its rate of change,
+the interval snaps back to the default sleep time. Watering, an open valve and button presses also
+snap back to fast sampling.
+
+The decision is made on filtered readings, an exponentially weighted moving average (SAMPLING_EWMA_ALPHA) per
+sample. The noise of a single level reading (about 0.01 m) is of the order of the deadband, compared sample to
+sample the interval would hardly ever grow. The average moves by SAMPLING_EWMA_ALPHA of the difference to a new
+reading: noise is damped by about that factor, a step of the level of more than the deadband / SAMPLING_EWMA_ALPHA
+still snaps back on the first sample, a smaller or slower change within a few samples.
+
+The device only wakes when a sample is due (or watering is due), so the number of samples and wakes per day
+follows how much the readings actually change.
+
+samplingPolicy Class:
+    Purpose:
+        Keeps track of the filtered readings, their rate of change and the current sampling interval in RTC memory.
+    Public Methods:
+        sampleDue(time_t now): true if the sensors should be read this wake.
+        update(time_t now, double level, double battery, int baseInterval): Update with new readings, adapts interval.
+        event(int baseInterval): Snap back to fast sampling, i.e. around watering.
+        timeToNextSample(time_t now): Seconds until the next sample is due.
+        getInterval(), getLevelRate(), getBatteryRate().
+
+Retained Variables (RTC_DATA_ATTR):
+    samplingPolicyState: Filtered readings, time of the last sample, rates and current interval.
+*/
+
+#include <Arduino.h>
+#include <time.h>
+
+#define SAMPLING_MAX_FACTOR 16    // Max interval, times default sleep time
+#define LEVEL_DEADBAND 0.02       // m, change in tank level considered no change
+#define BATTERY_DEADBAND 0.05     // V, change in battery voltage considered no change
+#define SAMPLING_EWMA_ALPHA 0.25  // Weight of a new reading in the filtered readings
+
+struct samplingState {
+    // Sampling policy state, retained after sleep
+    float level;        // m, filtered
+    float battery;      // V, filtered
+    float levelRate;    // m/h
+    float batteryRate;  // V/h
+    time_t lastSample;  // Time of last sample
+    int interval;       // s, current sampling interval, 0 = not yet sampled
+};
+
+extern RTC_DATA_ATTR samplingState samplingPolicyState;
+
+class samplingPolicy {
+    /*
+    Class for adapting the sampling interval to how fast readings change.
+    */
+private:
+    samplingState& state;
+
+public:
+    // Constructor
+    samplingPolicy(samplingState& state)
+        : state(state) {}
+
+    bool sampleDue(time_t now) const {
+        // Allow waking a few seconds early, the RTC drifts during deep sleep
+        return state.interval == 0 || difftime(now, state.lastSample) >= state.interval - 5;
+    }
+
+    void update(time_t now, double level, double battery, int baseInterval);
+
+    void event(int baseInterval) {
+        // Something happened, sample fast
+        if (state.interval > baseInterval) {
+            state.interval = baseInterval;
+        }
+    }
+
+    long timeToNextSample(time_t now) const {
+        long left = state.interval - (long)difftime(now, state.lastSample);
+        return left > 0 ? left : 0;
+    }
+
+    int getInterval() const {
+        return state.interval;
+    }
+
+    double getLevelRate() const {
+        return state.levelRate;
+    }
+
+    double getBatteryRate() const {
+        return state.batteryRate;
+    }
+};
+
+#endif
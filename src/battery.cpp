@@ -0,0 +1,109 @@
+/*
+Battery state of charge and duty cycle
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+*/
+
+#include "battery.h"
+#include "logger.h"
+#include <time.h>
+
+#define AWAKE_CURRENT 0.12      // A, current drawn while awake with radio on
+#define MOTOR_CURRENT 0.8       // A, current drawn by the valve motor during travel
+#define R_INTERNAL_DEFAULT 0.05 // Ohm, internal resistance of a healthy battery incl. wiring
+#define BROWNOUT_VOLTAGE 10.5   // V, battery is considered empty if it sags below this under motor load
+#define SOC_FILTER 0.3          // Weight of a new reading in the filtered SoC
+#define LEVEL_HYSTERESIS 5.0    // %, SoC has to pass the limit by this much before stepping up a level
+
+// Retain battery state after sleep
+RTC_DATA_ATTR batteryHistory batteryState = {0.0, R_INTERNAL_DEFAULT, {0}, 0, 0, 0, false};
+RTC_DATA_ATTR int powerLevel = POWER_NORMAL;
+
+// Rest voltage (open circuit, no load) to SoC for a 12 V lead-acid battery at 25 C
+static const double socVoltage[] = {11.51, 11.66, 11.81, 11.96, 12.10, 12.24, 12.37, 12.50, 12.62, 12.73};
+static const double socPercent[] = {10.0,  20.0,  30.0,  40.0,  50.0,  60.0,  70.0,  80.0,  90.0,  100.0};
+static const int socPoints = sizeof(socVoltage) / sizeof(socVoltage[0]);
+
+// Lower SoC limit of each power level, see dutyGovernor
+static const double levelLimit[] = {60.0, 40.0, 20.0, 0.0};
+
+double batteryEstimator::restSoc(double voltage) {
+    // Interpolate SoC in the rest voltage table, 0 % at 11.3 V
+    if (voltage >= socVoltage[socPoints - 1]) {
+        return 100.0;
+    }
+    if (voltage < socVoltage[0]) {
+        double soc = (voltage - 11.3) / (socVoltage[0] - 11.3) * socPercent[0];
+        return soc < 0.0 ? 0.0 : soc;
+    }
+    for (int i = 1; i < socPoints; i++) {
+        if (voltage < socVoltage[i]) {
+            return socPercent[i - 1] + (voltage - socVoltage[i - 1]) / (socVoltage[i] - socVoltage[i - 1]) * (socPercent[i] - socPercent[i - 1]);
+        }
+    }
+    return 100.0;
+}
+
+void batteryEstimator::update(double voltage, double loadVoltage) {
+    /*
+    voltage:     battery voltage read while awake
+    loadVoltage: battery voltage while the valve motor was running, 0 if the valve was not actuated
+    */
+
+    // Internal resistance from the sag during motor load
+    if (loadVoltage > 0.0 && voltage > loadVoltage) {
+        double r = (voltage - loadVoltage) / (MOTOR_CURRENT - AWAKE_CURRENT);
+        state.rInternal = state.rInternal * (1.0 - SOC_FILTER) + r * SOC_FILTER;
+    }
+
+    // Compensate for the current drawn while awake
+    restVoltage = voltage + AWAKE_CURRENT * state.rInternal;
+    double soc = restSoc(restVoltage);
+
+    // A battery that cannot carry the motor load is empty regardless of rest voltage
+    if (loadVoltage > 0.0 && loadVoltage < BROWNOUT_VOLTAGE) {
+        soc = 0.0;
+    }
+
+    if (!state.valid) {
+        state.soc = soc;
+        state.valid = true;
+    } else {
+        state.soc = state.soc * (1.0 - SOC_FILTER) + soc * SOC_FILTER;
+    }
+
+    // Store hourly history
+    time_t now = time(nullptr);
+    if (state.historyCount == 0 || difftime(now, state.lastHistoryTime) >= 3600) {
+        if (state.historyCount > 0) {
+            state.historyHead = (state.historyHead + 1) % SOC_HISTORY_SIZE;
+        }
+        state.history[state.historyHead] = (uint8_t)(state.soc + 0.5);
+        if (state.historyCount < SOC_HISTORY_SIZE) {
+            state.historyCount++;
+        }
+        state.lastHistoryTime = now;
+    }
+
+    LOG_INFO("Battery: %.2f V rest, SoC %.0f %%, R %.3f Ohm", restVoltage, (double)state.soc, (double)state.rInternal);
+}
+
+void dutyGovernor::update(double soc) {
+    // Step down as soon as SoC is below the limit of the level, step up only with hysteresis
+    while (level < POWER_CRITICAL && soc < levelLimit[level]) {
+        level++;
+    }
+    while (level > POWER_NORMAL && soc >= levelLimit[level - 1] + LEVEL_HYSTERESIS) {
+        level--;
+    }
+    LOG_DEBUG("Power level: %s", levelName());
+}
+
+const char* dutyGovernor::levelName() const {
+    switch (level) {
+        case POWER_NORMAL:   return "normal";
+        case POWER_ECO:      return "eco";
+        case POWER_LOW:      return "low";
+        case POWER_CRITICAL: return "critical";
+        default:             return "unknown";
+    }
+}
@@ -0,0 +1,156 @@
+#ifndef BATTERY_H
+#define BATTERY_H
+
+/*
+Battery state of charge and duty cycle
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+Estimates the state of charge (SoC) of the 12 V lead-acid battery and adapts how much work
+the device does each wake so it survives long periods without charging.
+
+batteryEstimator Class:
+    Purpose:
+        Estimates SoC from the rest voltage (open circuit voltage table for lead-acid) and the voltage sag
+        measured while the valve motor is running. The sag gives the internal resistance, which is used to
+        compensate the reading for the current drawn while awake, and a weak battery (sag below
+        brownout level) is reported as empty regardless of rest voltage.
+        Filtered SoC, internal resistance and an hourly SoC history are kept in RTC memory.
+    Public Methods:
+        update(double voltage, double loadVoltage): Update estimate with a reading while awake and, if the valve
+            was actuated this wake, the voltage under motor load (0 otherwise).
+        restSoc(double voltage): Static, SoC in % for a given rest voltage.
+        getSoc(), getRestVoltage(), getInternalResistance(), getHistory(int hoursAgo), getTrend().
+
+dutyGovernor Class:
+    Purpose:
+        Maps SoC to a power level and provides the duty cycle for that level. As the charge falls sleep is
+        stretched, the radio is only used every n:th wake, fewer ADC samples are taken and WiFi TX power
+        is lowered. Watering is never skipped by the governor.
+        Levels change with hysteresis, the current level is kept in RTC memory.
+    Public Methods:
+        update(double soc): Update level from SoC.
+        getLevel(), levelName(), getSleepTime(int defaultSleep), useRadio(int bootNr), getNrSamples(), getTxPower().
+
+Retained Variables (RTC_DATA_ATTR):
+    batteryState: Filtered SoC, internal resistance and SoC history.
+    powerLevel: Current level of the duty cycle governor.
+*/
+
+#include <Arduino.h>
+#include <WiFi.h>
+
+#define SOC_HISTORY_SIZE 24 // Hours of SoC history kept in RTC memory
+
+struct batteryHistory {
+    // Battery state, retained after sleep
+    float soc;                      // %, filtered
+    float rInternal;                // Ohm, estimated from sag during motor load
+    uint8_t history[SOC_HISTORY_SIZE]; // %, hourly SoC
+    uint8_t historyHead;            // Index of the newest history entry
+    uint8_t historyCount;           // Nr of valid entries
+    time_t lastHistoryTime;         // Time of newest history entry
+    bool valid;                     // false until first reading
+};
+
+enum powerLevels {
+    POWER_NORMAL = 0,
+    POWER_ECO,
+    POWER_LOW,
+    POWER_CRITICAL
+};
+
+extern RTC_DATA_ATTR batteryHistory batteryState;
+extern RTC_DATA_ATTR int powerLevel;
+
+class batteryEstimator {
+    /*
+    Class for estimating state of charge of a 12 V lead-acid battery.
+    */
+private:
+    batteryHistory& state;
+    double restVoltage; // V, last reading compensated for awake current
+
+public:
+    // Constructor
+    batteryEstimator(batteryHistory& state)
+        : state(state), restVoltage(0.0) {}
+
+    static double restSoc(double voltage);
+
+    void update(double voltage, double loadVoltage);
+
+    double getSoc() const {
+        return state.soc;
+    }
+
+    double getRestVoltage() const {
+        return restVoltage;
+    }
+
+    double getInternalResistance() const {
+        return state.rInternal;
+    }
+
+    int getHistory(int hoursAgo) const {
+        // SoC hoursAgo hours ago, -1 if not known
+        if (hoursAgo >= state.historyCount) {
+            return -1;
+        }
+        return state.history[(state.historyHead + SOC_HISTORY_SIZE - hoursAgo) % SOC_HISTORY_SIZE];
+    }
+
+    double getTrend() const {
+        // SoC change over the kept history, %/day
+        if (state.historyCount < 2) {
+            return 0.0;
+        }
+        int hours = state.historyCount - 1;
+        return (getHistory(0) - getHistory(hours)) * 24.0 / hours;
+    }
+};
+
+class dutyGovernor {
+    /*
+    Class that adapts the duty cycle of the device to the battery state of charge.
+    */
+private:
+    int& level;
+
+public:
+    // Constructor
+    dutyGovernor(int& level)
+        : level(level) {}
+
+    void update(double soc);
+
+    int getLevel() const {
+        return level;
+    }
+
+    const char* levelName() const;
+
+    int getSleepTime(int defaultSleep) const {
+        // Sleep time for current level, s
+        static const int sleepFactor[] = {1, 2, 4, 8};
+        return defaultSleep * sleepFactor[level];
+    }
+
+    bool useRadio(int bootNr) const {
+        // Only connect every n:th wake, readings in between are batched
+        static const int radioEvery[] = {1, 2, 4, 8};
+        return (bootNr % radioEvery[level]) == 0;
+    }
+
+    int getNrSamples() const {
+        // Nr of ADC samples averaged per reading
+        static const int nrSamples[] = {5, 4, 3, 2};
+        return nrSamples[level];
+    }
+
+    wifi_power_t getTxPower() const {
+        static const wifi_power_t txPower[] = {WIFI_POWER_8_5dBm, WIFI_POWER_7dBm, WIFI_POWER_5dBm, WIFI_POWER_2dBm};
+        return txPower[level];
+    }
+};
+
+#endif
@@ -0,0 +1,170 @@
+/*
+Command channel
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+*/
+
+#include "command_channel.h"
+#include <ArduinoJson.h>
+#include "logger.h"
+
+#include <stddef.h>
+
+// Survives resets, not only deep sleep
+RTC_NOINIT_ATTR commandState commandRetained;
+
+commandChannel commands(commandRetained);
+
+static const char* resultNames[] = {"queued", "applied", "duplicate", "invalid", "rejected"};
+
+void commandMQTT(const char* message) {
+    // Called when a message arrives on the command topic, empty when the retained command has been cleared
+    if (message[0] == '\0') {
+        return;
+    }
+    commands.receive(message);
+}
+
+uint32_t commandChannel::checksum(const commandState& s) {
+    // FNV-1a of all fields before the checksum
+    const uint8_t* bytes = (const uint8_t*)&s;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < offsetof(commandState, checksum); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+void commandChannel::save() {
+    state.checksum = checksum(state);
+}
+
+void commandChannel::begin() {
+    // Garbage after power on
+    if (state.magic != COMMAND_MAGIC || state.checksum != checksum(state)) {
+        memset(&state, 0, sizeof(state));
+        state.magic = COMMAND_MAGIC;
+        save();
+    }
+}
+
+queuedCommand* commandChannel::push(uint32_t seq, uint8_t kind) {
+    if (count >= COMMAND_QUEUE) {
+        LOG_WARN("Command queue full, %s %lu dropped", kindName(kind), (unsigned long)seq);
+        dropped = true;
+        return nullptr;
+    }
+    queuedCommand* c = &queue[count++];
+    memset(c, 0, sizeof(*c));
+    c->seq = seq;
+    c->kind = kind;
+    c->result = CMD_QUEUED;
+    return c;
+}
+
+void commandChannel::receive(const char* json) {
+    received = true;
+    StaticJsonDocument<192> doc;
+    DeserializationError error = deserializeJson(doc, json);
+    uint32_t seq = !error && doc.containsKey("seq") ? (uint32_t)doc["seq"] : 0;
+    const char* name = !error && doc.containsKey("cmd") ? (const char*)doc["cmd"] : nullptr;
+    uint8_t kind = CMD_NONE;
+    for (int i = CMD_NONE + 1; name != nullptr && i < CMD_KINDS; i++) {
+        if (strcmp(name, kindName(i)) == 0) {
+            kind = i;
+        }
+    }
+
+    queuedCommand* c = push(seq, kind);
+    if (c == nullptr) {
+        return;
+    }
+    if (seq == 0 || kind == CMD_NONE) {
+        LOG_ERROR("Command not valid: %s", error ? error.c_str() : json);
+        c->result = CMD_INVALID;
+        return;
+    }
+    if (kind == CMD_WATER) {
+        uint32_t minutes = doc.containsKey("min") ? (uint32_t)doc["min"] : 0;
+        c->minutes = minutes > COMMAND_MAX_WATER_MIN ? COMMAND_MAX_WATER_MIN : minutes;
+    }
+    if (kind == CMD_CAPTURE) {
+        c->rate = doc.containsKey("rate") ? (uint32_t)doc["rate"] : 0;
+        c->ms = doc.containsKey("ms") ? (uint32_t)doc["ms"] : 0;
+        c->battery = doc.containsKey("battery") ? (bool)doc["battery"] : false;
+    }
+    LOG_INFO("Command %lu received: %s", (unsigned long)seq, name);
+}
+
+void commandChannel::fromSettings(bool waterOnDemand, bool skipWatering) {
+    // Only a flag that has become true is a command, the settings are sent again every wake
+    if (waterOnDemand && !state.settingsOnDemand) {
+        push(0, CMD_WATER);
+    }
+    if (skipWatering && !state.settingsSkip) {
+        push(0, CMD_SKIP);
+    }
+    state.settingsOnDemand = waterOnDemand;
+    state.settingsSkip = skipWatering;
+    save();
+}
+
+queuedCommand* commandChannel::next() {
+    /*
+    The queued command with the lowest sequence nr, commands from the settings (seq 0) first.
+    The sequence nr is saved before the command is carried out, a reset while it is carried out does not repeat it.
+    */
+    queuedCommand* c = nullptr;
+    for (int i = 0; i < count; i++) {
+        if (queue[i].result == CMD_QUEUED && (c == nullptr || queue[i].seq < c->seq)) {
+            c = &queue[i];
+        }
+    }
+    if (c == nullptr) {
+        return nullptr;
+    }
+    if (c->seq != 0) {
+        if (c->seq <= state.lastSeq) {
+            LOG_INFO("Command %lu already applied", (unsigned long)c->seq);
+            c->result = CMD_DUPLICATE;
+            return next();
+        }
+        state.lastSeq = c->seq;
+    }
+    if (c->kind == CMD_SKIP) {
+        state.skipNext = true;
+    }
+    save();
+    c->result = CMD_APPLIED;
+    LOG_INFO("Applying command %lu: %s", (unsigned long)c->seq, kindName(c->kind));
+    return c;
+}
+
+void commandChannel::acknowledge(transport& uplink, const char* ackTopic, const char* commandTopic) {
+    // One acknowledgement per sequenced command, then the retained command is cleared
+    char ack[COMMAND_ACK_SIZE];
+    for (int i = 0; i < count; i++) {
+        const queuedCommand& c = queue[i];
+        if (c.seq == 0 && c.result != CMD_INVALID) {
+            continue;
+        }
+        snprintf(ack, sizeof(ack), "{\"seq\":%lu,\"cmd\":\"%s\",\"result\":\"%s\",\"last\":%lu}", (unsigned long)c.seq,
+                 kindName(c.kind), resultNames[c.result], (unsigned long)state.lastSeq);
+        uplink.publish(ackTopic, ack);
+    }
+    if (received && !dropped) {
+        uplink.publish(commandTopic, "", true);
+    }
+    count = 0;
+    received = false;
+    dropped = false;
+}
+
+void commandChannel::clearSkip() {
+    state.skipNext = false;
+    save();
+}
+
+const char* commandChannel::kindName(int kind) {
+    static const char* names[CMD_KINDS] = {"none", "water", "skip", "close", "capture", "resync"};
+    return kind >= 0 && kind < CMD_KINDS ? names[kind] : "none";
+}
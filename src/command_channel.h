@@ -0,0 +1,160 @@
+#ifndef COMMAND_CHANNEL_H
+#define COMMAND_CHANNEL_H
+
+/*
+Command channel
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+Remote operation of the device, on a topic of its own (water_thing/command). Settings describe how the device
+should behave every day, a command is something to do once: water now, skip the next watering, close the valve,
+take a waveform capture or resync.
+
+Commands are json with a sequence nr and the command, e.g.
+    mosquitto_pub -q 1 -r -t water_thing/command -m '{"seq":12,"cmd":"water","min":10}'
+    seq      Sequence nr, > 0 and increasing, one per command. Required.
+    cmd      water    Open the valve now and water for min minutes (default timeToWater, at most
+                      COMMAND_MAX_WATER_MIN), as a manual watering. SW2 or a close command stops it.
+             skip     Skip the next scheduled watering (the one of today if not done yet).
+             close    Close the valve now, stops a manual watering.
+             capture  Waveform capture, with the keys of a capture request (rate, ms, battery), see
+                      waveform_capture.h. The id of the capture is the sequence nr.
+             resync   Take and publish readings this wake, subscribe again on the next MQTT connect and
+                      restart the time sync.
+
+Delivery:
+    Published with QoS 1 a command is queued in the broker session while the device sleeps (mqtt_handler.h), and
+    retained it is also delivered after the session was lost. Either way it arrives right after the next connect,
+    in the settings step, and is applied there: before the sensors, publish, capture, OTA and watering steps.
+    Several commands of one wake (at most COMMAND_QUEUE, more are dropped without acknowledgement) are applied in
+    order of their sequence nr.
+
+Acknowledgement, one message per received command on the command_ack topic:
+    {"seq":12,"cmd":"water","result":"applied","last":12}
+    result   applied    Done, or for skip: the next watering will be skipped.
+             duplicate  seq is not above the last applied one, not applied again.
+             invalid    Not a command, not applied.
+             rejected   Not possible now (capture without the MQTT uplink), not applied.
+    last     Highest sequence nr applied, a controller that starts over continues from it.
+A controller publishes a command until it is acknowledged, the device applies it once: the sequence nr of the last
+applied command is kept in RTC_NOINIT_ATTR memory, which survives deep sleep and resets (not power loss), and is
+saved before the command is carried out. The retained command is cleared by the device once acknowledged.
+
+waterOnDemand and skipWatering in the settings (water_settings.h) are applied as commands without a sequence nr, not
+acknowledged. The settings are the reply to every "ready", a flag that stays true would water every wake: a flag is
+applied when it changes from false (or missing) to true between two settings replies. The flags of the last reply
+are kept with the sequence nr, a wake without a reply does not change them.
+
+commandChannel Class:
+    Purpose:
+        Receives, orders and deduplicates the commands of a wake, keeps the sequence nr and a pending skip.
+    Public Methods:
+        begin(): Validate the retained state after boot, called once in setup().
+        receive(const char* json): Queue a command, called from commandMQTT().
+        fromSettings(bool waterOnDemand, bool skipWatering): Flags of a settings reply, queues a command without
+            sequence nr for a flag that has become true.
+        next(): The next command to carry out (the sequence nr is saved), nullptr when there are none.
+        reject(queuedCommand* command): The command could not be carried out.
+        acknowledge(transport& uplink, const char* ackTopic, const char* commandTopic): Publish the
+            acknowledgements of the wake and clear the retained command.
+        skipPending(), clearSkip(): The next scheduled watering is to be skipped.
+        kindName(int kind): Static, name of a command.
+
+Functions:
+    commandMQTT(const char* message): Called when a message arrives on the command topic.
+
+Retained Variables (RTC_NOINIT_ATTR):
+    commandRetained: Last applied sequence nr, pending skip and the flags of the last settings reply.
+*/
+
+#include <Arduino.h>
+#include "transport.h"
+
+#define COMMAND_QUEUE 4            // Commands per wake
+#define COMMAND_MAX_WATER_MIN 120  // Longest watering on command
+#define COMMAND_ACK_SIZE 96
+#define COMMAND_MAGIC 0x57434D44   // "WCMD"
+
+enum commandKinds {
+    CMD_NONE = 0,
+    CMD_WATER,
+    CMD_SKIP,
+    CMD_CLOSE,
+    CMD_CAPTURE,
+    CMD_RESYNC,
+    CMD_KINDS
+};
+
+enum commandResults {
+    CMD_QUEUED = 0,     // Not carried out yet
+    CMD_APPLIED,
+    CMD_DUPLICATE,
+    CMD_INVALID,
+    CMD_REJECTED
+};
+
+struct commandState {
+    uint32_t magic;          // COMMAND_MAGIC when valid
+    uint32_t lastSeq;        // Highest sequence nr applied
+    bool skipNext;           // Skip the next scheduled watering
+    bool settingsOnDemand;   // waterOnDemand of the last settings reply
+    bool settingsSkip;       // skipWatering of the last settings reply
+    uint32_t checksum;       // Of the fields above
+};
+
+struct queuedCommand {
+    uint32_t seq;            // 0: from the settings, not acknowledged
+    uint8_t kind;
+    uint8_t result;
+    uint16_t minutes;        // CMD_WATER, 0 for timeToWater
+    uint32_t rate;           // CMD_CAPTURE, Hz per channel
+    uint32_t ms;             // CMD_CAPTURE, window
+    bool battery;            // CMD_CAPTURE, also the battery voltage
+};
+
+extern RTC_NOINIT_ATTR commandState commandRetained;
+
+class commandChannel {
+    /*
+    Class for the commands of this wake, the sequence nr is kept in RTC memory and survives resets.
+    */
+private:
+    commandState& state;
+    queuedCommand queue[COMMAND_QUEUE];
+    int count;
+    bool received;           // A message arrived on the command topic
+    bool dropped;            // The queue was full, the retained command is kept
+
+    static uint32_t checksum(const commandState& s);
+    void save();
+    queuedCommand* push(uint32_t seq, uint8_t kind);
+
+public:
+    // Constructor
+    commandChannel(commandState& retained) : state(retained), count(0), received(false), dropped(false) {}
+
+    void begin();
+    void receive(const char* json);
+    void fromSettings(bool waterOnDemand, bool skipWatering);
+    queuedCommand* next();
+
+    void reject(queuedCommand* command) {
+        command->result = CMD_REJECTED;
+    }
+
+    void acknowledge(transport& uplink, const char* ackTopic, const char* commandTopic);
+
+    bool skipPending() const {
+        return state.skipNext;
+    }
+
+    void clearSkip();
+
+    static const char* kindName(int kind);
+};
+
+void commandMQTT(const char* message);
+
+// Global commands, received via MQTT
+extern commandChannel commands;
+
+#endif
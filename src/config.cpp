@@ -1,70 +1,91 @@
-
 /*
 Configuration file (se config.cpp) for easy management of settings for water_thing project.
 
 By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+Turns the device specification (device_spec.h) into objects at compile time.
+Credentials and topics are constants in flash, settings is constant initialized (no constructor runs at boot)
+but may be updated via MQTT. settings is kept in RTC memory: the last received settings are also used on the wakes
+without radio and for the decisions made at the start of a wake, the defaults only until the first reply.
 */
 
 
 #include "config.h"
 #include "credentials.h"
 #include "water_settings.h"
+#include "topics.h"
 
 //******************
 // Basic Settings
 //******************
-#define waterTimeHH 20   // Hour to commence watering
-#define waterTimeMM 00   // Minute during above our to commence watering
-
-#define timeToWater 5   // min, how many minutes to water
-#define batteryLow  11.0   // V, Low voltage level alarm for battery
-#define levelLow    5.0 // m, Low level alarm for water tank
-
-#define defSleepTime 60  // S, default sleep time
 
-timeHHMM waterTime = {waterTimeHH, waterTimeMM};
-
-waterSettings settings(waterTime, timeToWater, batteryLow, levelLow, defSleepTime);
+RTC_DATA_ATTR waterSettings settings(timeHHMM{SPEC_WATER_TIME_HH, SPEC_WATER_TIME_MM}, SPEC_TIME_TO_WATER, SPEC_BATTERY_LOW, SPEC_LEVEL_LOW,
+                       SPEC_SLEEP_TIME, SPEC_FLOW_COEFFICIENT, SPEC_WATER_VOLUME);
 
 //******************
 // Wifi credentials
 //******************
 
-#define wifiactive true
-#define deviceName "water_thing"
-#define ssid "YOUR_SSID"
-#define pwd "YOUR_PASSWORD"
-
-// Init wifi object
-wifiCredentials wifi_cred(wifiactive, deviceName, ssid, pwd);
+constexpr wifiCredentials wifi_cred(SPEC_WIFI_ACTIVE, DEVICE_NAME, SPEC_SSID, SPEC_WIFI_PASSWORD);
 
 //******************
-// MQTT credentials
+// Topics
 //******************
 
-// Server and credentials
-#define mqtt_active true
+namespace {
+
+constexpr auto sensorPrefix = fixedLiteral("sensors/") + fixedLiteral(DEVICE_NAME) + fixedLiteral("/");
+constexpr auto devicePrefix = fixedLiteral(DEVICE_NAME) + fixedLiteral("/");
+
+// One constant string per topic, e.g. levelPub = "sensors/water_thing/level"
+#define X(name, prefix, suffix) constexpr auto name##Pub = prefix##Prefix + fixedLiteral(suffix);
+PUB_TOPICS(X)
+#undef X
+#define X(name, prefix, suffix) constexpr auto name##Sub = prefix##Prefix + fixedLiteral(suffix);
+SUB_TOPICS(X)
+#undef X
+
+// Tables in the order of pubTopic/subTopic
+constexpr const char* pubs[] = {
+#define X(name, prefix, suffix) name##Pub.c_str(),
+    PUB_TOPICS(X)
+#undef X
+};
+constexpr const char* subs[] = {
+#define X(name, prefix, suffix) name##Sub.c_str(),
+    SUB_TOPICS(X)
+#undef X
+};
+
+constexpr size_t nrPubs = sizeof(pubs) / sizeof(pubs[0]);
+constexpr size_t nrSubs = sizeof(subs) / sizeof(subs[0]);
+
+static_assert(nrPubs == (size_t)pubTopic::count, "pub topic table does not match pubTopic");
+static_assert(nrSubs == (size_t)subTopic::count, "sub topic table does not match subTopic");
+
+constexpr bool allValid(const char* const* topics, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (!validTopic(topics[i])) return false;
+    }
+    return true;
+}
+
+static_assert(allValid(pubs, nrPubs), "invalid pub topic in device_spec.h");
+static_assert(allValid(subs, nrSubs), "invalid sub topic in device_spec.h");
+static_assert(uniqueTopics(pubs, nrPubs), "duplicate pub topic in device_spec.h");
+static_assert(uniqueTopics(subs, nrSubs), "duplicate sub topic in device_spec.h");
+
+}
 
-#define mqtt_server "YOUR_MQTT_SERVER_IP"
-#define mqtt_port 1883
-#define mqtt_user "YOUR_MQTT_USER"
-#define mqtt_password "YOUR_MQTT_PASSWORD"
-
-// pub topics
-#define water_vlv_state "sensors/water_thing/vlv_state"
-#define water_level "sensors/water_thing/level"
-#define water_voltage "sensors/water_thing/battery_voltage"
-#define water_pressure "sensors/water_thing/pressure"
-
-#define water_ready "water_thing/ready" // Topic to send ready message to for updating settings
+//******************
+// MQTT credentials
+//******************
 
-//sub topics
-#define update_settings_mqtt "water_thing/settings" // send settings to  waterThing on this topic
+constexpr mqttCredentials mqtt_cred(SPEC_MQTT_ACTIVE, DEVICE_NAME, SPEC_MQTT_SERVER, SPEC_MQTT_PORT, SPEC_MQTT_USER, SPEC_MQTT_PASSWORD,
+                                    pubs, (int)nrPubs, subs, (int)nrSubs, SPEC_MQTT_TLS, SPEC_MQTT_CA_CERT, SPEC_MQTT_TLS_NAME);
 
-// Init mqtt object
-String pubs[] = {water_vlv_state, water_level, water_voltage, water_ready, water_pressure};
-String subs[] = {update_settings_mqtt};
+//******************
+// ESP-NOW gateway
+//******************
 
-// mqttCredentials(bool active, String device_name, String server, String port, String user, String password, String* pub, int pubSize, String* sub, int subSize)
-// By passing &pubs[0] and &subs[0], you are passing pointers to the first elements of the arrays pubs and subs, respectively, which is what the constructor expects
-mqttCredentials mqtt_cred(mqtt_active, deviceName, mqtt_server, mqtt_port, mqtt_user, mqtt_password, &pubs[0], sizeof(pubs) / sizeof(pubs[0]), &subs[0],  sizeof(subs) / sizeof(subs[0]));
\ No newline at end of file
+constexpr espNowCredentials espnow_cred(SPEC_ESPNOW_GATEWAY, SPEC_ESPNOW_CHANNEL);
@@ -3,7 +3,7 @@
 
 /*
 Configuration file (se config.cpp) for easy management of settings for water_thing project.
-settings object are made global in this file.
+settings object are made global in this file. Per device values are set in device_spec.h.
 
 By Christoffer Rappmann, christoffer.rappmann@gmail.com
 */
@@ -13,12 +13,15 @@ By Christoffer Rappmann, christoffer.rappmann@gmail.com
 
 // Define global variable with credentials to be used
 
-// Basic Settings
-extern waterSettings settings;
+// Basic Settings, kept in RTC memory between wakes
+extern RTC_DATA_ATTR waterSettings settings;
 
 // WiFi
-extern wifiCredentials wifi_cred;
+extern const wifiCredentials wifi_cred;
 
-// MQTT
-extern mqttCredentials mqtt_cred; 
+// MQTT, topics by name: mqtt_cred.getPub(pubTopic::level)
+extern const mqttCredentials mqtt_cred;
+
+// ESP-NOW gateway, used when SPEC_UPLINK is UPLINK_ESPNOW
+extern const espNowCredentials espnow_cred;
 #endif
\ No newline at end of file
@@ -8,27 +8,39 @@ By Christoffer Rappmann, christoffer.rappmann@gmail.com
 
 Defines ojects containing credentials for wifi and mqtt
 
+All strings are pointers to constant strings (string literals in flash, see config.cpp), nothing is copied
+and the getters do not allocate. The constructors are constexpr, the objects are built at compile time and are immutable.
+Topics are referred to by name (pubTopic/subTopic, see topics.h), not by index.
+
 wifiCredentials Class:
     Purpose: 
         Stores Wi-Fi connection credentials, including activation status, device name, SSID, and password.
     Private Variables: 
         wifi_active, device_name, ssid, password.
     Public Methods:
-        wifiCredentials(bool active, String name, String network, String pass): Constructor to initialize Wi-Fi credentials.
+        wifiCredentials(bool active, const char* name, const char* network, const char* pass): Constructor to initialize Wi-Fi credentials.
         Getter methods for retrieving Wi-Fi credentials: getWifiActive(), getDeviceName(), getSSID(), getPassword().
 
 mqttCredentials Class:
     Purpose: 
         Stores MQTT connection credentials, including activation status, device name, server address, port, username, password, and arrays of topics for publishing and subscribing.
+        With tls the connection is TLS (tls_client.h), verified with the CA certificate ca_cert (PEM, nullptr = not verified) against tls_name.
     Private Variables: 
-        active, device_name, server, port, user, password, pub, sub, pubSize, subSize.
+        active, device_name, server, port, user, password, pub, sub, pubSize, subSize, tls, ca_cert, tls_name.
+    Public Methods:
+        mqttCredentials(bool active, const char* device_name, const char* server, int port, const char* user, const char* password, const char* const* pub, int pubSize, const char* const* sub, int subSize, bool tls, const char* ca_cert, const char* tls_name): Constructor to initialize MQTT credentials.
+        Getter methods for retrieving MQTT credentials: getActive(), getDeviceName(), getServer(), getPort(), getUser(), getPassword(), getPub(pubTopic topic), getPubSize(), getSub(subTopic topic), getSubSize(), getTls(), getCaCert(), getTlsName().
+
+espNowCredentials Class:
+    Purpose:
+        Stores the ESP-NOW gateway, its MAC address ("24:0A:C4:12:34:56") and the WiFi channel it listens on.
     Public Methods:
-        mqttCredentials(bool active, String device_name, String server, int port, String user, String password, String* pub, int pubSize, String* sub, int subSize): Constructor to initialize MQTT credentials.
-        Getter methods for retrieving MQTT credentials: getActive(), getDeviceName(), getServer(), getPort(), getUser(), getPassword(), getPub(int i), getPubSize(), getSub(int i), getSubSize().
-        Setter methods for updating arrays of topics: setPub(String* pubArray, int size), setSub(String* subArray, int size).
+        espNowCredentials(const char* gateway, int channel): Constructor.
+        Getter methods: getGateway(), getChannel().
 */
 
 #include <Arduino.h>
+#include "topics.h"
 
 //***************************
 //***        WiFi         ***
@@ -42,29 +54,29 @@ class wifiCredentials {
 
     private:
         bool wifi_active;
-        String device_name;
-        String ssid;
-        String password;
+        const char* device_name;
+        const char* ssid;
+        const char* password;
 
     public:
         // Constructor
-        wifiCredentials(bool active, String name, String network, String pass)
+        constexpr wifiCredentials(bool active, const char* name, const char* network, const char* pass)
             : wifi_active(active), device_name(name), ssid(network), password(pass) {}
 
         // Getter functions
-        bool getWifiActive() const {
+        constexpr bool getWifiActive() const {
             return wifi_active;
         }
 
-        String getDeviceName() const {
+        const char* getDeviceName() const {
             return device_name;
         }
 
-        String getSSID() const {
+        const char* getSSID() const {
             return ssid;
         }
 
-        String getPassword() const {
+        const char* getPassword() const {
             return password;
         }
 };
@@ -82,31 +94,37 @@ class mqttCredentials {
 
 private:
     bool active;
-    String device_name;
-    String server;
+    const char* device_name;
+    const char* server;
     int port;
-    String user;
-    String password;
+    const char* user;
+    const char* password;
 
-    String* pub; // Array of strings for publishing topics
-    String* sub; // Array of strings for subscribing topics
+    const char* const* pub; // Array of strings for publishing topics
+    const char* const* sub; // Array of strings for subscribing topics
     int pubSize; // Size of the pub array
     int subSize; // Size of the sub array
 
+    bool tls;               // Connect with TLS
+    const char* ca_cert;    // PEM of the CA of the broker certificate, nullptr if not verified
+    const char* tls_name;   // Name in the broker certificate
+
 public:
     // Constructor
-    mqttCredentials(bool active, String device_name, String server, int port, String user, String password, String* pub, int pubSize, String* sub, int subSize)
-        : active(active), device_name(device_name), server(server), port(port), user(user), password(password), pub(pub), pubSize(pubSize), sub(sub), subSize(subSize) {}
+    constexpr mqttCredentials(bool active, const char* device_name, const char* server, int port, const char* user, const char* password, const char* const* pub, int pubSize, const char* const* sub, int subSize,
+                              bool tls, const char* ca_cert, const char* tls_name)
+        : active(active), device_name(device_name), server(server), port(port), user(user), password(password), pub(pub), sub(sub), pubSize(pubSize), subSize(subSize),
+          tls(tls), ca_cert(ca_cert), tls_name(tls_name) {}
 
     // Getter methods
     bool getActive() const {
             return active;
         }
-    String getDeviceName() const {
+    const char* getDeviceName() const {
         return device_name;
     }
 
-    String getServer() const {
+    const char* getServer() const {
         return server;
     }
 
@@ -114,40 +132,67 @@ public:
         return port;
     }
 
-    String getUser() const {
+    const char* getUser() const {
         return user;
     }
 
-    String getPassword() const {
+    const char* getPassword() const {
         return password;
     }
 
-    //String* getPub() const {
-    String getPub(int i) const {
-        return pub[i];
+    const char* getPub(pubTopic topic) const {
+        return pub[(int)topic];
     }
 
     int getPubSize() const {
         return pubSize;
     }
 
-    String getSub(int i) const {
-        return sub[i];
+    const char* getSub(subTopic topic) const {
+        return sub[(int)topic];
     }
 
     int getSubSize() const {
         return subSize;
     }
 
-    // Setter methods for pub and sub arrays
-    void setPub(String* pubArray, int size) {
-        pub = pubArray;
-        pubSize = size;
+    bool getTls() const {
+        return tls;
+    }
+
+    const char* getCaCert() const {
+        return ca_cert;
+    }
+
+    const char* getTlsName() const {
+        return tls_name;
+    }
+};
+
+//***************************
+//***       ESP-NOW       ***
+//***************************
+
+class espNowCredentials {
+    /*
+    Class for storing the ESP-NOW gateway address and channel.
+    */
+
+private:
+    const char* gateway;
+    int channel;
+
+public:
+    // Constructor
+    constexpr espNowCredentials(const char* gateway, int channel)
+        : gateway(gateway), channel(channel) {}
+
+    const char* getGateway() const {
+        return gateway;
     }
 
-    void setSub(String* subArray, int size) {
-        sub = subArray;
-        subSize = size;
+    int getChannel() const {
+        return channel;
     }
 };
 
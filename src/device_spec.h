@@ -0,0 +1,92 @@
+#ifndef DEVICE_SPEC_H
+#define DEVICE_SPEC_H
+
+/*
+Device specification for water_thing, everything that differs between units is set here.
+
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+config.cpp turns this specification into constant objects at compile time (settings defaults, WiFi and MQTT
+credentials and the topic tables). Topics are built from the device name and referred to by name in the code
+(pubTopic::level, see topics.h), a malformed or duplicated topic fails the build.
+
+Topic lists:
+    X(name, prefix, suffix)
+        name:   Name of the topic in the code, pubTopic::name / subTopic::name
+        prefix: sensor -> "sensors/<DEVICE_NAME>/<suffix>", device -> "<DEVICE_NAME>/<suffix>"
+        suffix: Last level of the topic
+*/
+
+//******************
+// Device
+//******************
+#define DEVICE_NAME "water_thing"       // Host name, MQTT client ID and topic prefix
+
+//******************
+// Basic Settings, defaults until updated via MQTT
+//******************
+#define SPEC_WATER_TIME_HH 20          // Hour to commence watering
+#define SPEC_WATER_TIME_MM 00          // Minute during above our to commence watering
+#define SPEC_TIME_TO_WATER 5           // min, how many minutes to water
+#define SPEC_BATTERY_LOW 11.0          // V, Low voltage level alarm for battery
+#define SPEC_LEVEL_LOW 5.0             // m, Low level alarm for water tank
+#define SPEC_SLEEP_TIME 60             // S, default sleep time
+#define SPEC_FLOW_COEFFICIENT 10.0     // l/min per sqrt(bar), flow through the installation at 1 bar(e), calibrate per site
+#define SPEC_WATER_VOLUME 0.0          // l, volume to deliver each watering, 0 = water for timeToWater minutes
+
+//******************
+// Wifi credentials
+//******************
+#define SPEC_WIFI_ACTIVE true
+#define SPEC_SSID "YOUR_SSID"
+#define SPEC_WIFI_PASSWORD "YOUR_PASSWORD"
+
+//******************
+// MQTT credentials
+//******************
+#define SPEC_MQTT_ACTIVE true
+#define SPEC_MQTT_SERVER "YOUR_MQTT_SERVER_IP"
+#define SPEC_MQTT_PORT 1883
+#define SPEC_MQTT_USER "YOUR_MQTT_USER"
+#define SPEC_MQTT_PASSWORD "YOUR_MQTT_PASSWORD"
+#define SPEC_MQTT_TLS false                // TLS with session resumption (tls_client.h), the broker port is then usually 8883
+#define SPEC_MQTT_TLS_NAME "YOUR_MQTT_SERVER_NAME" // Name in the broker certificate, checked against the CA
+#define SPEC_MQTT_CA_CERT nullptr          // PEM of the CA of the broker certificate as a string, nullptr = not verified
+
+//******************
+// Uplink
+//******************
+#ifndef SPEC_UPLINK
+#define SPEC_UPLINK UPLINK_MQTT            // UPLINK_MQTT, UPLINK_ESPNOW (via gateway) or UPLINK_LOOPBACK, see transport.h
+#endif
+#define SPEC_ESPNOW_GATEWAY "FF:FF:FF:FF:FF:FF" // MAC address of the ESP-NOW gateway, broadcast until set
+#define SPEC_ESPNOW_CHANNEL 1              // WiFi channel of the gateway
+
+// pub topics
+#define PUB_TOPICS(X) \
+    X(valveState,     sensor, "vlv_state")       /* Valve state, 1 open */ \
+    X(level,          sensor, "level")           /* Water level in tank, m */ \
+    X(batteryVoltage, sensor, "battery_voltage") /* Battery voltage, V */ \
+    X(ready,          device, "ready")           /* Ready message, settings are sent in reply */ \
+    X(pressure,       sensor, "pressure")        /* Water pressure, bar(e) */ \
+    X(volume,         sensor, "volume")          /* Volume delivered during last watering session, l */ \
+    X(soc,            sensor, "battery_soc")     /* Battery state of charge, % */ \
+    X(batch,          sensor, "batch")           /* Readings from wakes without radio, json array */ \
+    X(energy,         device, "energy")          /* Energy budget of the last day, mAh/day per state, json */ \
+    X(memory,         device, "memory")          /* Heap, stack and RTC memory usage this wake, json */ \
+    X(log,            device, "log")             /* Log events on request, lines "<time> <level> <text>" */ \
+    X(diagnostics,    device, "diagnostics")     /* Warnings and errors since the last batch, json */ \
+    X(otaStatus,      device, "ota_status")      /* State and progress of a firmware update, json */ \
+    X(latency,        device, "latency")         /* Latency histogram of the last day, one message per metric, json */ \
+    X(captureData,    device, "capture_data")    /* Chunks of a waveform capture, binary, see waveform_capture.h */ \
+    X(commandAck,     device, "command_ack")     /* Acknowledgement of a command, json, see command_channel.h */
+
+// sub topics
+#define SUB_TOPICS(X) \
+    X(settings,       device, "settings")        /* Settings for water_thing, json */ \
+    X(logRequest,     device, "log_request")     /* Number of log events to publish, retained, cleared by the device */ \
+    X(ota,            device, "ota")             /* Url of a firmware delta, retained, empty to cancel */ \
+    X(capture,        device, "capture")         /* Waveform capture request, json, retained, cleared by the device */ \
+    X(command,        device, "command")         /* Command with sequence nr, json, QoS 1, retained, cleared by the device */
+
+#endif
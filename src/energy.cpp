@@ -0,0 +1,112 @@
+/*
+Energy accounting
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+*/
+
+#include "energy.h"
+
+// Retain energy totals after sleep
+RTC_DATA_ATTR energyTotals energyToday = {};
+RTC_DATA_ATTR energyTotals energyReport = {};
+RTC_DATA_ATTR bool energyReportDue = false;
+RTC_DATA_ATTR time_t energySleepStart = 0;
+RTC_DATA_ATTR float energySleepPlanned = 0.0;
+
+energyMeter energy;
+
+double energyMeter::current(int state) {
+    // Current draw in mA of a state, CPU at the current frequency
+    switch (state) {
+        case ENERGY_SLEEP:      return ENERGY_I_SLEEP;
+        case ENERGY_LIGHT_SLEEP: return ENERGY_I_LIGHT_SLEEP;
+        case ENERGY_CPU:        return cpuCurrent(getCpuFrequencyMhz());
+        case ENERGY_WIFI_RX:    return ENERGY_I_WIFI_RX;
+        case ENERGY_WIFI_TX:    return ENERGY_I_WIFI_TX;
+        case ENERGY_MOTOR:      return ENERGY_I_MOTOR;
+        case ENERGY_LED_RED:
+        case ENERGY_LED_ORANGE:
+        case ENERGY_LED_GREEN:  return ENERGY_I_LED;
+        default:                return 0.0;
+    }
+}
+
+const char* energyMeter::stateName(int state) {
+    static const char* names[ENERGY_STATES] = {"sleep", "light_sleep", "cpu", "wifi_rx", "wifi_tx", "motor", "led_red", "led_orange", "led_green"};
+    return state >= 0 && state < ENERGY_STATES ? names[state] : "unknown";
+}
+
+void energyMeter::closeWake(double sleepSeconds) {
+    /*
+    Called just before deep sleep.
+    Stops all states and adds the time awake (incl. boot) to today's totals, the sleep is added by the next boot
+    (openWake()). When a day has passed the totals are moved to energyReport to be published.
+    */
+    for (int i = 0; i < ENERGY_STATES; i++) {
+        stop(i);
+    }
+    seconds[ENERGY_CPU] = (millis() + ENERGY_BOOT_MS) / 1000.0 - seconds[ENERGY_LIGHT_SLEEP];
+
+    time_t now = time(nullptr);
+    if (energyToday.start == 0) {
+        energyToday.start = now;
+    }
+
+    for (int i = 0; i < ENERGY_STATES; i++) {
+        energyToday.seconds[i] += seconds[i];
+        energyToday.charge[i] += seconds[i] * current(i);
+        seconds[i] = 0.0;
+    }
+    energyToday.wakes++;
+    energyToday.end = now;
+    energySleepStart = now;
+    energySleepPlanned = sleepSeconds;
+
+    if (difftime(energyToday.end, energyToday.start) >= 86400) {
+        energyReport = energyToday;
+        energyReportDue = true;
+        energyToday = {};
+        energyToday.start = energyReport.end;
+    }
+}
+
+void energyMeter::openWake() {
+    /*
+    Called at boot.
+    Adds the sleep before this wake to today's totals, from the time it started to now less the boot.
+    At most the planned sleep: the clock may have been set during the last wake.
+    */
+    if (energySleepStart == 0) {
+        return; // Reset or power on, or the last wake was cut (wake_budget.h)
+    }
+    double slept = difftime(time(nullptr), energySleepStart) - ENERGY_BOOT_MS / 1000.0;
+    if (slept < 0.0) slept = 0.0;
+    if (slept > energySleepPlanned) slept = energySleepPlanned;
+    energyToday.seconds[ENERGY_SLEEP] += slept;
+    energyToday.charge[ENERGY_SLEEP] += slept * current(ENERGY_SLEEP);
+    energySleepStart = 0;
+}
+
+size_t energyMeter::reportJSON(char* buffer, size_t size) const {
+    /*
+    Energy budget of the last complete day
+    {"mAh_day":..,"wakes":..,"hours":..,"sleep":..,"cpu":.., ...}, states in mAh/day
+    */
+    double days = difftime(energyReport.end, energyReport.start) / 86400.0;
+    if (days <= 0) {
+        days = 1.0;
+    }
+    double total = 0.0;
+    for (int i = 0; i < ENERGY_STATES; i++) {
+        total += energyReport.charge[i];
+    }
+
+    size_t len = snprintf(buffer, size, "{\"mAh_day\":%.2f,\"wakes\":%lu,\"hours\":%.1f", total / 3600.0 / days,
+                          (unsigned long)energyReport.wakes, days * 24.0);
+    for (int i = 0; i < ENERGY_STATES && len < size; i++) {
+        len += snprintf(buffer + len, size - len, ",\"%s\":%.3f", stateName(i), energyReport.charge[i] / 3600.0 / days);
+    }
+    if (len < size) {
+        len += snprintf(buffer + len, size - len, "}");
+    }
+    return len < size ? len : size - 1;
+}
@@ -0,0 +1,158 @@
+#ifndef ENERGY_H
+#define ENERGY_H
+
+/*
+Energy accounting
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+Assigns a calibrated current draw (at the battery, i.e. including regulator losses) to each state of the device
+and integrates it over the time spent in each state. The firmware records the states it enters during a wake
+(radio, valve motor, leds) and the time it slept, the simulator (sim/) uses the same table for its battery model.
+
+The result is an energy budget in mAh/day with a breakdown per state, published once per day on the energy topic
+and printed by the simulator. Comparing builds gives a concrete energy regression number.
+
+Calibrate the currents below by measuring the battery current of a unit in each state.
+
+energyStates:
+    ENERGY_SLEEP      Deep sleep, incl. regulators, voltage dividers and the pressure sensor
+    ENERGY_LIGHT_SLEEP  Light sleep between scheduled tasks during a wake (see taskScheduler in multitasker.h)
+    ENERGY_CPU        Awake, current depends on CPU frequency (see cpuCurrent())
+    ENERGY_WIFI_RX    Radio on, listening/idle (added on top of CPU)
+    ENERGY_WIFI_TX    Radio transmitting, estimated from bytes published (added on top of RX)
+    ENERGY_MOTOR      Valve motor running
+    ENERGY_LED_RED, ENERGY_LED_ORANGE, ENERGY_LED_GREEN
+
+energyMeter Class:
+    Purpose:
+        Records the time spent in each state during a wake and accumulates charge per state for the day in RTC memory.
+    Public Methods:
+        current(int state): Static, current draw in mA of a state.
+        cpuCurrent(uint32_t mhz): Static, current draw in mA when awake at a CPU frequency.
+        start(int state), stop(int state): State entered/left.
+        addTransmit(size_t bytes): Account for transmitting bytes.
+        closeWake(double sleepSeconds): Called just before deep sleep, accumulates the wake and keeps the start and the
+            planned duration of the sleep.
+        openWake(): Called at boot, accumulates the sleep actually slept: a button or a reset may cut it short.
+        reportDue(), reportJSON(char* buffer, size_t size), reportSent(): Daily report.
+        stateName(int state): Static, name of a state.
+
+Retained Variables (RTC_DATA_ATTR):
+    energyToday: Charge per state since the start of the current day.
+    energyReport: The last complete day, waiting to be published.
+    energySleepStart, energySleepPlanned: The sleep in progress, accounted by the next boot, start 0 if none.
+*/
+
+#include <Arduino.h>
+#include <time.h>
+
+enum energyStates {
+    ENERGY_SLEEP = 0,
+    ENERGY_LIGHT_SLEEP,
+    ENERGY_CPU,
+    ENERGY_WIFI_RX,
+    ENERGY_WIFI_TX,
+    ENERGY_MOTOR,
+    ENERGY_LED_RED,
+    ENERGY_LED_ORANGE,
+    ENERGY_LED_GREEN,
+    ENERGY_STATES
+};
+
+// Current draw at the battery, mA. 12 V -> 5 V step down (~85 %) and the 3.3 V LDO on the board.
+#define ENERGY_I_SLEEP     3.0   // Deep sleep, pressure sensor and dividers are always powered
+#define ENERGY_I_LIGHT_SLEEP 4.0 // Light sleep, RAM and clocks kept
+#define ENERGY_I_CPU_240  25.0   // Awake, no radio
+#define ENERGY_I_CPU_160  21.0
+#define ENERGY_I_CPU_80   15.0
+#define ENERGY_I_CPU_40   11.0
+#define ENERGY_I_WIFI_RX  45.0   // Radio on, on top of CPU
+#define ENERGY_I_WIFI_TX  75.0   // Transmitting, on top of RX
+#define ENERGY_I_MOTOR   800.0   // Valve motor
+#define ENERGY_I_LED       3.0   // Each led, 220 Ohm from 3.3 V
+
+#define ENERGY_BOOT_MS    300    // Bootloader and app start before setup(), not seen by millis()
+#define ENERGY_TX_RATE    6.0e6  // bit/s, lowest OFDM rate, airtime estimate for published bytes
+#define ENERGY_TX_OVERHEAD 0.001 // s, per transmission (headers, ack)
+
+struct energyTotals {
+    // Charge per state, mAs
+    float charge[ENERGY_STATES];
+    float seconds[ENERGY_STATES];
+    time_t start;     // Start of period
+    time_t end;       // End of period (last wake accounted)
+    uint32_t wakes;
+};
+
+extern RTC_DATA_ATTR energyTotals energyToday;
+extern RTC_DATA_ATTR energyTotals energyReport;
+extern RTC_DATA_ATTR bool energyReportDue;
+extern RTC_DATA_ATTR time_t energySleepStart;
+extern RTC_DATA_ATTR float energySleepPlanned;
+
+class energyMeter {
+    /*
+    Class for recording time in each state and accumulating charge.
+    */
+private:
+    unsigned long started[ENERGY_STATES]; // millis() when state was entered, 0 if not active
+    bool active[ENERGY_STATES];
+    double seconds[ENERGY_STATES];        // this wake
+
+public:
+    // Constructor
+    energyMeter() {
+        for (int i = 0; i < ENERGY_STATES; i++) {
+            started[i] = 0;
+            active[i] = false;
+            seconds[i] = 0.0;
+        }
+    }
+
+    static double cpuCurrent(uint32_t mhz) {
+        if (mhz >= 240) return ENERGY_I_CPU_240;
+        if (mhz >= 160) return ENERGY_I_CPU_160;
+        if (mhz >= 80) return ENERGY_I_CPU_80;
+        return ENERGY_I_CPU_40;
+    }
+
+    static double current(int state);
+
+    static const char* stateName(int state);
+
+    void start(int state) {
+        if (!active[state]) {
+            active[state] = true;
+            started[state] = millis();
+        }
+    }
+
+    void stop(int state) {
+        if (active[state]) {
+            active[state] = false;
+            seconds[state] += (millis() - started[state]) / 1000.0;
+        }
+    }
+
+    void addTransmit(size_t bytes) {
+        seconds[ENERGY_WIFI_TX] += ENERGY_TX_OVERHEAD + bytes * 8.0 / ENERGY_TX_RATE;
+    }
+
+    void closeWake(double sleepSeconds);
+    void openWake();
+
+    bool reportDue() const {
+        return energyReportDue;
+    }
+
+    size_t reportJSON(char* buffer, size_t size) const;
+
+    void reportSent() {
+        energyReportDue = false;
+    }
+};
+
+// Global meter, used by the modules that switch the states
+extern energyMeter energy;
+
+#endif
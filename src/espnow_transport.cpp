@@ -0,0 +1,221 @@
+/*
+ESP-NOW transport
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+*/
+
+#include "espnow_transport.h"
+#include "energy.h"
+#include "latency_stats.h"
+#include "logger.h"
+
+#include <esp_idf_version.h>
+#include <esp_now.h>
+#include <esp_wifi.h>
+
+RTC_DATA_ATTR uint8_t espNowMessageId = 0;
+
+// Result of the last send, set by the send callback (WiFi task): -1 waiting, 0 acknowledged, 1 failed
+static volatile int sendStatus = -1;
+
+// Frames received by the receive callback (WiFi task), handed to loop() through a single producer/consumer ring
+static uint8_t rxQueue[ESPNOW_QUEUE][ESPNOW_MAX_FRAME];
+static uint8_t rxQueueLength[ESPNOW_QUEUE];
+static volatile uint8_t rxHead = 0;   // Next slot to fill
+static volatile uint8_t rxTail = 0;   // Next slot to read
+static uint8_t rxFrom[6];             // Gateway address, frames from others are ignored
+
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 5, 0)
+static void onSent(const esp_now_send_info_t* info, esp_now_send_status_t status) {
+#else
+static void onSent(const uint8_t* mac, esp_now_send_status_t status) {
+#endif
+    sendStatus = status == ESP_NOW_SEND_SUCCESS ? 0 : 1;
+}
+
+static void queueFrame(const uint8_t* mac, const uint8_t* data, int length) {
+    static const uint8_t broadcast[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    if (memcmp(rxFrom, broadcast, 6) != 0 && memcmp(mac, rxFrom, 6) != 0) {
+        return;
+    }
+    uint8_t next = (rxHead + 1) % ESPNOW_QUEUE;
+    if (next == rxTail || length < ESPNOW_FRAME_HEADER || length > ESPNOW_MAX_FRAME) {
+        return; // Full or not ours, the gateway sends again
+    }
+    memcpy(rxQueue[rxHead], data, length);
+    rxQueueLength[rxHead] = length;
+    rxHead = next;
+}
+
+#if ESP_IDF_VERSION_MAJOR >= 5
+static void onReceive(const esp_now_recv_info_t* info, const uint8_t* data, int length) {
+    queueFrame(info->src_addr, data, length);
+}
+#else
+static void onReceive(const uint8_t* mac, const uint8_t* data, int length) {
+    queueFrame(mac, data, length);
+}
+#endif
+
+static bool parseMac(const char* text, uint8_t mac[6]) {
+    unsigned int b[6];
+    if (sscanf(text, "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 6) {
+        return false;
+    }
+    for (int i = 0; i < 6; i++) {
+        mac[i] = b[i];
+    }
+    return true;
+}
+
+espNowTransport::espNowTransport(const espNowCredentials& cred, wifi_power_t txPower)
+    : ready(false), rxLength(0), rxId(0), rxNext(0) {
+    if (!parseMac(cred.getGateway(), gateway)) {
+        LOG_ERROR("Bad ESP-NOW gateway address: %s", cred.getGateway());
+        return;
+    }
+    memcpy(rxFrom, gateway, 6);
+
+    // Station mode without association, on the channel of the gateway
+    WiFi.mode(WIFI_STA);
+    energy.start(ENERGY_WIFI_RX);
+    WiFi.setTxPower(txPower);
+    esp_wifi_set_channel(cred.getChannel(), WIFI_SECOND_CHAN_NONE);
+
+    if (esp_now_init() != ESP_OK) {
+        LOG_ERROR("ESP-NOW init failed");
+        return;
+    }
+    esp_now_register_send_cb(onSent);
+    esp_now_register_recv_cb(onReceive);
+
+    esp_now_peer_info_t peer;
+    memset(&peer, 0, sizeof(peer));
+    memcpy(peer.peer_addr, gateway, 6);
+    peer.channel = cred.getChannel();
+    peer.ifidx = WIFI_IF_STA;
+    peer.encrypt = false;
+    if (esp_now_add_peer(&peer) != ESP_OK) {
+        LOG_ERROR("Could not add ESP-NOW gateway %s", cred.getGateway());
+        esp_now_deinit();
+        return;
+    }
+    ready = true;
+    LOG_INFO("ESP-NOW uplink via %s on channel %d", cred.getGateway(), cred.getChannel());
+}
+
+espNowTransport::~espNowTransport() {
+    if (ready) {
+        esp_now_deinit();
+    }
+}
+
+bool espNowTransport::sendFrame(const uint8_t* frame, size_t length) {
+    for (int attempt = 0; attempt <= ESPNOW_RETRIES; attempt++) {
+        sendStatus = -1;
+        if (esp_now_send(gateway, frame, length) != ESP_OK) {
+            continue;
+        }
+        unsigned long start = millis();
+        while (sendStatus < 0 && millis() - start < ESPNOW_ACK_TIMEOUT_MS) {
+            delay(1);
+        }
+        if (sendStatus == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool espNowTransport::publish(const char* topic, const char* message, bool retained) {
+    // Split into fragments, the topic goes in the first one
+    if (!ready) {
+        return false;
+    }
+    size_t topicLength = strlen(topic);
+    size_t length = strlen(message);
+    if (topicLength >= TRANSPORT_MAX_TOPIC) {
+        LOG_ERROR("Topic too long for ESP-NOW: %s", topic);
+        return false;
+    }
+    const size_t firstRoom = ESPNOW_MAX_FRAME - ESPNOW_FRAME_HEADER - topicLength;
+    const size_t room = ESPNOW_MAX_FRAME - ESPNOW_FRAME_HEADER;
+    size_t fragments = length <= firstRoom ? 1 : 1 + (length - firstRoom + room - 1) / room;
+    if (fragments > ESPNOW_MAX_FRAGMENTS) {
+        LOG_ERROR("Message too long for ESP-NOW on %s, %u bytes", topic, (unsigned int)length);
+        return false;
+    }
+
+    uint8_t frame[ESPNOW_MAX_FRAME];
+    uint8_t id = espNowMessageId++;
+    size_t sent = 0;
+    unsigned long start = millis();
+    for (size_t i = 0; i < fragments; i++) {
+        size_t header = ESPNOW_FRAME_HEADER;
+        frame[0] = retained ? ESPNOW_FLAG_RETAINED : 0;
+        frame[1] = id;
+        frame[2] = (uint8_t)((i << 4) | fragments);
+        frame[3] = i == 0 ? topicLength : 0;
+        if (i == 0) {
+            memcpy(frame + header, topic, topicLength);
+            header += topicLength;
+        }
+        size_t part = length - sent < ESPNOW_MAX_FRAME - header ? length - sent : ESPNOW_MAX_FRAME - header;
+        memcpy(frame + header, message + sent, part);
+        sent += part;
+        energy.addTransmit(header + part);
+        if (!sendFrame(frame, header + part)) {
+            LOG_WARN("ESP-NOW frame not acknowledged, topic %s", topic);
+            latency.record(LATENCY_PUBLISH, millis() - start);
+            return false;
+        }
+    }
+    latency.record(LATENCY_PUBLISH, millis() - start);
+    return true;
+}
+
+void espNowTransport::receiveFrame(const uint8_t* frame, size_t length) {
+    // Reassemble fragments in order, a missing fragment drops the message
+    uint8_t id = frame[1];
+    uint8_t index = frame[2] >> 4;
+    uint8_t count = frame[2] & 0x0F;
+    size_t header = ESPNOW_FRAME_HEADER;
+
+    if (index == 0) {
+        size_t topicLength = frame[3];
+        if (topicLength >= TRANSPORT_MAX_TOPIC || header + topicLength > length) {
+            return;
+        }
+        memcpy(rxTopic, frame + header, topicLength);
+        rxTopic[topicLength] = '\0';
+        header += topicLength;
+        rxId = id;
+        rxLength = 0;
+        rxNext = 0;
+    }
+    else if (id != rxId || index != rxNext) {
+        LOG_WARN("ESP-NOW fragment %d of message %d out of order", index, id);
+        rxNext = 0;
+        return;
+    }
+
+    size_t part = length - header;
+    if (rxLength + part > MQTT_MAX_MESSAGE) {
+        part = MQTT_MAX_MESSAGE - rxLength; // Truncated like a long MQTT message
+    }
+    memcpy(rxMessage + rxLength, frame + header, part);
+    rxLength += part;
+    rxNext = index + 1;
+
+    if (rxNext >= count) {
+        rxMessage[rxLength] = '\0';
+        rxNext = 0;
+        transport::dispatch(rxTopic, rxMessage);
+    }
+}
+
+void espNowTransport::loop() {
+    while (rxTail != rxHead) {
+        receiveFrame(rxQueue[rxTail], rxQueueLength[rxTail]);
+        rxTail = (rxTail + 1) % ESPNOW_QUEUE;
+    }
+}
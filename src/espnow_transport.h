@@ -0,0 +1,90 @@
+#ifndef ESPNOW_TRANSPORT_H
+#define ESPNOW_TRANSPORT_H
+
+/*
+ESP-NOW transport
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+Uplink backend that sends each message as ESP-NOW frames to a mains powered gateway, which publishes it to the MQTT
+broker and sends messages for the device (settings, requests) back the same way. There is no association, DHCP or
+TCP connection, the radio is only needed for the frames themselves. The gateway must listen on the channel set in
+device_spec.h, the frames are acknowledged by the gateway's radio (MAC layer) and resent up to ESPNOW_RETRIES times.
+
+Frame, at most ESPNOW_MAX_FRAME bytes:
+    [0] flags       ESPNOW_FLAG_RETAINED
+    [1] message id  Counts per message (kept in RTC memory), the gateway drops repeated ids from the same device
+    [2] fragment    Index in the high nibble, nr of fragments in the low nibble
+    [3] topic length, 0 in all but the first fragment
+    [4] topic (first fragment), then the next part of the message
+Messages are split into at most ESPNOW_MAX_FRAGMENTS frames. The gateway replies in the same format, fragments of a
+message must arrive in order.
+
+espNowTransport Class:
+    Purpose:
+        ESP-NOW backend of transport (transport.h).
+    Public Methods:
+        espNowTransport(const espNowCredentials& cred, wifi_power_t txPower): Start the radio and add the gateway as peer.
+        connected(): ESP-NOW was started.
+        publish(topic, message, retained): Send the message, true if every frame was acknowledged.
+        loop(): Dispatch messages received from the gateway.
+
+Retained Variables (RTC_DATA_ATTR):
+    espNowMessageId: Id of the next message.
+*/
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include "credentials.h"
+#include "transport.h"
+
+#define ESPNOW_MAX_FRAME 250       // ESP-NOW payload limit
+#define ESPNOW_FRAME_HEADER 4
+#define ESPNOW_MAX_FRAGMENTS 15
+#define ESPNOW_QUEUE 4             // Received frames waiting for loop()
+#define ESPNOW_ACK_TIMEOUT_MS 30   // Wait for the send callback
+#define ESPNOW_RETRIES 2           // Resends of an unacknowledged frame
+#define ESPNOW_FLAG_RETAINED 0x01
+
+extern RTC_DATA_ATTR uint8_t espNowMessageId;
+
+class espNowTransport : public transport {
+    /*
+    Class for sending and receiving messages as ESP-NOW frames via a gateway.
+    */
+private:
+    uint8_t gateway[6];
+    bool ready;
+
+    // Downlink message being reassembled
+    char rxTopic[TRANSPORT_MAX_TOPIC];
+    char rxMessage[MQTT_MAX_MESSAGE + 1];
+    size_t rxLength;
+    uint8_t rxId;
+    uint8_t rxNext;      // Next fragment expected, 0 when idle
+
+    bool sendFrame(const uint8_t* frame, size_t length);
+    void receiveFrame(const uint8_t* frame, size_t length);
+
+public:
+    espNowTransport(const espNowCredentials& cred, wifi_power_t txPower);
+    ~espNowTransport();
+
+    using transport::publish;
+
+    bool connected() override {
+        return ready;
+    }
+
+    bool publish(const char* topic, const char* message, bool retained = false) override;
+    void loop() override;
+
+    bool needsIP() const override {
+        return false;
+    }
+
+    const char* name() const override {
+        return "espnow";
+    }
+};
+
+#endif
@@ -5,12 +5,275 @@ By Christoffer Rappmann, christoffer.rappmann@gmail.com
 
 #include "hardware_functions.h"
 #include <Arduino.h>
-
-// used pins for switches, not in code atm.
-/*
-const int buttonSW1 = 15;
-const int buttonSW2 = 2;
-*/
+#include <Preferences.h>
+#include "latency_stats.h"
 
 // Valve
 RTC_DATA_ATTR bool valveState = true; // Open or closed, retain after sleep
+
+//***************************
+//***        Valve        ***
+//***************************
+
+static const char* const travelKeys[2] = {"open_ms", "close_ms"};
+static uint32_t storedTravelMs[2] = {0, 0}; // In NVS, 0 if not stored
+volatile int valve::driving = -1;
+
+void valve::loadTravel() {
+    // Learned travel times from NVS, defaults if never learned
+    Preferences nvs;
+    if (nvs.begin("valve", true)) {
+        for (int i = 0; i < 2; i++) {
+            storedTravelMs[i] = nvs.getUInt(travelKeys[i], 0);
+            if (storedTravelMs[i] > 0) {
+                travelMs[i] = storedTravelMs[i];
+            }
+        }
+        nvs.end();
+    }
+    travelLoaded = true;
+}
+
+void valve::learnTravel(int direction, uint32_t ms) {
+    // Moving average, each detected travel counts a quarter
+    travelMs[direction] = (travelMs[direction] * 3 + ms + 2) / 4;
+
+    uint32_t change = travelMs[direction] > storedTravelMs[direction] ? travelMs[direction] - storedTravelMs[direction]
+                                                                      : storedTravelMs[direction] - travelMs[direction];
+    if (change > VALVE_LEARN_WRITE_MS) {
+        Preferences nvs;
+        if (nvs.begin("valve", false)) {
+            nvs.putUInt(travelKeys[direction], travelMs[direction]);
+            storedTravelMs[direction] = travelMs[direction];
+            nvs.end();
+        }
+        LOG_INFO("Valve %s travel learned, %lu ms", direction == 0 ? "open" : "close", (unsigned long)travelMs[direction]);
+    }
+}
+
+void valve::drive(int pin, int direction) {
+    /* Run the motor on pin until the end of travel is detected, see the valve class description.
+    direction: 0 opening, 1 closing
+    */
+    if (!travelLoaded) {
+        loadTravel();
+    }
+    const uint32_t learned = travelMs[direction];
+    const uint32_t minMs = learned * VALVE_MIN_PERCENT / 100;
+    const uint32_t timedMs = learned + VALVE_MARGIN_MS < VALVE_MAX_MS ? learned + VALVE_MARGIN_MS : VALVE_MAX_MS;
+
+    bool moved = false;       // The valve was seen moving
+    uint32_t endMs = 0;       // When the end of travel was first seen, 0 if not
+    bool loadSampled = false;
+    valveResults result = VALVE_TIMED;
+
+#if VALVE_CURRENT_PIN >= 0
+    uint32_t stallMs = 0;     // When the stall current started, 0 if not stalled
+#else
+    // Pressure of the last VALVE_SETTLE_MS, one per check
+    const int window = VALVE_SETTLE_MS / VALVE_SAMPLE_MS;
+    int32_t history[window];
+    int checks = 0;
+    const int32_t startPressure = sensors::samplePressureMicrobar(VALVE_SAMPLE_BURST);
+#endif
+
+    driving = pin;
+    digitalWrite(pin, HIGH);
+    energy.start(ENERGY_MOTOR);
+    unsigned long start = millis();
+    uint32_t elapsed = 0;
+    for (;;) {
+        delay(VALVE_SAMPLE_MS);
+        elapsed = millis() - start;
+
+        if (!loadSampled && elapsed >= learned / 2) {
+            loadVoltage = sensors::sampleBatteryVoltage(); // Voltage sag under motor load, mid travel
+            loadSampled = true;
+        }
+
+#if VALVE_CURRENT_PIN >= 0
+        // The limit switch cuts the current at the end of travel
+        uint32_t mv = analogReadMilliVolts(VALVE_CURRENT_PIN);
+        if (mv >= VALVE_CURRENT_RUN_MV) {
+            moved = true;
+        }
+        else if (elapsed >= VALVE_STALL_MS && endMs == 0) {
+            endMs = elapsed;
+        }
+        if (mv < VALVE_CURRENT_STALL_MV) {
+            stallMs = 0;
+        }
+        else if (stallMs == 0) {
+            stallMs = elapsed;
+        }
+        else if (elapsed - stallMs >= VALVE_STALL_MS) {
+            result = VALVE_STALLED;
+            break;
+        }
+        if (endMs > 0) {
+            result = VALVE_END_DETECTED;
+            break;
+        }
+#else
+        // Moved by VALVE_MOVE_UBAR and the change over the window below half the average rate of the travel
+        int32_t pressure = sensors::samplePressureMicrobar(VALVE_SAMPLE_BURST);
+        int64_t travelled = llabs((int64_t)pressure - startPressure);
+        if (travelled >= VALVE_MOVE_UBAR) {
+            moved = true;
+        }
+        if (checks >= window && moved && endMs == 0) {
+            int64_t recent = llabs((int64_t)pressure - history[checks % window]);
+            if (recent * 2 * elapsed < travelled * VALVE_SETTLE_MS) {
+                endMs = elapsed;
+            }
+        }
+        history[checks % window] = pressure;
+        checks++;
+        if (endMs > 0 && elapsed >= minMs) {
+            result = VALVE_END_DETECTED;
+            break;
+        }
+#endif
+        if (!moved && elapsed >= timedMs) {
+            break; // Not seen moving, the drive is timed
+        }
+        if (elapsed >= VALVE_MAX_MS) {
+            result = moved ? VALVE_STALLED : VALVE_TIMED;
+            break;
+        }
+    }
+    digitalWrite(pin, LOW);
+    driving = -1;
+    energy.stop(ENERGY_MOTOR);
+
+    if (!loadSampled) {
+        loadVoltage = 0.0; // Cut before mid travel, no voltage under load
+    }
+    lastResult = result;
+    lastDriveMs = elapsed;
+    latency.record(LATENCY_VALVE, elapsed);
+    if (result == VALVE_END_DETECTED && moved) {
+        LOG_INFO("Valve end of travel after %lu ms, motor ran %lu ms", (unsigned long)endMs, (unsigned long)elapsed);
+        learnTravel(direction, endMs);
+    }
+    else if (result == VALVE_STALLED) {
+        LOG_WARN("Valve stalled while %s, motor cut after %lu ms", direction == 0 ? "opening" : "closing", (unsigned long)elapsed);
+    }
+    else {
+        LOG_DEBUG("Valve end of travel not detected, motor ran %lu ms", (unsigned long)elapsed);
+    }
+}
+
+bool valve::halt() {
+    // Motor off, the drive loop may not return. Called from the esp_timer task: the pin only, no logging or energy
+    int pin = driving;
+    if (pin < 0) {
+        return false;
+    }
+    digitalWrite(pin, LOW);
+    driving = -1;
+    return true;
+}
+
+//***************************
+//***       Buttons       ***
+//***************************
+
+volatile uint32_t buttons::risenAt[2] = {0, 0};
+volatile bool buttons::released[2] = {false, false};
+bool buttons::wasPressed[2] = {false, false};
+void (*buttons::handler)(buttonEvents) = nullptr;
+
+void IRAM_ATTR buttons::edge(int i, int pin) {
+    // Both edges, a press held for BUTTON_DEBOUNCE_MS is kept when released before event() is called
+    uint32_t now = millis();
+    if (digitalRead(pin)) {
+        risenAt[i] = now | 1; // 0 means none, bounce restarts the wait
+    }
+    else if (risenAt[i] != 0) {
+        if (now - risenAt[i] >= BUTTON_DEBOUNCE_MS) {
+            released[i] = true;
+        }
+        risenAt[i] = 0;
+    }
+}
+
+void IRAM_ATTR buttons::edgeSW2() {
+    edge(0, buttonSW2);
+}
+
+void IRAM_ATTR buttons::edgeSW1() {
+    edge(1, buttonSW1);
+}
+
+void buttons::begin() {
+    // A switch held since the wake (the wake press) is not reported again by event()
+    wasPressed[0] = digitalRead(buttonSW2);
+    wasPressed[1] = digitalRead(buttonSW1);
+    attachInterrupt(digitalPinToInterrupt(buttonSW2), edgeSW2, CHANGE);
+    attachInterrupt(digitalPinToInterrupt(buttonSW1), edgeSW1, CHANGE);
+}
+
+buttonEvents buttons::wakeEvent() {
+    // The switch that woke the device from deep sleep, read before anything else is done
+    if (esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_EXT1) {
+        return BUTTON_NONE;
+    }
+    uint64_t pins = esp_sleep_get_ext1_wakeup_status();
+    if (pins & (1ULL << buttonSW2)) {
+        return BUTTON_CLOSE;
+    }
+    if (pins & (1ULL << buttonSW1)) {
+        return BUTTON_WATER;
+    }
+    return BUTTON_NONE;
+}
+
+buttonEvents buttons::event() {
+    // Debounced press since the last call, see the buttons class description
+    static const int pins[2] = {buttonSW2, buttonSW1};
+    static const buttonEvents events[2] = {BUTTON_CLOSE, BUTTON_WATER};
+    uint32_t now = millis();
+    for (int i = 0; i < 2; i++) {
+        bool pressed = digitalRead(pins[i]);
+        if (pressed && !wasPressed[i] && risenAt[i] == 0) {
+            risenAt[i] = now | 1; // Pressed in light sleep, the edge was not seen
+        }
+        wasPressed[i] = pressed;
+
+        uint32_t rise = risenAt[i];
+        bool held = pressed && rise != 0 && now - rise >= BUTTON_DEBOUNCE_MS;
+        if (released[i] || held) {
+            released[i] = false;
+            if (held) {
+                risenAt[i] = 0; // Reported, not again when released
+            }
+            LOG_DEBUG("Button %s pressed", i == 0 ? "SW2" : "SW1");
+            return events[i];
+        }
+    }
+    return BUTTON_NONE;
+}
+
+void buttons::poll() {
+    // A press while a step waits, the handler may move the valve. Not reentered from the handler
+    static bool busy = false;
+    if (handler == nullptr || busy) {
+        return;
+    }
+    buttonEvents e = event();
+    if (e != BUTTON_NONE) {
+        busy = true;
+        handler(e);
+        busy = false;
+    }
+}
+
+void buttons::wait(uint32_t ms) {
+    unsigned long start = millis();
+    while (millis() - start < ms) {
+        poll();
+        uint32_t left = ms - (millis() - start);
+        delay(left < BUTTON_POLL_MS ? left : BUTTON_POLL_MS);
+    }
+}
@@ -15,18 +15,35 @@ sensors Class:
     Private Variables:
         prSensorPin: Pin for the pressure sensor.
         btrLvlPin: Pin for the battery level sensor.
-        Sensor data variables: pressure, tankLevel, batteryVoltage.
+        Sensor data variables: pressure (ubar(e)), tankLevel (um), batteryVoltage (uV), integers, see sensor_math.h.
         Warning flags: warningLowLevel, warningLowBattery.
 
     Public Functions:
         sensors(int levelLow, int batteryLow): Constructor to initialize the sensor class with low-level warning and low-battery warning thresholds.
         readSensors(): Method to update sensor values.
-        Getter functions for sensor data and warning flags: getPressure(), getLevel(), getBatteryVoltage(), getWarningLowLevel(), getWarningLowBattery().
+        setReadings(double pressure, double batteryVoltage): Method to store readings taken earlier, level and warnings are updated.
+        samplePressureMicrobar(samples), samplePressure(): Static method for a fast pressure reading without delays, used for high-rate sampling.
+        sampleBatteryVoltage(): Static method for a single fast battery reading, used to measure voltage sag under load.
+        setNrSamples(int samples): Set the nr of ADC samples averaged for each reading.
+        Getter functions for sensor data (bar(e), m, V) and warning flags: getPressure(), getLevel(), getBatteryVoltage(), getWarningLowLevel(), getWarningLowBattery().
 
 valve Class:
     Class for managing the water valve.
     Provides methods to open, close the valve and reporting valve state.
 
+    The motor is driven until the end of travel is detected, not for a fixed time:
+        Current (VALVE_CURRENT_PIN fitted): the valve's limit switch cuts the current at the end of travel, a current
+            above VALVE_CURRENT_STALL_MV for VALVE_STALL_MS is a stall.
+        Pressure (otherwise): opening lowers and closing raises the pressure at the sensor (GPIO33) while the valve
+            moves, the travel has ended when the pressure has moved by VALVE_MOVE_UBAR and settled, i.e. changed by less
+            than half the average rate of the travel over the last VALVE_SETTLE_MS.
+    The drive is not cut before VALVE_MIN_PERCENT of the learned travel time. If the end can not be detected (no
+    pressure, valve already at the end) the motor runs for the learned travel time + VALVE_MARGIN_MS. If the valve
+    still moves after VALVE_MAX_MS, or the current shows a stall, the drive is cut and a stall is reported (warning,
+    shipped with the diagnostics).
+    Travel times per direction are learned from detected ends (moving average) and kept in NVS (Preferences,
+    namespace "valve"), written when they change by more than VALVE_LEARN_WRITE_MS.
+
     Private Variables:
         vlvOpenPin: Pin for opening the valve.
         vlvClosePin: Pin for closing the valve.
@@ -35,6 +52,11 @@ valve Class:
         valve(): Constructor to initialize the valve class.
         open(): Method to open the valve.
         close(): Method to close the valve.
+        getLoadVoltage(): Battery voltage measured while the motor was running.
+        getLastResult(), getLastDriveMs(): How the last actuation ended (valveResults) and how long the motor ran.
+        halt(): Stop the motor from another task (wake budget, wake_budget.h), true if it was running. Only the pin is
+            written, nothing is logged or accounted.
+        getTravelMs(bool opening): Learned travel time.
 
 leds Class:
     Class for controlling LEDs.
@@ -49,13 +71,30 @@ leds Class:
 
 buttons Class:
     Class for reading the state of switches.
-    Provides methods to check if each switch is pressed or not.
+    Provides methods to check if each switch is pressed or not, which switch woke the device and debounced presses
+    while awake.
+
+    SW1 starts a manual watering, SW2 closes the valve (stops a watering). Both wake the device from deep sleep
+    (ext1), the switch is read from the wake status at the start of setup() so the valve is actuated before any
+    networking. While awake the edges are caught by interrupts, a press is a switch closed for BUTTON_DEBOUNCE_MS
+    after the last rising edge (contact bounce restarts the wait, bounce on release is not a press). A short press
+    is kept until event() is called, a long one is reported once. Edges are not seen in light sleep, a press is then
+    found from the level on the next call of event().
+    A press is acted on within BUTTON_POLL_MS also while a step waits (WiFi association, MQTT reconnect, listening,
+    OTA download, capture): those loops call poll() or wait(), which pass a press to the handler set with onPress().
 
     Private Variables:
         Pins for switches: buttonSW1, buttonSW2.
+        risenAt, released, wasPressed: Press state per switch, static as it is written by the interrupts.
 
     Public Functions:
         Switch(): Constructor to initialize the switch class and set pin modes.
+        begin(): Attach the interrupts, a switch held since the wake is not reported again.
+        wakeEvent(): Static, the switch that woke the device (buttonEvents), SW2 if both.
+        event(): Static, debounced press since the last call (buttonEvents), SW2 first if both.
+        onPress(handler): Static, set the function called by poll() with a press.
+        poll(): Static, pass a press since the last call to the handler, for wait loops.
+        wait(uint32_t ms): Static, delay(ms) that polls every BUTTON_POLL_MS.
         Method to check if switch SW1 is pressed: isPressedSW1().
         Method to check if switch SW2 is pressed: isPressedSW2().
         Method to check if any switch is pressed (returns true if any button is pressed): isAnyPressed().
@@ -63,10 +102,44 @@ buttons Class:
 
 #include <Arduino.h>
 #include <Wire.h>
+#include "energy.h"
+#include "logger.h"
+#include "sensor_math.h"
 
 // Global variable for valve state, it is retained after sleep.
 extern RTC_DATA_ATTR bool valveState;
 
+// Valve actuation, see valve below
+#define VALVE_TRAVEL_MS 8000        // Travel time until learned, the valve takes roughly 8 s
+#define VALVE_MAX_MS 12000          // Longest drive, a valve still moving is stalled
+#define VALVE_MARGIN_MS 1000        // Drive past the learned travel time when the end is not detected
+#define VALVE_MIN_PERCENT 80        // Drive at least this share of the learned travel time
+#define VALVE_SAMPLE_MS 50          // Check the end of travel this often
+#define VALVE_SAMPLE_BURST 16       // ADC samples averaged per check
+#define VALVE_SETTLE_MS 1000        // Window for the pressure to be settled
+#define VALVE_MOVE_UBAR 10000       // Pressure change showing that the valve moves, 10 mbar
+#define VALVE_LEARN_WRITE_MS 100    // Write a learned travel time to NVS when it changed by more
+#define VALVE_CURRENT_PIN -1        // ADC1 pin with the motor current (shunt amplifier), -1 = not fitted
+#define VALVE_CURRENT_RUN_MV 100    // Motor runs above this
+#define VALVE_CURRENT_STALL_MV 1500 // Motor stalled above this
+#define VALVE_STALL_MS 300          // Stall current for this long is a stall
+
+enum valveResults {
+    VALVE_END_DETECTED,             // End of travel detected, drive cut
+    VALVE_TIMED,                    // End not detected, learned travel time + margin
+    VALVE_STALLED                   // Still moving after VALVE_MAX_MS or stall current
+};
+
+// Buttons, see buttons below
+#define BUTTON_DEBOUNCE_MS 30       // A switch is pressed when still closed this long after the last edge
+#define BUTTON_POLL_MS 50           // Longest wait between polls in the wait loops
+
+enum buttonEvents {
+    BUTTON_NONE = 0,
+    BUTTON_WATER,                   // SW1, start a manual watering
+    BUTTON_CLOSE                    // SW2, close the valve
+};
+
 class sensors {
     /*
         Class for reading and storing sensor values.
@@ -78,10 +151,10 @@ class sensors {
         static const int prSensorPin = 33; // Pressure sensor pin
         static const int btrLvlPin = 35; // Battery level pin
 
-        // Sensor data
-        double pressure;        // Actual water pressure, barg
-        double tankLevel;       // Corresponding tank level, %
-        double batteryVoltage;  // Battery voltage, V
+        // Sensor data, fixed point (sensor_math.h)
+        int32_t pressure;       // Actual water pressure, ubar(e)
+        int32_t tankLevel;      // Corresponding tank level, um water column
+        int32_t batteryVoltage; // Battery voltage, uV
 
         // Warnings
         double levelLow;
@@ -90,86 +163,29 @@ class sensors {
         bool warningLowLevel;
         bool warningLowBattery;
 
-        static double adc2voltage(double adc_val){
-            /* Function for compensating ADC value for unlinearity
-            ADC correction
-            [ 1.75101646e-01  7.25018385e-04  8.88075249e-08 -2.20849715e-11]
-            https://randomnerdtutorials.com/esp32-adc-analog-read-arduino-ide/
-
-            adc_val: double, value between 0-4095 from ADC
+        // Nr of ADC samples averaged for each reading
+        int nrSamples;
 
-            returns, double corrected voltage that corresponds to reading
-            */
-            double x0 = 0.175101646;
-            double x1 = 0.000725018385;
-            double x2 = 0.0000000888075249;
-            double x3 = 0.0000000000220849715;
-
-            double U = x0 + pow(x1, 1)*adc_val + pow(x2, 2)*adc_val + pow(x3, 3)*adc_val;
-            return U;
+        int32_t readSum(int pin) const {
+            /* Sum of nrSamples ADC codes, 200 ms apart*/
+            int32_t adcSum = 0;
+            for (int i=0; i<nrSamples; i++){
+                adcSum += analogRead(pin); //Read adc value
+                delay(200);
+            }
+            return adcSum;
         }
-    
+
         void readPressure(){
-            /* Function for reading a voltage from specified pins and converting it into a pressure
+            /* Function for reading a voltage from the pressure sensor pin and converting it into a pressure
             */
-            double R6 = 67.3 * 1000; // Resistance R6 ohm
-            double R7 = 117.3 * 1000; // Resistance R7 Ohm
-  
-            //double adc_val = analogRead(prSensorPin); //Read adc value
-            // Sample adc 5 times and average
-            double adc_val = 0;
-            int nrSamples = 5;
-            for (int i=0; i<nrSamples; i++){
-                adc_val = adc_val + analogRead(prSensorPin); //Read adc value
-            delay(200);
-            }
-            adc_val = adc_val / nrSamples;
-  
-            double U = adc2voltage(adc_val);
-            //Serial.print("\nU: " + String(U, 4) + "V (" + String(adc_val, 4) + "/4095)");
-  
-            double I = U / R7 * 1e6; // Calculate current
-            double Uactual = (R6 + R7) / R7 * U; // Voltage from pressure sensor
-            //Serial.print("\nUactual: " + String(Uactual, 4));
-  
-            // Pressure sensor outputs 0.5V (0 PSig) - 4.5V (30 PSig)
-            //                              (0 bar(e))       (2.068 bar(e))
-            // Output voltage is linear.
-            // Suply voltage to sensor = 5V
-
-            double uHigh = 4.5;
-            double uLow = 0.5;
-            double pHigh = 2.068;
-            double pLow = 0.0;
-
-            double k = (pHigh - pLow) / (uHigh - uLow);
-            //Serial.print("\nk: " + String(k, 4));
-            double m = pLow - uLow * k;
-            //Serial.print("\nm: " + String(m, 4));
-            pressure = k * Uactual + m;
-            }
+            pressure = sensorMath::adcToMicrobar(readSum(prSensorPin), nrSamples);
+        }
 
         void readBatteryLevel() {
             /* Function for reading battery level/voltage*/
-            double R1 = 100.0 * 1000; // Resistance R1 ohm
-            double R2 = 30.0 * 1000; // Resistance R2 Ohm
-
-            // Sample adc 5 times and average
-            double adc_val = 0;
-            int nrSamples = 5;
-            for (int i=0; i<nrSamples; i++){
-                adc_val = adc_val + analogRead(btrLvlPin); //Read adc value
-                delay(200);
-            }
-            adc_val = adc_val / nrSamples;
-  
-            double U = adc2voltage(adc_val); //seems to show 2v to little...
-            //Serial.print("\nU: " + String(U, 4) + "V (" + String(adc_val, 4) + "/4095)");
-  
-            double I = U / R2 * 1e6; // Calculate current
-            batteryVoltage = (R1 + R2) / R2 * U; // Voltage before voltage divider
-  
-            }
+            batteryVoltage = sensorMath::adcToMicrovolt(readSum(btrLvlPin), nrSamples);
+        }
 
     public:
         // Constructor
@@ -177,52 +193,95 @@ class sensors {
             : levelLow(levelLow), batteryLow(batteryLow){
                 warningLowLevel = false;
                 warningLowBattery = false;
+                nrSamples = 5;
             }
 
         void readSensors(){
             /* Update all available sensors and store in object*/
             // Read pressure
-            Serial.println("Reading pressure....");
             readPressure();
-            Serial.println("Pressure " + String(pressure) + " bar(e)");
+            LOG_INFO("Pressure %.3f bar(e)", getPressure());
+
+            // Read battery level
+            readBatteryLevel();
+            LOG_INFO("Battery %.2f V", getBatteryVoltage());
+
+            updateLevel();
+        }
+
+        void setReadings(double newPressure, double newBatteryVoltage){
+            /* Store readings taken earlier in the wake cycle (see wake_cycle.h), level and warnings are updated*/
+            pressure = lround(newPressure * 1e6);
+            batteryVoltage = lround(newBatteryVoltage * 1e6);
+            updateLevel();
+        }
 
+        void updateLevel(){
             //Calculate Level
-            tankLevel = pressure/998.0/9.82*1e5;
+            tankLevel = sensorMath::microbarToMicrometre(pressure);
 
             // Warn if pressure is below levelLow
-            if (tankLevel < levelLow){
+            if (getLevel() < levelLow){
                 warningLowLevel = true;
             }
 
-            // Read battery level
-            Serial.println("Reading battery level....");
-            readBatteryLevel();
-            Serial.println("Level " + String(batteryVoltage) + " V");
-
             // Warn if batteryvoltage is below 11 V
-            if (batteryVoltage < batteryLow){
+            if (getBatteryVoltage() < batteryLow){
                 warningLowBattery = true;
             }
         }
 
+        static int32_t samplePressureMicrobar(int samples = 1){
+            /* Fast reading of the pressure sensor, the mean of samples back to back ADC readings (no delays),
+            integer only. Used for high-rate sampling while the valve is open, see water_volume.h, and to
+            detect the end of valve travel.
+
+            returns, pressure in ubar(e)
+            */
+            int32_t adcSum = 0;
+            for (int i = 0; i < samples; i++){
+                adcSum += analogRead(prSensorPin);
+            }
+            return sensorMath::adcToMicrobar(adcSum, samples);
+        }
+
+        static double samplePressure(){
+            /* As samplePressureMicrobar(), in bar(e)*/
+            return samplePressureMicrobar() / 1e6;
+        }
+
+        static double sampleBatteryVoltage(){
+            /* Single, fast reading of the battery voltage (no averaging or delays).
+            Used to measure the voltage sag while the valve motor is running, see battery.h
+
+            returns, double battery voltage in V
+            */
+            return sensorMath::adcToMicrovolt(analogRead(btrLvlPin)) / 1e6;
+        }
+
+        void setNrSamples(int samples){
+            // Set nr of ADC samples averaged for each reading, each sample takes 200 ms
+            nrSamples = samples < 1 ? 1 : samples;
+        }
+
         void updateWarningLevels(double lvl, double btr){
             levelLow = lvl;
             batteryLow = btr;
         }
 
-        // Getter function for pressure
+        // Getter function for pressure, bar(e)
         double getPressure() const {
-        return pressure;
+        return pressure / 1e6;
         }
 
-        // Getter function for tankLevel
+        // Getter function for tankLevel, m
         double getLevel() const {
-        return tankLevel;
+        return tankLevel / 1e6;
         }
 
-        // Getter function for batteryVoltage
+        // Getter function for batteryVoltage, V
         double getBatteryVoltage() const {
-        return batteryVoltage;
+        return batteryVoltage / 1e6;
         }
 
         bool getWarningLowLevel() const{
@@ -246,37 +305,75 @@ class valve{
         static const int vlvOpenPin = 25;
         static const int vlvClosePin = 26;
 
+        // Battery voltage measured while the motor was running, 0 if not actuated this wake
+        double loadVoltage;
+
+        // Learned travel times, ms, index 0 opening, 1 closing, loaded from NVS at the first actuation
+        uint32_t travelMs[2];
+        bool travelLoaded;
+
+        valveResults lastResult;
+        uint32_t lastDriveMs;
+
+        // Pin of the motor while it runs, -1 if stopped, static for halt()
+        static volatile int driving;
+
+        void loadTravel();
+        void learnTravel(int direction, uint32_t ms);
+        void drive(int pin, int direction);
+
     public:
         // Constructor
         valve(){
             // Set used pins to output...
             pinMode(vlvOpenPin, OUTPUT);
             pinMode(vlvClosePin, OUTPUT);
+            loadVoltage = 0.0;
+            travelMs[0] = VALVE_TRAVEL_MS;
+            travelMs[1] = VALVE_TRAVEL_MS;
+            travelLoaded = false;
+            lastResult = VALVE_TIMED;
+            lastDriveMs = 0;
         }
 
         // Open valve.
         void open() {
   
-            Serial.print("\n\n -- Opening valve --\n");
+            LOG_INFO("Opening valve");
             //digitalWrite(ledD2, HIGH);
       
-            digitalWrite(vlvOpenPin, HIGH);
-            delay(10 * 1000); // valve takes roughly 8 s to manouver
-            digitalWrite(vlvOpenPin, LOW);
+            drive(vlvOpenPin, 0);
             valveState = true; // Set global variable valveState, its global to be able to be saved during sleep
         }
 
         // Close valve.
         void close() {
   
-            Serial.print("\n\n -- Closing valve --\n");
+            LOG_INFO("Closing valve");
             //digitalWrite(ledD2, LOW);
       
-            digitalWrite(vlvClosePin, HIGH);
-            delay(10 * 1000); // valve takes roughly 8 s to manouver
-            digitalWrite(vlvClosePin, LOW);
+            drive(vlvClosePin, 1);
             valveState = false; // Set global variable valveState, its global to be able to be saved during sleep
         }
+
+        // Battery voltage during last actuation, 0 if the valve has not been actuated this wake
+        double getLoadVoltage() const {
+            return loadVoltage;
+        }
+
+        valveResults getLastResult() const {
+            return lastResult;
+        }
+
+        uint32_t getLastDriveMs() const {
+            return lastDriveMs;
+        }
+
+        uint32_t getTravelMs(bool opening) const {
+            return travelMs[opening ? 0 : 1];
+        }
+
+        static bool halt();
 };
 
 class leds{
@@ -302,31 +399,37 @@ class leds{
     // Function to turn on the red LED
     void redLedOn() {
         digitalWrite(ledD1, HIGH);
+        energy.start(ENERGY_LED_RED);
     }
 
     // Function to turn off the red LED
     void redLedOff() {
         digitalWrite(ledD1, LOW);
+        energy.stop(ENERGY_LED_RED);
     }
 
     // Function to turn on the orange LED
     void orangeLedOn() {
         digitalWrite(ledD2, HIGH);
+        energy.start(ENERGY_LED_ORANGE);
     }
 
     // Function to turn off the orange LED
     void orangeLedOff() {
         digitalWrite(ledD2, LOW);
+        energy.stop(ENERGY_LED_ORANGE);
     }
 
     // Function to turn on the green LED
     void greenLedOn() {
         digitalWrite(ledD3, HIGH);
+        energy.start(ENERGY_LED_GREEN);
     }
 
     // Function to turn off the green LED
     void greenLedOff() {
         digitalWrite(ledD3, LOW);
+        energy.stop(ENERGY_LED_GREEN);
     }
 
 };
@@ -341,12 +444,33 @@ private:
     static const int buttonSW1 = 15;
     static const int buttonSW2 = 2;
 
+    // Index 0 SW2, 1 SW1, SW2 is reported first
+    static volatile uint32_t risenAt[2];    // millis() of the rising edge of a press not reported, 0 if none
+    static volatile bool released[2];       // A debounced press was released before it was reported
+    static bool wasPressed[2];              // Level at the last call of event()
+    static void (*handler)(buttonEvents);   // Called by poll(), nullptr if none
+
+    static void IRAM_ATTR edge(int i, int pin);
+    static void IRAM_ATTR edgeSW1();
+    static void IRAM_ATTR edgeSW2();
+
 public:
     buttons() {
         pinMode(buttonSW1, INPUT_PULLDOWN);
         pinMode(buttonSW2, INPUT_PULLDOWN);
     }
 
+    void begin();
+    static buttonEvents wakeEvent();
+    static buttonEvents event();
+
+    static void onPress(void (*pressHandler)(buttonEvents)) {
+        handler = pressHandler;
+    }
+
+    static void poll();
+    static void wait(uint32_t ms);
+
     // Method to check if switch SW1 is pressed
     bool isPressedSW1() {
         return digitalRead(buttonSW1);
@@ -0,0 +1,99 @@
+/*
+Latency statistics
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+*/
+
+#include "latency_stats.h"
+#include "energy.h"
+
+// Retain histograms after sleep
+RTC_DATA_ATTR latencyHistograms latencyDay = {};
+
+latencyStats latency;
+
+const char* latencyStats::metricName(int metric) {
+    static const char* names[LATENCY_METRICS] = {"awake", "wifi", "mqtt", "publish", "valve"};
+    return metric >= 0 && metric < LATENCY_METRICS ? names[metric] : "unknown";
+}
+
+void latencyStats::closeWake() {
+    // The boot before setup() is not seen by millis()
+    record(LATENCY_AWAKE, millis() + ENERGY_BOOT_MS);
+
+    time_t now = time(nullptr);
+    if (latencyDay.start == 0) {
+        latencyDay.start = now;
+    }
+    if (difftime(now, latencyDay.start) >= LATENCY_REPORT_S) {
+        latencyDay.due = true;
+    }
+}
+
+uint32_t latencyStats::percentile(int metric, int percent) const {
+    const latencyHistogram& h = latencyDay.metric[metric];
+    uint32_t n = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        n += h.counts[i];
+    }
+    if (n == 0) {
+        return 0;
+    }
+    // Rank of the percentile, at least the first sample
+    uint32_t rank = (n * (uint32_t)percent + 99) / 100;
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint32_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS - 1; i++) {
+        seen += h.counts[i];
+        if (seen >= rank) {
+            uint32_t upper = bucketStart(i + 1) - 1;
+            return upper < h.max ? upper : h.max;
+        }
+    }
+    return h.max;
+}
+
+size_t latencyStats::reportJSON(int metric, char* buffer, size_t size) const {
+    /*
+    Histogram of one metric since the last report, see the header for the format
+    */
+    const latencyHistogram& h = latencyDay.metric[metric];
+    uint32_t n = 0;
+    int first = LATENCY_BUCKETS;
+    int last = -1;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        if (h.counts[i] > 0) {
+            n += h.counts[i];
+            first = i < first ? i : first;
+            last = i;
+        }
+    }
+    double hours = difftime(time(nullptr), latencyDay.start) / 3600.0;
+
+    size_t len = snprintf(buffer, size, "{\"metric\":\"%s\",\"start\":%lld,\"hours\":%.1f,\"n\":%lu,\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"max\":%lu,\"b0\":%d,\"c\":[",
+                          metricName(metric), (long long)latencyDay.start, hours, (unsigned long)n,
+                          (unsigned long)percentile(metric, 50), (unsigned long)percentile(metric, 90),
+                          (unsigned long)percentile(metric, 99), (unsigned long)h.max, last < 0 ? 0 : first);
+    for (int i = first; i <= last && len < size; i++) {
+        len += snprintf(buffer + len, size - len, i == first ? "%u" : ",%u", (unsigned int)h.counts[i]);
+    }
+    if (len < size) {
+        len += snprintf(buffer + len, size - len, "]}");
+    }
+    return len < size ? len : size - 1;
+}
+
+void latencyStats::reportSent(int metric) {
+    /*
+    The histogram of the metric has been published, it starts again. Once all metrics have been sent the next
+    period starts.
+    */
+    latencyDay.metric[metric] = {};
+    latencyDay.sent |= 1 << metric;
+    if (latencyDay.sent == (1 << LATENCY_METRICS) - 1) {
+        latencyDay.start = time(nullptr);
+        latencyDay.due = false;
+        latencyDay.sent = 0;
+    }
+}
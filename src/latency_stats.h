@@ -0,0 +1,142 @@
+#ifndef LATENCY_STATS_H
+#define LATENCY_STATS_H
+
+/*
+Latency statistics
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+Histograms of how long the slow parts of a wake take, kept in RTC memory over the day and published once per day.
+The tail is what sizes the battery and the budgets (wake_budget.h): a wake of 15 s instead of 1 s on a few % of the
+wakes. The histograms give p50/p99/max per device without shipping the samples, and histograms of several devices
+or days are merged by adding the counts bucket by bucket (tools/latency_merge.py).
+
+Buckets are logarithmic with LATENCY_SUB_BUCKETS per power of two (HDR style): exact below 4 ms, then 4 buckets per
+octave, each value is within 25 % of the lower bound of its bucket. LATENCY_BUCKETS cover 0 - 131 s, longer values
+go in the last bucket, the exact maximum is kept apart. Bucket i starts at:
+    i                        for i < 4
+    (4 + i % 4) << (i / 4 - 1)  otherwise
+
+Metrics, ms:
+    LATENCY_AWAKE    The whole wake incl. the boot (ENERGY_BOOT_MS), recorded when going to sleep.
+    LATENCY_WIFI     Wait for the WiFi association, also when it failed (the timeout).
+    LATENCY_MQTT     MQTT (re)connect incl. retries and the TLS handshake, also when the broker was not reached.
+    LATENCY_PUBLISH  Hand over of one message: socket write for MQTT, the MAC ack of all fragments for ESP-NOW.
+    LATENCY_VALVE    Motor time of a valve actuation.
+
+Day:
+    When a day has passed since the histograms were reset they are due. The wake that publishes them resets them,
+    a day without radio is added to the next. Each message has the start and the length of the period.
+    The metrics already published are kept as a bit mask (sent). Each histogram is reset when its message has been
+    published. If a publish fails or the wake is cut, the next wake with the broker sends only the metrics that are
+    missing, so tools/latency_merge.py does not count a metric twice. The period ends when all have been sent.
+
+Published on the latency topic, one message per metric:
+    {"metric":"wifi","start":<epoch>,"hours":24.1,"n":398,"p50":1535,"p90":2047,"p99":9215,"max":10012,"b0":40,"c":[..]}
+    Percentiles are the upper bound of the bucket (at most max), c are the counts of the buckets from b0 to the last
+    bucket that is not empty.
+
+latencyStats Class:
+    Purpose:
+        Records the samples of a wake into the histograms in RTC memory and formats the daily report.
+    Public Methods:
+        record(int metric, uint32_t ms): Add a sample.
+        closeWake(): Called just before deep sleep, records the awake time and checks if a day has passed.
+        percentile(int metric, int percent): Upper bound of the bucket holding the percentile, ms.
+        reportDue(), reportPending(int metric), reportJSON(int metric, char* buffer, size_t size),
+            reportSent(int metric): Daily report, reportSent() resets the histogram of the metric and ends the period
+            when all metrics have been sent.
+        bucketOf(uint32_t ms), bucketStart(int bucket): Static, bucket layout.
+        metricName(int metric): Static, name of a metric.
+
+Retained Variables (RTC_DATA_ATTR):
+    latencyDay: Histograms since the last report.
+*/
+
+#include <Arduino.h>
+#include <time.h>
+
+enum latencyMetrics {
+    LATENCY_AWAKE = 0,
+    LATENCY_WIFI,
+    LATENCY_MQTT,
+    LATENCY_PUBLISH,
+    LATENCY_VALVE,
+    LATENCY_METRICS
+};
+
+#define LATENCY_SUB_BUCKETS 4      // Buckets per power of two
+#define LATENCY_BUCKETS 64         // 0 - 131071 ms, the last bucket also holds longer values
+#define LATENCY_REPORT_S 86400     // Histograms are published this often
+#define LATENCY_JSON_SIZE 640      // One metric, all buckets
+
+struct latencyHistogram {
+    uint16_t counts[LATENCY_BUCKETS]; // Saturates
+    uint32_t max;                     // ms
+};
+
+struct latencyHistograms {
+    latencyHistogram metric[LATENCY_METRICS];
+    time_t start;                     // UTC, start of the period, 0 before the first wake
+    bool due;                         // A day has passed, publish
+    uint8_t sent;                     // Bit per metric, published since the report was due
+};
+
+static_assert(LATENCY_METRICS <= 8, "latencyHistograms::sent holds a bit per metric");
+
+extern RTC_DATA_ATTR latencyHistograms latencyDay;
+
+class latencyStats {
+    /*
+    Class for the latency histograms.
+    */
+public:
+    static int bucketOf(uint32_t ms) {
+        if (ms < LATENCY_SUB_BUCKETS) {
+            return (int)ms;
+        }
+        int msb = 31 - __builtin_clz(ms);
+        int bucket = LATENCY_SUB_BUCKETS * (msb - 1) + (int)((ms >> (msb - 2)) & (LATENCY_SUB_BUCKETS - 1));
+        return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+    }
+
+    static uint32_t bucketStart(int bucket) {
+        if (bucket < LATENCY_SUB_BUCKETS) {
+            return (uint32_t)bucket;
+        }
+        return (uint32_t)(LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS) << (bucket / LATENCY_SUB_BUCKETS - 1);
+    }
+
+    static const char* metricName(int metric);
+
+    void record(int metric, uint32_t ms) {
+        latencyHistogram& h = latencyDay.metric[metric];
+        uint16_t& count = h.counts[bucketOf(ms)];
+        if (count < UINT16_MAX) {
+            count++;
+        }
+        if (ms > h.max) {
+            h.max = ms;
+        }
+    }
+
+    void closeWake();
+
+    uint32_t percentile(int metric, int percent) const;
+
+    bool reportDue() const {
+        return latencyDay.due;
+    }
+
+    bool reportPending(int metric) const {
+        return latencyDay.due && !(latencyDay.sent & (1 << metric));
+    }
+
+    size_t reportJSON(int metric, char* buffer, size_t size) const;
+
+    void reportSent(int metric);
+};
+
+// Global statistics, used by the modules that measure
+extern latencyStats latency;
+
+#endif
@@ -0,0 +1,100 @@
+/*
+Log shipping
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+*/
+
+#include "log_shipping.h"
+
+// Retain warnings and errors after sleep
+RTC_DATA_ATTR shipEntry shipEntries[LOG_SHIP_ENTRIES];
+RTC_DATA_ATTR int shipCount = 0;
+RTC_DATA_ATTR uint16_t shipLost = 0;
+
+logShipper logShip;
+
+uint16_t logShipper::hashFormat(const char* format) {
+    // FNV-1a folded to 16 bits, the format string is the same for every event from one log call
+    uint32_t hash = 2166136261u;
+    for (const char* c = format; *c != '\0'; c++) {
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+    return (uint16_t)(hash ^ (hash >> 16));
+}
+
+void logShipper::add(uint32_t time, uint8_t level, const char* format, const char* text, size_t len) {
+    uint16_t key = hashFormat(format);
+
+    // Merge with an earlier event from the same log call
+    int i = 0;
+    while (i < shipCount && (shipEntries[i].key != key || shipEntries[i].level != level)) {
+        i++;
+    }
+    if (i == shipCount) {
+        // New entry, drop oldest when full
+        if (shipCount == LOG_SHIP_ENTRIES) {
+            for (int j = 1; j < LOG_SHIP_ENTRIES; j++) {
+                shipEntries[j - 1] = shipEntries[j];
+            }
+            shipCount--;
+            if (shipLost < UINT16_MAX) shipLost++;
+        }
+        i = shipCount++;
+        shipEntries[i].first = time;
+        shipEntries[i].count = 0;
+        shipEntries[i].key = key;
+        shipEntries[i].level = level;
+    }
+
+    shipEntry& e = shipEntries[i];
+    e.last = time;
+    if (e.count < UINT16_MAX) e.count++;
+
+    // Keep the text of the last event, quotes and backslashes are replaced to keep the json valid
+    if (len > LOG_SHIP_TEXT - 1) {
+        len = LOG_SHIP_TEXT - 1;
+    }
+    for (size_t k = 0; k < len; k++) {
+        char c = text[k];
+        e.text[k] = (c == '"' || c == '\\' || (uint8_t)c < 0x20) ? '\'' : c;
+    }
+    e.text[len] = '\0';
+}
+
+size_t logShipper::toJSON(char* buffer, size_t size, int& entries) const {
+    // Oldest entries first, stops before the first entry that does not fit
+    entries = 0;
+    if (shipCount == 0 || size < 2) {
+        return 0;
+    }
+    uint32_t t0 = shipEntries[0].first;
+    size_t len = snprintf(buffer, size, "{\"t0\":%lu,\"lost\":%u,\"ev\":[", (unsigned long)t0, (unsigned)shipLost);
+    for (int i = 0; i < shipCount && len < size; i++) {
+        const shipEntry& e = shipEntries[i];
+        size_t n = snprintf(buffer + len, size - len, "%s[%lu,\"%c\",%u,%lu,\"%s\"]", i > 0 ? "," : "",
+                            (unsigned long)(e.first - t0), e.level == LOG_LEVEL_ERROR ? 'E' : 'W', (unsigned)e.count,
+                            (unsigned long)(e.last - e.first), e.text);
+        if (len + n + 2 >= size) {
+            break; // Keep for the next wake, room is left for the closing brackets
+        }
+        len += n;
+        entries++;
+    }
+    if (entries == 0) {
+        return 0;
+    }
+    len += snprintf(buffer + len, size - len, "]}");
+    return len;
+}
+
+void logShipper::remove(int entries) {
+    if (entries >= shipCount) {
+        shipCount = 0;
+    }
+    else {
+        for (int j = entries; j < shipCount; j++) {
+            shipEntries[j - entries] = shipEntries[j];
+        }
+        shipCount -= entries;
+    }
+    shipLost = 0;
+}
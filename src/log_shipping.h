@@ -0,0 +1,79 @@
+#ifndef LOG_SHIPPING_H
+#define LOG_SHIPPING_H
+
+/*
+Log shipping
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+Warnings and errors from all modules (LOG_WARN and LOG_ERROR, see logger.h) are collected in a small buffer in RTC
+memory and published as one batch on the diagnostics topic the next time the radio is up for telemetry. The radio is
+never turned on for the log alone.
+
+The batch is kept small:
+    - Events from the same log call are merged into one entry with a count, the first and last time and the text of
+      the last event, a warning repeated every wake (e.g. a failed WiFi connection) costs one entry.
+    - Times are sent relative to the first entry.
+    - At most LOG_SHIP_BUDGET bytes are published per wake, entries that do not fit are kept for the next wake.
+
+Format:
+    {"t0":<unix time>,"lost":<n>,"ev":[[<first - t0>,"<E|W>",<count>,<last - first>,"<text>"],...]}
+    lost is the nr of entries dropped since the last batch because the buffer was full.
+
+logShipper Class:
+    Purpose:
+        Collect, merge and format the events, the oldest entry is dropped when the buffer is full.
+    Public Methods:
+        add(uint32_t time, uint8_t level, const char* format, const char* text, size_t len): Add an event, called by logWrite().
+        toJSON(char* buffer, size_t size, int& entries): Format the oldest entries that fit into buffer, returns length.
+        remove(int entries): Remove the oldest entries, call when published.
+        getCount(): Nr of stored entries.
+
+Retained Variables (RTC_DATA_ATTR):
+    shipEntries, shipCount, shipLost: The stored entries and the nr of dropped entries.
+*/
+
+#include <Arduino.h>
+#include "logger.h"
+
+#ifndef LOG_SHIP_LEVEL
+#define LOG_SHIP_LEVEL LOG_LEVEL_WARN   // Highest level that is shipped
+#endif
+
+#define LOG_SHIP_ENTRIES 10        // Max nr of merged entries kept between radio wakes
+#define LOG_SHIP_TEXT 48           // Longest text kept per entry, incl. terminator
+#define LOG_SHIP_BUDGET 384        // bytes published per wake at most
+
+struct shipEntry {
+    // Events from one log call since the last batch
+    uint32_t first;                // Unix time of the first event
+    uint32_t last;                 // Unix time of the last event
+    uint16_t count;                // Nr of events
+    uint16_t key;                  // Hash of the format string, identifies the log call
+    uint8_t level;
+    char text[LOG_SHIP_TEXT];      // Text of the last event
+};
+
+extern RTC_DATA_ATTR shipEntry shipEntries[LOG_SHIP_ENTRIES];
+extern RTC_DATA_ATTR int shipCount;
+extern RTC_DATA_ATTR uint16_t shipLost;
+
+class logShipper {
+    /*
+    Class for collecting warnings and errors between radio wakes in RTC memory.
+    */
+public:
+    void add(uint32_t time, uint8_t level, const char* format, const char* text, size_t len);
+    size_t toJSON(char* buffer, size_t size, int& entries) const;
+    void remove(int entries);
+
+    int getCount() const {
+        return shipCount;
+    }
+
+private:
+    static uint16_t hashFormat(const char* format);
+};
+
+extern logShipper logShip;
+
+#endif
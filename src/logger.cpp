@@ -0,0 +1,156 @@
+/*
+Logging
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+*/
+
+#include "logger.h"
+#include "transport.h"
+#include "log_shipping.h"
+
+#include <stdlib.h>
+
+// Retain the last log events after sleep
+RTC_DATA_ATTR logRing logBuffer = {};
+
+// Number of events requested via MQTT this wake
+static int requestedEvents = 0;
+
+static const char levelLetters[] = {'-', 'E', 'W', 'I', 'D'};
+
+static void ringPut(const void* src, size_t n) {
+    const uint8_t* bytes = (const uint8_t*)src;
+    for (size_t i = 0; i < n; i++) {
+        logBuffer.data[logBuffer.head] = bytes[i];
+        logBuffer.head = (logBuffer.head + 1) % LOG_RING_SIZE;
+    }
+    logBuffer.used += n;
+}
+
+static void ringGet(uint16_t pos, void* dst, size_t n) {
+    uint8_t* bytes = (uint8_t*)dst;
+    for (size_t i = 0; i < n; i++) {
+        bytes[i] = logBuffer.data[(pos + i) % LOG_RING_SIZE];
+    }
+}
+
+static uint16_t recordSize(uint16_t pos) {
+    // Size of the record at pos, header incl.
+    return LOG_HEADER_SIZE + logBuffer.data[(pos + 5) % LOG_RING_SIZE];
+}
+
+static void ringAdd(uint32_t stamp, uint8_t level, const char* text, size_t len) {
+    // Add a record, dropping the oldest records until it fits
+    size_t need = LOG_HEADER_SIZE + len;
+    while ((size_t)(LOG_RING_SIZE - logBuffer.used) < need && logBuffer.count > 0) {
+        uint16_t size = recordSize(logBuffer.tail);
+        logBuffer.tail = (logBuffer.tail + size) % LOG_RING_SIZE;
+        logBuffer.used -= size;
+        logBuffer.count--;
+        logBuffer.dropped++;
+    }
+    uint8_t length = (uint8_t)len;
+    ringPut(&stamp, 4);
+    ringPut(&level, 1);
+    ringPut(&length, 1);
+    ringPut(text, len);
+    logBuffer.count++;
+}
+
+void logWrite(uint8_t level, const char* format, ...) {
+    char line[LOG_LINE_SIZE];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len < 0) {
+        return;
+    }
+    if (len >= (int)sizeof(line)) {
+        len = sizeof(line) - 1;
+    }
+
+    if (level <= LOG_SERIAL_LEVEL) {
+        Serial.printf("[%c] %s\n", levelLetters[level], line);
+    }
+    if (level <= LOG_RING_LEVEL) {
+        ringAdd((uint32_t)time(nullptr), level, line, len);
+    }
+    if (level <= LOG_SHIP_LEVEL) {
+        logShip.add((uint32_t)time(nullptr), level, format, line, len);
+    }
+}
+
+int logCount() {
+    return logBuffer.count;
+}
+
+logCursor logFirst(int lastN) {
+    // Cursor at the first of the last N events
+    logCursor cursor = {logBuffer.tail, logBuffer.count};
+    while (cursor.remaining > lastN) {
+        cursor.pos = (cursor.pos + recordSize(cursor.pos)) % LOG_RING_SIZE;
+        cursor.remaining--;
+    }
+    return cursor;
+}
+
+bool logNext(logCursor& cursor, char* line, size_t size) {
+    // Format the next event as "<unix time> <level> <text>", returns false when there are no more events
+    if (cursor.remaining == 0) {
+        return false;
+    }
+    uint32_t stamp;
+    uint8_t header[2];
+    char text[LOG_LINE_SIZE];
+    ringGet(cursor.pos, &stamp, 4);
+    ringGet(cursor.pos + 4, header, 2);
+    ringGet(cursor.pos + LOG_HEADER_SIZE, text, header[1]);
+    text[header[1]] = '\0';
+    snprintf(line, size, "%lu %c %s", (unsigned long)stamp, header[0] <= LOG_LEVEL_DEBUG ? levelLetters[header[0]] : '?', text);
+
+    cursor.pos = (cursor.pos + LOG_HEADER_SIZE + header[1]) % LOG_RING_SIZE;
+    cursor.remaining--;
+    return true;
+}
+
+void logRequestMQTT(const char* message) {
+    // Called when a log request is received, the payload is the number of events wanted
+    if (message[0] == '\0') {
+        return; // The cleared request
+    }
+    requestedEvents = atoi(message);
+    if (requestedEvents <= 0) {
+        requestedEvents = logCount();
+    }
+}
+
+int logRequested() {
+    return requestedEvents;
+}
+
+void logPublish(transport& session, const char* topic, const char* requestTopic) {
+    // Publish the requested events in chunks of whole lines, then clear the retained request
+    char chunk[LOG_CHUNK_SIZE];
+    char line[LOG_LINE_SIZE + 16];
+    size_t len = 0;
+
+    logCursor cursor = logFirst(requestedEvents);
+    while (logNext(cursor, line, sizeof(line))) {
+        size_t lineLen = strlen(line);
+        if (len + lineLen + 2 > sizeof(chunk)) {
+            session.publish(topic, chunk);
+            len = 0;
+        }
+        len += snprintf(chunk + len, sizeof(chunk) - len, "%s\n", line);
+    }
+    if (len > 0) {
+        session.publish(topic, chunk);
+    }
+    if (logBuffer.dropped > 0) {
+        snprintf(line, sizeof(line), "%lu events dropped since power on", (unsigned long)logBuffer.dropped);
+        session.publish(topic, line);
+    }
+
+    session.publish(requestTopic, "", true);
+    requestedEvents = 0;
+}
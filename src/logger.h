@@ -0,0 +1,113 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+/*
+Logging
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+Levelled logging with printf style formatting into a fixed buffer on the stack, no String is created.
+
+Levels are filtered at compile time, set with build flags (platformio.ini):
+    LOG_LEVEL          Calls above this level are compiled out, arguments are type checked but never evaluated (default info)
+    LOG_SERIAL_LEVEL   Messages up to this level are also printed on Serial (default warn)
+    LOG_RING_LEVEL     Messages up to this level are kept in the ring buffer in RTC memory (default info)
+
+The ring buffer keeps the last log events across deep sleep as binary records [time (4), level (1), length (1), text],
+the oldest records are dropped when it is full. The events are fetched on demand via MQTT instead of being streamed
+over UART every wake: publish the number of events wanted (e.g. "50", empty payload is ignored) retained with QoS 1 on
+the log_request topic (mosquitto_pub -q 1 -r, see the persistent session in mqtt_handler.h). The device replies on the log topic with lines "<unix time> <E|W|I|D> <text>" in chunks and clears
+the retained request. Warnings and errors are also shipped unrequested in batches, see log_shipping.h.
+
+Macros:
+    LOG_ERROR(format, ...), LOG_WARN(format, ...), LOG_INFO(format, ...), LOG_DEBUG(format, ...)
+
+Functions:
+    logWrite(uint8_t level, const char* format, ...): Format and write a log event, used by the macros.
+    logCount(): Number of events in the ring buffer.
+    logFirst(int lastN), logNext(logCursor& cursor, char* line, size_t size): Iterate over the last N events, oldest first.
+    logRequestMQTT(const char* message): Subscription handler for log requests.
+    logRequested(): Number of events requested via MQTT, 0 if none.
+    logPublish(transport& session, const char* topic, const char* requestTopic): Publish the requested events.
+
+Retained Variables (RTC_DATA_ATTR):
+    logBuffer: The ring buffer.
+*/
+
+#include <Arduino.h>
+#include <stdarg.h>
+
+#define LOG_LEVEL_NONE  0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_INFO  3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#ifndef LOG_SERIAL_LEVEL
+#define LOG_SERIAL_LEVEL LOG_LEVEL_WARN
+#endif
+
+#ifndef LOG_RING_LEVEL
+#define LOG_RING_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_LINE_SIZE 96      // Longest message, longer messages are truncated
+#define LOG_RING_SIZE 1536    // bytes of RTC memory for the ring buffer
+#define LOG_HEADER_SIZE 6     // time (4), level (1), length (1)
+#define LOG_CHUNK_SIZE 512    // Longest MQTT message when publishing the log
+
+struct logRing {
+    uint16_t head;            // Next byte to write
+    uint16_t tail;            // Oldest record
+    uint16_t used;            // bytes
+    uint16_t count;           // records
+    uint32_t dropped;         // records overwritten since power on
+    uint8_t data[LOG_RING_SIZE];
+};
+
+struct logCursor {
+    uint16_t pos;             // Next record
+    uint16_t remaining;       // records left
+};
+
+extern RTC_DATA_ATTR logRing logBuffer;
+
+void logWrite(uint8_t level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) logWrite(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) do { if (0) logWrite(LOG_LEVEL_ERROR, __VA_ARGS__); } while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) logWrite(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) do { if (0) logWrite(LOG_LEVEL_WARN, __VA_ARGS__); } while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) logWrite(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) do { if (0) logWrite(LOG_LEVEL_INFO, __VA_ARGS__); } while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) logWrite(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do { if (0) logWrite(LOG_LEVEL_DEBUG, __VA_ARGS__); } while (0)
+#endif
+
+int logCount();
+logCursor logFirst(int lastN);
+bool logNext(logCursor& cursor, char* line, size_t size);
+
+class transport;
+void logRequestMQTT(const char* message);
+int logRequested();
+void logPublish(transport& session, const char* topic, const char* requestTopic);
+
+#endif
@@ -1,15 +1,29 @@
 #include <Arduino.h>
 
 #include "networking.h"
-#include "mqtt_handler.h"
+#include "transport.h"
 #include "config.h"
 #include "water_settings.h"
 #include "multitasker.h"
 #include "sleep.h"
 #include "time_keeping.h"
 #include "hardware_functions.h"
+#include "water_volume.h"
+#include "battery.h"
+#include "reading_batch.h"
+#include "adaptive_sampling.h"
+#include "memory_stats.h"
+#include "logger.h"
+#include "log_shipping.h"
+#include "wake_cycle.h"
+#include "ota_update.h"
+#include "wake_budget.h"
+#include "latency_stats.h"
+#include "waveform_capture.h"
+#include "command_channel.h"
+#include "mqtt_handler.h"
 
-mqttHandler* mqttSession = nullptr; // Declare pointer to mqttHandler
+transport* uplink = nullptr; // Uplink backend, SPEC_UPLINK (MQTT, ESP-NOW or loopback), created in the connect step
   
 // Set up target time
 timeKeeper* targetTime = nullptr;
@@ -20,185 +34,538 @@ sensors mySensors(settings.getLevelLow(), settings.getBatteryLow());
 leds myLeds;
 buttons mybuttons;
 
-void setup() {
-  //***************
-  //**** Setup! ***
-  //***************
-
-  // Start Serial
-  Serial.begin(115200);
-
-  // Setup deep sleep
-  sleepSetup();
+// Battery state of charge and duty cycle, state is kept in RTC memory
+batteryEstimator battery(batteryState);
+dutyGovernor governor(powerLevel);
+readingBatch batch;
+
+// Adaptive sampling, state is kept in RTC memory
+samplingPolicy sampler(samplingPolicyState);
+
+// Decided at the start of the wake, used by the steps
+bool useRadio = false;
+bool sampleNow = false;
+bool manualWatering = false; // SW1 or a command opened the valve this wake
+int manualWaterS = 0;        // Duration of the manual watering, s
+
+template <typename... Args>
+static bool publishOnce(pubTopic topic, Args... args){
+  // Publish once per cycle, a resumed cycle does not repeat what was published before the reset.
+  // Returns false if the message was not sent, it is then tried again by a resumed cycle.
+  if (cycle.isPublished(topic)){
+    return true;
+  }
+  if (uplink->needsIP()){
+    delay(100); // Add a small delay to make sure all messages are sent, ESP-NOW frames are acknowledged instead
+  }
+  if (!uplink->publish(mqtt_cred.getPub(topic), args...)){
+    return false;
+  }
+  cycle.setPublished(topic);
+  return true;
+}
 
-  // If active, connect to wifi
-  if (wifi_cred.getWifiActive()) {
-    connect_wifi(wifi_cred);
-    if (WiFi.status() == WL_CONNECTED){
-      myLeds.greenLedOn();
+static void handleButton(buttonEvents event){
+  // Manual operation, the valve is actuated right away, before any networking. The valve state is published by
+  // the steps that follow, a manual watering then sleeps for the duration of a watering (see waterStep()).
+  switch (event){
+    case BUTTON_WATER:
+      if (!valveState){
+        LOG_INFO("Manual watering, opening valve");
+        cycle.setValveOpen(true);
+        myValve.open();
+        volumeSessionStart(mySensors);
       }
-    else{
-      myLeds.orangeLedOn();
+      else {
+        LOG_INFO("Manual watering, valve already open");
       }
-    }
+      manualWatering = true;
+      manualWaterS = settings.getTimeToWater();
+      break;
+    case BUTTON_CLOSE:
+      manualWatering = false;
+      if (valveState){
+        LOG_INFO("Manual stop, closing valve");
+        volumeSessionFinish(mySensors, settings.getFlowCoefficient());
+        myValve.close();
+        cycle.setValveOpen(false);
+      }
+      break;
+    case BUTTON_NONE:
+      break;
+  }
+}
+
+static void connectStep(){
+  // If active, connect to wifi, only the MQTT uplink needs an associated station (see transport.h)
+  if (!useRadio) {
+    LOG_INFO("Radio not used this wake, power level: %s", governor.levelName());
+  }
   else {
-    Serial.println("Wifi not active");
-    myLeds.greenLedOn();
+    if (SPEC_UPLINK == UPLINK_MQTT) {
+      if (wifi_cred.getWifiActive()) {
+        connect_wifi(wifi_cred, governor.getTxPower());
+        if (WiFi.status() == WL_CONNECTED){
+          myLeds.greenLedOn();
+          }
+        else{
+          myLeds.orangeLedOn();
+          }
+        }
+      else {
+        LOG_INFO("Wifi not active");
+        myLeds.greenLedOn();
+        }
     }
 
-  // If MQTT shoud be active, instantiate mqttSession
-  if (mqtt_cred.getActive()){
-    mqttSession = new mqttHandler(mqtt_cred); // Dynamically allocate memory and instantiate mqttHandler
-    
-    //Test subscription
-    //Serial.println("Test to subsript to " + String(mqtt_cred.getSub(0)));
-    //mqttSubs = new mqqtSubscriptions();
-    //mqttSubs.addSub(mqtt_cred.getSub(0), settingsMQTT);
-    //mqttSession->addSubscription(mqtt_cred.getSub(0), settingsMQTT);
-  } 
-  else {
-    Serial.println("MQTT not active");
+    // Instantiate the uplink, nullptr if MQTT is not active or the backend could not start
+    uplink = transportCreate(SPEC_UPLINK, governor.getTxPower());
+    if (SPEC_UPLINK != UPLINK_MQTT){
+      if (uplink != nullptr){
+        myLeds.greenLedOn();
+        }
+      else{
+        myLeds.orangeLedOn();
+        }
+      }
   }
+  memStats.mark(MEM_RADIO);
 
-  // Connect to NTP server and set up target time
-  timeSetup();
-  if(bootCount < 2){ // If first boot wait for time to sync
-    delay(10000); // Make sure timeserver is connected
+  if(bootCount < 2 && !cycle.resumed()){ // If first boot wait for time to sync
+    unsigned long start = millis();
+    while (!timeValid() && millis() - start < NTP_WAIT_MS && !budget.expired()){
+      buttons::wait(100); // Make sure timeserver is connected
+    }
+    LOG_DEBUG("Time %s after %lu ms", timeValid() ? "synced" : "not synced", millis() - start);
   }
+}
 
-  // Close valve if not closed
-  if (valveState){
+static void closeValveStep(){
+  // Close valve if not closed, unless a manual watering was started this wake
+  if (valveState && !manualWatering){
     
     // Send Valve state
-    mqttSession->publish(mqtt_cred.getPub(0), String(valveState));
+    if (uplink != nullptr){
+      uplink->publish(mqtt_cred.getPub(pubTopic::valveState), valveState);
+    }
+
+    // Estimate delivered volume of the timed session before the flow stops
+    volumeSessionFinish(mySensors, settings.getFlowCoefficient());
 
     // Close Valve
     myValve.close();
+    cycle.setValveOpen(false);
+  }
+}
+
+static void applyCommands(){
+  // Commands of this wake, applied before the slow steps, see command_channel.h.
+  // Water now and skip in the settings are applied as commands without sequence nr when they become true.
+  if (settingsReceived()){
+    commands.fromSettings(settings.getWaterOnDemand(), settings.getSkipWatering());
   }
 
-  //***********************
-  //**** Do your thing! ***
-  //***********************
+  for (queuedCommand* c = commands.next(); c != nullptr; c = commands.next()){
+    switch (c->kind){
+      case CMD_WATER:
+        handleButton(BUTTON_WATER);
+        if (c->minutes > 0){
+          manualWaterS = c->minutes * 60;
+        }
+        break;
+      case CMD_SKIP:
+        break; // Kept by the channel until the next watering, see waterStep()
+      case CMD_CLOSE:
+        handleButton(BUTTON_CLOSE);
+        break;
+      case CMD_CAPTURE:
+        if (SPEC_UPLINK != UPLINK_MQTT){
+          commands.reject(c);
+          break;
+        }
+        capture.request((uint16_t)c->seq, c->rate, c->ms, c->battery);
+        break;
+      case CMD_RESYNC:
+        sampleNow = true;
+        sampler.event(settings.getDefaultSleepTime());
+        mqttSessionKey = 0; // Subscribe again on the next connect
+        timeSetup();        // Restart the time sync
+        break;
+    }
+  }
+  commands.acknowledge(*uplink, mqtt_cred.getPub(pubTopic::commandAck), mqtt_cred.getSub(subTopic::command));
+}
 
+static void settingsStep(){
   //----------------------
   // Try updating settings
   //----------------------
-  Serial.println("\n\n1. Updating settings");
+  if (uplink != nullptr){
+    LOG_DEBUG("1. Updating settings");
   
-  // Setup
-  mqttSession->addSubscription(mqtt_cred.getSub(0), &settingsMQTT);
-  mqttSession->publish(mqtt_cred.getPub(3), "Ready");
+    // Setup
+    transport::addSubscription(mqtt_cred.getSub(subTopic::settings), &settingsMQTT);
+    transport::addSubscription(mqtt_cred.getSub(subTopic::logRequest), &logRequestMQTT);
+    transport::addSubscription(mqtt_cred.getSub(subTopic::ota), &otaRequestMQTT);
+    transport::addSubscription(mqtt_cred.getSub(subTopic::capture), &captureRequestMQTT);
+    transport::addSubscription(mqtt_cred.getSub(subTopic::command), &commandMQTT);
+    uplink->publish(mqtt_cred.getPub(pubTopic::ready), "Ready");
     
-  //Listen for a respons for 1s
-  unsigned long startTime = millis();
-  while (millis() - startTime < 1000) {
-    mqttSession->loop();
-    delay(100);
+    // Listen for queued messages and the respons, until it is quiet (at most 1 s)
+    uplink->listen();
+
+    // Every ready is answered with the settings, without a reply the broker may have lost the persistent session
+    if (SPEC_UPLINK == UPLINK_MQTT && uplink->connected() && !settingsReceived()){
+      mqttSessionLost();
+    }
+
+    // Water now, skip, close valve, capture and resync
+    applyCommands();
+
+    // Log events requested via MQTT
+    if (logRequested() > 0){
+      logPublish(*uplink, mqtt_cred.getPub(pubTopic::log), mqtt_cred.getSub(subTopic::logRequest));
+    }
   }
+  memStats.mark(MEM_SETTINGS);
+}
 
+static void sensorsStep(){
   // -------------
   // Check sensors
   // -------------
-  Serial.println("\n\n2. Checking my sensors....");
-  mySensors.updateWarningLevels(settings.getBatteryLow(), settings.getLevelLow());
-  mySensors.readSensors();
+  if (sampleNow){
+    LOG_DEBUG("2. Checking my sensors");
+    mySensors.updateWarningLevels(settings.getBatteryLow(), settings.getLevelLow());
+    mySensors.readSensors();
+    cycle.saveReadings(mySensors.getPressure(), mySensors.getBatteryVoltage());
+
+    // Update battery state of charge, the valve may have been closed this wake giving the voltage under load
+    battery.update(mySensors.getBatteryVoltage(), myValve.getLoadVoltage());
+    governor.update(battery.getSoc());
+
+    // Adapt sampling interval to how fast the readings change
+    sampler.update(time(nullptr), mySensors.getLevel(), mySensors.getBatteryVoltage(), settings.getDefaultSleepTime());
   
-  // Turn on warning lights correspondingly
-  if(mySensors.getWarningLowBattery()){
-    Serial.println("Warning, low battery level!");
-    myLeds.redLedOn();
-  }
+    // Turn on warning lights correspondingly
+    if(mySensors.getWarningLowBattery()){
+      LOG_WARN("Low battery level, %.2f V", mySensors.getBatteryVoltage());
+      myLeds.redLedOn();
+    }
 
-  if(mySensors.getWarningLowLevel()){
-    Serial.println("Warning, low water level!");
-    myLeds.redLedOn();
+    if(mySensors.getWarningLowLevel()){
+      LOG_WARN("Low water level, %.2f m", mySensors.getLevel());
+      myLeds.redLedOn();
+    }
+  }
+  else {
+    LOG_DEBUG("2. No sample due, next in %ld s", (long)sampler.timeToNextSample(time(nullptr)));
   }
+  memStats.mark(MEM_SENSORS);
+}
 
-   // ------------------
+static void publishStep(){
+  // ------------------
   // Send data via MQTT
   // ------------------
 
-  if (mqtt_cred.getActive()){ //only if MQTT Active
-    Serial.println("\n\n3. Send MQTT Data");
+  if (uplink == nullptr || !uplink->connected()){ // Radio not used or broker unreachable, keep readings until next time
+    if (sampleNow){
+      batch.add(time(nullptr), mySensors.getLevel(), mySensors.getPressure(), mySensors.getBatteryVoltage());
+    }
+  }
+  else { //only if MQTT Active
+    LOG_DEBUG("3. Send MQTT Data");
 
     // Valve state
-    mqttSession->publish(mqtt_cred.getPub(0), String(valveState));
-    // Level
-    delay(100); // Add a small delay to make sure all messages are sent.
-    mqttSession->publish(mqtt_cred.getPub(1), String(mySensors.getLevel(), 2));
+    publishOnce(pubTopic::valveState, (int)valveState);
+
+    if (sampleNow){
+      bool sent = publishOnce(pubTopic::level, mySensors.getLevel(), 2);
+      sent = publishOnce(pubTopic::pressure, mySensors.getPressure(), 2) && sent;
+      sent = publishOnce(pubTopic::batteryVoltage, mySensors.getBatteryVoltage(), 2) && sent;
+      if (!sent){ // Connection lost, sent with the batch below or on the next wake
+        batch.add(time(nullptr), mySensors.getLevel(), mySensors.getPressure(), mySensors.getBatteryVoltage());
+      }
+    }
+
+    // Volume delivered during last watering
+    publishOnce(pubTopic::volume, lastSessionVolume, 1);
+
+    // Battery state of charge
+    publishOnce(pubTopic::soc, (double)battery.getSoc(), 0);
+
+    // Energy budget of the last day
+    if (energy.reportDue()){
+      char energyJSON[256];
+      energy.reportJSON(energyJSON, sizeof(energyJSON));
+      if (publishOnce(pubTopic::energy, (const char*)energyJSON)){
+        energy.reportSent();
+      }
+    }
+
+    // Latency histograms of the last day, one message per metric, only the ones not sent yet
+    if (latency.reportDue()){
+      char latencyJSON[LATENCY_JSON_SIZE];
+      for (int i = 0; i < LATENCY_METRICS; i++){
+        if (!latency.reportPending(i)){
+          continue;
+        }
+        latency.reportJSON(i, latencyJSON, sizeof(latencyJSON));
+        if (!uplink->publish(mqtt_cred.getPub(pubTopic::latency), latencyJSON)){
+          break;
+        }
+        latency.reportSent(i);
+      }
+    }
+
+    // Readings from wakes without radio or without the broker
+    if (batch.getCount() > 0){
+      char batchJSON[512];
+      batch.toJSON(batchJSON, sizeof(batchJSON));
+      if (publishOnce(pubTopic::batch, (const char*)batchJSON)){
+        batch.clear();
+      }
+    }
+
+    // Memory usage this wake
+    memStats.mark(MEM_PUBLISH);
+    char memoryJSON[384];
+    memStats.toJSON(memoryJSON, sizeof(memoryJSON));
+    publishOnce(pubTopic::memory, (const char*)memoryJSON);
+
+    // Warnings and errors since the last batch, limited to LOG_SHIP_BUDGET bytes per wake
+    if (logShip.getCount() > 0){
+      char diagnosticsJSON[LOG_SHIP_BUDGET];
+      int shipped;
+      if (logShip.toJSON(diagnosticsJSON, sizeof(diagnosticsJSON), shipped) > 0){
+        if (uplink->needsIP()){
+          delay(100);
+        }
+        if (uplink->publish(mqtt_cred.getPub(pubTopic::diagnostics), diagnosticsJSON)){
+          logShip.remove(shipped);
+        }
+      }
+    }
+  }
+}
 
-    // Pressure
-    delay(100);
-    mqttSession->publish(mqtt_cred.getPub(4), String(mySensors.getPressure(), 2));
+static void captureStep(){
+  // ---------------------------------
+  // Waveform capture, if requested
+  // ---------------------------------
+  if (!capture.pending() || uplink == nullptr){
+    return;
+  }
+  if (SPEC_UPLINK != UPLINK_MQTT){
+    LOG_WARN("Capture needs the MQTT uplink, request dropped");
+    capture.cancel();
+    return;
+  }
+  if (!uplink->connected()){
+    return; // Kept until the broker is reached
+  }
+  capture.run(*uplink, mqtt_cred.getPub(pubTopic::captureData), mqtt_cred.getSub(subTopic::capture));
+}
 
-    // Battery
-    delay(100);
-    mqttSession->publish(mqtt_cred.getPub(2), String(mySensors.getBatteryVoltage(),2));
+static void otaStep(){
+  // --------------------------------------------
+  // Next part of a firmware update, if requested
+  // --------------------------------------------
+  if (!ota.active() || uplink == nullptr || WiFi.status() != WL_CONNECTED){
+    return;
+  }
+  if (battery.getSoc() < OTA_MIN_SOC){
+    LOG_INFO("Update paused, battery at %d %%", (int)battery.getSoc());
+    return;
   }
+  ota.run();
+
+  char otaJSON[128];
+  ota.statusJSON(otaJSON, sizeof(otaJSON));
+  publishOnce(pubTopic::otaStatus, (const char*)otaJSON);
+}
 
+static void waterStep(){
   // ---------------------
   // If time to water, do!
   // ---------------------
 
-  Serial.println("\n\n4. Is it time? To water?");
+  LOG_DEBUG("4. Is it time? To water?");
+
+  // Manual watering, SW1 opened the valve at the start of the wake (or while awake), or a water command did.
+  // The valve remains open for the duration of a standard watering (or the one of the command), SW2 wakes the
+  // device and closes it earlier.
+  // A scheduled watering that is due is done when the device wakes with the valve closed.
+  if (manualWatering){
+    LOG_INFO("Manual watering for %d s", manualWaterS);
+    sleepNow(manualWaterS);
+  }
+
   targetTime = new timeKeeper(settings.getWaterTimeHour(), settings.getWaterTimeMinute());
   
-  Serial.println("Current target time:" + targetTime->timeString());
-  Serial.println("Time until target: " + String(targetTime->timeUntil()) + " s");
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+  char targetString[64];
+  targetTime->timeString(targetString, sizeof(targetString));
+  LOG_DEBUG("Current target time: %s", targetString);
+#endif
+  LOG_DEBUG("Time until target: %ld s", (long)targetTime->timeUntil());
 
   if (targetTime->timeUntil() <= 0){
-      Serial.println("Time has passed");
+      LOG_DEBUG("Time has passed");
+      if (targetTime->getDay() != lastWaterDay && commands.skipPending()){ // Skip command, counts as the watering of today
+        LOG_INFO("Watering of today skipped on command");
+        lastWaterDay = targetTime->getDay();
+        cycle.setWaterDay(lastWaterDay);
+        commands.clearSkip();
+      }
       if (targetTime->getDay() != lastWaterDay){ // check which day the last watering occured, if not today, then water..
-        Serial.println("Not watered yet today, do the watering...");
+        LOG_INFO("Not watered yet today, do the watering");
 
-        myValve.open(); // Open valve
         lastWaterDay = targetTime->getDay(); // Set last water dat to today
-        Serial.println("\nValve State:" + String(valveState));
+        cycle.setWaterDay(lastWaterDay);
+        cycle.setValveOpen(true);
+
+        if (settings.getWaterVolume() > 0){
+          // Deliver a volume, stay awake and sample pressure until it is delivered.
+          // timeToWater is used as an upper limit.
+          if (uplink != nullptr){
+            uplink->publish(mqtt_cred.getPub(pubTopic::valveState), true);
+          }
+          wifi_disconnect(); // Radio is not needed while sampling
+
+          budget.extend((uint32_t)settings.getTimeToWater() * 1000); // The watering is the long part of the wake
+          deliverVolume(myValve, mySensors, mybuttons, settings.getFlowCoefficient(), settings.getWaterVolume(), settings.getTimeToWater());
+          sleepNow(settings.getDefaultSleepTime()); // Volume is reported next wake
+        }
+
+        myValve.open(); // Open valve
+        volumeSessionStart(mySensors);
+        LOG_DEBUG("Valve State: %d", (int)valveState);
         
         // Send new Valve state
-        mqttSession->publish(mqtt_cred.getPub(0), String(valveState));
-        delay(100); // wait for 100ms to make sure message is sent before going to sleep.
+        if (uplink != nullptr){
+          uplink->publish(mqtt_cred.getPub(pubTopic::valveState), valveState);
+          delay(100); // wait for 100ms to make sure message is sent before going to sleep.
+        }
 
         sleepNow(settings.getTimeToWater()); // Sleep for the duration of the watering
       }
       else{
-        Serial.println("Already watered today, do nothing...");
+        LOG_DEBUG("Already watered today, do nothing");
       }
     }
+}
 
-    // Manual override to water, If a button is pressed the valve should be opened
-    if (mybuttons.isAnyPressed()){
-      // Is any button pressed?
-      Serial.println("Manual override, opening valve....");
-      myValve.open(); // Open valve
-
-      // Send new Valve state
-      mqttSession->publish(mqtt_cred.getPub(0), String(valveState));
-
-      sleepNow(settings.getTimeToWater()); // Sleep for the duration of the watering
-
-      /*
-        The valve will remain open for the duration of a standard watering. 
-        
-        If any button is pressed again the device will wake from sleep and close the valve. 
-        The valve is closed on every boot if open.
-      */
-    }
-
+static void sleepStep(){
   // -----------
   // Go to sleep
   // -----------
 
-  Serial.println("\n\n5. Preparing to sleep...");
+  LOG_DEBUG("5. Preparing to sleep");
+
+  // SW1 or a water command after the watering step, the valve is open: sleep for the manual watering
+  if (manualWatering){
+    LOG_INFO("Manual watering for %d s", manualWaterS);
+    sleepNow(manualWaterS);
+  }
+  if (targetTime == nullptr){ // Watering step given up
+    targetTime = new timeKeeper(settings.getWaterTimeHour(), settings.getWaterTimeMinute());
+  }
 
-  // if time to next watering is less than the default sleep time and no watering has been done yet today
+  // Sleep time is stretched by the governor when the battery is low and by the sampling policy when readings are stable.
+  // if time to next watering is less than the sleep time and no watering has been done yet today
   // the sleep time should be shortened to next watering time.
-  if ((settings.getDefaultSleepTime() > targetTime->timeUntil()) && (targetTime->getDay() != lastWaterDay)){
+  int sleepTime = governor.getSleepTime(settings.getDefaultSleepTime());
+  if (sampler.timeToNextSample(time(nullptr)) > sleepTime){
+    sleepTime = sampler.timeToNextSample(time(nullptr));
+  }
+  if ((sleepTime > targetTime->timeUntil()) && (targetTime->getDay() != lastWaterDay)){
     sleepNow(targetTime->timeUntil());
-  } else { // if not, use default sleep time
-    sleepNow(settings.getDefaultSleepTime());
+  } else { // if not, use governed sleep time
+    sleepNow(sleepTime);
+  }
+}
+
+void setup() {
+  //***************
+  //**** Setup! ***
+  //***************
+
+  // Start Serial
+  Serial.begin(115200);
+  memStats.mark(MEM_BOOT);
+
+  // Setup deep sleep
+  sleepSetup();
+
+  // Connect to NTP server and set up time zone
+  timeSetup();
+
+  // Resume a cycle that was interrupted by a reset, restores the valve state and the day of the last watering
+  cycle.begin();
+
+  // Hard limit of the wake, counted from the boot. Phase deadlines for the steps, see wake_budget.h
+  budget.begin();
+
+  // A button wake is acted on first, the valve moves within ms of the boot. Presses while awake are handled between
+  // the steps and in the loops that wait (buttons::poll()).
+  buttonEvents wakeButton = buttons::wakeEvent();
+  mybuttons.begin();
+  handleButton(wakeButton);
+  buttons::onPress(handleButton);
+
+  ota.begin();
+  commands.begin();
+
+  // The settings of the last reply, also on wakes without radio (config.h)
+  if (!settingsValid()){
+    LOG_DEBUG("No settings received since the reset, using the defaults");
+  }
+
+  // When the battery is low the radio is only used every n:th wake,
+  // always use it when something happens (first boot, valve open, watering due or button pressed)
+  timeKeeper wateringCheck(settings.getWaterTimeHour(), settings.getWaterTimeMinute());
+  bool wateringDue = (wateringCheck.timeUntil() <= 0) && (wateringCheck.getDay() != lastWaterDay);
+  bool buttonWake = wakeButton != BUTTON_NONE;
+  useRadio = governor.useRadio(bootCount) || bootCount < 2 || valveState || wateringDue || buttonWake;
+  mySensors.setNrSamples(governor.getNrSamples());
+
+  // Sample fast around watering and manual operation
+  if (valveState || wateringDue || buttonWake){
+    sampler.event(settings.getDefaultSleepTime());
   }
+  sampleNow = sampler.sampleDue(time(nullptr));
 
+  // Readings taken before a reset are used instead of sampling again
+  if (cycle.hasReadings()){
+    mySensors.updateWarningLevels(settings.getBatteryLow(), settings.getLevelLow());
+    mySensors.setReadings(cycle.getPressure(), cycle.getBatteryVoltage());
+    sampleNow = true;
+  }
+
+  //***********************
+  //**** Do your thing! ***
+  //***********************
+
+  // Run the steps of the cycle, steps done before a reset are skipped
+  for (int step = cycle.next(); step != STEP_DONE; step = cycle.next()){
+    budget.phase(step);
+    switch (step){
+      case STEP_CONNECT:     connectStep(); break;
+      case STEP_CLOSE_VALVE: closeValveStep(); break;
+      case STEP_SETTINGS:    settingsStep(); break;
+      case STEP_SENSORS:     if (!cycle.hasReadings()) sensorsStep(); break;
+      case STEP_PUBLISH:     publishStep(); break;
+      case STEP_CAPTURE:     captureStep(); break;
+      case STEP_OTA:         otaStep(); break;
+      case STEP_WATER:       waterStep(); break;
+      case STEP_SLEEP:       sleepStep(); break;
+    }
+    cycle.complete(step);
+    buttons::poll();
+  }
+  sleepNow(settings.getDefaultSleepTime()); // Not reached, the sleep step ends the cycle
 }
 
 void loop() {
@@ -0,0 +1,111 @@
+/*
+Memory telemetry
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+*/
+
+#include "memory_stats.h"
+
+#include <stddef.h>
+
+// Retain the lowest values since power on after sleep
+RTC_DATA_ATTR memoryLowWater memoryLow = {0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0};
+
+memoryMonitor memStats;
+
+// System tasks whose free stack is reported, tasks that are not running are left out
+static const char* const monitoredTasks[] = {"wifi", "tiT", "esp_timer", "sys_evt", "arduino_events"};
+
+#ifdef WATER_THING_SIM
+// Section with all RTC_DATA_ATTR variables in the simulator
+extern "C" char __start_sim_rtc[];
+extern "C" char __stop_sim_rtc[];
+extern "C" char __start_sim_rtc_noinit[];
+extern "C" char __stop_sim_rtc_noinit[];
+
+size_t memoryMonitor::rtcUsed() {
+    return (__stop_sim_rtc - __start_sim_rtc) + (__stop_sim_rtc_noinit - __start_sim_rtc_noinit);
+}
+#else
+// RTC slow memory sections from the linker script of the ESP32
+extern "C" char _rtc_data_start[];
+extern "C" char _rtc_data_end[];
+extern "C" char _rtc_bss_start[];
+extern "C" char _rtc_bss_end[];
+extern "C" char _rtc_noinit_start[];
+extern "C" char _rtc_noinit_end[];
+
+size_t memoryMonitor::rtcUsed() {
+    return (_rtc_data_end - _rtc_data_start) + (_rtc_bss_end - _rtc_bss_start) + (_rtc_noinit_end - _rtc_noinit_start);
+}
+#endif
+
+void memoryMonitor::mark(int phase) {
+    memSnapshot& s = snapshots[phase];
+    s.freeHeap = ESP.getFreeHeap();
+    s.largestBlock = ESP.getMaxAllocHeap();
+    s.freeStack = uxTaskGetStackHighWaterMark(nullptr);
+}
+
+memoryLowWater memoryMonitor::lowest() const {
+    // Lowest values since power on incl. this wake
+    memoryLowWater low = memoryLow;
+    for (int i = 0; i < MEM_PHASES; i++) {
+        const memSnapshot& s = snapshots[i];
+        if (s.freeHeap == 0) {
+            continue; // Phase not reached
+        }
+        if (s.freeHeap < low.freeHeap) low.freeHeap = s.freeHeap;
+        if (s.largestBlock < low.largestBlock) low.largestBlock = s.largestBlock;
+        if (s.freeStack < low.freeStack) low.freeStack = s.freeStack;
+    }
+    return low;
+}
+
+void memoryMonitor::closeWake() {
+    // Update the low water marks, called before deep sleep
+    mark(MEM_SLEEP);
+    memoryLow = lowest();
+    memoryLow.wakes++;
+}
+
+static size_t appendArray(char* buffer, size_t size, size_t len, const char* name, const memSnapshot* snapshots,
+                          size_t offset) {
+    // ,"name":[a,b,...] with one value per phase (not incl. sleep), value at byte offset in memSnapshot
+    len += snprintf(buffer + len, size - len, ",\"%s\":[", name);
+    for (int i = 0; i < MEM_SLEEP && len < size; i++) {
+        uint32_t value = *(const uint32_t*)((const char*)&snapshots[i] + offset);
+        len += snprintf(buffer + len, size - len, i == 0 ? "%lu" : ",%lu", (unsigned long)value);
+    }
+    if (len < size) {
+        len += snprintf(buffer + len, size - len, "]");
+    }
+    return len;
+}
+
+size_t memoryMonitor::toJSON(char* buffer, size_t size) const {
+    size_t len = snprintf(buffer, size, "{\"min_heap\":%lu", (unsigned long)ESP.getMinFreeHeap());
+    if (len < size) len = appendArray(buffer, size, len, "heap", snapshots, offsetof(memSnapshot, freeHeap));
+    if (len < size) len = appendArray(buffer, size, len, "block", snapshots, offsetof(memSnapshot, largestBlock));
+    if (len < size) len = appendArray(buffer, size, len, "stack", snapshots, offsetof(memSnapshot, freeStack));
+
+    if (len < size) len += snprintf(buffer + len, size - len, ",\"tasks\":{");
+    bool first = true;
+    for (const char* name : monitoredTasks) {
+        TaskHandle_t task = xTaskGetHandle(name);
+        if (task == nullptr || len >= size) {
+            continue;
+        }
+        len += snprintf(buffer + len, size - len, first ? "\"%s\":%lu" : ",\"%s\":%lu", name,
+                        (unsigned long)uxTaskGetStackHighWaterMark(task));
+        first = false;
+    }
+
+    memoryLowWater low = lowest();
+    if (len < size) {
+        len += snprintf(buffer + len, size - len,
+                        "},\"rtc\":%lu,\"rtc_size\":%lu,\"low\":{\"heap\":%lu,\"block\":%lu,\"stack\":%lu,\"wakes\":%lu}}",
+                        (unsigned long)rtcUsed(), (unsigned long)rtcSize(), (unsigned long)low.freeHeap,
+                        (unsigned long)low.largestBlock, (unsigned long)low.freeStack, (unsigned long)low.wakes);
+    }
+    return len < size ? len : size - 1;
+}
@@ -0,0 +1,101 @@
+#ifndef MEMORY_STATS_H
+#define MEMORY_STATS_H
+
+/*
+Memory telemetry
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+Records free heap, largest free heap block and the stack high water mark of the running task at each phase of a wake,
+plus the stack high water marks of the system tasks and how much of the RTC slow memory the retained variables use.
+The lowest values seen since power on are kept in RTC memory, so a slow leak or growing fragmentation shows
+across wakes before it ends in a reset.
+
+The record of the current wake is published as json on the memory topic:
+    {"heap":[..],"block":[..],"stack":[..],   per phase: free heap, largest free block, free stack of loopTask, bytes
+     "min_heap":..,                           lowest free heap this wake
+     "tasks":{"wifi":..,"tiT":..,...},        free stack of system tasks, bytes
+     "rtc":..,"rtc_size":..,                  RTC slow memory used by retained variables, size, bytes
+     "low":{"heap":..,"block":..,"stack":..,"wakes":..}} lowest values since power on, wakes recorded
+Phases that have not been reached are 0.
+
+memPhases:
+    MEM_BOOT      Start of setup()
+    MEM_RADIO     WiFi and MQTT connected
+    MEM_SETTINGS  Settings updated via MQTT
+    MEM_SENSORS   Sensors read
+    MEM_PUBLISH   Readings published
+    MEM_SLEEP     Going to sleep (recorded in sleepNow(), only part of the low water marks)
+
+memoryMonitor Class:
+    Purpose:
+        Takes the snapshots and formats the record.
+    Public Methods:
+        mark(int phase): Take a snapshot at a phase boundary.
+        toJSON(char* buffer, size_t size): The record of this wake, returns length.
+        closeWake(): Update the low water marks since power on, called before deep sleep.
+        The low water marks in the record include the current wake.
+        rtcUsed(), rtcSize(): Static, RTC slow memory used by RTC_DATA_ATTR variables and its size, bytes.
+
+Retained Variables (RTC_DATA_ATTR):
+    memoryLow: Lowest free heap, largest block and free stack since power on.
+*/
+
+#include <Arduino.h>
+
+enum memPhases {
+    MEM_BOOT = 0,
+    MEM_RADIO,
+    MEM_SETTINGS,
+    MEM_SENSORS,
+    MEM_PUBLISH,
+    MEM_SLEEP,
+    MEM_PHASES
+};
+
+#define MEM_RTC_SLOW_SIZE 8192 // RTC slow memory of the ESP32, bytes
+
+struct memSnapshot {
+    uint32_t freeHeap;      // bytes
+    uint32_t largestBlock;  // bytes
+    uint32_t freeStack;     // bytes, high water mark of the running task
+};
+
+struct memoryLowWater {
+    uint32_t freeHeap;
+    uint32_t largestBlock;
+    uint32_t freeStack;
+    uint32_t wakes;
+};
+
+extern RTC_DATA_ATTR memoryLowWater memoryLow;
+
+class memoryMonitor {
+    /*
+    Class for recording memory usage at the phases of a wake.
+    */
+private:
+    memSnapshot snapshots[MEM_PHASES];
+
+    memoryLowWater lowest() const;
+
+public:
+    // Constructor
+    memoryMonitor() : snapshots() {}
+
+    void mark(int phase);
+
+    size_t toJSON(char* buffer, size_t size) const;
+
+    void closeWake();
+
+    static size_t rtcUsed();
+
+    static size_t rtcSize() {
+        return MEM_RTC_SLOW_SIZE;
+    }
+};
+
+// Global monitor, marked by main and sleep
+extern memoryMonitor memStats;
+
+#endif
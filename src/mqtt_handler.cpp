@@ -6,4 +6,45 @@ By Christoffer Rappmann, christoffer.rappmann@gmail.com
 #include "mqtt_handler.h"
 #include <Arduino.h>
 
-mqqtSubscriptions mqttSubs;
\ No newline at end of file
+// Subscriptions made in the broker session, kept during deep sleep, a reset subscribes again
+RTC_DATA_ATTR uint32_t mqttSessionKey = 0;
+RTC_DATA_ATTR uint16_t mqttSessionConnects = 0;
+
+void mqttSessionLost() {
+    // Called when the settings reply to "ready" did not arrive
+    if (mqttSessionKey != 0) {
+        LOG_INFO("No settings reply, subscribing again on the next connect");
+        mqttSessionKey = 0;
+    }
+}
+
+static uint32_t fnv(uint32_t hash, const char* text) {
+    // FNV-1a, incl. the terminating null to separate the strings
+    do {
+        hash = (hash ^ (uint8_t)*text) * 16777619u;
+    } while (*text++ != '\0');
+    return hash;
+}
+
+uint32_t mqttHandler::sessionKey() const {
+    // Changes if the broker, the client ID or the topics change, never 0
+    uint32_t hash = fnv(2166136261u, cred.getServer());
+    hash = (hash ^ (uint32_t)cred.getPort()) * 16777619u;
+    hash = fnv(hash, cred.getDeviceName());
+    for (int i = 0; i < cred.getSubSize(); i++){
+        hash = fnv(hash, cred.getSub((subTopic)i));
+    }
+    hash = (hash ^ MQTT_SUB_QOS) * 16777619u;
+    return hash != 0 ? hash : 1;
+}
+
+void mqttHandler::subscribeAll() {
+    bool ok = true;
+    for (int i = 0; i < cred.getSubSize(); i++){
+        LOG_DEBUG("Subscribing to: %s", cred.getSub((subTopic)i));
+        ok = client.subscribe(cred.getSub((subTopic)i), MQTT_SUB_QOS) && ok;
+    }
+    // Remembered only if all went out, otherwise subscribe again next connect
+    mqttSessionKey = ok && MQTT_PERSISTENT_SESSION ? sessionKey() : 0;
+    mqttSessionConnects = 0;
+}
@@ -9,6 +9,7 @@ Contains main class mqttHandler and supporting functions/classes.
 mqttHandler Class for connecting to a MQTT-server and handling
 subscribed topics as well as publishing to a topic 
 on the specific server.
+It is the MQTT backend of the uplink transport (transport.h), the subscriptions are shared by all backends.
 
 mqttHandler: 
     This class handles the connection to the MQTT server and the publishing/subscribing of messages. 
@@ -16,120 +17,94 @@ mqttHandler:
     Key functions include:
         Functions: 
         - mqttInit() for initializing the MQTT client,
-        - reconnect() for reconnecting to the MQTT server if the connection is lost 
+        - reconnect() for reconnecting to the MQTT server if the connection is lost, see Persistent session below 
         - loop() for checking the MQTT connection and handling messages in the main loop, and publish() for publishing messages 
             to a topic.
-        - public(topic, message) Publish mqtt "pubMessage" on topic "pubTopic"
+        - publish(topic, message) Publish mqtt "pubMessage" on topic "pubTopic", numbers are formatted into a stack buffer
+            by the overloads publish(topic, int) and publish(topic, double, decimals) of transport, no String is created.
         
         Static functions:
         - callback() as the callback function for received MQTT messages, This is a static member function of mqttHandler, 
-            acting as the callback for received MQTT messages. It matches the received topic with subscribed topics and calls 
-            the corresponding functions.
-        -addSubscription(), This is a static member function of mqttHandler, providing a way to add subscriptions to the global 
-            mqttSubs instance of mqqtSubscriptions.
-
-
-mqqtSubscriptions: 
-    This class manages a list of subscriptions 
-    (topics and corresponding functions to call when a message is received on that topic). 
-    It provides methods for adding subscriptions (addSub()), getting the number of subscriptions 
-    (getSubscriptionCount()), and retrieving a specific subscription (getSubscription()).
-
-FunctionTopicPair: 
-    This struct represents a pair of a topic and a function pointer. 
-    It is used within mqqtSubscriptions to associate topics with functions.
+            acting as the callback for received MQTT messages. It copies the message and hands it to transport::dispatch()
+            that calls the functions subscribed to the topic.
+
+Persistent session:
+    With MQTT_PERSISTENT_SESSION the device connects with clean session false and its device name as a stable client
+    ID, and subscribes with QoS 1. The broker keeps the subscriptions while the device sleeps and queues QoS 1
+    messages (settings, requests) for it, they are delivered right after the next connect.
+    PubSubClient does not expose the session present flag of the CONNACK, instead the subscriptions made are
+    remembered in RTC memory (mqttSessionKey, a hash of server, client ID and topics) and only made again when that
+    changes, after a reset (RTC memory cleared) or every MQTT_RESUBSCRIBE_CONNECTS connects in case the broker lost
+    the session (restart without persistence, session expiry).
+    A lost session is also noticed sooner: every "ready" is answered with the settings, a wake without the reply
+    clears mqttSessionKey (mqttSessionLost()) and the next connect subscribes again.
+    Messages to the device must be published with QoS 1 to be queued, e.g. mosquitto_pub -q 1. A QoS 0 message is
+    not queued for a sleeping device, and a retained message alone is only sent again on a new subscription.
+
+TLS:
+    With SPEC_MQTT_TLS in device_spec.h the connection goes through tlsClient (tls_client.h) instead of a plain
+    WiFiClient. The TLS session is kept in RTC memory and resumed on the next wake, a full handshake is only made
+    after a reset or when the broker no longer accepts the session.
+
+Bounded reconnect:
+    A connect is tried at most MQTT_CONNECT_ATTEMPTS times, MQTT_RETRY_MS apart, and not after the phase of the wake
+    budget is over (wake_budget.h) or without WiFi. The broker is then unreachable for the rest of the wake, publish()
+    returns false without trying again. The readings of the wake are then kept in the batch (reading_batch.h) and
+sent on the next wake, as are reports and diagnostics that were not sent (main.cpp, publishStep()).
+
+Functions:
+    mqttSessionLost(): The broker may have lost the session, subscribe again on the next connect.
+
+Retained Variables (RTC_DATA_ATTR):
+    mqttSessionKey: Subscriptions made in the broker session, 0 if none.
+    mqttSessionConnects: Connects since the subscriptions were made.
 */
 
 #include <Arduino.h>
 #include "credentials.h"
+#include "energy.h"
+#include "logger.h"
+#include "tls_client.h"
+#include "transport.h"
+#include "wake_budget.h"
+#include "latency_stats.h"
+#include "hardware_functions.h"
 
 // https://github.com/knolleary/pubsubclient
 #include <WiFi.h>
 #include <PubSubClient.h>
 
-// Define the typedef for a function pointer
-typedef void (*FunctionPointer)(String);
+#define MQTT_BUFFER_SIZE 768       // PubSubClient packet buffer, topic + payload of the longest publish (batch, memory)
+#define MQTT_PERSISTENT_SESSION 1  // Keep subscriptions and queued messages in the broker between wakes
+#define MQTT_SUB_QOS 1             // QoS of the subscriptions, 1 for messages to be queued while asleep
+#define MQTT_RESUBSCRIBE_CONNECTS 100 // Subscribe again after this many connects, the broker may have lost the session
+#define MQTT_CONNECT_ATTEMPTS 3    // Connect attempts per wake
+#define MQTT_RETRY_MS 2000         // Wait between the attempts
+#define MQTT_SOCKET_TIMEOUT_S 5    // Wait for a reply from the broker
 
-struct FunctionTopicPair {
-    // Simple structure containing a topic with a corresponding function to call if a message is recieved on that topic
-    // Used in mqqtSubscriptions class
-    String topic;
-    FunctionPointer functPtr;
-};
+extern RTC_DATA_ATTR uint32_t mqttSessionKey;
+extern RTC_DATA_ATTR uint16_t mqttSessionConnects;
 
-class mqqtSubscriptions {
-    /*
-    This class contains a stack with structs of type "FunctionTopicPair", each such pair contains both
-    a topic and a function pointer. 
-
-    public functions for adding a new function-topic-pair to the stack, 
-    a function for returning the number of elements in the stack 
-    as well as function that returns the function-topic-pair for a given location in the stack 
-
-    (the function that is pointed to is to be called when a MQTT message on that topic is recived., this
-     is done by the mqttHandler class)
-    */
-
-    private:
-        // Subscriptions
-        FunctionTopicPair* subscriptions; // Struct with functionpointer and topic for subscribed topics.
-        int subscriptionCount;            // Keep track of the number of subscriptions
-
-    public:
-    
-        //Constructor
-        mqqtSubscriptions():subscriptions(nullptr), subscriptionCount(0)
-        {}
+void mqttSessionLost();
 
-        void addSub(const String& topic, FunctionPointer functPtr) {
-        // Method to add a new subscription to the array
-
-        // Increase the size of the array
-        FunctionTopicPair* newSubscriptions = new FunctionTopicPair[subscriptionCount + 1];
-        // Copy existing subscriptions to the new array
-        for (int i = 0; i < subscriptionCount; ++i) {
-            newSubscriptions[i] = subscriptions[i];
-        }
-        // Add new subscription
-        newSubscriptions[subscriptionCount].topic = topic;
-        newSubscriptions[subscriptionCount].functPtr = functPtr;
-        // Delete the old array
-        delete[] subscriptions;
-        // Update the pointer to the new array
-        subscriptions = newSubscriptions;
-        // Increment subscription count
-        subscriptionCount++;
-        }
-
-        int getSubscriptionCount() {
-            return subscriptionCount;
-        }
-
-        FunctionTopicPair getSubscription(int i){
-            return subscriptions[i];
-        }
-
-};
-
-// Global instance to share subscriptions
-// This is done since it's not possible to pass an instance of an object to
-// the callbackfunction within the mqttHandler class. 
-extern mqqtSubscriptions mqttSubs;
-
-class mqttHandler {
+class mqttHandler : public transport {
     /* Class for connecting to a MQTT-server and handling
     subscribed topics as well as publishing to a topic 
     on the specific server.
     */
 
     private:
-        // Credentials and topics names
-        mqttCredentials cred;
+        // Credentials and topics names, refers to the global (immutable) credentials
+        const mqttCredentials& cred;
 
-        // Clients for MQTT connection
+        // Clients for MQTT connection, the TLS client is used if the credentials ask for TLS
         WiFiClient espClient;
+        tlsClient tlsNet;
         PubSubClient client;
 
+        // The broker could not be reached, no more attempts this wake
+        bool unreachable;
+
         void mqttInit(){
             /*****************
             --- MQTT Init ---
@@ -140,6 +115,8 @@ class mqttHandler {
     
             client.setServer(ipAddress, cred.getPort());
             client.setCallback(callback);
+            client.setBufferSize(MQTT_BUFFER_SIZE); // Default 256 bytes is too small for the json records
+            client.setSocketTimeout(MQTT_SOCKET_TIMEOUT_S); // Default 15 s
 
         }
 
@@ -147,76 +124,68 @@ class mqttHandler {
             /* Function that is passed to client as a callback for when a
             mqtt message has been recieved.
 
-            It prints the topic and message to serial, converts the messsage to a string
-            and then matches it to the correct subscribed topic.
-
-            With each topic a function pointer to a global function is bundeled in a struct
-            called "FunctionTopicPair". This function will then be called if the topic matches.
+            It copies the messsage to a null terminated buffer and then dispatches it to the subscribed functions.
             */
 
-            String messageTopic = String(topic);
-            String messageTemp;
-            
-            Serial.println("Message arrived on topic: " + messageTopic + ". Message: ");
-
-            // Read message
-            for (int i = 0; i < length; i++) {
-                //Serial.print((char)message[i]);
-                messageTemp += (char)message[i];
-            }
-            Serial.println(messageTemp);
+            // Copy message to a null terminated buffer on the stack
+            char messageTemp[MQTT_MAX_MESSAGE + 1];
+            unsigned int n = length < MQTT_MAX_MESSAGE ? length : MQTT_MAX_MESSAGE;
+            memcpy(messageTemp, message, n);
+            messageTemp[n] = '\0';
 
-            // Match topic and call corresponding function
-            for (int j = 0; j < mqttSubs.getSubscriptionCount(); j++){
-                FunctionTopicPair tempPair = mqttSubs.getSubscription(j);
-                if (messageTopic == tempPair.topic){
-                    (*tempPair.functPtr)(messageTemp);
-                }
-            }
+            transport::dispatch(topic, messageTemp);
         }
 
-        void reconnect() {
-            // Function to connect to MQTT-server
-
-            // Loop until we're reconnected
-            while (!client.connected()) {
-                Serial.println("Attempting MQTT connection...");
+        uint32_t sessionKey() const;
+        void subscribeAll();
 
-                // Create client ID
-                String clientId = cred.getDeviceName();
-
-                // Attempt to connect
-                if (client.connect(clientId.c_str(), cred.getUser().c_str(), cred.getPassword().c_str())) {
-                    Serial.println("MTTQ connected");
-                    Serial.print("Server: ");
-                    Serial.println(cred.getServer());
-
-                //subscribe
-                for (int i = 0; i< cred.getSubSize(); i++){
-                    Serial.println("Subscribing to: " + cred.getSub(i));
-                    client.subscribe(cred.getSub(i).c_str());
-                }
+        void reconnect() {
+            // Function to connect to MQTT-server, see Bounded reconnect above
 
+            if (unreachable) {
+                return;
+            }
+            unsigned long start = millis();
+            for (int attempt = 1; !client.connected(); attempt++) {
+                LOG_DEBUG("Attempting MQTT connection...");
+
+                // Attempt to connect, device name is used as client ID
+                if (client.connect(cred.getDeviceName(), cred.getUser(), cred.getPassword(), nullptr, 0, false, nullptr, !MQTT_PERSISTENT_SESSION)) {
+                    LOG_INFO("MQTT connected, server: %s", cred.getServer());
+                    latency.record(LATENCY_MQTT, millis() - start);
+
+                    // Subscribe, unless the broker already has the subscriptions in the session
+                    if (!MQTT_PERSISTENT_SESSION || mqttSessionKey != sessionKey() || mqttSessionConnects >= MQTT_RESUBSCRIBE_CONNECTS){
+                        subscribeAll();
+                    }
+                    else {
+                        mqttSessionConnects++;
+                        LOG_DEBUG("Persistent session, %d connects since subscribing", mqttSessionConnects);
+                    }
+                } else if (attempt >= MQTT_CONNECT_ATTEMPTS || budget.remaining() < MQTT_RETRY_MS || WiFi.status() != WL_CONNECTED) {
+                    LOG_WARN("MQTT connection failed, rc=%d, giving up this wake after %d attempts", client.state(), attempt);
+                    unreachable = true;
+                    latency.record(LATENCY_MQTT, millis() - start);
+                    return;
                 } else {
-                    Serial.print("failed, rc=");
-                    Serial.print(client.state());
-                    Serial.println(" try again in 5 seconds");
-
-                    // Wait 5 seconds before retrying
-                    delay(5000);
+                    LOG_WARN("MQTT connection failed, rc=%d, try again in %d ms", client.state(), MQTT_RETRY_MS);
+                    buttons::wait(MQTT_RETRY_MS);
                 }
-            }         
+            }
         }
 
     public:
         //Constructor
-        mqttHandler(mqttCredentials cred)
-        :cred(cred), client(espClient)
+        mqttHandler(const mqttCredentials& cred)
+        :cred(cred), tlsNet(cred.getCaCert(), cred.getTlsName()),
+         client(cred.getTls() ? (Client&)tlsNet : (Client&)espClient), unreachable(false)
         {
             mqttInit(); 
             }
 
-        void loop(){
+        using transport::publish;
+
+        void loop() override {
             //Check MQTT-server connection and listen for MQTT-messages
             //if (cred.getActive()){
                 if (!client.connected()) {
@@ -226,21 +195,45 @@ class mqttHandler {
             //}
         }
 
-        void publish(String pubTopic, String pubMessage){
+        bool publish(const char* pubTopic, const char* pubMessage, bool retained = false) override {
             // Publish mqtt "pubMessage" on topic "pubTopic"
             if (!client.connected()) {
                     reconnect();
                 }
                 
-            client.publish(pubTopic.c_str(), pubMessage.c_str());
+            unsigned long start = millis();
+            bool sent = client.publish(pubTopic, pubMessage, retained);
+            latency.record(LATENCY_PUBLISH, millis() - start);
+            energy.addTransmit(strlen(pubTopic) + strlen(pubMessage));
+            return sent;
+        }
+
+        bool publishBinary(const char* topic, const uint8_t* header, size_t headerLength, const uint8_t* data, size_t length) override {
+            // Streamed to the client, not through the packet buffer (MQTT_BUFFER_SIZE)
+            if (!client.connected()) {
+                    reconnect();
+                }
+
+            unsigned long start = millis();
+            bool sent = client.beginPublish(topic, headerLength + length, false) &&
+                        client.write(header, headerLength) == headerLength &&
+                        client.write(data, length) == length &&
+                        client.endPublish() == 1;
+            latency.record(LATENCY_PUBLISH, millis() - start);
+            energy.addTransmit(strlen(topic) + headerLength + length);
+            return sent;
+        }
+
+        bool connected() override {
+            return client.connected();
+        }
+
+        bool needsIP() const override {
+            return true;
         }
 
-        static void addSubscription(const String& topic, FunctionPointer functPtr){
-            // Wrapper to be used with MQTTHandler
-            // Function to add a subscription to the glocal mqttSubs instance of
-            // mqttSubscriptions. 
-            
-            mqttSubs.addSub(topic, functPtr);
+        const char* name() const override {
+            return "mqtt";
         }
 };
 
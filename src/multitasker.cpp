@@ -0,0 +1,167 @@
+/*
+Multitasker
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+*/
+
+#include "multitasker.h"
+#include "energy.h"
+
+void taskScheduler::link(int id) {
+    // Put a task first in the slot of its deadline
+    schedTask& t = tasks[id];
+    t.slot = tickOf(t.deadline) & (SCHED_SLOTS - 1);
+    t.prev = -1;
+    t.next = slots[t.slot];
+    if (t.next >= 0) {
+        tasks[t.next].prev = id;
+    }
+    slots[t.slot] = id;
+}
+
+void taskScheduler::unlink(int id) {
+    schedTask& t = tasks[id];
+    if (t.prev >= 0) {
+        tasks[t.prev].next = t.next;
+    }
+    else {
+        slots[t.slot] = t.next;
+    }
+    if (t.next >= 0) {
+        tasks[t.next].prev = t.prev;
+    }
+}
+
+int taskScheduler::add(uint32_t delayMs, uint32_t periodMs, taskFunction fn, void* arg) {
+    int id = 0;
+    while (id < SCHED_MAX_TASKS && tasks[id].fn != nullptr) {
+        id++;
+    }
+    if (id == SCHED_MAX_TASKS || fn == nullptr) {
+        return -1;
+    }
+    schedTask& t = tasks[id];
+    t.fn = fn;
+    t.arg = arg;
+    t.deadline = millis() + delayMs;
+    t.period = periodMs;
+    link(id);
+    taskCount++;
+    return id;
+}
+
+void taskScheduler::cancel(int id) {
+    if (id < 0 || id >= SCHED_MAX_TASKS || tasks[id].fn == nullptr) {
+        return;
+    }
+    unlink(id);
+    tasks[id].fn = nullptr;
+    taskCount--;
+}
+
+void taskScheduler::runTask(int id, uint32_t now) {
+    // Reschedule (or free) the task before it runs, so it can cancel itself or add new tasks
+    schedTask& t = tasks[id];
+    taskFunction fn = t.fn;
+    void* arg = t.arg;
+
+    unlink(id);
+    if (t.period > 0) {
+        t.deadline += t.period;
+        if ((int32_t)(t.deadline - now) <= 0) {
+            t.deadline = now + t.period; // Late, skip the missed runs instead of running them back to back
+        }
+        link(id);
+    }
+    else {
+        t.fn = nullptr;
+        taskCount--;
+    }
+    fn(arg);
+}
+
+int taskScheduler::runDue() {
+    /*
+    Process the slots of the ticks since the last call, incl. the current tick.
+    Tasks in those slots whose deadline has passed are run, the others belong to a later turn of the wheel.
+    */
+    uint32_t now = millis();
+    uint32_t nowTick = tickOf(now);
+    uint32_t ticks = nowTick - lastTick + 1;
+    if (ticks > SCHED_SLOTS) {
+        ticks = SCHED_SLOTS;
+    }
+
+    int ran = 0;
+    for (uint32_t k = 0; k < ticks; k++) {
+        uint8_t slot = (lastTick + k) & (SCHED_SLOTS - 1);
+
+        // Collect first, running a task changes the slot lists
+        int8_t due[SCHED_MAX_TASKS];
+        int dueCount = 0;
+        for (int8_t id = slots[slot]; id >= 0; id = tasks[id].next) {
+            if ((int32_t)(tasks[id].deadline - now) <= 0) {
+                due[dueCount++] = id;
+            }
+        }
+        for (int i = 0; i < dueCount; i++) {
+            schedTask& t = tasks[due[i]];
+            if (t.fn == nullptr || t.slot != slot || (int32_t)(t.deadline - now) > 0) {
+                continue; // Cancelled or replaced by an earlier task
+            }
+            runTask(due[i], now);
+            ran++;
+        }
+    }
+    lastTick = nowTick;
+    return ran;
+}
+
+uint32_t taskScheduler::msToNext() const {
+    uint32_t now = millis();
+    uint32_t next = SCHED_IDLE;
+    for (int id = 0; id < SCHED_MAX_TASKS; id++) {
+        if (tasks[id].fn == nullptr) {
+            continue;
+        }
+        int32_t left = (int32_t)(tasks[id].deadline - now);
+        uint32_t wait = left > 0 ? (uint32_t)left : 0;
+        if (wait < next) {
+            next = wait;
+        }
+    }
+    return next;
+}
+
+void taskScheduler::sleepFor(uint32_t ms) {
+    if (ms == 0) {
+        return;
+    }
+    if (!lightSleep || ms < SCHED_LIGHT_SLEEP_MIN_MS) {
+        delay(ms);
+        return;
+    }
+    // Light sleep keeps RAM, GPIO states and millis(), the CPU is stopped until the timer fires
+    Serial.flush();
+    esp_sleep_enable_timer_wakeup((uint64_t)ms * 1000ULL);
+    energy.start(ENERGY_LIGHT_SLEEP);
+    esp_light_sleep_start();
+    energy.stop(ENERGY_LIGHT_SLEEP);
+}
+
+void taskScheduler::run(uint32_t maxMs) {
+    // Run tasks until stop() is called, no tasks are left or maxMs has passed
+    stopped = false;
+    uint32_t start = millis();
+    while (!stopped && taskCount > 0) {
+        runDue();
+        uint32_t elapsed = millis() - start;
+        if (stopped || taskCount == 0 || elapsed >= maxMs) {
+            break;
+        }
+        uint32_t wait = msToNext();
+        if (wait > maxMs - elapsed) {
+            wait = maxMs - elapsed;
+        }
+        sleepFor(wait);
+    }
+}
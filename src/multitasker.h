@@ -9,6 +9,10 @@ It provides a class multiTasker that is initilized with a run intervall in milli
 In the arduino loop()-function a if statement can be used with the function .isTime() that 
 returns true if the time intervall has been passed, if not it remains false.
 
+For work during a wake that has to be done at intervals (sampling while the valve is open, timeouts) the
+taskScheduler runs periodic and one-shot tasks from one run loop. Instead of polling millis() it computes the
+next deadline and light sleeps (or delays, when the radio is on) until then.
+
 multiTasker Class:
     Purpose: 
         Provides a mechanism for multitasking by checking if a specified time interval has elapsed.
@@ -19,10 +23,30 @@ multiTasker Class:
         multiTasker(unsigned long _interval): Constructor to initialize the multiTasker object with a specified time interval.
         bool isTime(): Checks whether the specified time interval has elapsed since the last check. Returns true if the interval has passed and resets the counting; otherwise, returns false.
 
+taskScheduler Class:
+    Purpose:
+        Cooperative scheduler, tasks are kept in a hashed timer wheel of SCHED_SLOTS slots of SCHED_TICK_MS.
+        A task is linked into the slot of its deadline, deadlines more than one turn ahead wait in the slot for
+        later turns. Adding and cancelling a task is O(1), no memory is allocated.
+    Public Methods:
+        every(uint32_t periodMs, taskFunction fn, void* arg, uint32_t firstMs): Run fn every periodMs, first after firstMs. Returns task id, -1 if full.
+        after(uint32_t delayMs, taskFunction fn, void* arg): Run fn once after delayMs. Returns task id, -1 if full.
+        cancel(int id): Remove a task, ignored if already done.
+        runDue(): Run the tasks that are due, returns the nr of tasks run.
+        msToNext(): ms until the next deadline, SCHED_IDLE if no tasks.
+        run(uint32_t maxMs): Run tasks, sleeping between deadlines, until stop() is called, no tasks are left or maxMs has passed.
+        stop(): Make run() return, can be called from a task.
+        setLightSleep(bool allowed): Light sleep between deadlines, only when the radio is off (default delay()).
 */
 
 #include <Arduino.h>
 
+#define SCHED_SLOTS 32               // Slots in the timer wheel, power of 2
+#define SCHED_TICK_MS 10             // ms per slot, resolution of the deadlines
+#define SCHED_MAX_TASKS 8            // Tasks that can be scheduled at the same time
+#define SCHED_LIGHT_SLEEP_MIN_MS 5   // Shorter waits are done with delay(), light sleep entry/exit costs ~1 ms
+#define SCHED_IDLE 0xFFFFFFFF
+
 class multiTasker {
     /* Multitasking class, checks wether a predetermined (during initilizing a object) time in miliseconds
     has elapsed since last time it returned true. 
@@ -54,4 +78,78 @@ public:
     }
 };
 
+typedef void (*taskFunction)(void* arg);
+
+struct schedTask {
+    taskFunction fn;       // nullptr if free
+    void* arg;
+    uint32_t deadline;     // millis()
+    uint32_t period;       // ms, 0 for one-shot
+    int8_t next;           // Next task in the same slot, -1 last
+    int8_t prev;           // Previous task in the same slot, -1 first
+    uint8_t slot;
+};
+
+class taskScheduler {
+    /*
+    Timer wheel scheduler for the tasks of one wake, not retained during deep sleep.
+    */
+private:
+    schedTask tasks[SCHED_MAX_TASKS];
+    int8_t slots[SCHED_SLOTS];  // First task in each slot, -1 if empty
+    uint32_t lastTick;          // Last tick that has been processed
+    int taskCount;
+    bool stopped;
+    bool lightSleep;
+
+    static uint32_t tickOf(uint32_t ms) {
+        return ms / SCHED_TICK_MS;
+    }
+
+    void link(int id);
+    void unlink(int id);
+    int add(uint32_t delayMs, uint32_t periodMs, taskFunction fn, void* arg);
+    void runTask(int id, uint32_t now);
+    void sleepFor(uint32_t ms);
+
+public:
+    taskScheduler() {
+        for (int i = 0; i < SCHED_MAX_TASKS; i++) {
+            tasks[i].fn = nullptr;
+        }
+        for (int i = 0; i < SCHED_SLOTS; i++) {
+            slots[i] = -1;
+        }
+        lastTick = tickOf(millis());
+        taskCount = 0;
+        stopped = false;
+        lightSleep = false;
+    }
+
+    int every(uint32_t periodMs, taskFunction fn, void* arg = nullptr, uint32_t firstMs = 0) {
+        return add(firstMs, periodMs > 0 ? periodMs : 1, fn, arg);
+    }
+
+    int after(uint32_t delayMs, taskFunction fn, void* arg = nullptr) {
+        return add(delayMs, 0, fn, arg);
+    }
+
+    void cancel(int id);
+    int runDue();
+    uint32_t msToNext() const;
+    void run(uint32_t maxMs);
+
+    void stop() {
+        stopped = true;
+    }
+
+    void setLightSleep(bool allowed) {
+        lightSleep = allowed;
+    }
+
+    int getCount() const {
+        return taskCount;
+    }
+};
+
 #endif
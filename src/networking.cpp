@@ -16,7 +16,9 @@ WiFi Event Handling Functions:
 
 Function to Connect to WiFi (connect_wifi):
   This function attempts to connect to a Wi-Fi network using the provided credentials.
-  Parameters: Takes an instance of the wifiCredentials class (cred) containing Wi-Fi network credentials.
+  Parameters: Takes a reference to the wifiCredentials object (cred) containing Wi-Fi network credentials
+  and the TX power to use (lowered by the duty cycle governor when the battery is low, see battery.h).
+  Waits for the association at most WIFI_TIMEOUT_MS, or until the phase of the wake budget is over (wake_budget.h).
 
 Function to Disconnect WiFi (wifi_disconnect):
   This function disconnects the device from the current Wi-Fi network.
@@ -26,32 +28,29 @@ Function to Disconnect WiFi (wifi_disconnect):
 
 #include <WiFi.h>
 #include "config.h"
+#include "energy.h"
+#include "logger.h"
+#include "wake_budget.h"
+#include "latency_stats.h"
+#include "hardware_functions.h"
 
 // Event Handling
 void WiFiStationConnected(WiFiEvent_t event, WiFiEventInfo_t info){
-  Serial.println("Connected to AP successfully!");
+  LOG_DEBUG("Connected to AP successfully!");
 }
 
 void WiFiGotIP(WiFiEvent_t event, WiFiEventInfo_t info){
-  Serial.println("WiFi connected");
-  Serial.println("\n\nConnected to; " + WiFi.SSID());
-  Serial.println("IP address: ");
-  Serial.println(WiFi.localIP());
+  LOG_DEBUG("Got IP address");
 }
 
 void WiFiStationDisconnected(WiFiEvent_t event, WiFiEventInfo_t info){
-  Serial.println("Disconnected from WiFi access point");
-  Serial.print("WiFi lost connection. Reason: ");
-  Serial.println(info.wifi_sta_disconnected.reason);
-  Serial.println("Trying to Reconnect");
+  LOG_WARN("WiFi lost connection, reason: %d, trying to reconnect", (int)info.wifi_sta_disconnected.reason);
   WiFi.begin(wifi_cred.getSSID(), wifi_cred.getPassword());
 }
 
-void connect_wifi(wifiCredentials cred){
+void connect_wifi(const wifiCredentials& cred, wifi_power_t txPower){
   // Connect to wifi
-  Serial.print("\nTrying to connect to WiFi: ");
-  Serial.print(cred.getSSID());
-  Serial.println("");
+  LOG_DEBUG("Trying to connect to WiFi: %s", cred.getSSID());
   
   // Make sure wifi is disconnected before trying to connect.
   WiFi.disconnect(true);
@@ -63,38 +62,34 @@ void connect_wifi(wifiCredentials cred){
   
   // Wifi-setup
   WiFi.mode(WIFI_STA);
-  WiFi.setTxPower(WIFI_POWER_8_5dBm); // Workaround for getting wifi working on ESP32-C3
-  WiFi.hostname(cred.getDeviceName());
+  energy.start(ENERGY_WIFI_RX);
+  WiFi.setTxPower(txPower); // 8.5 dBm by default, workaround for getting wifi working on ESP32-C3
+  WiFi.setHostname(cred.getDeviceName());
 
-  delay(500);
+  buttons::wait(500);
   // Connect
   WiFi.begin(cred.getSSID(), cred.getPassword());
   
-  int timeout_wifi = 0;
-  while (WiFi.status() != WL_CONNECTED && timeout_wifi < 30) {
-    // Wait for connection and show animation
-    Serial.print(".");
-    timeout_wifi++;
+  unsigned long start = millis();
+  while (WiFi.status() != WL_CONNECTED && millis() - start < WIFI_TIMEOUT_MS && !budget.expired()) {
+    // Wait for connection, presses are acted on meanwhile
+    buttons::wait(WIFI_POLL_MS);
   }
+  latency.record(LATENCY_WIFI, millis() - start);
   if (WiFi.status() == WL_CONNECTED){
     // If succesfully connected
-    Serial.println("WiFi connected");
-    Serial.println("\n\nConnected to: " + String(cred.getSSID()));
-    Serial.println("IP address: ");
-    Serial.println(WiFi.localIP());
-    delay(1000);
+    IPAddress ip = WiFi.localIP();
+    LOG_INFO("WiFi connected to %s in %lu ms, IP address %u.%u.%u.%u", cred.getSSID(), millis() - start, ip[0], ip[1], ip[2], ip[3]);
   }else{
     // If not connected after time-out
-    Serial.println("\n\nFailed to Connect to " + String(cred.getSSID()));
-    delay(5000);
+    LOG_WARN("Failed to connect to %s after %lu ms", cred.getSSID(), millis() - start);
   }
 }
 
 void wifi_disconnect(){
     //Disconnect wifi
-    Serial.print("\nDisconnecting from WiFi: ");
-    Serial.print(WiFi.SSID());
-    Serial.println("");
+    LOG_DEBUG("Disconnecting from WiFi: %s", wifi_cred.getSSID());
     WiFi.disconnect(true);
+    energy.stop(ENERGY_WIFI_RX);
 
 }
\ No newline at end of file
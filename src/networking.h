@@ -9,9 +9,13 @@ a function to connect to a Wi-Fi network, and a function to disconnect from the
 By Christoffer Rappmann, christoffer.rappmann@gmail.com
 */
 
+#include <WiFi.h>
 #include "credentials.h"
 
-void connect_wifi(wifiCredentials cred);
+#define WIFI_TIMEOUT_MS 10000       // Longest wait for the association
+#define WIFI_POLL_MS 50             // Status check while waiting
+
+void connect_wifi(const wifiCredentials& cred, wifi_power_t txPower = WIFI_POWER_8_5dBm);
 void wifi_disconnect();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,483 @@
+/*
+Delta firmware update
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+*/
+
+#include "ota_update.h"
+#include "logger.h"
+#include "hardware_functions.h"
+
+#include <stddef.h>
+
+#ifndef WATER_THING_SIM
+#include <HTTPClient.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <mbedtls/sha256.h>
+#endif
+
+// Survives resets, not only deep sleep
+RTC_NOINIT_ATTR otaJob otaState;
+
+otaUpdater ota(otaState);
+
+// One sector of the new image is assembled here before it is written
+static uint8_t sectorBuffer[OTA_SECTOR];
+
+//***************************
+//***   Flash and source  ***
+//***************************
+
+#ifndef WATER_THING_SIM
+
+static const esp_partition_t* runningPartition = nullptr;
+static const esp_partition_t* updatePartition = nullptr;
+static HTTPClient* http = nullptr;
+static WiFiClient* stream = nullptr;
+static uint32_t streamLeft = 0;     // Bytes left of the requested range
+
+static bool flashOpen(uint32_t baseSize, uint32_t targetSize) {
+    runningPartition = esp_ota_get_running_partition();
+    updatePartition = esp_ota_get_next_update_partition(nullptr);
+    if (runningPartition == nullptr || updatePartition == nullptr) {
+        LOG_ERROR("No OTA partition, check the partition table");
+        return false;
+    }
+    if (baseSize > runningPartition->size || targetSize > updatePartition->size) {
+        LOG_ERROR("Image does not fit, base %lu, new %lu, partition %lu", (unsigned long)baseSize,
+                  (unsigned long)targetSize, (unsigned long)updatePartition->size);
+        return false;
+    }
+    return true;
+}
+
+static bool flashReadBase(uint32_t offset, uint8_t* buffer, size_t length) {
+    return esp_partition_read(runningPartition, offset, buffer, length) == ESP_OK;
+}
+
+static bool flashWriteSector(uint32_t offset, const uint8_t* buffer, size_t length) {
+    // Erase the whole sector, the last sector of the image may be partly used
+    return esp_partition_erase_range(updatePartition, offset, OTA_SECTOR) == ESP_OK &&
+           esp_partition_write(updatePartition, offset, buffer, length) == ESP_OK;
+}
+
+static bool flashSha(bool update, uint32_t size, uint8_t sha[32]) {
+    // SHA-256 of the first size bytes of the running or the update partition, read through the sector buffer
+    const esp_partition_t* partition = update ? updatePartition : runningPartition;
+    mbedtls_sha256_context ctx;
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts(&ctx, 0);
+    bool ok = true;
+    for (uint32_t offset = 0; offset < size && ok; offset += OTA_SECTOR) {
+        size_t length = size - offset < OTA_SECTOR ? size - offset : OTA_SECTOR;
+        ok = esp_partition_read(partition, offset, sectorBuffer, length) == ESP_OK;
+        mbedtls_sha256_update(&ctx, sectorBuffer, length);
+    }
+    mbedtls_sha256_finish(&ctx, sha);
+    mbedtls_sha256_free(&ctx);
+    return ok;
+}
+
+static bool flashActivate() {
+    // Checks the image header and segments before it is marked bootable
+    esp_err_t err = esp_ota_set_boot_partition(updatePartition);
+    if (err != ESP_OK) {
+        LOG_ERROR("Could not set boot partition, err %d", (int)err);
+        return false;
+    }
+    return true;
+}
+
+static bool sourceRead(uint8_t* buffer, size_t length) {
+    // Exactly length bytes or false, at the end of the range or on a timeout
+    if (stream == nullptr || length > streamLeft) {
+        return false;
+    }
+    size_t got = stream->readBytes(buffer, length);
+    streamLeft -= got;
+    if (got < length) {
+        streamLeft = 0; // Timed out, the rest is fetched next wake
+        return false;
+    }
+    return true;
+}
+
+static bool sourceOpen(const char* url, uint32_t from, uint32_t to) {
+    // Request bytes [from, to) of the delta
+    char range[40];
+    snprintf(range, sizeof(range), "bytes=%lu-%lu", (unsigned long)from, (unsigned long)to - 1);
+
+    http = new HTTPClient();
+    http->setConnectTimeout(OTA_TIMEOUT_MS);
+    http->setTimeout(OTA_TIMEOUT_MS);
+    if (!http->begin(url)) {
+        LOG_ERROR("Bad update url: %s", url);
+        return false;
+    }
+    http->addHeader("Range", range);
+    int code = http->GET();
+    if (code != HTTP_CODE_PARTIAL_CONTENT && code != HTTP_CODE_OK) {
+        LOG_WARN("Update download failed, HTTP %d", code);
+        return false;
+    }
+    stream = http->getStreamPtr();
+    streamLeft = to - from;
+
+    if (code == HTTP_CODE_OK && from > 0) {
+        // No range support, the whole delta is sent, skip to the position
+        LOG_DEBUG("Server ignored the range, skipping %lu bytes", (unsigned long)from);
+        streamLeft = from;
+        while (streamLeft > 0) {
+            size_t length = streamLeft < OTA_SECTOR ? streamLeft : OTA_SECTOR;
+            if (!sourceRead(sectorBuffer, length)) {
+                return false;
+            }
+        }
+        streamLeft = to - from;
+    }
+    return true;
+}
+
+static void sourceClose() {
+    if (http != nullptr) {
+        http->end();
+        delete http;
+    }
+    http = nullptr;
+    stream = nullptr;
+    streamLeft = 0;
+}
+
+#else
+
+// The simulator has no flash partitions or HTTP, a requested update fails on the first attempt
+static bool flashOpen(uint32_t, uint32_t) { return false; }
+static bool flashReadBase(uint32_t, uint8_t*, size_t) { return false; }
+static bool flashWriteSector(uint32_t, const uint8_t*, size_t) { return false; }
+static bool flashSha(bool, uint32_t, uint8_t*) { return false; }
+static bool flashActivate() { return false; }
+static bool sourceRead(uint8_t*, size_t) { return false; }
+static bool sourceOpen(const char*, uint32_t, uint32_t) {
+    LOG_WARN("Updates are not simulated");
+    return false;
+}
+static void sourceClose() {}
+
+#endif
+
+static bool readVarint(uint32_t& value, uint32_t& consumed) {
+    // Unsigned LEB128, at most 5 bytes
+    value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        uint8_t byte;
+        if (!sourceRead(&byte, 1)) {
+            return false;
+        }
+        consumed++;
+        value |= (uint32_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint32_t readU32(const uint8_t* bytes) {
+    return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+//***************************
+//***       Updater       ***
+//***************************
+
+uint32_t otaUpdater::checksum(const otaJob& j) {
+    // FNV-1a of all fields before the checksum
+    const uint8_t* bytes = (const uint8_t*)&j;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < offsetof(otaJob, checksum); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+void otaUpdater::save() {
+    job.checksum = checksum(job);
+}
+
+void otaUpdater::begin() {
+    // Garbage after power on
+    if (job.magic != OTA_MAGIC || job.checksum != checksum(job)) {
+        memset(&job, 0, sizeof(job));
+        job.magic = OTA_MAGIC;
+        job.state = OTA_IDLE;
+        save();
+    }
+}
+
+void otaUpdater::request(const char* url) {
+    // The url is retained and arrives every wake, only a new url starts a new job
+    if (url[0] == '\0') {
+        if (job.state != OTA_IDLE) {
+            LOG_INFO("Update request cleared");
+        }
+        memset(&job, 0, sizeof(job));
+        job.magic = OTA_MAGIC;
+        save();
+        return;
+    }
+    if (strlen(url) >= OTA_URL_SIZE) {
+        LOG_ERROR("Update url too long, max %d", OTA_URL_SIZE - 1);
+        return;
+    }
+    if (job.state != OTA_IDLE && strcmp(url, job.url) == 0) {
+        return;
+    }
+    memset(&job, 0, sizeof(job));
+    job.magic = OTA_MAGIC;
+    job.state = OTA_PENDING;
+    strcpy(job.url, url);
+    save();
+    LOG_INFO("Update requested: %s", url);
+}
+
+void otaUpdater::fail(const char* reason) {
+    LOG_ERROR("Update failed: %s", reason);
+    job.state = OTA_FAILED;
+    save();
+}
+
+bool otaUpdater::readHeader() {
+    uint8_t header[OTA_HEADER_SIZE];
+    if (!sourceRead(header, sizeof(header))) {
+        return false;
+    }
+    if (memcmp(header, OTA_DELTA_MAGIC, 4) != 0) {
+        fail("not a delta");
+        return false;
+    }
+    uint32_t deltaSize = readU32(header + 4);
+    uint32_t baseSize = readU32(header + 8);
+    uint32_t targetSize = readU32(header + 12);
+    if (deltaSize <= OTA_HEADER_SIZE || targetSize == 0) {
+        fail("bad header");
+        return false;
+    }
+    if (!flashOpen(baseSize, targetSize)) {
+        fail("no room for the image");
+        return false;
+    }
+
+    // The delta only applies to the image it was made from
+    uint8_t sha[32];
+    if (!flashSha(false, baseSize, sha)) {
+        fail("could not read the running image");
+        return false;
+    }
+    if (memcmp(sha, header + 16, sizeof(sha)) != 0) {
+        if (flashSha(false, targetSize, sha) && memcmp(sha, header + 48, sizeof(sha)) == 0) {
+            LOG_INFO("Update already running");
+            job.state = OTA_DONE;
+            save();
+            return false;
+        }
+        fail("delta is for another image");
+        return false;
+    }
+
+    job.deltaSize = deltaSize;
+    job.baseSize = baseSize;
+    job.targetSize = targetSize;
+    memcpy(job.targetSha, header + 48, sizeof(job.targetSha));
+    memset(&job.at, 0, sizeof(job.at));
+    job.at.deltaPos = OTA_HEADER_SIZE;
+    job.at.op = OTA_OP_NONE;
+    job.state = OTA_DOWNLOADING;
+    save();
+    LOG_INFO("Updating to a %lu byte image with a %lu byte delta", (unsigned long)targetSize, (unsigned long)deltaSize);
+    return true;
+}
+
+bool otaUpdater::apply(uint32_t& sectors) {
+    /*
+    Decode ops into the sector buffer until the downloaded range ends, the image is complete or OTA_MAX_SECTORS have
+    been written. The position is only saved after a sector is written, a partly filled sector is decoded again
+    next wake.
+    */
+    otaPosition pos = job.at;
+    uint32_t fill = 0;
+
+    while (pos.outPos + fill < job.targetSize) {
+        buttons::poll(); // A press during the download
+        if (pos.op == OTA_OP_NONE) {
+            uint8_t code;
+            uint32_t consumed = 1;
+            uint32_t a = 0, b = 0;
+            if (!sourceRead(&code, 1)) {
+                break;
+            }
+            if (code == OTA_OP_COPY) {
+                if (!readVarint(a, consumed) || !readVarint(b, consumed)) {
+                    break;
+                }
+                if (a > job.baseSize || b > job.baseSize - a) {
+                    fail("copy outside the running image");
+                    return false;
+                }
+                pos.copyFrom = a;
+                pos.opRemaining = b;
+            }
+            else if (code == OTA_OP_INSERT || code == OTA_OP_FILL) {
+                if (!readVarint(b, consumed)) {
+                    break;
+                }
+                if (code == OTA_OP_FILL) {
+                    if (!sourceRead(&pos.fill, 1)) {
+                        break;
+                    }
+                    consumed++;
+                }
+                pos.opRemaining = b;
+            }
+            else {
+                fail("unknown op");
+                return false;
+            }
+            if (pos.opRemaining > job.targetSize - (pos.outPos + fill)) {
+                fail("op beyond the end of the image");
+                return false;
+            }
+            pos.op = code;
+            pos.deltaPos += consumed;
+        }
+
+        uint32_t length = OTA_SECTOR - fill;
+        if (pos.opRemaining < length) {
+            length = pos.opRemaining;
+        }
+        if (pos.op == OTA_OP_COPY) {
+            if (!flashReadBase(pos.copyFrom, sectorBuffer + fill, length)) {
+                fail("could not read the running image");
+                return false;
+            }
+            pos.copyFrom += length;
+        }
+        else if (pos.op == OTA_OP_INSERT) {
+            if (!sourceRead(sectorBuffer + fill, length)) {
+                break;
+            }
+            pos.deltaPos += length;
+        }
+        else {
+            memset(sectorBuffer + fill, pos.fill, length);
+        }
+        fill += length;
+        pos.opRemaining -= length;
+        if (pos.opRemaining == 0) {
+            pos.op = OTA_OP_NONE;
+        }
+
+        if (fill == OTA_SECTOR || pos.outPos + fill == job.targetSize) {
+            if (!flushSector(fill)) {
+                return false;
+            }
+            pos.outPos += fill;
+            fill = 0;
+            job.at = pos;
+            save();
+            sectors++;
+            if (sectors >= OTA_MAX_SECTORS) {
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+bool otaUpdater::flushSector(uint32_t length) {
+    if (!flashWriteSector(job.at.outPos, sectorBuffer, length)) {
+        fail("flash write failed");
+        return false;
+    }
+    return true;
+}
+
+bool otaUpdater::finish() {
+    // The whole image is written, check it against the hash in the delta before it is made bootable
+    uint8_t sha[32];
+    if (!flashSha(true, job.targetSize, sha) || memcmp(sha, job.targetSha, sizeof(sha)) != 0) {
+        fail("new image does not match");
+        return false;
+    }
+    if (!flashActivate()) {
+        fail("new image not bootable");
+        return false;
+    }
+    job.state = OTA_DONE;
+    save();
+    LOG_INFO("Update verified, new firmware runs from the next wake");
+    return true;
+}
+
+void otaUpdater::run() {
+    if (!active()) {
+        return;
+    }
+    if (job.busy) {
+        job.failures++;
+        LOG_WARN("Update attempt was interrupted by a reset");
+    }
+    if (job.failures >= OTA_MAX_FAILURES) {
+        fail("too many failed attempts");
+        return;
+    }
+    job.busy = true;
+    save();
+
+    int stateBefore = job.state;
+    uint32_t outBefore = job.at.outPos;
+    uint32_t deltaBefore = job.at.deltaPos;
+    uint32_t from = job.state == OTA_PENDING ? 0 : job.at.deltaPos;
+    uint32_t to = job.state == OTA_PENDING ? OTA_CHUNK : job.deltaSize;
+    if (to - from > OTA_CHUNK) {
+        to = from + OTA_CHUNK;
+    }
+
+    uint32_t sectors = 0;
+    bool ok = from >= to || sourceOpen(job.url, from, to); // Only ops without delta bytes left
+    if (ok && job.state == OTA_PENDING) {
+        ok = readHeader();
+    }
+    if (ok && job.state == OTA_DOWNLOADING) {
+        apply(sectors);
+    }
+    sourceClose();
+
+    if (job.state == OTA_DOWNLOADING && job.at.outPos == job.targetSize) {
+        finish();
+    }
+    else if (job.state == stateBefore && job.at.outPos == outBefore) {
+        job.failures++;
+        LOG_WARN("No update progress, attempt %d of %d", job.failures, OTA_MAX_FAILURES);
+    }
+    job.busy = false;
+    save();
+    LOG_INFO("Update %s, %lu sectors, delta %lu -> %lu of %lu", stateName(job.state), (unsigned long)sectors,
+             (unsigned long)deltaBefore, (unsigned long)job.at.deltaPos, (unsigned long)job.deltaSize);
+}
+
+size_t otaUpdater::statusJSON(char* buffer, size_t size) const {
+    int len = snprintf(buffer, size, "{\"state\":\"%s\",\"delta\":[%lu,%lu],\"image\":[%lu,%lu],\"failures\":%d}",
+                       stateName(job.state), (unsigned long)job.at.deltaPos, (unsigned long)job.deltaSize,
+                       (unsigned long)job.at.outPos, (unsigned long)job.targetSize, job.failures);
+    return len < 0 ? 0 : ((size_t)len < size ? (size_t)len : size - 1);
+}
+
+const char* otaUpdater::stateName(int state) {
+    static const char* names[] = {"idle", "pending", "downloading", "done", "failed"};
+    return state >= OTA_IDLE && state <= OTA_FAILED ? names[state] : "unknown";
+}
+
+void otaRequestMQTT(const char* message) {
+    // Called when a message arrives on the ota topic, the message is the url of the delta, empty to cancel
+    ota.request(message);
+}
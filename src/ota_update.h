@@ -0,0 +1,142 @@
+#ifndef OTA_UPDATE_H
+#define OTA_UPDATE_H
+
+/*
+Delta firmware update
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+A new firmware is fetched as a binary delta against the running image from a local HTTP server, a few KB per
+wake, and written to the next OTA partition. When the whole image is written it is verified and the boot
+partition is switched, the new firmware runs from the next wake.
+
+An update is started by publishing the URL of the delta retained with QoS 1 on the ota topic (water_thing/ota,
+mosquitto_pub -q 1 -r). Deltas are made with tools/make_delta.py from the firmware.bin that is running and the new one.
+
+Delta format (little endian), see tools/make_delta.py:
+    Header, OTA_HEADER_SIZE bytes:
+        "WTD1", delta size (incl. header), base image size, new image size, SHA-256 of base image, SHA-256 of new image
+    Ops until the new image is complete:
+        0x01 COPY   offset, length (varints)  Copy from the running image
+        0x02 INSERT length (varint), bytes    New bytes
+        0x03 FILL   length (varint), byte     Repeated byte (padding)
+    Varints are unsigned LEB128.
+
+The delta is not compressed with a general compressor, the decompressor state (dictionary) would not fit in RTC
+memory between wakes. Unchanged code and data become COPY ops of a few bytes each, which is what makes it small.
+
+Each wake with radio (and enough charge) downloads at most OTA_CHUNK bytes of the delta with a HTTP range request
+and writes at most OTA_MAX_SECTORS flash sectors. The new image is written a whole sector at a time, after each
+sector the decoder position is saved in RTC_NOINIT_ATTR memory (survives resets, validated with a checksum). A
+download that is interrupted continues from the last written sector, what was downloaded after it is fetched again.
+Servers without range support (python -m http.server) work too, the bytes before the position are skipped.
+
+otaUpdater Class:
+    Purpose:
+        Keeps the update job and runs one wake's part of it.
+    Public Methods:
+        begin(): Validate the job after boot, called once in setup().
+        request(const char* url): Start an update from the delta at url, ignored if it is the current job.
+        active(): An update is in progress.
+        run(): Download and apply the next chunk, verify and switch partition when complete. Radio must be up.
+        statusJSON(char* buffer, size_t size): State and progress, json. Returns length.
+        stateName(int state): Static, name of a state.
+
+Functions:
+    otaRequestMQTT(const char* message): Called when a message arrives on the ota topic, the message is the url.
+
+Retained Variables (RTC_NOINIT_ATTR):
+    otaState: The update job.
+*/
+
+#include <Arduino.h>
+
+#define OTA_URL_SIZE 96            // Longest url of a delta
+#define OTA_CHUNK 16384            // Bytes of delta downloaded per wake
+#define OTA_SECTOR 4096            // Flash sector, unit of erase and write
+#define OTA_MAX_SECTORS 32         // Sectors written per wake, ~50 ms erase + write each
+#define OTA_MAX_FAILURES 5         // Failed or interrupted attempts before the job is dropped
+#define OTA_MIN_SOC 30             // %, no flash writes on a low battery
+#define OTA_TIMEOUT_MS 5000        // HTTP connect and read timeout
+#define OTA_HEADER_SIZE 80
+#define OTA_DELTA_MAGIC "WTD1"
+#define OTA_MAGIC 0x4F544155       // "OTAU"
+
+enum otaStates {
+    OTA_IDLE = 0,       // No update
+    OTA_PENDING,        // Url received, header not read yet
+    OTA_DOWNLOADING,    // Writing the new image
+    OTA_DONE,           // New image verified, boots from the next wake
+    OTA_FAILED          // Given up, see the log
+};
+
+enum otaOps {
+    OTA_OP_NONE = 0,
+    OTA_OP_COPY,
+    OTA_OP_INSERT,
+    OTA_OP_FILL
+};
+
+struct otaPosition {
+    // Decoder position, saved when a sector has been written
+    uint32_t deltaPos;       // Bytes of the delta consumed
+    uint32_t outPos;         // Bytes of the new image written, whole sectors until the end
+    uint32_t opRemaining;    // Bytes left of the op in progress
+    uint32_t copyFrom;       // COPY: next offset in the running image
+    uint8_t op;              // Op in progress, OTA_OP_NONE between ops
+    uint8_t fill;            // FILL: the byte
+};
+
+struct otaJob {
+    uint32_t magic;          // OTA_MAGIC when valid
+    uint8_t state;
+    uint8_t failures;        // Failed attempts of this job
+    bool busy;               // An attempt is in progress, still set after a reset
+    char url[OTA_URL_SIZE];
+    uint32_t deltaSize;
+    uint32_t baseSize;
+    uint32_t targetSize;
+    uint8_t targetSha[32];
+    otaPosition at;
+    uint32_t checksum;       // Of the fields above
+};
+
+extern RTC_NOINIT_ATTR otaJob otaState;
+
+class otaUpdater {
+    /*
+    Class for the delta update job, the job is kept in RTC memory and survives resets.
+    */
+private:
+    otaJob& job;
+
+    static uint32_t checksum(const otaJob& j);
+    void save();
+    void fail(const char* reason);
+    bool readHeader();
+    bool apply(uint32_t& sectors);
+    bool flushSector(uint32_t length);
+    bool finish();
+
+public:
+    // Constructor
+    otaUpdater(otaJob& state) : job(state) {}
+
+    void begin();
+    void request(const char* url);
+
+    bool active() const {
+        return job.state == OTA_PENDING || job.state == OTA_DOWNLOADING;
+    }
+
+    void run();
+    size_t statusJSON(char* buffer, size_t size) const;
+
+    static const char* stateName(int state);
+};
+
+// Global updater
+extern otaUpdater ota;
+
+void otaRequestMQTT(const char* message);
+
+#endif
@@ -0,0 +1,10 @@
+/*
+Reading batch
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+*/
+
+#include "reading_batch.h"
+
+// Retain readings after sleep
+RTC_DATA_ATTR batchedReading batchReadings[BATCH_SIZE];
+RTC_DATA_ATTR int batchCount = 0;
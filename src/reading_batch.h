@@ -0,0 +1,84 @@
+#ifndef READING_BATCH_H
+#define READING_BATCH_H
+
+/*
+Reading batch
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+When the battery is low the radio is only used every n:th wake (see dutyGovernor in battery.h).
+Readings from the wakes in between are kept in RTC memory and published together as one
+json array the next time the radio is up.
+
+readingBatch Class:
+    Purpose:
+        Stores sensor readings in a fixed size buffer in RTC memory, the oldest reading is dropped when full.
+    Public Methods:
+        add(time_t time, double level, double pressure, double battery): Add a reading.
+        toJSON(char* buffer, size_t size): Format all readings as a json array into buffer, returns length.
+        clear(): Remove all readings, call when published.
+        getCount(): Nr of stored readings.
+
+Retained Variables (RTC_DATA_ATTR):
+    batchReadings, batchCount: The stored readings.
+*/
+
+#include <Arduino.h>
+#include <time.h>
+
+#define BATCH_SIZE 8 // Max nr of readings kept between radio wakes
+
+struct batchedReading {
+    // One reading, stored compact to save RTC memory
+    uint32_t time;        // Unix time
+    int16_t level;        // cm
+    int16_t pressure;     // mbar(e)
+    uint16_t battery;     // mV
+};
+
+extern RTC_DATA_ATTR batchedReading batchReadings[BATCH_SIZE];
+extern RTC_DATA_ATTR int batchCount;
+
+class readingBatch {
+    /*
+    Class for storing readings between radio wakes in RTC memory.
+    */
+public:
+    void add(time_t time, double level, double pressure, double battery) {
+        // Drop oldest when full
+        if (batchCount == BATCH_SIZE) {
+            for (int i = 1; i < BATCH_SIZE; i++) {
+                batchReadings[i - 1] = batchReadings[i];
+            }
+            batchCount--;
+        }
+        batchedReading& r = batchReadings[batchCount++];
+        r.time = (uint32_t)time;
+        r.level = (int16_t)(level * 100.0);
+        r.pressure = (int16_t)(pressure * 1000.0);
+        r.battery = (uint16_t)(battery * 1000.0);
+    }
+
+    size_t toJSON(char* buffer, size_t size) const {
+        // [{"t":..,"lvl":..,"p":..,"bat":..},...], levels in m, pressure in bar(e), battery in V
+        size_t len = snprintf(buffer, size, "[");
+        for (int i = 0; i < batchCount && len < size; i++) {
+            const batchedReading& r = batchReadings[i];
+            len += snprintf(buffer + len, size - len, "%s{\"t\":%lu,\"lvl\":%.2f,\"p\":%.3f,\"bat\":%.2f}",
+                            i > 0 ? "," : "", (unsigned long)r.time, r.level / 100.0, r.pressure / 1000.0, r.battery / 1000.0);
+        }
+        if (len < size) {
+            len += snprintf(buffer + len, size - len, "]");
+        }
+        return len < size ? len : size - 1;
+    }
+
+    void clear() {
+        batchCount = 0;
+    }
+
+    int getCount() const {
+        return batchCount;
+    }
+};
+
+#endif
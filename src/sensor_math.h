@@ -0,0 +1,160 @@
+#ifndef SENSOR_MATH_H
+#define SENSOR_MATH_H
+
+/*
+Sensor conversions
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+Conversion of ADC codes into pressure, tank level and battery voltage, used by sensors (hardware_functions.h).
+
+The chain ADC code -> voltage at the pin -> sensor voltage (divider) -> pressure -> tank level is affine in the ADC
+code: the ADC correction as calibrated is x0 + (x1 + x2^2 + x3^3) * adc, the dividers and the pressure sensor are
+linear. Each conversion is therefore folded at compile time into an offset and a slope per ADC code, in fixed point
+with SENSOR_Q fractional bits. A conversion is one 32x32 -> 64 bit integer multiply, an add and a shift. The ESP32
+FPU is single precision only, the double arithmetic it replaces was done in software calls.
+
+Results are integers in micro units (ubar(e), uV, um water column), fine enough not to round away the resolution of
+an averaged reading (one ADC code is about 590 ubar). Averaged readings are converted from the sum of the ADC codes
+with one 64 bit division, no rounding of the mean.
+
+The double conversions are kept as reference (reference*()), the fixed point conversions are checked against them
+for every ADC code at compile time (static_assert at the end), a change of a constant that breaks the fixed point
+range or precision fails the build.
+
+Functions:
+    adcToMicrobar(int32_t adcSum, int n): Pressure of the mean of n ADC codes, ubar(e).
+    adcToMicrovolt(int32_t adcSum, int n): Battery voltage of the mean of n ADC codes, uV.
+    microbarToMicrometre(int32_t ubar): Tank level of a pressure, um water column.
+    referencePressure(adc), referenceBattery(adc), referenceLevel(bar): Double reference, bar(e) / V / m.
+*/
+
+#include <stdint.h>
+
+namespace sensorMath {
+
+// ADC correction, https://randomnerdtutorials.com/esp32-adc-analog-read-arduino-ide/
+// [ 1.75101646e-01  7.25018385e-04  8.88075249e-08 -2.20849715e-11], applied as x0 + (x1 + x2^2 + x3^3) * adc
+constexpr double ADC_X0 = 0.175101646;
+constexpr double ADC_X1 = 0.000725018385;
+constexpr double ADC_X2 = 0.0000000888075249;
+constexpr double ADC_X3 = 0.0000000000220849715;
+constexpr int ADC_MAX = 4095;
+
+// Voltage dividers, ohm
+constexpr double R6 = 67.3 * 1000;     // Pressure sensor
+constexpr double R7 = 117.3 * 1000;
+constexpr double R1 = 100.0 * 1000;    // Battery
+constexpr double R2 = 30.0 * 1000;
+
+// Pressure sensor outputs 0.5 V (0 psig) - 4.5 V (30 psig), linear, supply 5 V
+constexpr double SENSOR_U_LOW = 0.5;
+constexpr double SENSOR_U_HIGH = 4.5;
+constexpr double SENSOR_P_LOW = 0.0;       // bar(e)
+constexpr double SENSOR_P_HIGH = 2.068;    // bar(e)
+
+constexpr double WATER_DENSITY = 998.0;    // kg/m3
+constexpr double GRAVITY = 9.82;           // m/s2
+
+constexpr int SENSOR_Q = 16;               // Fractional bits of the ADC coefficients
+constexpr int LEVEL_Q = 24;                // Fractional bits of the level coefficient, it multiplies a larger number
+
+//***************************
+//***  Double reference   ***
+//***************************
+
+constexpr double referenceVoltage(double adc) {
+    // Voltage at the pin, V
+    return ADC_X0 + ADC_X1 * adc + ADC_X2 * ADC_X2 * adc + ADC_X3 * ADC_X3 * ADC_X3 * adc;
+}
+
+constexpr double referencePressure(double adc) {
+    // Pressure, bar(e)
+    double k = (SENSOR_P_HIGH - SENSOR_P_LOW) / (SENSOR_U_HIGH - SENSOR_U_LOW);
+    double m = SENSOR_P_LOW - SENSOR_U_LOW * k;
+    return k * ((R6 + R7) / R7 * referenceVoltage(adc)) + m;
+}
+
+constexpr double referenceBattery(double adc) {
+    // Battery voltage before the divider, V
+    return (R1 + R2) / R2 * referenceVoltage(adc);
+}
+
+constexpr double referenceLevel(double bar) {
+    // Water column, m
+    return bar / WATER_DENSITY / GRAVITY * 1e5;
+}
+
+//***************************
+//***     Fixed point     ***
+//***************************
+
+struct fixedAffine {
+    int64_t offset;    // Output at ADC code 0, << SENSOR_Q
+    int32_t slope;     // Output per ADC code, << SENSOR_Q
+};
+
+constexpr int64_t toFixed(double value, int bits = SENSOR_Q) {
+    return (int64_t)(value * ((int64_t)1 << bits) + (value < 0 ? -0.5 : 0.5));
+}
+
+constexpr fixedAffine fold(double (*reference)(double), double scale) {
+    // Offset and slope of an affine reference, output in reference units * scale
+    return fixedAffine{toFixed(reference(0) * scale), (int32_t)toFixed((reference(ADC_MAX) - reference(0)) / ADC_MAX * scale)};
+}
+
+constexpr fixedAffine PRESSURE = fold(referencePressure, 1e6);   // ubar(e)
+constexpr fixedAffine BATTERY = fold(referenceBattery, 1e6);     // uV
+constexpr int32_t LEVEL_PER_UBAR = (int32_t)toFixed(referenceLevel(1.0), LEVEL_Q); // um per ubar, equal to m per bar
+
+constexpr int32_t apply(fixedAffine f, int32_t adcSum, int n) {
+    // Single code: multiply, add and shift. Mean of n codes: rounded division of the sum, the sign is kept apart as
+    // division rounds towards zero.
+    int64_t value = (int64_t)f.slope * adcSum + f.offset * n;
+    if (n == 1) {
+        return (int32_t)((value + ((int64_t)1 << (SENSOR_Q - 1))) >> SENSOR_Q);
+    }
+    int64_t divisor = (int64_t)n << SENSOR_Q;
+    return (int32_t)(value >= 0 ? (value + divisor / 2) / divisor : -((-value + divisor / 2) / divisor));
+}
+
+constexpr int32_t adcToMicrobar(int32_t adcSum, int n = 1) {
+    return apply(PRESSURE, adcSum, n);
+}
+
+constexpr int32_t adcToMicrovolt(int32_t adcSum, int n = 1) {
+    return apply(BATTERY, adcSum, n);
+}
+
+constexpr int32_t microbarToMicrometre(int32_t ubar) {
+    return (int32_t)(((int64_t)ubar * LEVEL_PER_UBAR + (1 << (LEVEL_Q - 1))) >> LEVEL_Q);
+}
+
+//***************************
+//***     Validation      ***
+//***************************
+
+constexpr double distance(double a, double b) {
+    return a > b ? a - b : b - a;
+}
+
+constexpr bool matchesReference() {
+    // Every ADC code, single and mean of 5 with a fraction: within 1 unit (rounding to a unit plus coefficient
+    // rounding). The level of a rounded pressure is within half a ubar of water column (5.1 um) plus rounding.
+    for (int adc = 0; adc <= ADC_MAX; adc++) {
+        double bar = referencePressure(adc);
+        double mean = adc + (adc % 5) / 5.0;
+        if (distance(adcToMicrobar(adc), bar * 1e6) > 1.0 ||
+            distance(adcToMicrobar(adc * 5 + adc % 5, 5), referencePressure(mean) * 1e6) > 1.0 ||
+            distance(adcToMicrovolt(adc), referenceBattery(adc) * 1e6) > 1.0 ||
+            distance(microbarToMicrometre(adcToMicrobar(adc)), referenceLevel(bar) * 1e6) > 6.0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(matchesReference(), "fixed point sensor conversion differs from the double reference");
+
+}
+
+#endif
@@ -17,8 +17,14 @@
     Purpose: Initiates the deep sleep mode for the specified duration.
     Parameters:
       sToSleep: The duration in seconds for the ESP32 to remain in deep sleep.
+      endCycle: false when the wake is cut (wake_budget.h), the wake cycle is resumed at the next wake.
     Functionality: Enables the wake-up timer and external wake-up buttons, prints a message indicating the sleep duration, and initiates the deep sleep mode.
   
+  sleepCut(int sToSleep):
+    Purpose: Deep sleep from the esp_timer task when the wake is cut (wake_budget.h).
+    Functionality: Only the wake-up sources are set, nothing is accounted or logged: the setup() task may be blocked
+      in the middle of it. The wake cycle is resumed at the next wake.
+
   print_wakeup_reason():
     Purpose: Prints the reason for the ESP32 waking up from sleep.
     Parameters: None.
@@ -26,7 +32,7 @@
 
   Retained Variables (RTC_DATA_ATTR):
     bootCount: Stores the number of times the ESP32 has booted.
-    lastWaterDay: Stores the day of the last watering action.
+    lastWaterDay: Stores the day of the last watering action, local epoch day.
 */
 
 // Sleep
@@ -34,6 +40,11 @@
 
 #include <Arduino.h>
 #include "sleep.h"
+#include "energy.h"
+#include "memory_stats.h"
+#include "logger.h"
+#include "wake_cycle.h"
+#include "latency_stats.h"
 
 #define uS_TO_S_FACTOR 1000000ULL  /* Conversion factor for micro seconds to seconds */
 #define TIME_TO_SLEEP  60
@@ -44,7 +55,7 @@
 
 //retain variables after sleep
 RTC_DATA_ATTR int bootCount = 0;
-RTC_DATA_ATTR int lastWaterDay = 40; // day of last watering, set to a date that does not exist
+RTC_DATA_ATTR int32_t lastWaterDay = -1; // local epoch day of last watering (see time_keeping.h), none yet
 
 
 void sleepSetup(){
@@ -53,14 +64,16 @@ void sleepSetup(){
 
     ++bootCount;
 
-    Serial.println("\nBoot number: " + String(bootCount));
+    LOG_INFO("Boot number: %d", bootCount);
+
+    energy.openWake(); // The sleep that ended, it may have been cut short
 
     // Why did it wake?
     print_wakeup_reason();
 
 }
 
-void sleepNow(int sToSleep){
+void sleepNow(int sToSleep, bool endCycle){
     // Start deep sleep
     
     // Define wake up timer (sleep time) and wakeup buttons 
@@ -68,8 +81,23 @@ void sleepNow(int sToSleep){
     esp_sleep_enable_timer_wakeup(sToSleep * uS_TO_S_FACTOR);
     esp_sleep_enable_ext1_wakeup(BUTTON_PIN_BITMASK,ESP_EXT1_WAKEUP_ANY_HIGH);
 
+    // Account for the energy used this wake and during the sleep
+    latency.closeWake();
+    energy.closeWake(sToSleep);
+    memStats.closeWake();
+    if (endCycle) {
+        cycle.end();
+    }
+
+    LOG_INFO("Going to sleep for %d s", sToSleep);
     Serial.flush();
-    Serial.println("\nGoing to sleep for " + String(sToSleep ) + " s");
+    esp_deep_sleep_start();
+}
+
+void sleepCut(int sToSleep){
+    // Wake budget, called from the esp_timer task. RTC memory and registers only
+    esp_sleep_enable_timer_wakeup(sToSleep * uS_TO_S_FACTOR);
+    esp_sleep_enable_ext1_wakeup(BUTTON_PIN_BITMASK,ESP_EXT1_WAKEUP_ANY_HIGH);
     esp_deep_sleep_start();
 }
 
@@ -88,11 +116,11 @@ void print_wakeup_reason(){
 
   switch(wakeup_reason)
   {
-    case ESP_SLEEP_WAKEUP_EXT0 :        Serial.println("Wakeup caused by external signal using RTC_IO"); break;
-    case ESP_SLEEP_WAKEUP_EXT1 :        Serial.println("Wakeup caused by external signal using RTC_CNTL"); break;
-    case ESP_SLEEP_WAKEUP_TIMER :       Serial.println("Wakeup caused by timer"); break;
-    case ESP_SLEEP_WAKEUP_TOUCHPAD :    Serial.println("Wakeup caused by touchpad"); break;
-    case ESP_SLEEP_WAKEUP_ULP :         Serial.println("Wakeup caused by ULP program"); break;
-    default :                           Serial.printf("Wakeup was not caused by deep sleep: %d\n",wakeup_reason); break;
+    case ESP_SLEEP_WAKEUP_EXT0 :        LOG_INFO("Wakeup caused by external signal using RTC_IO"); break;
+    case ESP_SLEEP_WAKEUP_EXT1 :        LOG_INFO("Wakeup caused by external signal using RTC_CNTL"); break;
+    case ESP_SLEEP_WAKEUP_TIMER :       LOG_DEBUG("Wakeup caused by timer"); break;
+    case ESP_SLEEP_WAKEUP_TOUCHPAD :    LOG_INFO("Wakeup caused by touchpad"); break;
+    case ESP_SLEEP_WAKEUP_ULP :         LOG_INFO("Wakeup caused by ULP program"); break;
+    default :                           LOG_INFO("Wakeup was not caused by deep sleep: %d", (int)wakeup_reason); break;
   }
 }
@@ -8,10 +8,11 @@ By Christoffer Rappmann, christoffer.rappmann@gmail.com
 */
 
 void sleepSetup();
-void sleepNow(int sToSleep);
+void sleepNow(int sToSleep, bool endCycle = true);
+void sleepCut(int sToSleep);
 void print_wakeup_reason();
 
-extern RTC_DATA_ATTR int lastWaterDay;
+extern RTC_DATA_ATTR int32_t lastWaterDay;
 extern RTC_DATA_ATTR int bootCount;
 
 #endif
\ No newline at end of file
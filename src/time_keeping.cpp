@@ -1,4 +1,3 @@
-
 #include "time_keeping.h"
 
 /*********************************
@@ -8,16 +7,95 @@
 #include <time.h>
 #include <Arduino.h>
 
+// DST transitions of the current year, computed once per year
+RTC_DATA_ATTR dstTable dstTransitions = {};
+
 void timeSetup(){
     //***************************
-    //---  Set up NTP Servers --- 
+    //---  Set up NTP Servers ---
     //***************************
-    
+
     // Configure NTP servers
     configTime(0, 0, "se.pool.ntp.org", "time.google.com");
 
-    // Set timezone to UTC+1 with DST
-    setenv("TZ", "CET-1CEST-2,M3.5.0/02:00:00,M10.5.0/03:00:00", 1);
+    // Set timezone to UTC+1 with DST, only used when formatting times (see utcOffset())
+    setenv("TZ", TZ_STRING, 1);
     tzset();
 
-}
\ No newline at end of file
+}
+
+bool timeValid(){
+    return time(nullptr) >= TIME_VALID_AFTER;
+}
+
+static int32_t floorDiv(int64_t a, int32_t b) {
+    // Division rounding towards minus infinity, times before 1970 are negative
+    return (int32_t)(a >= 0 ? a / b : -((-a + b - 1) / b));
+}
+
+static int32_t daysFromCivil(int32_t year, int month, int day) {
+    // Days since 1970-01-01 of a date in the proleptic Gregorian calendar
+    year -= month <= 2;
+    int32_t era = (year >= 0 ? year : year - 399) / 400;
+    int32_t yoe = year - era * 400;
+    int32_t doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+static int32_t yearFromDays(int32_t days) {
+    // Year of a day since 1970-01-01
+    days += 719468;
+    int32_t era = (days >= 0 ? days : days - 146096) / 146097;
+    int32_t doe = days - era * 146097;
+    int32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int32_t mp = (5 * doy + 2) / 153;
+    return yoe + era * 400 + (mp >= 10);
+}
+
+static int32_t lastSunday(int32_t year, int month) {
+    // Day since 1970-01-01 of the last Sunday of a month (1970-01-01 was a Thursday)
+    int32_t last = daysFromCivil(year + (month == 12), month == 12 ? 1 : month + 1, 1) - 1;
+    int32_t weekday = (last % 7 + 7 + 4) % 7; // 0 = Sunday
+    return last - weekday;
+}
+
+static void updateTransitions(time_t t) {
+    // Compute the transitions of the year t is in, only when a new year has started
+    if (t >= dstTransitions.yearStart && t < dstTransitions.yearEnd) {
+        return;
+    }
+    int32_t year = yearFromDays(floorDiv(t, 86400));
+    dstTransitions.yearStart = (time_t)daysFromCivil(year, 1, 1) * 86400;
+    dstTransitions.yearEnd = (time_t)daysFromCivil(year + 1, 1, 1) * 86400;
+    dstTransitions.dstStart = (time_t)lastSunday(year, TZ_DST_START_MONTH) * 86400 + TZ_DST_CHANGE_UTC;
+    dstTransitions.dstEnd = (time_t)lastSunday(year, TZ_DST_END_MONTH) * 86400 + TZ_DST_CHANGE_UTC;
+}
+
+int32_t utcOffset(time_t t){
+    // Offset from UTC in seconds at a point in time
+    updateTransitions(t);
+    if (t >= dstTransitions.dstStart && t < dstTransitions.dstEnd) {
+        return TZ_DST_OFFSET;
+    }
+    return TZ_STD_OFFSET;
+}
+
+int32_t epochDay(time_t t){
+    // Local day number, days since 1970-01-01 local time
+    return floorDiv((int64_t)t + utcOffset(t), 86400);
+}
+
+time_t localToEpoch(int32_t day, int hour, int minute){
+    /*
+    UTC epoch seconds of hour:minute local time on a local epoch day.
+    A time that occurs twice (DST end) is the first occurrence,
+    a time that does not exist (skipped at DST start) ends up one hour later.
+    */
+    time_t local = (time_t)day * 86400 + hour * 3600 + minute * 60;
+    if (utcOffset(local - TZ_DST_OFFSET) == TZ_DST_OFFSET) {
+        return local - TZ_DST_OFFSET;
+    }
+    return local - TZ_STD_OFFSET;
+}
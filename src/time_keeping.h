@@ -8,22 +8,33 @@ By Christoffer Rappmann, christoffer.rappmann@gmail.com
 
 Contains classes and functions for time management, including setting up time via NTP, managing target times, and calculating time differences.
 
+All targets are kept as UTC epoch seconds and days as local epoch day numbers (days since 1970-01-01 local time),
+so comparing days works across month and year boundaries.
+The daylight saving time transitions of the current year are computed once from the time zone rule below
+and cached in RTC memory, converting between UTC and local time is then a couple of integer operations per wake
+(mktime() and the POSIX TZ parsing behind it are not used).
+
 timeKeeper:
-    This class provides functionality for managing target times and calculating time differences. 
-    It allows users to specify a target time during initialization and provides methods to determine the time until the target time, increment the target time by a specified number of days, and retrieve the target time as a string. 
+    This class provides functionality for managing target times and calculating time differences.
+    It allows users to specify a target time during initialization and provides methods to determine the time until the target time, increment the target time by a specified number of days, and retrieve the target time as a string.
 
     Key functions include:
         - timeUntil() calculates the time until the target time.
-        - incrementDays() adds a specified number of days to the target time.
-        - timeString() returns the target time as a formatted string.
+        - incrementDays() adds a specified number of days to the target time, keeping the local time of day across DST changes.
+        - timeString(char* buffer, size_t size) formats the target time into buffer, returns the length.
+        - getDay() returns the local epoch day of the target time.
 
 Functionality includes handling time zones, daylight saving time adjustments, and automatic adjustment of incomplete target time specifications.
 
 Functions:
     - timeSetup() initializes NTP servers and sets up the time zone for the device.
+    - timeValid() the clock has been set (NTP or kept from before the sleep), not counting from 1970.
+    - utcOffset(time_t t) returns the offset from UTC in seconds at a point in time, incl. DST.
+    - epochDay(time_t t) returns the local epoch day of a point in time.
+    - localToEpoch(int32_t day, int hour, int minute) returns the UTC epoch seconds of a local time on a local epoch day.
 
 Structures:
-    - tm: Represents a date and time broken down into its components (year, month, day, hour, minute, second). Used for specifying target times.
+    - dstTable: DST transitions of one year, kept in RTC memory.
 
 Usage:
     1. Initialize the time setup using timeSetup() to configure NTP servers and time zone.
@@ -35,35 +46,57 @@ Usage:
 #include <time.h>
 #include <Arduino.h>
 
+// Time zone, CET/CEST (EU rule: DST from the last Sunday in March to the last Sunday in October, 01:00 UTC)
+#define TZ_STRING "CET-1CEST-2,M3.5.0/02:00:00,M10.5.0/03:00:00" // Only used for formatting
+// Offsets and DST rule used for the watering targets, must match TZ_STRING
+#define TZ_STD_OFFSET 3600       // s, standard time offset from UTC
+#define TZ_DST_OFFSET 7200       // s, daylight saving time offset from UTC
+#define TZ_DST_START_MONTH 3     // DST starts the last Sunday of this month
+#define TZ_DST_END_MONTH 10      // DST ends the last Sunday of this month
+#define TZ_DST_CHANGE_UTC 3600   // s after midnight UTC of the transition day
+
+#define TIME_VALID_AFTER 1704067200 // 2024-01-01 UTC, an earlier clock has not been set
+#define NTP_WAIT_MS 10000        // Longest wait for the time sync at the first boot
+
+struct dstTable {
+    time_t yearStart;   // UTC, start of the year the table is valid for
+    time_t yearEnd;     // UTC, start of the next year
+    time_t dstStart;    // UTC, DST begins
+    time_t dstEnd;      // UTC, DST ends
+};
+
+extern RTC_DATA_ATTR dstTable dstTransitions;
+
 void timeSetup();
+bool timeValid();
+int32_t utcOffset(time_t t);
+int32_t epochDay(time_t t);
+time_t localToEpoch(int32_t day, int hour, int minute);
 
 class timeKeeper {
     /*
-    This class provides functionality for managing target times and calculating time differences. 
-    It allows users to specify a target time during initialization and provides methods to determine the time until the target time, increment the target time by a specified number of days, and retrieve the target time as a string. 
+    This class provides functionality for managing target times and calculating time differences.
+    It allows users to specify a target time during initialization and provides methods to determine the time until the target time, increment the target time by a specified number of days, and retrieve the target time as a string.
 
     Key functions include:
         - timeUntil() calculates the time until the target time.
         - incrementDays() adds a specified number of days to the target time.
-        - timeString() returns the target time as a formatted string.
+        - timeString(char* buffer, size_t size) formats the target time into buffer.
 
     */
 private:
-    //tmElements_t targetTime;
-    tm targetTime;
+    time_t targetTime;  // UTC epoch seconds
+    int32_t targetDay;  // Local epoch day
+    int targetHour;
+    int targetMinute;
 
 public:
     timeKeeper(int hour, int minute) {
-        // Init timeKeeper class
-        // Get current time
-        time_t currentTime = getCurrentTime();
-        
-        localtime_r(&currentTime, &targetTime);
-
-        // Set target hour and minute
-        targetTime.tm_hour = hour;
-        targetTime.tm_min = minute;
-        targetTime.tm_sec = 0;  // Reset seconds to zero
+        // Init timeKeeper class, target is hour:minute local time today
+        targetHour = hour;
+        targetMinute = minute;
+        targetDay = epochDay(getCurrentTime());
+        targetTime = localToEpoch(targetDay, targetHour, targetMinute);
     }
 
     static time_t getCurrentTime() {
@@ -74,53 +107,37 @@ public:
         return now;
     }
 
-    String timeString() {
-        // Method to retrieve the target time as a formatted string
+    size_t timeString(char* buffer, size_t size) {
+        // Method to format the target time into buffer, returns the length
 
-       char buffer[80]; // Buffer to store formatted time string
+       tm timeinfo;
+       localtime_r(&targetTime, &timeinfo);
 
         // Format timeinfo structure into a string using strftime
-        strftime(buffer, sizeof(buffer), "%A, %B %d %Y %H:%M:%S zone %Z %z", &targetTime);
-
-       return String(buffer);
+        return strftime(buffer, size, "%A, %B %d %Y %H:%M:%S zone %Z %z", &timeinfo);
     }
 
     long timeUntil() {
         // Method to calculate the time until the target time
-
-        // Calculate current time
-        time_t currentTime = getCurrentTime();
-
-        // Calculate target time
-        time_t targetT = mktime(&targetTime);
-
-        // Calculate difference
-        return difftime(targetT, currentTime);
+        return (long)(targetTime - getCurrentTime());
     }
 
     void incrementDays(int days) {
-        // Method to increment the target time by a specified number of days
-
-        // Get current target time
-        time_t currentTime = mktime(&targetTime);
-
-        // Add days to target time
-        currentTime += (days * 3600 * 24);
+        // Method to increment the target time by a specified number of days,
+        // the local time of day is kept when DST changes in between
+        targetDay += days;
+        targetTime = localToEpoch(targetDay, targetHour, targetMinute);
+    }
 
-        /* Update target time
-        targetTime is initialized using an empty {} initializer to reset all its members.
-        The localtime_r() function is then used to populate targetTime with the components of the new time after adding the specified number of days. 
-        This approach ensures that targetTime is correctly updated with the new time information and resolves the error related to the assignment operator.
-        */
-        targetTime = {};
-        localtime_r(&currentTime, &targetTime);
+    int32_t getDay(){
+        // Method to get the local epoch day of the target time
+        return targetDay;
     }
 
-    int getDay(){
-        // Method to get the day of the target time
-        
-        return targetTime.tm_mday;
+    time_t getTime(){
+        // Method to get the target time, UTC epoch seconds
+        return targetTime;
     }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,348 @@
+/*
+TLS client with session resumption
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+*/
+
+#include "tls_client.h"
+#include "logger.h"
+
+#include <time.h>
+
+#ifndef WATER_THING_SIM
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/x509_crt.h>
+
+#ifndef MBEDTLS_PRIVATE
+#define MBEDTLS_PRIVATE(member) member   // mbedTLS 2, the struct members are public
+#endif
+#endif
+
+// Session of the last full handshake, kept during deep sleep, a reset makes a full handshake
+RTC_DATA_ATTR tlsSessionCache tlsSession = {0, 0, 0, {0}};
+
+uint32_t tlsClient::sessionKey(uint16_t port) const {
+    // FNV-1a of server name and port, never 0
+    uint32_t hash = 2166136261u;
+    for (const char* c = serverName != nullptr ? serverName : ""; *c != '\0'; c++) {
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+    hash = (hash ^ port) * 16777619u;
+    return hash != 0 ? hash : 1;
+}
+
+int tlsClient::connect(IPAddress ip, uint16_t port) {
+    stop();
+    if (!tcp.connect(ip, port)) {
+        LOG_WARN("TLS: TCP connect to %s:%u failed", String(ip).c_str(), port);
+        return 0;
+    }
+    return handshake(port) ? 1 : 0;
+}
+
+int tlsClient::connect(const char* host, uint16_t port) {
+    stop();
+    if (!tcp.connect(host, port)) {
+        LOG_WARN("TLS: TCP connect to %s:%u failed", host, port);
+        return 0;
+    }
+    return handshake(port) ? 1 : 0;
+}
+
+#ifndef WATER_THING_SIM
+
+struct tlsContext {
+    mbedtls_ssl_context ssl;
+    mbedtls_ssl_config conf;
+    mbedtls_x509_crt ca;
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context drbg;
+    bool verified;          // The certificate was checked, i.e. a full handshake
+};
+
+static int tlsSend(void* p, const unsigned char* buffer, size_t length) {
+    WiFiClient* tcp = (WiFiClient*)p;
+    if (!tcp->connected()) {
+        return MBEDTLS_ERR_SSL_CONN_EOF;
+    }
+    int n = tcp->write(buffer, length);
+    return n > 0 ? n : MBEDTLS_ERR_SSL_WANT_WRITE;
+}
+
+static int tlsReceive(void* p, unsigned char* buffer, size_t length) {
+    WiFiClient* tcp = (WiFiClient*)p;
+    if (!tcp->available()) {
+        return tcp->connected() ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_SSL_CONN_EOF;
+    }
+    int n = tcp->read(buffer, length);
+    return n > 0 ? n : MBEDTLS_ERR_SSL_WANT_READ;
+}
+
+static int tlsVerified(void* p, mbedtls_x509_crt* crt, int depth, uint32_t* flags) {
+    // Called for each certificate of the chain, only in a full handshake
+    (void)crt; (void)depth; (void)flags;
+    ((tlsContext*)p)->verified = true;
+    return 0;
+}
+
+bool tlsClient::handshake(uint16_t port) {
+    ctx = new tlsContext;
+    ctx->verified = false;
+    mbedtls_ssl_init(&ctx->ssl);
+    mbedtls_ssl_config_init(&ctx->conf);
+    mbedtls_x509_crt_init(&ctx->ca);
+    mbedtls_entropy_init(&ctx->entropy);
+    mbedtls_ctr_drbg_init(&ctx->drbg);
+
+    int ret = mbedtls_ctr_drbg_seed(&ctx->drbg, mbedtls_entropy_func, &ctx->entropy, (const unsigned char*)"water_thing", 11);
+    if (ret == 0) {
+        ret = mbedtls_ssl_config_defaults(&ctx->conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+    }
+    if (ret == 0 && caCert != nullptr) {
+        ret = mbedtls_x509_crt_parse(&ctx->ca, (const unsigned char*)caCert, strlen(caCert) + 1);
+        mbedtls_ssl_conf_ca_chain(&ctx->conf, &ctx->ca, nullptr);
+        mbedtls_ssl_conf_authmode(&ctx->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+    }
+    else if (ret == 0) {
+        LOG_WARN("TLS: no CA certificate, the broker is not verified");
+        mbedtls_ssl_conf_authmode(&ctx->conf, MBEDTLS_SSL_VERIFY_NONE);
+    }
+    if (ret != 0) {
+        LOG_ERROR("TLS: setup failed, -0x%04x", -ret);
+        release();
+        return false;
+    }
+    mbedtls_ssl_conf_rng(&ctx->conf, mbedtls_ctr_drbg_random, &ctx->drbg);
+    mbedtls_ssl_conf_verify(&ctx->conf, tlsVerified, ctx);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    mbedtls_ssl_conf_session_tickets(&ctx->conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+
+    ret = mbedtls_ssl_setup(&ctx->ssl, &ctx->conf);
+    if (ret == 0 && serverName != nullptr) {
+        ret = mbedtls_ssl_set_hostname(&ctx->ssl, serverName);
+    }
+    if (ret != 0) {
+        LOG_ERROR("TLS: setup failed, -0x%04x", -ret);
+        release();
+        return false;
+    }
+    mbedtls_ssl_set_bio(&ctx->ssl, &tcp, tlsSend, tlsReceive, nullptr);
+
+    // Offer the saved session, the broker answers with an abbreviated or a full handshake
+    bool offered = false;
+    if (tlsSession.key == sessionKey(port) && tlsSession.length > 0 && (uint32_t)time(nullptr) < tlsSession.expires) {
+        mbedtls_ssl_session session;
+        mbedtls_ssl_session_init(&session);
+        offered = mbedtls_ssl_session_load(&session, tlsSession.data, tlsSession.length) == 0 &&
+                  mbedtls_ssl_set_session(&ctx->ssl, &session) == 0;
+        mbedtls_ssl_session_free(&session);
+        if (!offered) {
+            tlsSession.key = 0;  // Saved by another mbedTLS build or damaged
+        }
+    }
+
+    unsigned long start = millis();
+    while ((ret = mbedtls_ssl_handshake(&ctx->ssl)) != 0) {
+        if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+            LOG_ERROR("TLS: handshake failed, -0x%04x, verify flags 0x%x", -ret, (unsigned int)mbedtls_ssl_get_verify_result(&ctx->ssl));
+            break;
+        }
+        if (millis() - start > TLS_TIMEOUT_MS) {
+            LOG_ERROR("TLS: handshake timeout");
+            break;
+        }
+        delay(1);
+    }
+    lastHandshakeMs = millis() - start;
+    if (ret != 0) {
+        tlsSession.key = 0;  // Do not offer it again, the next handshake is full
+        release();
+        return false;
+    }
+
+    // Without a CA nothing is verified and a resumption can not be told apart, the session is saved every time
+    lastResumed = offered && !ctx->verified && caCert != nullptr;
+    LOG_INFO("TLS: %s handshake, %lu ms, %s", lastResumed ? "resumed" : "full", (unsigned long)lastHandshakeMs,
+             mbedtls_ssl_get_ciphersuite(&ctx->ssl));
+    if (!lastResumed) {
+        saveSession(port);
+    }
+    return true;
+}
+
+void tlsClient::saveSession(uint16_t port) {
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+    size_t length = 0;
+    tlsSession.key = 0;
+    if (mbedtls_ssl_get_session(&ctx->ssl, &session) == 0 &&
+        mbedtls_ssl_session_save(&session, tlsSession.data, sizeof(tlsSession.data), &length) == 0) {
+        uint32_t lifetime = TLS_SESSION_LIFETIME_S;
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+        uint32_t hint = session.MBEDTLS_PRIVATE(ticket_lifetime);
+        if (hint > 0 && hint < lifetime) {
+            lifetime = hint;
+        }
+#endif
+        tlsSession.length = length;
+        tlsSession.expires = (uint32_t)time(nullptr) + lifetime;
+        tlsSession.key = sessionKey(port);
+        LOG_DEBUG("TLS: session saved, %u bytes, %lu s", (unsigned int)length, (unsigned long)lifetime);
+    }
+    else {
+        LOG_WARN("TLS: session not saved, larger than TLS_SESSION_SIZE (%d)?", TLS_SESSION_SIZE);
+    }
+    mbedtls_ssl_session_free(&session);
+}
+
+void tlsClient::release() {
+    if (ctx == nullptr) {
+        return;
+    }
+    mbedtls_ssl_free(&ctx->ssl);
+    mbedtls_ssl_config_free(&ctx->conf);
+    mbedtls_x509_crt_free(&ctx->ca);
+    mbedtls_ctr_drbg_free(&ctx->drbg);
+    mbedtls_entropy_free(&ctx->entropy);
+    delete ctx;
+    ctx = nullptr;
+    tcp.stop();
+}
+
+size_t tlsClient::write(const uint8_t* buffer, size_t size) {
+    if (ctx == nullptr) {
+        return 0;
+    }
+    size_t sent = 0;
+    unsigned long start = millis();
+    while (sent < size) {
+        int ret = mbedtls_ssl_write(&ctx->ssl, buffer + sent, size - sent);
+        if (ret > 0) {
+            sent += ret;
+        }
+        else if ((ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) || millis() - start > TLS_TIMEOUT_MS) {
+            LOG_WARN("TLS: write failed, -0x%04x", -ret);
+            release();
+            break;
+        }
+    }
+    return sent;
+}
+
+int tlsClient::available() {
+    if (ctx == nullptr) {
+        return 0;
+    }
+    int n = mbedtls_ssl_get_bytes_avail(&ctx->ssl);
+    if (n == 0 && tcp.available()) {
+        // Decrypt the next record without taking any bytes
+        int ret = mbedtls_ssl_read(&ctx->ssl, nullptr, 0);
+        if (ret < 0 && ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+            if (ret != MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+                LOG_WARN("TLS: read failed, -0x%04x", -ret);
+            }
+            release();
+            return peeked >= 0 ? 1 : 0;
+        }
+        n = mbedtls_ssl_get_bytes_avail(&ctx->ssl);
+    }
+    return n + (peeked >= 0 ? 1 : 0);
+}
+
+int tlsClient::read(uint8_t* buffer, size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+    int n = 0;
+    if (peeked >= 0) {
+        buffer[n++] = peeked;
+        peeked = -1;
+    }
+    if (ctx == nullptr || (size_t)n == size || available() == 0) {
+        return n > 0 ? n : -1;  // available() releases the context if the connection failed
+    }
+    int ret = mbedtls_ssl_read(&ctx->ssl, buffer + n, size - n);
+    if (ret > 0) {
+        n += ret;
+    }
+    return n > 0 ? n : -1;
+}
+
+#else
+
+// Not simulated, the PubSubClient shim exchanges the data
+struct tlsContext {};
+
+bool tlsClient::handshake(uint16_t port) {
+    ctx = new tlsContext;
+    lastResumed = tlsSession.key == sessionKey(port);
+    lastHandshakeMs = 0;
+    tlsSession.key = sessionKey(port);
+    return true;
+}
+
+void tlsClient::saveSession(uint16_t port) {
+    (void)port;
+}
+
+void tlsClient::release() {
+    delete ctx;
+    ctx = nullptr;
+    tcp.stop();
+}
+
+size_t tlsClient::write(const uint8_t* buffer, size_t size) {
+    return ctx != nullptr ? tcp.write(buffer, size) : 0;
+}
+
+int tlsClient::available() {
+    return ctx != nullptr ? tcp.available() + (peeked >= 0 ? 1 : 0) : 0;
+}
+
+int tlsClient::read(uint8_t* buffer, size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+    int n = 0;
+    if (peeked >= 0) {
+        buffer[n++] = peeked;
+        peeked = -1;
+    }
+    if (ctx != nullptr && (size_t)n < size) {
+        int ret = tcp.read(buffer + n, size - n);
+        if (ret > 0) {
+            n += ret;
+        }
+    }
+    return n > 0 ? n : -1;
+}
+
+#endif
+
+int tlsClient::read() {
+    uint8_t c;
+    return read(&c, 1) == 1 ? c : -1;
+}
+
+int tlsClient::peek() {
+    if (peeked < 0) {
+        peeked = read();
+    }
+    return peeked;
+}
+
+void tlsClient::stop() {
+    if (ctx != nullptr) {
+#ifndef WATER_THING_SIM
+        mbedtls_ssl_close_notify(&ctx->ssl);
+#endif
+        release();
+    }
+    peeked = -1;
+}
+
+uint8_t tlsClient::connected() {
+    return ctx != nullptr && tcp.connected() ? 1 : peeked >= 0;
+}
@@ -0,0 +1,121 @@
+#ifndef TLS_CLIENT_H
+#define TLS_CLIENT_H
+
+/*
+TLS client with session resumption
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+Client (the Arduino stream interface used by PubSubClient) that runs TLS over a WiFiClient with mbedTLS.
+WiFiClientSecure does the handshake inside connect() and gives no way to offer a saved session, so it makes a full
+handshake every wake: certificate chain, signature check and key exchange, a couple of round trips and around a
+second of CPU on the ESP32.
+
+After a handshake the session (master secret and the session ticket if the broker sent one) is saved to RTC memory
+and offered in the next connect, also after deep sleep. If the broker accepts it the handshake is abbreviated: no
+certificate, no public key operations, one round trip less. The broker decides how long a session can be resumed,
+the lifetime hint of the ticket (at most TLS_SESSION_LIFETIME_S) is kept and the session is not offered after it.
+If the broker does not accept it the same handshake continues as a full one, a new session is then saved.
+The certificate is only verified in a full handshake, that is also how a resumption is detected.
+
+The saved session is tied to the server name and port (tlsSessionKey), a reset clears RTC memory and the next
+connect is a full handshake. The session does not fit if the serialized size (peer certificate + ticket) exceeds
+TLS_SESSION_SIZE, it is then a full handshake every wake and a warning is logged.
+
+The mbedTLS contexts (about 40 kB incl. the record buffers) are allocated in connect() and freed in stop().
+In the simulator TLS is not simulated, the client passes the stream through.
+
+tlsClient Class:
+    Purpose:
+        Client for PubSubClient, TLS with the session kept across deep sleep.
+    Public Methods:
+        tlsClient(const char* caCert, const char* serverName): caCert is the PEM of the CA that signed the broker
+            certificate (nullptr: the broker is not verified), serverName the name in the certificate.
+        connect(ip/host, port): TCP connect and handshake, 1 on success.
+        write(), available(), read(), peek(), flush(), stop(), connected(): Client interface.
+        resumed(): The last handshake resumed the saved session.
+        handshakeMs(): Duration of the last handshake.
+
+Retained Variables (RTC_DATA_ATTR):
+    tlsSession: Serialized session, its key and when it expires.
+*/
+
+#include <Arduino.h>
+#include <WiFi.h>
+
+#define TLS_SESSION_SIZE 1536           // Bytes of RTC memory for the serialized session
+#define TLS_SESSION_LIFETIME_S 86400    // s, longest a session is offered, the broker's ticket hint is used if shorter
+#define TLS_TIMEOUT_MS 5000             // Handshake timeout
+
+struct tlsSessionCache {
+    uint32_t key;                       // Server name and port, 0 if no session
+    uint32_t expires;                   // time() when the session is no longer offered
+    uint16_t length;                    // Bytes in data
+    uint8_t data[TLS_SESSION_SIZE];     // mbedtls_ssl_session_save()
+};
+
+extern RTC_DATA_ATTR tlsSessionCache tlsSession;
+
+struct tlsContext;
+
+class tlsClient : public Client {
+    /*
+    Class for a TLS connection over WiFi that resumes the session of the previous wake.
+    */
+private:
+    WiFiClient tcp;
+    const char* caCert;
+    const char* serverName;
+    tlsContext* ctx;        // nullptr when not connected
+    int peeked;             // Byte read by peek(), -1 if none
+    bool lastResumed;
+    uint32_t lastHandshakeMs;
+
+    uint32_t sessionKey(uint16_t port) const;
+    bool handshake(uint16_t port);
+    void saveSession(uint16_t port);
+    void release();
+
+public:
+    tlsClient(const char* caCert, const char* serverName)
+        : caCert(caCert), serverName(serverName), ctx(nullptr), peeked(-1), lastResumed(false), lastHandshakeMs(0) {}
+    ~tlsClient() {
+        stop();
+    }
+
+    int connect(IPAddress ip, uint16_t port) override;
+    int connect(const char* host, uint16_t port) override;
+#if ESP_ARDUINO_VERSION_MAJOR >= 3
+    int connect(IPAddress ip, uint16_t port, int32_t timeout) override {
+        (void)timeout;
+        return connect(ip, port);
+    }
+    int connect(const char* host, uint16_t port, int32_t timeout) override {
+        (void)timeout;
+        return connect(host, port);
+    }
+#endif
+    size_t write(uint8_t c) override {
+        return write(&c, 1);
+    }
+    size_t write(const uint8_t* buffer, size_t size) override;
+    int available() override;
+    int read() override;
+    int read(uint8_t* buffer, size_t size) override;
+    int peek() override;
+    void flush() override {}
+    void stop() override;
+    uint8_t connected() override;
+    operator bool() override {
+        return connected();
+    }
+
+    bool resumed() const {
+        return lastResumed;
+    }
+
+    uint32_t handshakeMs() const {
+        return lastHandshakeMs;
+    }
+};
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef TOPICS_H
+#define TOPICS_H
+
+/*
+MQTT topics
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+Topics are listed in device_spec.h and built at compile time by concatenating the device name and the suffix of
+each topic, the strings and the tables pointing to them are constants in flash (see config.cpp).
+
+pubTopic, subTopic:
+    Topics by name, generated from PUB_TOPICS/SUB_TOPICS in device_spec.h. count is the number of topics.
+
+fixedString<N> Struct:
+    Purpose:
+        A string of N - 1 characters with a terminating null that can be built in constant expressions.
+    Functions:
+        fixedLiteral(const char (&s)[N]): fixedString from a string literal.
+        a + b: Concatenation of two fixedStrings.
+        validTopic(const char* topic): True if topic is a valid topic name to publish to (no wildcards or empty levels).
+        uniqueTopics(const char* const* topics, size_t n): True if no topic occurs twice.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include "device_spec.h"
+
+#define MQTT_MAX_TOPIC 127 // Longest topic, leaves room for the payload in the PubSubClient buffer
+
+enum class pubTopic : uint8_t {
+#define X(name, prefix, suffix) name,
+    PUB_TOPICS(X)
+#undef X
+    count
+};
+
+enum class subTopic : uint8_t {
+#define X(name, prefix, suffix) name,
+    SUB_TOPICS(X)
+#undef X
+    count
+};
+
+template <size_t N>
+struct fixedString {
+    char data[N];
+
+    constexpr size_t length() const {
+        return N - 1;
+    }
+
+    constexpr const char* c_str() const {
+        return data;
+    }
+};
+
+template <size_t N>
+constexpr fixedString<N> fixedLiteral(const char (&s)[N]) {
+    fixedString<N> result = {};
+    for (size_t i = 0; i < N; i++) {
+        result.data[i] = s[i];
+    }
+    return result;
+}
+
+template <size_t N, size_t M>
+constexpr fixedString<N + M - 1> operator+(const fixedString<N>& a, const fixedString<M>& b) {
+    fixedString<N + M - 1> result = {};
+    for (size_t i = 0; i < N - 1; i++) {
+        result.data[i] = a.data[i];
+    }
+    for (size_t i = 0; i < M; i++) {
+        result.data[N - 1 + i] = b.data[i];
+    }
+    return result;
+}
+
+constexpr bool validTopic(const char* topic) {
+    // Not empty, no wildcards, no empty levels and not too long
+    size_t len = 0;
+    for (; topic[len] != '\0'; len++) {
+        char c = topic[len];
+        if (c == '+' || c == '#' || c == ' ') return false;
+        if (c == '/' && (len == 0 || topic[len - 1] == '/' || topic[len + 1] == '\0')) return false;
+    }
+    return len > 0 && len <= MQTT_MAX_TOPIC;
+}
+
+constexpr bool sameTopic(const char* a, const char* b) {
+    size_t i = 0;
+    for (; a[i] != '\0' && a[i] == b[i]; i++) {}
+    return a[i] == b[i];
+}
+
+constexpr bool uniqueTopics(const char* const* topics, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = i + 1; j < n; j++) {
+            if (sameTopic(topics[i], topics[j])) return false;
+        }
+    }
+    return true;
+}
+
+#endif
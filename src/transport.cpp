@@ -0,0 +1,131 @@
+/*
+Uplink transport
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+*/
+
+#include "transport.h"
+#include "config.h"
+#include "mqtt_handler.h"
+#include "espnow_transport.h"
+#include "hardware_functions.h"
+
+mqqtSubscriptions mqttSubs;
+
+uint32_t transport::received = 0;
+
+void transport::listen(uint32_t maxMs, uint32_t quietMs) {
+    /*
+    Messages queued for the device arrive right after connecting, replies (settings to "ready") shortly after.
+    Wait until it has been quiet for quietMs instead of a fixed time, what arrives later is queued in the broker
+    session (mqtt_handler.h) or the gateway until the next wake.
+    */
+    unsigned long start = millis();
+    unsigned long lastMessage = start;
+    uint32_t seen = received;
+    while (millis() - start < maxMs) {
+        loop();
+        if (received != seen) {
+            seen = received;
+            lastMessage = millis();
+        }
+        else if (millis() - lastMessage >= quietMs) {
+            break;
+        }
+        buttons::wait(10);
+    }
+    LOG_DEBUG("Listened %lu ms, %lu messages", millis() - start, (unsigned long)received);
+}
+
+void transport::dispatch(const char* topic, const char* message) {
+    /*
+    Match the topic with the subscriptions and call the corresponding functions.
+    With each topic a function pointer to a global function is bundeled in a struct
+    called "FunctionTopicPair". This function will then be called if the topic matches.
+    */
+    LOG_INFO("Message arrived on topic: %s. Message: %s", topic, message);
+    received++;
+
+    for (int j = 0; j < mqttSubs.getSubscriptionCount(); j++){
+        const FunctionTopicPair& tempPair = mqttSubs.getSubscription(j);
+        if (strcmp(topic, tempPair.topic) == 0){
+            (*tempPair.functPtr)(message);
+        }
+    }
+}
+
+//***************************
+//***      Loopback       ***
+//***************************
+
+void loopbackTransport::copy(loopbackMessage& m, const char* topic, const char* message, bool retained) {
+    snprintf(m.topic, sizeof(m.topic), "%s", topic);
+    snprintf(m.message, sizeof(m.message), "%s", message);
+    m.retained = retained;
+}
+
+bool loopbackTransport::publish(const char* topic, const char* message, bool retained) {
+    // Keep the message, the oldest is dropped when full
+    int i = (first + count) % LOOPBACK_MESSAGES;
+    if (count == LOOPBACK_MESSAGES) {
+        first = (first + 1) % LOOPBACK_MESSAGES;
+    }
+    else {
+        count++;
+    }
+    copy(published[i], topic, message, retained);
+
+    // A broker sends it back if the device is subscribed to the topic
+    for (int j = 0; j < mqttSubs.getSubscriptionCount(); j++) {
+        if (strcmp(topic, mqttSubs.getSubscription(j).topic) == 0) {
+            inject(topic, message);
+            break;
+        }
+    }
+    return true;
+}
+
+bool loopbackTransport::inject(const char* topic, const char* message) {
+    if (receivedCount == LOOPBACK_MESSAGES) {
+        return false;
+    }
+    copy(received[receivedCount++], topic, message, false);
+    return true;
+}
+
+void loopbackTransport::loop() {
+    // Deliver in order, messages queued by the subscribed functions wait for the next loop()
+    int n = receivedCount;
+    for (int i = 0; i < n; i++) {
+        dispatch(received[i].topic, received[i].message);
+    }
+    memmove(received, received + n, (receivedCount - n) * sizeof(loopbackMessage));
+    receivedCount -= n;
+}
+
+//***************************
+//***       Factory       ***
+//***************************
+
+transport* transportCreate(int kind, wifi_power_t txPower) {
+    // WiFi must be associated before an IP backend is created
+    switch (kind) {
+        case UPLINK_MQTT:
+            if (!mqtt_cred.getActive()) {
+                LOG_INFO("MQTT not active");
+                return nullptr;
+            }
+            return new mqttHandler(mqtt_cred);
+        case UPLINK_ESPNOW: {
+            espNowTransport* link = new espNowTransport(espnow_cred, txPower);
+            if (!link->connected()) {
+                delete link;
+                return nullptr;
+            }
+            return link;
+        }
+        case UPLINK_LOOPBACK:
+            return new loopbackTransport();
+    }
+    LOG_ERROR("Unknown uplink %d", kind);
+    return nullptr;
+}
@@ -0,0 +1,252 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+/*
+Uplink transport
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+Telemetry, settings and the other topics go through a transport, the code above it only knows topics and messages.
+The backend is chosen with SPEC_UPLINK in device_spec.h:
+    UPLINK_MQTT      MQTT over WiFi (mqtt_handler.h), needs association, DHCP and a TCP connection every wake.
+    UPLINK_ESPNOW    ESP-NOW frames to a mains powered gateway (espnow_transport.h) that bridges them to MQTT,
+                     no association, a wake's data is sent in tens of ms of radio time.
+    UPLINK_LOOPBACK  In process, nothing leaves the device (loopbackTransport below), for host tests.
+
+Messages received on subscribed topics are dispatched to the functions registered with addSubscription(), whichever
+backend received them.
+
+transport Class:
+    Purpose:
+        Interface of the backends.
+    Public Methods:
+        connected(): Messages can be sent.
+        publish(topic, message, retained): Publish a message, returns true if it was sent.
+        publish(topic, int), publish(topic, double, decimals): Numbers are formatted into a stack buffer.
+        publishBinary(topic, header, headerLength, data, length): Publish header and data as one binary message,
+            written from both buffers as they are. Returns false if the backend does not stream binary (only MQTT does).
+        loop(): Receive messages and call the subscribed functions, call while waiting for replies.
+        listen(maxMs, quietMs): Call loop() until no message has arrived for quietMs, at most maxMs.
+        needsIP(): The backend uses the IP network, WiFi is associated before it is created.
+        name(): Name of the backend.
+        addSubscription(topic, function): Static, call function with the message when one arrives on topic.
+        dispatch(topic, message): Static, call the functions subscribed to topic, used by the backends.
+        getReceived(): Static, nr of messages dispatched this wake.
+
+mqqtSubscriptions Class:
+    This class manages a list of subscriptions
+    (topics and corresponding functions to call when a message is received on that topic).
+    It provides methods for adding subscriptions (addSub()), getting the number of subscriptions
+    (getSubscriptionCount()), and retrieving a specific subscription (getSubscription()).
+    The list is a fixed array of MQTT_MAX_SUBSCRIPTIONS, adding the same topic again replaces the function.
+
+FunctionTopicPair:
+    This struct represents a pair of a topic and a function pointer.
+    It is used within mqqtSubscriptions to associate topics with functions.
+
+loopbackTransport Class:
+    Purpose:
+        Keeps the last LOOPBACK_MESSAGES published messages and delivers messages on subscribed topics back to the
+        device on loop(), as a broker would. Messages injected with inject() are delivered the same way.
+    Public Methods:
+        inject(topic, message): Queue a message as if it was received.
+        getCount(), getTopic(i), getMessage(i), isRetained(i): Published messages, oldest first.
+        clear(): Forget the published messages.
+
+Functions:
+    transportCreate(int kind, wifi_power_t txPower): New backend of kind UPLINK_*, nullptr if it could not be started.
+*/
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include "logger.h"
+
+#define UPLINK_MQTT 0
+#define UPLINK_ESPNOW 1
+#define UPLINK_LOOPBACK 2
+
+#define MQTT_MAX_SUBSCRIPTIONS 6   // Subscribed topics
+#define MQTT_MAX_MESSAGE 256       // Longest received message, longer messages are truncated
+#define TRANSPORT_MAX_TOPIC 64     // Longest topic
+#define LOOPBACK_MESSAGES 8        // Published messages kept by the loopback backend
+#define TRANSPORT_LISTEN_MS 1000   // Longest wait for messages after connecting
+#define TRANSPORT_QUIET_MS 200     // Stop waiting when nothing has arrived for this long
+
+// Define the typedef for a function pointer, called with the received message (null terminated)
+typedef void (*FunctionPointer)(const char*);
+
+struct FunctionTopicPair {
+    // Simple structure containing a topic with a corresponding function to call if a message is recieved on that topic
+    // Used in mqqtSubscriptions class
+    const char* topic;
+    FunctionPointer functPtr;
+};
+
+class mqqtSubscriptions {
+    /*
+    This class contains a stack with structs of type "FunctionTopicPair", each such pair contains both
+    a topic and a function pointer.
+
+    public functions for adding a new function-topic-pair to the stack,
+    a function for returning the number of elements in the stack
+    as well as function that returns the function-topic-pair for a given location in the stack
+
+    (the function that is pointed to is to be called when a message on that topic is recived, this
+     is done by transport::dispatch())
+    */
+
+    private:
+        // Subscriptions
+        FunctionTopicPair subscriptions[MQTT_MAX_SUBSCRIPTIONS]; // Struct with functionpointer and topic for subscribed topics.
+        int subscriptionCount;            // Keep track of the number of subscriptions
+
+    public:
+
+        //Constructor
+        mqqtSubscriptions():subscriptionCount(0)
+        {}
+
+        void addSub(const char* topic, FunctionPointer functPtr) {
+            // Method to add a new subscription to the array, topic must outlive the subscription (a constant in flash)
+            for (int i = 0; i < subscriptionCount; ++i) {
+                if (strcmp(subscriptions[i].topic, topic) == 0) {
+                    subscriptions[i].functPtr = functPtr;
+                    return;
+                }
+            }
+            if (subscriptionCount >= MQTT_MAX_SUBSCRIPTIONS) {
+                LOG_ERROR("Too many subscriptions, ignoring: %s", topic);
+                return;
+            }
+            subscriptions[subscriptionCount].topic = topic;
+            subscriptions[subscriptionCount].functPtr = functPtr;
+            subscriptionCount++;
+        }
+
+        int getSubscriptionCount() const {
+            return subscriptionCount;
+        }
+
+        const FunctionTopicPair& getSubscription(int i) const {
+            return subscriptions[i];
+        }
+
+};
+
+// Global instance to share subscriptions
+// This is done since it's not possible to pass an instance of an object to
+// the callback functions of the backends.
+extern mqqtSubscriptions mqttSubs;
+
+class transport {
+    /*
+    Interface of the uplink backends.
+    */
+public:
+    virtual ~transport() {}
+
+    virtual bool connected() = 0;
+    virtual bool publish(const char* topic, const char* message, bool retained = false) = 0;
+    virtual void loop() = 0;
+    virtual bool needsIP() const = 0;
+    virtual const char* name() const = 0;
+
+    virtual bool publishBinary(const char* topic, const uint8_t* header, size_t headerLength, const uint8_t* data, size_t length){
+        return false;
+    }
+
+    bool publish(const char* topic, int value){
+        // Publish an integer (or bool as 0/1)
+        char buffer[12];
+        snprintf(buffer, sizeof(buffer), "%d", value);
+        return publish(topic, buffer);
+    }
+
+    bool publish(const char* topic, double value, unsigned int decimals){
+        // Publish a number with a fixed number of decimals
+        char buffer[24];
+        snprintf(buffer, sizeof(buffer), "%.*f", (int)decimals, value);
+        return publish(topic, buffer);
+    }
+
+    static void addSubscription(const char* topic, FunctionPointer functPtr){
+        mqttSubs.addSub(topic, functPtr);
+    }
+
+    void listen(uint32_t maxMs = TRANSPORT_LISTEN_MS, uint32_t quietMs = TRANSPORT_QUIET_MS);
+
+    static void dispatch(const char* topic, const char* message);
+
+    static uint32_t getReceived() {
+        return received;
+    }
+
+private:
+    static uint32_t received;
+};
+
+class loopbackTransport : public transport {
+    /*
+    In process backend for host tests, a broker with a single client.
+    */
+private:
+    struct loopbackMessage {
+        char topic[TRANSPORT_MAX_TOPIC];
+        char message[MQTT_MAX_MESSAGE + 1];
+        bool retained;
+    };
+
+    loopbackMessage published[LOOPBACK_MESSAGES];   // Ring, oldest at first
+    loopbackMessage received[LOOPBACK_MESSAGES];    // To be delivered on loop()
+    int first;
+    int count;
+    int receivedCount;
+
+    static void copy(loopbackMessage& m, const char* topic, const char* message, bool retained);
+
+public:
+    loopbackTransport() : first(0), count(0), receivedCount(0) {}
+
+    using transport::publish;
+
+    bool connected() override {
+        return true;
+    }
+
+    bool publish(const char* topic, const char* message, bool retained = false) override;
+    void loop() override;
+
+    bool needsIP() const override {
+        return false;
+    }
+
+    const char* name() const override {
+        return "loopback";
+    }
+
+    bool inject(const char* topic, const char* message);
+
+    int getCount() const {
+        return count;
+    }
+
+    const char* getTopic(int i) const {
+        return published[(first + i) % LOOPBACK_MESSAGES].topic;
+    }
+
+    const char* getMessage(int i) const {
+        return published[(first + i) % LOOPBACK_MESSAGES].message;
+    }
+
+    bool isRetained(int i) const {
+        return published[(first + i) % LOOPBACK_MESSAGES].retained;
+    }
+
+    void clear() {
+        first = 0;
+        count = 0;
+    }
+};
+
+transport* transportCreate(int kind, wifi_power_t txPower);
+
+#endif
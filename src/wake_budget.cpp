@@ -0,0 +1,83 @@
+/*
+Wake budget
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+*/
+
+#include "wake_budget.h"
+#include "wake_cycle.h"
+#include "hardware_functions.h"
+#include "sleep.h"
+#include "logger.h"
+
+wakeBudget budget;
+
+// Phase and budget of a cut wake, logged by the next boot
+RTC_DATA_ATTR budgetCut lastCut = {false, false, 0, 0};
+
+static const uint32_t phaseMs[WAKE_STEPS] = {
+    BUDGET_CONNECT_MS, BUDGET_CLOSE_VALVE_MS, BUDGET_SETTINGS_MS, BUDGET_SENSORS_MS,
+    BUDGET_PUBLISH_MS, BUDGET_CAPTURE_MS, BUDGET_OTA_MS, BUDGET_WATER_MS, BUDGET_SLEEP_MS
+};
+
+static void cut(void* arg) {
+    /*
+    esp_timer task, the setup() task may be blocked anywhere, also in the logger or the energy and latency accounting.
+    Only the motor, the checkpoint and RTC memory are touched, the cut is logged by the next boot.
+    */
+    wakeBudget* b = (wakeBudget*)arg;
+    lastCut.cut = true;
+    lastCut.step = b->getStep();
+    lastCut.deadline = b->getDeadline();
+    lastCut.halted = valve::halt();
+    if (lastCut.halted) {
+        valveState = true;
+        cycle.setValveOpen(true); // Stopped mid travel, may be open
+    }
+    sleepCut(WAKE_BUDGET_RETRY_S); // The cycle is resumed at the step that overran
+}
+
+void wakeBudget::begin() {
+    if (lastCut.cut) {
+        LOG_ERROR("Wake budget of %lu ms exceeded in %s, the wake was cut%s", (unsigned long)lastCut.deadline,
+                  lastCut.step >= 0 ? wakeCycle::stepName(lastCut.step) : "boot",
+                  lastCut.halted ? ", valve motor halted" : "");
+        lastCut.cut = false;
+    }
+
+    esp_timer_create_args_t args = {};
+    args.callback = &cut;
+    args.arg = this;
+    args.name = "wake_budget";
+    if (esp_timer_create(&args, &timer) != ESP_OK) {
+        LOG_ERROR("Wake budget timer not created");
+        timer = nullptr;
+        return;
+    }
+    arm();
+}
+
+void wakeBudget::arm() {
+    if (timer == nullptr) {
+        return;
+    }
+    esp_timer_stop(timer);
+    int32_t left = (int32_t)(deadline - millis());
+    esp_timer_start_once(timer, (uint64_t)(left > 0 ? left : 1) * 1000ULL);
+}
+
+void wakeBudget::phase(int step) {
+    uint32_t now = millis();
+    if ((int32_t)(now - phaseEnd) > 0) {
+        LOG_WARN("Phase %s took %lu ms, deadline %lu ms", name, (unsigned long)(now - phaseStart), (unsigned long)(phaseEnd - phaseStart));
+    }
+    this->step = step;
+    name = wakeCycle::stepName(step);
+    phaseStart = now;
+    phaseEnd = now + (step >= 0 && step < WAKE_STEPS ? phaseMs[step] : 0);
+}
+
+void wakeBudget::extend(uint32_t ms) {
+    deadline += ms;
+    phaseEnd += ms;
+    arm();
+}
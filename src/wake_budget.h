@@ -0,0 +1,117 @@
+#ifndef WAKE_BUDGET_H
+#define WAKE_BUDGET_H
+
+/*
+Wake budget
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+Bounds the time a wake stays awake, the battery can be sized against the worst case: WAKE_BUDGET_MS, plus the
+duration of a watering by volume (the only part of a wake that is meant to be long, extend()).
+
+Each step of the wake cycle (wake_cycle.h) is a phase with a deadline (BUDGET_*_MS), the time before the first step
+(button handling, see main.cpp) is the phase "boot". Code that waits for the network checks expired() and gives up
+when the phase is over: the WiFi association, the MQTT (re)connect and the time sync of the first boot. A phase that
+still overruns its deadline is logged as a warning when the next one starts.
+
+The budget itself is enforced by an esp_timer started in begin(), it fires also when the setup() task is blocked
+in a call that does not return. The wake is then cut from the timer task:
+    - The valve motor is stopped. If it was running the valve is marked as possibly open in the checkpoint.
+    - The cycle is not ended, the device sleeps WAKE_BUDGET_RETRY_S and resumes the cycle at the step that overran,
+      as after a reset (wake_cycle.h) but with RTC memory kept: readings, the batch and what has been published are
+      not lost, and a step that is cut WAKE_MAX_ATTEMPTS times is given up for the cycle.
+    - Nothing else is done in the timer task, the setup() task may be blocked in the logger or in the energy and
+      latency accounting: the cut wake is not booked in the statistics, and the cut is kept in RTC memory (lastCut)
+      and logged as an error by the next boot, shipped with the diagnostics.
+
+wakeBudget Class:
+    Purpose:
+        Phase deadlines and the hard limit of the wake.
+    Public Methods:
+        begin(): Start the budget (counted from the boot, millis()) and the phase "boot".
+        phase(int step): Start the phase of a wake step, the previous phase is checked.
+        expired(): The deadline of the phase has passed.
+        remaining(): ms left of the phase, 0 when expired.
+        extend(uint32_t ms): Add to the budget and the phase, for a watering by volume.
+        getDeadline(): ms after the boot when the wake is cut.
+        getStep(): Wake step of the current phase, -1 for "boot".
+        phaseName(): Name of the current phase.
+
+Retained Variables (RTC_DATA_ATTR):
+    lastCut: Phase and budget of a cut wake, logged by begin().
+*/
+
+#include <Arduino.h>
+#include <esp_timer.h>
+
+#define WAKE_BUDGET_MS 150000       // Hard limit of a wake, above the sum of the phase deadlines
+#define WAKE_BUDGET_RETRY_S 5       // Sleep after a cut, the cycle is then resumed
+
+// Phase deadlines
+#define BUDGET_BOOT_MS 15000        // Before the first step, a valve actuation for a button
+#define BUDGET_CONNECT_MS 20000     // WiFi, transport and the time sync of the first boot
+#define BUDGET_CLOSE_VALVE_MS 15000
+#define BUDGET_SETTINGS_MS 5000
+#define BUDGET_SENSORS_MS 10000
+#define BUDGET_PUBLISH_MS 10000
+#define BUDGET_CAPTURE_MS 15000     // Window (CAPTURE_MAX_MS) and streaming
+#define BUDGET_OTA_MS 30000
+#define BUDGET_WATER_MS 15000       // A watering by volume extends it by its duration
+#define BUDGET_SLEEP_MS 2000
+
+struct budgetCut {
+    bool cut;                // The last wake was cut
+    bool halted;             // The valve motor was stopped
+    int8_t step;             // Phase that overran, -1 for "boot"
+    uint32_t deadline;       // ms after the boot
+};
+
+extern RTC_DATA_ATTR budgetCut lastCut;
+
+class wakeBudget {
+    /*
+    Class for the phase deadlines and the hard limit of the wake.
+    */
+private:
+    esp_timer_handle_t timer;
+    uint32_t deadline;       // millis() when the wake is cut
+    uint32_t phaseStart;     // millis()
+    uint32_t phaseEnd;       // millis(), deadline of the phase
+    int step;                // Wake step of the phase, -1 for "boot"
+    const char* name;
+
+    void arm();
+
+public:
+    // Constructor
+    wakeBudget() : timer(nullptr), deadline(WAKE_BUDGET_MS), phaseStart(0), phaseEnd(BUDGET_BOOT_MS), step(-1), name("boot") {}
+
+    void begin();
+    void phase(int step);
+    void extend(uint32_t ms);
+
+    bool expired() const {
+        return (int32_t)(millis() - phaseEnd) >= 0;
+    }
+
+    uint32_t remaining() const {
+        int32_t left = (int32_t)(phaseEnd - millis());
+        return left > 0 ? (uint32_t)left : 0;
+    }
+
+    uint32_t getDeadline() const {
+        return deadline;
+    }
+
+    int getStep() const {
+        return step;
+    }
+
+    const char* phaseName() const {
+        return name;
+    }
+};
+
+// Global budget of the wake
+extern wakeBudget budget;
+
+#endif
@@ -0,0 +1,131 @@
+/*
+Wake cycle
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+*/
+
+#include "wake_cycle.h"
+#include "hardware_functions.h"
+#include "sleep.h"
+#include "logger.h"
+
+#include <stddef.h>
+
+// Survives resets, not only deep sleep
+RTC_NOINIT_ATTR wakeCheckpoint cycleCheckpoint;
+
+wakeCycle cycle(cycleCheckpoint);
+
+uint32_t wakeCycle::checksum(const wakeCheckpoint& c) {
+    // FNV-1a of all fields before the checksum
+    const uint8_t* bytes = (const uint8_t*)&c;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < offsetof(wakeCheckpoint, checksum); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+void wakeCycle::save() {
+    cp.checksum = checksum(cp);
+}
+
+bool wakeCycle::begin() {
+    /*
+    Called once per boot before the first step.
+    A valid checkpoint with a step in progress means that the previous boot was reset during that step.
+    */
+    bool valid = cp.magic == WAKE_MAGIC && cp.checksum == checksum(cp);
+    if (valid) {
+        // Kept here as well, the RTC_DATA_ATTR copies are lost in a reset (the valve is then assumed open)
+        valveState = cp.valveOpen;
+        if (cp.waterDay > lastWaterDay) {
+            lastWaterDay = cp.waterDay;
+        }
+    }
+    else {
+        // Power on, start from scratch
+        memset(&cp, 0, sizeof(cp));
+        cp.magic = WAKE_MAGIC;
+        cp.step = STEP_DONE;
+        cp.valveOpen = valveState;
+        cp.waterDay = -1;
+    }
+
+    if (cp.step != STEP_DONE) {
+        resumedCycle = true;
+        interruptedStep = cp.step;
+        if (cp.attempts[cp.step] < UINT8_MAX) {
+            cp.attempts[cp.step]++;
+        }
+        cp.done &= ~WAKE_PER_BOOT;
+        LOG_WARN("Resuming wake cycle at %s, attempt %d", stepName(cp.step), cp.attempts[cp.step] + 1);
+    }
+    else {
+        // New cycle
+        cp.cycles++;
+        memset(cp.attempts, 0, sizeof(cp.attempts));
+        cp.done = 0;
+        cp.published = 0;
+        cp.hasReadings = false;
+    }
+    save();
+    return resumedCycle;
+}
+
+int wakeCycle::next() {
+    // The first step that is not done, steps interrupted too many times are given up
+    for (int step = 0; step < WAKE_STEPS; step++) {
+        if (cp.done & (1 << step)) {
+            continue;
+        }
+        if (cp.attempts[step] >= WAKE_MAX_ATTEMPTS && step != STEP_CLOSE_VALVE && step != STEP_SLEEP) {
+            LOG_ERROR("Giving up %s for this cycle after %d resets", stepName(step), cp.attempts[step]);
+            cp.done |= 1 << step;
+            continue;
+        }
+        cp.step = step;
+        save();
+        return step;
+    }
+    return STEP_DONE;
+}
+
+void wakeCycle::complete(int step) {
+    // The step stays in progress until next() moves on, the cycle only ends in end()
+    cp.done |= 1 << step;
+    save();
+}
+
+void wakeCycle::end() {
+    // The cycle is complete, the device goes to deep sleep
+    cp.valveOpen = valveState;
+    cp.step = STEP_DONE;
+    save();
+}
+
+void wakeCycle::saveReadings(double pressure, double battery) {
+    cp.pressure = pressure;
+    cp.batteryVoltage = battery;
+    cp.hasReadings = true;
+    save();
+}
+
+void wakeCycle::setPublished(pubTopic topic) {
+    cp.published |= 1UL << (int)topic;
+    save();
+}
+
+void wakeCycle::setValveOpen(bool open) {
+    cp.valveOpen = open;
+    save();
+}
+
+void wakeCycle::setWaterDay(int32_t day) {
+    cp.waterDay = day;
+    save();
+}
+
+const char* wakeCycle::stepName(int step) {
+    static const char* names[WAKE_STEPS] = {"connect", "close_valve", "settings", "sensors", "publish", "capture", "ota", "water", "sleep"};
+    return step >= 0 && step < WAKE_STEPS ? names[step] : "done";
+}
@@ -0,0 +1,157 @@
+#ifndef WAKE_CYCLE_H
+#define WAKE_CYCLE_H
+
+/*
+Wake cycle
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+The work of a wake (the cycle) is split into steps that setup() runs in order. The step in progress, the steps
+that are done, the nr of interrupted attempts per step and partial results are checkpointed in RTC memory.
+
+RTC_DATA_ATTR variables are only kept during deep sleep, they start from their initial values after a reset.
+The checkpoint is kept in RTC_NOINIT_ATTR memory instead, which survives a watchdog or brownout reset, and is
+validated with a checksum (it holds garbage after power on). A cycle that is interrupted by a reset (WiFi or MQTT
+stalls, brownout while the valve motor runs) is resumed at the step that failed on the next boot:
+    - Steps that are done are skipped, the sensor readings are restored from the checkpoint and topics that were
+      already published are not published again.
+    - CONNECT and SETTINGS are run again every boot, the radio and the settings do not survive a reset.
+    - A step that has been interrupted WAKE_MAX_ATTEMPTS times is given up for this cycle (logged as an error),
+      except closing the valve.
+    - The valve state is restored, the valve is not closed again after a reset unless it could be open.
+    - The day of the last watering is restored, watering is not repeated after a reset.
+The cycle ends when the device goes to deep sleep (sleepNow()).
+
+wakeSteps:
+    STEP_CONNECT      Connect WiFi and MQTT
+    STEP_CLOSE_VALVE  Close the valve if it is open
+    STEP_SETTINGS     Fetch settings via MQTT
+    STEP_SENSORS      Read the sensors
+    STEP_PUBLISH      Publish the readings
+    STEP_CAPTURE      Sample and stream a waveform, if requested
+    STEP_OTA          Download the next part of a firmware update
+    STEP_WATER        Water if it is time, may end the cycle
+    STEP_SLEEP        Calculate the sleep time and sleep, ends the cycle
+
+wakeCycle Class:
+    Purpose:
+        Runs the steps in order and keeps the checkpoint.
+    Public Methods:
+        begin(): Validate the checkpoint, resume an interrupted cycle or start a new one. Returns true if resumed.
+        next(): The next step to run (marked as in progress), STEP_DONE if there are none.
+        complete(int step): The step is done.
+        end(): The cycle is complete, called before deep sleep.
+        resumed(): The previous cycle was interrupted and is resumed.
+        interruptedAt(int step): The previous attempt was interrupted at this step.
+        saveReadings(double pressure, double battery), hasReadings(), getPressure(), getBatteryVoltage(): Sensor readings of the cycle.
+        isPublished(pubTopic topic), setPublished(pubTopic topic): Topics published in the cycle.
+        setValveOpen(bool open): The valve is about to be opened or has been closed.
+        setWaterDay(int32_t day): The watering of the day has been started.
+        stepName(int step): Static, name of a step.
+
+Retained Variables (RTC_NOINIT_ATTR):
+    cycleCheckpoint: The checkpoint.
+*/
+
+#include <Arduino.h>
+#include "topics.h"
+
+#define WAKE_MAX_ATTEMPTS 3        // Interrupted attempts before a step is given up for the cycle
+#define WAKE_MAGIC 0x57435943      // "WCYC"
+
+enum wakeSteps {
+    STEP_CONNECT = 0,
+    STEP_CLOSE_VALVE,
+    STEP_SETTINGS,
+    STEP_SENSORS,
+    STEP_PUBLISH,
+    STEP_CAPTURE,
+    STEP_OTA,
+    STEP_WATER,
+    STEP_SLEEP,
+    WAKE_STEPS,
+    STEP_DONE = WAKE_STEPS
+};
+
+// Steps run again every boot, their results do not survive a reset
+#define WAKE_PER_BOOT ((1 << STEP_CONNECT) | (1 << STEP_SETTINGS))
+
+struct wakeCheckpoint {
+    uint32_t magic;                // WAKE_MAGIC when valid
+    uint32_t cycles;               // Nr of cycles since power on
+    uint8_t step;                  // Step in progress, STEP_DONE when the cycle is complete
+    uint8_t attempts[WAKE_STEPS];  // Interrupted attempts per step this cycle
+    uint16_t done;                 // Steps done this cycle, bit mask
+    uint32_t published;            // Topics published this cycle, bit mask of pubTopic
+    bool valveOpen;                // Valve may be open
+    bool hasReadings;
+    float pressure;                // bar(e)
+    float batteryVoltage;          // V
+    int32_t waterDay;              // Local epoch day of the last watering, -1 none
+    uint32_t checksum;             // Of the fields above
+};
+
+static_assert((int)pubTopic::count <= 32, "published is a 32 bit mask");
+
+extern RTC_NOINIT_ATTR wakeCheckpoint cycleCheckpoint;
+
+class wakeCycle {
+    /*
+    Class for running the steps of a wake and checkpointing them in RTC memory.
+    */
+private:
+    wakeCheckpoint& cp;
+    bool resumedCycle;
+    uint8_t interruptedStep;   // Step the previous attempt was interrupted at, STEP_DONE if none
+
+    static uint32_t checksum(const wakeCheckpoint& c);
+    void save();
+
+public:
+    // Constructor
+    wakeCycle(wakeCheckpoint& checkpoint) : cp(checkpoint) {
+        resumedCycle = false;
+        interruptedStep = STEP_DONE;
+    }
+
+    bool begin();
+    int next();
+    void complete(int step);
+    void end();
+
+    bool resumed() const {
+        return resumedCycle;
+    }
+
+    bool interruptedAt(int step) const {
+        return interruptedStep == step;
+    }
+
+    void saveReadings(double pressure, double battery);
+
+    bool hasReadings() const {
+        return cp.hasReadings;
+    }
+
+    double getPressure() const {
+        return cp.pressure;
+    }
+
+    double getBatteryVoltage() const {
+        return cp.batteryVoltage;
+    }
+
+    bool isPublished(pubTopic topic) const {
+        return cp.published & (1UL << (int)topic);
+    }
+
+    void setPublished(pubTopic topic);
+    void setValveOpen(bool open);
+    void setWaterDay(int32_t day);
+
+    static const char* stepName(int step);
+};
+
+// Global cycle, ended by sleepNow()
+extern wakeCycle cycle;
+
+#endif
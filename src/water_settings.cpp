@@ -1,10 +1,25 @@
 #include "water_settings.h"
 #include "config.h"
 
-void settingsMQTT(String message){
+static bool received = false; // Settings arrived this wake
+RTC_DATA_ATTR static bool valid = false; // Settings arrived since the last reset, kept with settings
+
+void settingsMQTT(const char* message){
     // This function will be called when a settingsMQTT has been recieved.
     // It should recieve a json file with settings...
-    Serial.println("\nApplying new settings!");
-    settings.extractSettingsJSON(message.c_str());
+    LOG_INFO("Applying new settings");
+    received = true;
+    valid = true;
+    settings.extractSettingsJSON(message);
     settings.printExtractedIntegers();
+}
+
+bool settingsReceived(){
+    // The reply to the ready message has arrived this wake
+    return received;
+}
+
+bool settingsValid(){
+    // settings hold a reply, not only the defaults of device_spec.h
+    return valid;
 }
\ No newline at end of file
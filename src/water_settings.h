@@ -14,9 +14,14 @@ Communication with the MQTT to a node red script according to: (to be implemente
 1. When ready to recieve new settings a ready message is sent on topic xxxx
 2. Node red script will send a message coded in json with all settings
 3. An instance of class waterSettings containing all active settings can be suplied with json-formated string which will den extract and update all settings
+
+The global settings (config.h) are kept in RTC memory, a reply only changes the keys it contains and the settings
+stay in force on the wakes without radio. After a reset or power on they start from the defaults in device_spec.h
+until the next reply, settingsValid() tells which.
 */
 
 #include <ArduinoJson.h>
+#include "logger.h"
 
 struct timeHHMM {
     // Struct containing a time of day
@@ -34,6 +39,8 @@ class waterSettings {
     batteryLow       = at which battery voltage should a low battery warning be sent out?
     levelLow         = at which water level in tank should a low water level warning be sent out?
     defaultSleepTime = how many minutes to sleep between each wake upp
+    flowCoefficient  = flow coefficient of the installation, l/min per sqrt(bar), used to estimate delivered volume
+    waterVolume      = litres to deliver each watering session, 0 = water for timeToWater minutes instead
     waterOnDemand    = do an extra watering on demand, ie when recivied. 
     skipWatering     = no watering today thanks...
 
@@ -46,16 +53,16 @@ private:
     int batteryLow;
     int levelLow;
     int defaultSleepTime;
+    double flowCoefficient;
+    double waterVolume;
     bool waterOnDemand;
     bool skipWatering;
 
 public:
-    // Constructor
-    waterSettings(timeHHMM wTime, int tTime, int btrLow, int lvlLow, int defSleepTime) 
-            : waterTime(wTime), timeToWater(tTime), batteryLow(btrLow), levelLow(lvlLow), defaultSleepTime(defSleepTime) {
-                waterOnDemand = false;
-                skipWatering = false;
-            }
+    // Constructor, constexpr so the global settings are initialized at compile time (before any other global uses them)
+    constexpr waterSettings(timeHHMM wTime, int tTime, int btrLow, int lvlLow, int defSleepTime, double flowCoef, double wVolume) 
+            : timeToWater(tTime), waterTime(wTime), batteryLow(btrLow), levelLow(lvlLow), defaultSleepTime(defSleepTime),
+              flowCoefficient(flowCoef), waterVolume(wVolume), waterOnDemand(false), skipWatering(false) {}
 
     // Getter function for timeToWater
     int getTimeToWater() const {
@@ -87,14 +94,33 @@ public:
         return defaultSleepTime;
     }
 
+    // Getter function for flow coefficient, l/min per sqrt(bar)
+    double getFlowCoefficient() const {
+        return flowCoefficient;
+    }
+
+    // Getter function for volume to deliver per watering, l (0 = timed watering)
+    double getWaterVolume() const {
+        return waterVolume;
+    }
+
+    // Getter function for waterOnDemand, an extra watering is asked for (applied as a command when it becomes true, see command_channel.h)
+    bool getWaterOnDemand() const {
+        return waterOnDemand;
+    }
+
+    // Getter function for skipWatering, the next watering is to be skipped (applied as a command when it becomes true)
+    bool getSkipWatering() const {
+        return skipWatering;
+    }
+
     // Method to extract settings from JSON formatted data
     void extractSettingsJSON(const char* jsonData) {
         StaticJsonDocument<200> doc;
         DeserializationError error = deserializeJson(doc, jsonData);
 
         if (error) {
-            Serial.print(F("deserializeJson() failed: "));
-            Serial.println(error.f_str());
+            LOG_ERROR("deserializeJson() failed: %s", error.c_str());
             return;
         }
 
@@ -115,6 +141,12 @@ public:
         if (doc.containsKey("defaultSleepTime")) {
             defaultSleepTime = doc["defaultSleepTime"];
         }
+        if (doc.containsKey("flowCoefficient")) {
+            flowCoefficient = doc["flowCoefficient"];
+        }
+        if (doc.containsKey("waterVolume")) {
+            waterVolume = doc["waterVolume"];
+        }
         if (doc.containsKey("waterOnDemand")) {
             waterOnDemand = doc["waterOnDemand"];
         }
@@ -125,22 +157,15 @@ public:
 
     void printExtractedIntegers() {
         
-        Serial.print("\ntimeToWater: ");
-        Serial.println(timeToWater);
-        Serial.print("waterTime - HH: ");
-        Serial.println(waterTime.HH);
-        Serial.print("waterTime - MM: ");
-        Serial.println(waterTime.MM);
-        Serial.print("batteryLow: ");
-        Serial.println(batteryLow);
-        Serial.print("levelLow: ");
-        Serial.println(levelLow);
-        Serial.print("defaultSleepTime: ");
-        Serial.println(defaultSleepTime);
+        LOG_DEBUG("timeToWater %d min, waterTime %02d:%02d, batteryLow %d, levelLow %d, defaultSleepTime %d s",
+                  timeToWater, waterTime.HH, waterTime.MM, batteryLow, levelLow, defaultSleepTime);
+        LOG_DEBUG("flowCoefficient %.2f, waterVolume %.1f l", flowCoefficient, waterVolume);
     }
 };
 
 // Functions from CPP-file that should be accessible
-void settingsMQTT(String);
+void settingsMQTT(const char*);
+bool settingsReceived();
+bool settingsValid();
 
 #endif
\ No newline at end of file
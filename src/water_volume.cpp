@@ -0,0 +1,103 @@
+/*
+Water volume accounting
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+*/
+
+#include "water_volume.h"
+#include "logger.h"
+#include "multitasker.h"
+#include <time.h>
+
+#define SAMPLE_INTERVAL_MS 100 // High-rate sampling while the valve is open, 10 Hz
+#define BURST_SAMPLES 20       // Nr of samples averaged at start/end of a timed session
+
+// Retain session state after sleep
+RTC_DATA_ATTR double lastSessionVolume = 0.0;
+RTC_DATA_ATTR double sessionStartPressure = 0.0; // bar(e), pressure just after the valve was opened
+RTC_DATA_ATTR time_t sessionStartTime = 0;       // When the timed session started
+
+static double burstPressure(sensors& sns) {
+    // Average a short burst of fast samples, used at the ends of a timed session
+    int64_t pressure = 0; // ubar(e)
+    for (int i = 0; i < BURST_SAMPLES; i++) {
+        pressure += sns.samplePressureMicrobar();
+        delay(10);
+    }
+    return pressure / 1e6 / BURST_SAMPLES;
+}
+
+struct deliveryState {
+    // Shared by the tasks of deliverVolume()
+    taskScheduler* scheduler;
+    volumeAccountant* session;
+    sensors* sns;
+    buttons* btn;
+    double targetVolume;
+};
+
+static void deliverySample(void* arg) {
+    deliveryState* d = (deliveryState*)arg;
+    d->session->addSample(d->sns->samplePressure(), millis());
+    if (d->session->getVolume() >= d->targetVolume) {
+        d->scheduler->stop();
+    }
+    else if (d->btn->event() == BUTTON_CLOSE) {
+        LOG_INFO("Delivery stopped by SW2");
+        d->scheduler->stop();
+    }
+}
+
+double deliverVolume(valve& vlv, sensors& sns, buttons& btn, double coefficient, double targetVolume, long maxSeconds) {
+    /*
+    Open the valve and keep it open until targetVolume litres has been delivered,
+    the valve is closed after maxSeconds regardless (i.e. empty tank or wrong coefficient) or when SW2 is pressed.
+
+    Pressure is sampled at SAMPLE_INTERVAL_MS while the valve is open, the radio is off so the
+    scheduler light sleeps between the samples.
+    */
+    volumeAccountant session(coefficient);
+    taskScheduler scheduler;
+    deliveryState state = {&scheduler, &session, &sns, &btn, targetVolume};
+
+    vlv.open();
+
+    session.start(sns.samplePressure(), millis());
+
+    scheduler.setLightSleep(true);
+    scheduler.every(SAMPLE_INTERVAL_MS, &deliverySample, &state, SAMPLE_INTERVAL_MS);
+    scheduler.run((uint32_t)maxSeconds * 1000);
+
+    vlv.close();
+
+    lastSessionVolume = session.getVolume();
+    LOG_INFO("Delivered %.1f l of %.1f l", lastSessionVolume, targetVolume);
+    return lastSessionVolume;
+}
+
+void volumeSessionStart(sensors& sns) {
+    // Start a timed session, the valve should already be open.
+    // The device sleeps during watering so only the pressure at the start is kept.
+    sessionStartPressure = burstPressure(sns);
+    sessionStartTime = time(nullptr);
+}
+
+double volumeSessionFinish(sensors& sns, double coefficient) {
+    // Finish a timed session, call before the valve is closed.
+    // Integrates between the pressure at opening and the pressure now.
+    volumeAccountant session(coefficient);
+
+    double pressure = burstPressure(sns);
+    double seconds = difftime(time(nullptr), sessionStartTime);
+
+    // No valid start, i.e. the valve was open at first boot
+    if (sessionStartTime == 0 || seconds < 0) {
+        seconds = 0;
+    }
+
+    session.addInterval(sessionStartPressure, pressure, seconds);
+    sessionStartTime = 0;
+
+    lastSessionVolume = session.getVolume();
+    LOG_INFO("Delivered %.1f l in %.0f s", lastSessionVolume, (double)seconds);
+    return lastSessionVolume;
+}
@@ -0,0 +1,106 @@
+#ifndef WATER_VOLUME_H
+#define WATER_VOLUME_H
+
+/*
+Water volume accounting
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+Estimates how many litres each watering session delivers from the pressure signal.
+
+The flow through the installation is modelled as an orifice, flow = C * sqrt(dP), where dP is the
+pressure before the valve (bar(e), the outlet is at atmospheric pressure) and C is a per-installation
+flow coefficient in l/min per sqrt(bar) (see flowCoefficient in config.cpp, may be updated via MQTT).
+The flow rate is integrated over pressure samples taken while the valve is open.
+
+volumeAccountant Class:
+    Purpose:
+        Integrates the estimated flow rate over pressure samples (trapezoidal rule).
+    Private Variables:
+        flowCoefficient, volume, lastFlow, lastSampleMs, active.
+    Public Methods:
+        volumeAccountant(double coefficient): Constructor, coefficient in l/min per sqrt(bar).
+        flowRate(double pressure, double coefficient): Static, estimated flow in l/min at a given pressure.
+        start(double pressure, unsigned long nowMs): Start a new session with a first sample.
+        addSample(double pressure, unsigned long nowMs): Add a sample and integrate since the last one.
+        addInterval(double pStart, double pEnd, double seconds): Integrate over an interval without samples (i.e. during sleep).
+        getVolume(): Volume delivered so far, l.
+
+Functions:
+    deliverVolume(...): Opens the valve, samples pressure at a high rate and closes the valve when the target volume
+        has been delivered, the maximum time has passed or SW2 is pressed. Returns delivered volume.
+    volumeSessionStart(...): Start a timed session that continues during deep sleep, stores the pressure and time at
+        opening in RTC memory.
+    volumeSessionFinish(...): Finish a timed session, called just before the valve is closed on the next boot.
+
+Retained Variables (RTC_DATA_ATTR):
+    lastSessionVolume: Volume delivered by the last finished watering session, l.
+*/
+
+#include <Arduino.h>
+#include "hardware_functions.h"
+
+// Volume delivered during the last finished session, retained after sleep.
+extern RTC_DATA_ATTR double lastSessionVolume;
+
+class volumeAccountant {
+    /*
+    Class that integrates an estimated flow rate (orifice model) over pressure samples.
+    */
+private:
+    double flowCoefficient; // l/min per sqrt(bar)
+    double volume;          // l, delivered this session
+    double lastFlow;        // l/min, flow at last sample
+    unsigned long lastSampleMs;
+    bool active;
+
+public:
+    // Constructor
+    volumeAccountant(double coefficient)
+        : flowCoefficient(coefficient), volume(0.0), lastFlow(0.0), lastSampleMs(0), active(false) {}
+
+    static double flowRate(double pressure, double coefficient) {
+        // Estimated flow in l/min for a given pressure in bar(e), no flow for negative pressure (sensor offset)
+        if (pressure <= 0.0) {
+            return 0.0;
+        }
+        return coefficient * sqrt(pressure);
+    }
+
+    void start(double pressure, unsigned long nowMs) {
+        // Start a new session
+        volume = 0.0;
+        lastFlow = flowRate(pressure, flowCoefficient);
+        lastSampleMs = nowMs;
+        active = true;
+    }
+
+    void addSample(double pressure, unsigned long nowMs) {
+        // Add a pressure sample and integrate (trapezoidal) since the last one
+        if (!active) {
+            start(pressure, nowMs);
+            return;
+        }
+        double flow = flowRate(pressure, flowCoefficient);
+        double minutes = (nowMs - lastSampleMs) / 60000.0;
+        volume += (lastFlow + flow) / 2.0 * minutes;
+        lastFlow = flow;
+        lastSampleMs = nowMs;
+    }
+
+    void addInterval(double pStart, double pEnd, double seconds) {
+        // Integrate over an interval where no samples could be taken (i.e. during deep sleep)
+        double flowStart = flowRate(pStart, flowCoefficient);
+        double flowEnd = flowRate(pEnd, flowCoefficient);
+        volume += (flowStart + flowEnd) / 2.0 * seconds / 60.0;
+    }
+
+    double getVolume() const {
+        return volume;
+    }
+};
+
+double deliverVolume(valve& vlv, sensors& sns, buttons& btn, double coefficient, double targetVolume, long maxSeconds);
+void volumeSessionStart(sensors& sns);
+double volumeSessionFinish(sensors& sns, double coefficient);
+
+#endif
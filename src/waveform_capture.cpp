@@ -0,0 +1,200 @@
+/*
+Waveform capture
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+*/
+
+#include "waveform_capture.h"
+#include <ArduinoJson.h>
+#include "logger.h"
+#include "hardware_functions.h"
+
+#ifndef WATER_THING_SIM
+#include <driver/i2s.h>
+#include <driver/adc.h>
+#include <soc/syscon_struct.h>
+#endif
+
+RTC_DATA_ATTR uint16_t captureDoneId = 0;
+RTC_DATA_ATTR captureRequest captureJob = {};
+
+waveformCapture capture(captureJob);
+
+// Samples of a capture, preallocated so a capture does not depend on the heap left after WiFi and TLS
+static uint16_t captureBuffer[CAPTURE_SAMPLES];
+
+void captureRequestMQTT(const char* message) {
+    // Called when a message arrives on the capture topic, empty when the request has been cleared
+    if (message[0] == '\0') {
+        return;
+    }
+    capture.request(message);
+}
+
+void waveformCapture::request(const char* json) {
+    StaticJsonDocument<128> doc;
+    DeserializationError error = deserializeJson(doc, json);
+    if (error) {
+        LOG_ERROR("Capture request not valid: %s", error.c_str());
+        return;
+    }
+    request(doc.containsKey("id") ? (uint16_t)doc["id"] : 0,
+            doc.containsKey("rate") ? (uint32_t)doc["rate"] : CAPTURE_DEFAULT_RATE,
+            doc.containsKey("ms") ? (uint32_t)doc["ms"] : CAPTURE_DEFAULT_MS,
+            doc.containsKey("battery") ? (bool)doc["battery"] : false);
+}
+
+void waveformCapture::request(uint16_t captureId, uint32_t captureRate, uint32_t captureMs, bool withBattery) {
+    // 0 for rate or ms: the default
+    if (captureId != 0 && captureId == captureDoneId) {
+        LOG_DEBUG("Capture %u already streamed", (unsigned int)captureId);
+        return;
+    }
+    job.id = captureId;
+    job.rate = captureRate != 0 ? captureRate : CAPTURE_DEFAULT_RATE;
+    job.ms = captureMs != 0 ? captureMs : CAPTURE_DEFAULT_MS;
+    job.battery = withBattery;
+    if (job.rate < CAPTURE_MIN_RATE) job.rate = CAPTURE_MIN_RATE;
+    if (job.rate > CAPTURE_MAX_RATE) job.rate = CAPTURE_MAX_RATE;
+    if (job.ms > CAPTURE_MAX_MS) job.ms = CAPTURE_MAX_MS;
+    job.pending = true;
+    LOG_INFO("Capture %u requested, %lu Hz for %lu ms%s", (unsigned int)job.id, (unsigned long)job.rate,
+             (unsigned long)job.ms, job.battery ? " with battery" : "");
+}
+
+#ifdef WATER_THING_SIM
+size_t waveformCapture::sample(uint16_t* buffer, size_t samples, uint8_t channels) {
+    // The ADC read at the conversion rate, in the format of the I2S samples
+    uint32_t periodUs = 1000000UL / (job.rate * (channels == 3 ? 2 : 1));
+    for (size_t i = 0; i < samples; i++) {
+        bool second = channels == 3 && (i & 1);
+        uint16_t code = analogRead(second ? 35 : 33);
+        buffer[i] = (uint16_t)((second ? CAPTURE_BATTERY_CHANNEL : CAPTURE_PRESSURE_CHANNEL) << 12) | (code & 0x0FFF);
+        if (i % CAPTURE_DMA_LEN == 0) {
+            buttons::poll();
+        }
+        delayMicroseconds(periodUs);
+    }
+    return samples;
+}
+#else
+size_t waveformCapture::sample(uint16_t* buffer, size_t samples, uint8_t channels) {
+    // I2S0 in ADC mode, DMA into the driver's buffers, see the header
+    i2s_config_t config = {};
+    config.mode = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_RX | I2S_MODE_ADC_BUILT_IN);
+    config.sample_rate = job.rate * (channels == 3 ? 2 : 1);
+    config.bits_per_sample = I2S_BITS_PER_SAMPLE_16BIT;
+    config.channel_format = I2S_CHANNEL_FMT_ONLY_LEFT;
+    config.communication_format = I2S_COMM_FORMAT_STAND_I2S;
+    config.dma_buf_count = CAPTURE_DMA_BUFFERS;
+    config.dma_buf_len = CAPTURE_DMA_LEN;
+    if (i2s_driver_install(I2S_NUM_0, &config, 0, nullptr) != ESP_OK) {
+        LOG_ERROR("Capture, I2S driver not installed");
+        return 0;
+    }
+    adc1_config_width(ADC_WIDTH_BIT_12);
+    adc1_config_channel_atten((adc1_channel_t)CAPTURE_PRESSURE_CHANNEL, ADC_ATTEN_DB_11);
+    adc1_config_channel_atten((adc1_channel_t)CAPTURE_BATTERY_CHANNEL, ADC_ATTEN_DB_11);
+    i2s_set_adc_mode(ADC_UNIT_1, (adc1_channel_t)CAPTURE_PRESSURE_CHANNEL);
+    i2s_adc_enable(I2S_NUM_0);
+    if (channels == 3) {
+        // After i2s_adc_enable(), it writes a pattern table with the one channel of i2s_set_adc_mode()
+        // Pattern table: channel << 4 | 12 bit (3) << 2 | 11 dB (3), one byte per conversion from the top
+        SYSCON.saradc_ctrl.sar1_patt_len = 1;
+        SYSCON.saradc_sar1_patt_tab[0] = ((CAPTURE_PRESSURE_CHANNEL << 4 | 0x0F) << 24) | ((CAPTURE_BATTERY_CHANNEL << 4 | 0x0F) << 16);
+    }
+
+    const TickType_t timeout = pdMS_TO_TICKS(job.ms + 1000);
+    size_t bytes = 0;
+    i2s_read(I2S_NUM_0, buffer, CAPTURE_DMA_LEN * sizeof(uint16_t), &bytes, timeout); // Discarded
+    size_t got = 0;
+    while (got < samples) {
+        // A DMA buffer at a time, a press is acted on between them (the valve moves while the DMA samples)
+        size_t n = samples - got < CAPTURE_DMA_LEN ? samples - got : CAPTURE_DMA_LEN;
+        buttons::poll();
+        if (i2s_read(I2S_NUM_0, buffer + got, n * sizeof(uint16_t), &bytes, timeout) != ESP_OK || bytes == 0) {
+            LOG_WARN("Capture, DMA read stopped after %u samples", (unsigned int)got);
+            break;
+        }
+        got += bytes / sizeof(uint16_t);
+    }
+    i2s_adc_disable(I2S_NUM_0);
+    i2s_driver_uninstall(I2S_NUM_0);
+
+    // Time order, each 32 bit word holds two samples with the later one first
+    got &= ~(size_t)1;
+    for (size_t i = 0; i < got; i += 2) {
+        uint16_t t = buffer[i];
+        buffer[i] = buffer[i + 1];
+        buffer[i + 1] = t;
+    }
+    return got;
+}
+#endif
+
+void waveformCapture::run(transport& uplink, const char* dataTopic, const char* requestTopic) {
+    uint8_t channels = job.battery ? 3 : 1;
+    size_t samples = (size_t)job.rate * (job.battery ? 2 : 1) * job.ms / 1000;
+    if (samples > CAPTURE_SAMPLES) {
+        samples = CAPTURE_SAMPLES;
+    }
+    if (samples < 2) {
+        samples = 2;
+    }
+
+    captureHeader header;
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    header.id = job.id;
+    header.channels = channels;
+    header.reserved = 0;
+    header.rate = job.rate;
+    header.start = (uint32_t)time(nullptr);
+
+    unsigned long start = millis();
+    samples = sample(captureBuffer, samples, channels);
+    unsigned long sampled = millis();
+    if (samples == 0) {
+        LOG_ERROR("Capture %u, no samples, request dropped", (unsigned int)job.id);
+        job.pending = false;
+        return;
+    }
+    if (channels == 3 && samples > 2 && (captureBuffer[0] >> 12) == CAPTURE_BATTERY_CHANNEL) {
+        // The scan started at the battery channel, the capture starts at the next pair
+        memmove(captureBuffer, captureBuffer + 1, (samples - 1) * sizeof(uint16_t));
+        samples -= 2;
+    }
+    size_t wrong = 0;
+    for (size_t i = 0; i < samples; i++) {
+        uint16_t expected = channels == 3 && (i & 1) ? CAPTURE_BATTERY_CHANNEL : CAPTURE_PRESSURE_CHANNEL;
+        if ((captureBuffer[i] >> 12) != expected) {
+            wrong++;
+        }
+    }
+    if (wrong > 0) {
+        // The ADC did not scan the requested channels, the samples would be read as pressure and voltage
+        LOG_ERROR("Capture %u, %u of %u samples from the wrong ADC channel, request dropped", (unsigned int)job.id,
+                  (unsigned int)wrong, (unsigned int)samples);
+        job.pending = false;
+        return;
+    }
+
+    header.samples = samples;
+    header.chunks = (samples + CAPTURE_CHUNK_SAMPLES - 1) / CAPTURE_CHUNK_SAMPLES;
+    uint16_t sent = 0;
+    for (header.chunk = 0; header.chunk < header.chunks; header.chunk++) {
+        size_t first = (size_t)header.chunk * CAPTURE_CHUNK_SAMPLES;
+        size_t n = samples - first < CAPTURE_CHUNK_SAMPLES ? samples - first : CAPTURE_CHUNK_SAMPLES;
+        if (!uplink.publishBinary(dataTopic, (const uint8_t*)&header, sizeof(header), (const uint8_t*)(captureBuffer + first), n * sizeof(uint16_t))) {
+            break;
+        }
+        sent++;
+    }
+    if (sent < header.chunks) {
+        LOG_WARN("Capture %u, %u of %u chunks sent over %s", (unsigned int)job.id, (unsigned int)sent, (unsigned int)header.chunks, uplink.name());
+        return; // The request is kept in RTC memory, it is captured again on the next wake with the broker connected
+    }
+    LOG_INFO("Capture %u, %u samples in %lu ms, streamed in %lu ms", (unsigned int)job.id, (unsigned int)samples,
+             sampled - start, millis() - sampled);
+    captureDoneId = job.id;
+    job.pending = false;
+    uplink.publish(requestTopic, "", true);
+}
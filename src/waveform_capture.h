@@ -0,0 +1,138 @@
+#ifndef WAVEFORM_CAPTURE_H
+#define WAVEFORM_CAPTURE_H
+
+/*
+Waveform capture
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+On request the pressure (GPIO33, ADC1 channel 5), and optionally the battery voltage (GPIO35, ADC1 channel 7), is
+sampled at a high rate for a short window and streamed over the uplink, to look at pump cycling, valve chatter or
+water hammer at a site. The normal readings are averages of a few samples per wake (hardware_functions.h).
+
+A capture is requested by publishing retained with QoS 1 on the capture topic (water_thing/capture), e.g.
+    mosquitto_pub -r -q 1 -t water_thing/capture -m '{"id":7,"rate":2000,"ms":3000,"battery":true}'
+    id       Identifies the request, a request with the id of the last capture is ignored (the clear was lost).
+             0 or missing: not checked.
+    rate     Samples per second per channel, CAPTURE_MIN_RATE - CAPTURE_MAX_RATE, default CAPTURE_DEFAULT_RATE.
+    ms       Window, at most CAPTURE_MAX_MS and what fits in the buffer (CAPTURE_SAMPLES over all channels).
+    battery  Also sample the battery voltage, the samples of the two channels alternate.
+The request arrives in the settings step, the capture runs in its own step of the wake cycle (STEP_CAPTURE, with the
+radio still up) and is streamed right after it, the device is awake for the window and the streaming only. The
+request is kept in RTC memory (captureJob) until all chunks have been sent, then it is dropped and the retained
+request is cleared. A capture whose stream broke off is taken again on the next wake with the broker connected,
+the retained request is not delivered again in the persistent session (mqtt_handler.h). Captures need the MQTT
+uplink, the other backends do not stream binary messages and drop the request.
+
+Sampling:
+    The SAR ADC is driven by I2S0 in ADC mode, samples are moved by DMA into the I2S driver's buffers
+    (CAPTURE_DMA_BUFFERS of CAPTURE_DMA_LEN samples) and read from there into captureBuffer, a static buffer: no
+    allocation per capture. With the battery channel the ADC pattern table scans both channels, the conversion rate
+    is rate * 2. The table is written after i2s_adc_enable(), which sets a table with one channel. The first DMA
+    buffer is discarded (samples from before the pattern was set). The ESP32 I2S swaps the samples of each 32 bit
+    word, they are put back in time order in place. run() checks the channel in each sample: a capture that starts
+    at the battery channel is moved on by one sample, a capture with samples from any other channel is not streamed
+    and the request is dropped.
+    In the simulator the ADC is read with analogRead() at the rate instead.
+
+Stream, one binary message per chunk on the capture_data topic, written from captureBuffer without copying
+(transport::publishBinary()). Each chunk starts with captureHeader, little endian:
+    "WTC1", capture id (uint16), chunk nr (uint16), nr of chunks (uint16), channel mask (uint8, 1: GPIO33,
+    2: GPIO35), reserved (uint8), rate per channel in Hz (uint32), samples in the capture (uint32, all channels),
+    start of the capture (uint32, epoch)
+followed by up to CAPTURE_CHUNK_SAMPLES samples (uint16): ADC code in bits 0 - 11, ADC1 channel in bits 12 - 15.
+tools/capture_reassemble.py puts the chunks together and writes the samples as CSV with pressure and voltage.
+
+waveformCapture Class:
+    Purpose:
+        Keeps the request in RTC memory, samples and streams.
+    Public Methods:
+        request(const char* json): Parse a request, called from captureRequestMQTT().
+        request(uint16_t id, uint32_t rate, uint32_t ms, bool battery): Request a capture, 0 for rate or ms is the
+            default. Used by the capture command (command_channel.h).
+        pending(): A capture is requested.
+        cancel(): Drop the request.
+        run(transport& uplink, const char* dataTopic, const char* requestTopic): Sample and stream, the request is
+            dropped and the retained request cleared when all chunks were sent.
+
+Functions:
+    captureRequestMQTT(const char* message): Called when a message arrives on the capture topic.
+
+Retained Variables (RTC_DATA_ATTR):
+    captureDoneId: Id of the last capture streamed.
+    captureJob: The request until it has been streamed.
+*/
+
+#include <Arduino.h>
+#include "transport.h"
+
+#define CAPTURE_SAMPLES 8192       // captureBuffer, 16 KB
+#define CAPTURE_CHUNK_SAMPLES 512  // Samples per message, 1 KB
+#define CAPTURE_DEFAULT_RATE 1000  // Hz per channel
+#define CAPTURE_MIN_RATE 100
+#define CAPTURE_MAX_RATE 20000
+#define CAPTURE_DEFAULT_MS 2000
+#define CAPTURE_MAX_MS 10000
+#define CAPTURE_DMA_BUFFERS 4
+#define CAPTURE_DMA_LEN 256        // Samples per DMA buffer
+#define CAPTURE_PRESSURE_CHANNEL 5 // ADC1 channel of GPIO33
+#define CAPTURE_BATTERY_CHANNEL 7  // ADC1 channel of GPIO35
+#define CAPTURE_MAGIC "WTC1"
+
+struct captureHeader {
+    char magic[4];
+    uint16_t id;
+    uint16_t chunk;
+    uint16_t chunks;
+    uint8_t channels;
+    uint8_t reserved;
+    uint32_t rate;
+    uint32_t samples;
+    uint32_t start;
+};
+
+static_assert(sizeof(captureHeader) == 24, "captureHeader is sent as is");
+
+struct captureRequest {
+    bool pending;            // Requested and not streamed yet
+    bool battery;            // Also the battery voltage
+    uint16_t id;
+    uint32_t rate;           // Hz per channel
+    uint32_t ms;             // Window
+};
+
+extern RTC_DATA_ATTR uint16_t captureDoneId;
+extern RTC_DATA_ATTR captureRequest captureJob;
+
+class waveformCapture {
+    /*
+    Class for the capture, the request is kept in RTC memory until it has been streamed.
+    */
+private:
+    captureRequest& job;
+
+    size_t sample(uint16_t* buffer, size_t samples, uint8_t channels);
+
+public:
+    // Constructor
+    waveformCapture(captureRequest& request) : job(request) {}
+
+    void request(const char* json);
+    void request(uint16_t captureId, uint32_t captureRate, uint32_t captureMs, bool withBattery);
+
+    bool pending() const {
+        return job.pending;
+    }
+
+    void cancel() {
+        job.pending = false;
+    }
+
+    void run(transport& uplink, const char* dataTopic, const char* requestTopic);
+};
+
+void captureRequestMQTT(const char* message);
+
+// Global capture, requested via MQTT
+extern waveformCapture capture;
+
+#endif
@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+"""
+Reassemble a water_thing waveform capture
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+Puts the chunks of a capture (src/waveform_capture.h) back together and writes the samples as CSV: time in ms
+from the start of the capture, channel, ADC code and the value (pressure in bar(e) for GPIO33, battery voltage in
+V for GPIO35). The chunks are read as one hex payload per line, as printed by
+    mosquitto_sub -t water_thing/capture_data -F %x > capture.hex
+or as raw payload files, one chunk per file. Chunks may arrive in any order and twice, missing chunks are reported.
+
+    python3 tools/capture_reassemble.py capture.hex > capture.csv
+    python3 tools/capture_reassemble.py --id 7 capture.hex > capture.csv
+    python3 tools/capture_reassemble.py --raw chunk_*.bin > capture.csv
+
+With captures of several ids in the input the last one is written unless --id is given.
+"""
+
+import argparse
+import struct
+import sys
+
+MAGIC = b"WTC1"
+HEADER = struct.Struct("<4sHHHBBIII")    # captureHeader, 24 bytes
+
+PRESSURE_CHANNEL = 5    # CAPTURE_PRESSURE_CHANNEL, GPIO33
+BATTERY_CHANNEL = 7     # CAPTURE_BATTERY_CHANNEL, GPIO35
+CHUNK_SAMPLES = 512     # CAPTURE_CHUNK_SAMPLES
+
+# Conversions of src/sensor_math.h (double reference)
+ADC_X0 = 0.175101646
+ADC_X1 = 0.000725018385
+ADC_X2 = 0.0000000888075249
+ADC_X3 = 0.0000000000220849715
+R6, R7 = 67.3e3, 117.3e3
+R1, R2 = 100.0e3, 30.0e3
+U_LOW, U_HIGH, P_LOW, P_HIGH = 0.5, 4.5, 0.0, 2.068
+
+
+def voltage(adc):
+    return ADC_X0 + ADC_X1 * adc + ADC_X2 * ADC_X2 * adc + ADC_X3 * ADC_X3 * ADC_X3 * adc
+
+
+def pressure(adc):
+    k = (P_HIGH - P_LOW) / (U_HIGH - U_LOW)
+    return k * ((R6 + R7) / R7 * voltage(adc)) + P_LOW - U_LOW * k
+
+
+def battery(adc):
+    return (R1 + R2) / R2 * voltage(adc)
+
+
+def payloads(args):
+    if args.raw:
+        for name in args.files:
+            with open(name, "rb") as f:
+                yield f.read()
+        return
+    streams = [open(f) for f in args.files] if args.files else [sys.stdin]
+    for stream in streams:
+        for line in stream:
+            line = line.strip()
+            if line:
+                yield bytes.fromhex(line)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Reassemble a water_thing waveform capture")
+    parser.add_argument("files", nargs="*", help="Hex lines (stdin if none) or raw chunk files with --raw")
+    parser.add_argument("--raw", action="store_true", help="One raw chunk per file")
+    parser.add_argument("--id", type=int, help="Capture id, the last capture in the input if not given")
+    args = parser.parse_args()
+
+    captures = {}    # (id, start) -> (header, {chunk: samples})
+    order = []
+    for payload in payloads(args):
+        if len(payload) < HEADER.size or payload[:4] != MAGIC:
+            print("Not a capture chunk, %d bytes skipped" % len(payload), file=sys.stderr)
+            continue
+        magic, cid, chunk, chunks, channels, _, rate, samples, start = HEADER.unpack_from(payload)
+        if args.id is not None and cid != args.id:
+            continue
+        key = (cid, start)
+        if key not in captures:
+            captures[key] = ((chunks, channels, rate, samples, start), {})
+            order.append(key)
+        data = payload[HEADER.size:]
+        captures[key][1][chunk] = struct.unpack("<%dH" % (len(data) // 2), data[:len(data) // 2 * 2])
+
+    if not order:
+        sys.exit("No capture found")
+    key = order[-1]
+    (chunks, channels, rate, samples, start), parts = captures[key]
+    missing = [i for i in range(chunks) if i not in parts]
+    if missing:
+        print("Capture %d: chunks %s missing, the gaps are left out" % (key[0], missing), file=sys.stderr)
+
+    per_sample_ms = 1000.0 / (rate * bin(channels).count("1"))
+    print("ms,channel,adc,value")
+    received = 0
+    for i in range(chunks):
+        part = parts.get(i, ())
+        index = i * CHUNK_SAMPLES
+        received += len(part)
+        for word in part:
+            channel, adc = word >> 12, word & 0x0FFF
+            if channel == PRESSURE_CHANNEL:
+                name, value = "pressure", pressure(adc)
+            elif channel == BATTERY_CHANNEL:
+                name, value = "battery", battery(adc)
+            else:
+                name, value = "ch%d" % channel, float(adc)
+            print("%.3f,%s,%d,%.4f" % (index * per_sample_ms, name, adc, value))
+            index += 1
+    print("Capture %d: %d of %d samples, %d Hz per channel, started %d" % (key[0], received, samples, rate, start),
+          file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
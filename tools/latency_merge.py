@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+"""
+Merge water_thing latency histograms
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+Reads the daily latency messages (src/latency_stats.h), one JSON object per line, e.g. collected with
+    mosquitto_sub -t '+/latency' >> latency.jsonl
+and prints count, p50, p90, p99 and max per metric over all devices and days given. Histograms are merged by adding
+the counts bucket by bucket, percentiles of the merged histogram are exact up to the bucket width (25 %).
+
+    python3 tools/latency_merge.py latency.jsonl
+    python3 tools/latency_merge.py --since 1717200000 latency.jsonl
+
+Messages published twice (same metric, device topic and start) are counted once when the topic is kept in the
+line as {"topic":..,"payload":{..}}, plain payloads are all counted.
+"""
+
+import argparse
+import json
+import sys
+
+SUB_BUCKETS = 4     # LATENCY_SUB_BUCKETS
+BUCKETS = 64        # LATENCY_BUCKETS
+
+
+def bucket_start(i):
+    if i < SUB_BUCKETS:
+        return i
+    return (SUB_BUCKETS + i % SUB_BUCKETS) << (i // SUB_BUCKETS - 1)
+
+
+def percentile(counts, maximum, percent):
+    # Upper bound of the bucket holding the percentile, as the device reports it
+    n = sum(counts)
+    if n == 0:
+        return 0
+    rank = max(1, (n * percent + 99) // 100)
+    seen = 0
+    for i in range(BUCKETS - 1):
+        seen += counts[i]
+        if seen >= rank:
+            return min(bucket_start(i + 1) - 1, maximum)
+    return maximum
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Merge water_thing latency histograms")
+    parser.add_argument("files", nargs="*", help="JSON lines, stdin if none")
+    parser.add_argument("--since", type=int, default=0, help="Only periods starting at or after this epoch")
+    args = parser.parse_args()
+
+    merged = {}
+    seen = set()
+    streams = [open(f) for f in args.files] if args.files else [sys.stdin]
+    for stream in streams:
+        for line in stream:
+            line = line.strip()
+            if not line:
+                continue
+            record = json.loads(line)
+            topic = None
+            if "payload" in record:
+                topic, record = record.get("topic"), record["payload"]
+            if record["start"] < args.since:
+                continue
+            if topic is not None:
+                key = (topic, record["metric"], record["start"])
+                if key in seen:
+                    continue
+                seen.add(key)
+            counts, maximum = merged.setdefault(record["metric"], ([0] * BUCKETS, [0]))
+            for i, c in enumerate(record["c"]):
+                counts[record["b0"] + i] += c
+            maximum[0] = max(maximum[0], record["max"])
+
+    print("%-8s %10s %8s %8s %8s %8s" % ("metric", "n", "p50", "p90", "p99", "max"))
+    for metric, (counts, maximum) in merged.items():
+        print("%-8s %10d %8d %8d %8d %8d" % (metric, sum(counts), percentile(counts, maximum[0], 50),
+                                             percentile(counts, maximum[0], 90), percentile(counts, maximum[0], 99),
+                                             maximum[0]))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,170 @@
+#!/usr/bin/env python3
+"""
+Make a firmware delta for water_thing
+By Christoffer Rappmann, christoffer.rappmann@gmail.com
+
+Makes a delta that turns the running firmware (base) into a new firmware, in the format read by
+src/ota_update.cpp. The delta is applied and checked against the new image before it is written.
+
+    python3 tools/make_delta.py old/firmware.bin .pio/build/upesy_wroom/firmware.bin fw.delta
+    python3 -m http.server 8000
+    mosquitto_pub -r -t water_thing/ota -m http://192.168.1.10:8000/fw.delta
+
+Format (little endian):
+    Header: "WTD1", delta size, base size, new size (uint32), SHA-256 of base, SHA-256 of new image
+    Ops:    0x01 COPY offset length | 0x02 INSERT length bytes | 0x03 FILL length byte, varints are LEB128
+
+Matches are found with an index of BLOCK byte blocks of the base at every ALIGN:th offset and extended byte by
+byte in both directions, code that moved by any amount is found as long as one aligned block is unchanged.
+"""
+
+import argparse
+import hashlib
+import struct
+import sys
+
+MAGIC = b"WTD1"
+HEADER = struct.Struct("<4sIII32s32s")
+OP_COPY, OP_INSERT, OP_FILL = 1, 2, 3
+
+BLOCK = 16      # Bytes hashed per index entry
+ALIGN = 4       # Base offsets indexed
+MIN_COPY = 12   # Shorter matches are inserted, a COPY costs up to 11 bytes
+MIN_FILL = 8    # Shorter runs are inserted
+
+
+def varint(value):
+    out = bytearray()
+    while True:
+        byte = value & 0x7F
+        value >>= 7
+        if value:
+            out.append(byte | 0x80)
+        else:
+            out.append(byte)
+            return bytes(out)
+
+
+def emit_literal(ops, data):
+    # Runs of one byte (flash padding) become FILL, the rest INSERT
+    i = 0
+    start = 0
+    while i < len(data):
+        j = i
+        while j < len(data) and data[j] == data[i]:
+            j += 1
+        if j - i >= MIN_FILL:
+            if i > start:
+                ops += bytes([OP_INSERT]) + varint(i - start) + data[start:i]
+            ops += bytes([OP_FILL]) + varint(j - i) + bytes([data[i]])
+            start = j
+        i = j
+    if start < len(data):
+        ops += bytes([OP_INSERT]) + varint(len(data) - start) + data[start:]
+
+
+def make_delta(base, new):
+    index = {}
+    for offset in range(0, len(base) - BLOCK + 1, ALIGN):
+        index.setdefault(base[offset:offset + BLOCK], offset)
+
+    ops = bytearray()
+    literal = 0     # Start of new bytes not covered by a COPY
+    i = 0
+    while i + BLOCK <= len(new):
+        match = index.get(new[i:i + BLOCK])
+        if match is None:
+            i += 1
+            continue
+        # Extend the match forwards, then backwards into the pending literal bytes
+        end, base_end = i + BLOCK, match + BLOCK
+        while end < len(new) and base_end < len(base) and new[end] == base[base_end]:
+            end += 1
+            base_end += 1
+        start = i
+        while start > literal and match > 0 and new[start - 1] == base[match - 1]:
+            start -= 1
+            match -= 1
+        if end - start < MIN_COPY:
+            i += 1
+            continue
+        emit_literal(ops, new[literal:start])
+        ops += bytes([OP_COPY]) + varint(match) + varint(end - start)
+        literal = i = end
+    emit_literal(ops, new[literal:])
+
+    header = HEADER.pack(MAGIC, HEADER.size + len(ops), len(base), len(new),
+                         hashlib.sha256(base).digest(), hashlib.sha256(new).digest())
+    return header + bytes(ops)
+
+
+def read_varint(delta, pos):
+    value = shift = 0
+    while True:
+        byte = delta[pos]
+        pos += 1
+        value |= (byte & 0x7F) << shift
+        shift += 7
+        if not byte & 0x80:
+            return value, pos
+
+
+def apply_delta(base, delta):
+    # Same decoding as the device, used to check a delta
+    magic, size, base_size, new_size, base_sha, new_sha = HEADER.unpack_from(delta)
+    if magic != MAGIC or size != len(delta):
+        raise ValueError("not a delta or truncated")
+    if hashlib.sha256(base[:base_size]).digest() != base_sha:
+        raise ValueError("delta is for another base image")
+    out = bytearray()
+    pos = HEADER.size
+    while len(out) < new_size:
+        op = delta[pos]
+        pos += 1
+        if op == OP_COPY:
+            offset, pos = read_varint(delta, pos)
+            length, pos = read_varint(delta, pos)
+            out += base[offset:offset + length]
+        elif op == OP_INSERT:
+            length, pos = read_varint(delta, pos)
+            out += delta[pos:pos + length]
+            pos += length
+        elif op == OP_FILL:
+            length, pos = read_varint(delta, pos)
+            out += bytes([delta[pos]]) * length
+            pos += 1
+        else:
+            raise ValueError("unknown op %d at %d" % (op, pos - 1))
+    if hashlib.sha256(out).digest() != new_sha:
+        raise ValueError("result does not match the new image")
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Make a firmware delta for water_thing")
+    parser.add_argument("base", help="firmware.bin running on the device")
+    parser.add_argument("new", help="new firmware.bin")
+    parser.add_argument("delta", help="delta to write")
+    args = parser.parse_args()
+
+    with open(args.base, "rb") as f:
+        base = f.read()
+    with open(args.new, "rb") as f:
+        new = f.read()
+
+    delta = make_delta(base, new)
+    apply_delta(base, delta)
+    with open(args.delta, "wb") as f:
+        f.write(delta)
+
+    # Each wake downloads at most OTA_CHUNK bytes and writes at most OTA_MAX_SECTORS sectors, see src/ota_update.h
+    chunk = 16384
+    sectors_per_wake = 32 * 4096
+    wakes = max(-(-len(delta) // chunk), -(-len(new) // sectors_per_wake))
+    print("%s: %d bytes, %.1f %% of %d, %d wakes" % (args.delta, len(delta), 100.0 * len(delta) / len(new),
+                                                     len(new), wakes))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())